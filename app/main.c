@@ -19,8 +19,15 @@
 #include "km_phys.h"
 #include "km_scene.h"
 #include "km_geom.h"
+#include "km_water.h"
+#include "km_step.h"
 #include "timing.h"
 
+// Smallest water height change, in meters, to update the mesh with
+#define WATER_EPS 0.0001f
+// Most physics steps to catch up with in one frame
+#define MAX_CATCHUP_STEPS 5
+
 int main(int argc, char *argv[])
 {
         struct scene scene = {0};
@@ -105,15 +112,29 @@ int main(int argc, char *argv[])
         {
                 struct vec3 level = (struct vec3){ .a = {0.0f, -1.0f, 0.0f } };
                 mesh_translate(scene.w.surfaces, level);
+                if (world_build_bvh(&scene.w) != 0)
+                {
+                        fprintf(stderr, "Failed to build surface bvh\n");
+                }
         }
 
         scene.w.waters = load_meshes(water_file, &scene.w.water_count);
 
-        struct water w;
-        init_water(&w, scene.w.waters, scene.w.surfaces);
+        struct water_grid w;
+        if (water_grid_init(&w, scene.w.waters, scene.w.surfaces) != 0)
+        {
+                fprintf(stderr, "Failed to init water\n");
+                scene.w.water_count = 0;
+        }
+
+        struct color_lut water_lut;
+        color_lut_init(&water_lut, GRADIENT_WATER);
 
         mesh_colorize_water(scene.w.waters);
-        mesh_normalize(scene.w.waters);
+        if (mesh_grid_normalize(scene.w.waters) != 0)
+        {
+                mesh_normalize(scene.w.waters);
+        }
 
         scene.entity_count = 0;
         if (renderer->upload(renderer,
@@ -140,6 +161,9 @@ int main(int argc, char *argv[])
                 return 1;
         }
 
+        struct stepper stepper;
+        stepper_init(&stepper, scene.w.dt, MAX_CATCHUP_STEPS);
+
         last = SDL_GetPerformanceCounter();
         // go!
         int counter = 0;
@@ -161,32 +185,46 @@ int main(int argc, char *argv[])
                 }
 
                 now = SDL_GetPerformanceCounter();
-                float dt  = (float)(now - last)
-                        / (float)SDL_GetPerformanceFrequency();
-                dt = dt / (float)slowmo;
+                double frame = (double)(now - last)
+                        / (double)SDL_GetPerformanceFrequency();
+                float dt = (float)frame / (float)slowmo;
                 last = now;
 
-                // update objects
-                for (int i = 0; i < scene.entity_count; i++)
+                // Run the physics at its fixed rate, independent of the
+                // frame rate
+                int steps = stepper_advance(&stepper,
+                                            (int64_t)(frame * 1e9 / slowmo));
+                for (int k = 0; k < steps; k++)
                 {
-                        update_object(1, &scene.w, &scene.entities[i].o);
-                }
+                        for (int i = 0; i < scene.entity_count; i++)
+                        {
+                                struct entity* e = scene.entities + i;
+
+                                e->prev = e->o.p;
+                                update_object(1, &scene.w, &e->o);
+                                if (e->animate)
+                                {
+                                        e->animate(e, scene.w.dt);
+                                }
+                        }
 
-                // animate
-                for (int i = 0; i < scene.entity_count; i++)
-                {
-                        if (scene.entities[i].animate)
+                        for (int i = 0; i < scene.w.water_count; i++)
                         {
-                                scene.entities[i].animate(&scene.entities[i], dt);
+                                water_grid_step(&w, scene.w.dt,
+                                                scene.w.pool);
                         }
                 }
+                scene.alpha = stepper_alpha(&stepper);
 
                 // Animate environment
-                for (int i = 0; i < scene.w.water_count; i++)
+                for (int i = 0; i < scene.w.water_count && steps > 0; i++)
                 {
-                        update_water(&w, scene.w.waters + i, dt);
-                        mesh_normalize(scene.w.waters);
-                        mesh_colorize_water(scene.w.waters);
+                        // Only the normals around moved vertices. The
+                        // water is not a surface, so nothing rests on
+                        // it, otherwise active_set_wake_mesh is needed.
+                        water_grid_store_normals(&w, scene.w.waters + i,
+                                                 WATER_EPS);
+                        mesh_colorize_lut(scene.w.waters + i, &water_lut);
                 }
 
                 // Update dynamic mesh GPU data
@@ -218,6 +256,13 @@ int main(int argc, char *argv[])
                         printf("dt: %fs\n", dt);
                         printf("remaining: %fs\n", remaining);
                         printf("ns %ldns\n", ns);
+                        printf("steps: %llu in %llu frames, peak %d\n",
+                               (unsigned long long)stepper.steps,
+                               (unsigned long long)stepper.frames,
+                               stepper.peak_steps);
+                        printf("capped frames: %llu, dropped %fs\n",
+                               (unsigned long long)stepper.capped_frames,
+                               (double)stepper.dropped_ns / 1e9);
                         printf("camera pos: %f %f %f\n", scene.cam.pos.x, scene.cam.pos.y, scene.cam.pos.x);
                         printf("camera center: %f %f %f\n", scene.cam.center.x, scene.cam.center.y, scene.cam.center.x);
                         printf("camera up: %f %f %f\n", scene.cam.up.x, scene.cam.up.y, scene.cam.up.x);
@@ -231,6 +276,8 @@ int main(int argc, char *argv[])
                 mesh_free(scene.w.surfaces + i);
         }
         free(scene.w.surfaces);
+        world_free_bvh(&scene.w);
+        water_grid_free(&w);
 
         km_window_destroy(&window);
         SDL_Quit();
@@ -1,7 +1,7 @@
 CC = cc
 CFLAGS = -D_POSIX_C_SOURCE=200809L \
          -Wall -W -Wextra -Wconversion -Wsign-conversion -Werror \
-         -pedantic -O2 \
+         -pedantic -O2 -ffp-contract=off \
          -std=c11
 OBJCFLAGS = -D_POSIX_C_SOURCE=200809L \
          -Wall -W -Wextra -Wconversion -Wsign-conversion -Werror \
@@ -28,7 +28,7 @@ ifdef DEBUG
 endif
 
 ifeq ($(UNAME),Linux)
-LDFLAGS += -lm
+LDFLAGS += -lm -pthread
 endif
 
 SRCS ?= $(wildcard *.c)
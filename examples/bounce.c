@@ -43,9 +43,10 @@ acl: 0.000000 -9.820011 0.000000
 int main(int argc, char** argv)
 {
         struct timing start;
-        struct world w;
+        struct world w = {0};
         struct object objs[NUM_OBJS];
         long t1;
+        int64_t next;
         int run = 1;
         int step = 0;
         int stop = 25 * FREQ;
@@ -65,7 +66,7 @@ int main(int argc, char** argv)
         print_particle(&objs[0].p);
 
         // create a mesh that (-1,1) (-1,-1) (1, -1) (1,1) in the x-z plane
-        struct mesh s1;
+        struct mesh s1 = {0};
         s1.vertices = malloc(4 * sizeof(struct vertex));
         s1.indices = malloc(6 * sizeof(uint16_t));
         s1.vertex_count = 4;
@@ -101,9 +102,9 @@ int main(int argc, char** argv)
 
         timing_start(&start);
         t1 = timing_current_millis();
+        next = start.ns;
         while (run)
         {
-                long begin = timing_current_usec();
                 char print = 0;
 
                 if (debug)
@@ -120,9 +121,10 @@ int main(int argc, char** argv)
                 }
                 update_objects(step, &w, objs, NUM_OBJS, print);
 
-                // wait for next step
-                long sbegin = timing_current_usec();
-                timing_sleep(PERIOD - (sbegin - begin) * 1000);
+                // wait for next step, a late step does not delay the
+                // ones after it
+                next += PERIOD;
+                timing_sleep_until(next);
 
                 if (step >= stop) {
                         run = 0;
@@ -155,5 +157,7 @@ void init_object(struct object* o)
         o->p.v = (struct vec3){ .a = {0.0f, 0.0f, 0.0f} };
         o->p.a = (struct vec3){ .a = {0.0f, 0.0f, 0.0f} };
         o->steady_state = 0;
+        o->sleep_timer = 0.0f;
         o->contact_mesh = NULL;
+        o->contact_tri = 0;
 }
@@ -10,8 +10,12 @@
 #include "km_input.h"
 #include "metal/metal_renderer.h"
 #include "km_geom.h"
+#include "km_step.h"
 #include "timing.h"
 
+// Most physics steps to catch up with in one frame
+#define MAX_CATCHUP_STEPS 5
+
 void init_cube(struct mesh* m);
 void init_plane(struct mesh* m, float w, float h, int tilt);
 void init_vert_plane(struct mesh* m, float x);
@@ -88,7 +92,7 @@ int main(int argc, char* argv[])
                                   sizeof(struct mesh));
         init_plane(&scene.w.surfaces[0], 10.0f, 10.0f, tilt);
         init_plane(&scene.w.surfaces[1], 20.0f, 10.0f, 0);
-        for (int i = 0; i < scene.w.surfaces[1].vertex_count; i++)
+        for (uint32_t i = 0; i < scene.w.surfaces[1].vertex_count; i++)
         {
                 scene.w.surfaces[1].vertices[i].pos.x -= 5.0f;
                 scene.w.surfaces[1].vertices[i].pos.y = -2.0f;
@@ -108,7 +112,7 @@ int main(int argc, char* argv[])
         scene.entities[0].o.restitution = 0.9f;
         scene.entities[0].o.static_mu = 0.15f;
         scene.entities[0].o.dynamic_mu = 0.1f;
-        scene.entities[0].o.p.rad = 0.0f; // 0.0f non zero radius breaks
+        scene.entities[0].o.p.rad = 1.0f; // the cube's inscribed sphere
         scene.entities[0].a.speed = 0.8f; // 0.2 rad/sec
         scene.entities[0].animate = &animate_rot_y;
         init_cube(&scene.entities[0].surfaces[0]);
@@ -126,6 +130,9 @@ int main(int argc, char* argv[])
         }
 
         int step = 0;
+        struct stepper stepper;
+        stepper_init(&stepper, scene.w.dt, MAX_CATCHUP_STEPS);
+        scene.entities[0].prev = scene.entities[0].o.p;
         last = SDL_GetPerformanceCounter();
         while (!input.quit)
         {
@@ -152,18 +159,26 @@ int main(int argc, char* argv[])
                         input.pause = !input.pause;
                 }
                 now = SDL_GetPerformanceCounter();
-                float dt  = (float)(now - last)
-                        / (float)SDL_GetPerformanceFrequency();
+                double frame = (double)(now - last)
+                        / (double)SDL_GetPerformanceFrequency();
+                float dt = (float)frame;
                 last = now;
 
-                // update objects
-                if (!input.pause)
+                // update objects at the fixed rate, no time passes
+                // while paused
+                int steps = stepper_advance(&stepper, input.pause ? 0 :
+                                            (int64_t)(frame * 1e9));
+                for (int k = 0; k < steps; k++)
                 {
                         for (int i = 0; i < scene.entity_count; i++)
                         {
-                                update_object(step, &scene.w, &scene.entities[i].o);
+                                struct entity* e = scene.entities + i;
+
+                                e->prev = e->o.p;
+                                update_object(step, &scene.w, &e->o);
                         }
                 }
+                scene.alpha = stepper_alpha(&stepper);
 
 
                 renderer->render(renderer, &scene, dt);
@@ -199,6 +214,7 @@ int main(int argc, char* argv[])
 
 void init_cube(struct mesh* m)
 {
+        memset(m, 0, sizeof(*m));
         m->vertex_count = 24;
         m->vertices = malloc(m->vertex_count * sizeof(struct vertex));
         m->index_count = 36;
@@ -263,7 +279,7 @@ void init_cube(struct mesh* m)
         m->indices[33] = 20; m->indices[34] = 22; m->indices[35] = 23;
 
         /* Colorize each vertex with a unique hue */
-        for (int i = 0; i < m->vertex_count; i++) {
+        for (uint32_t i = 0; i < m->vertex_count; i++) {
                 float hue = (float)i / (float)m->vertex_count * 360.0f;
                 float s = 0.8f, v = 0.9f;
                 float c = v * s;
@@ -284,6 +300,7 @@ void init_plane(struct mesh* m, float w, float h, int tilt)
 {
         float y = tilt ? -1.0f : 0.0f;
 
+        memset(m, 0, sizeof(*m));
         m->vertex_count = 4;
         m->vertices = malloc(m->vertex_count * sizeof(struct vertex));
         m->index_count = 6;
@@ -316,7 +333,7 @@ void init_plane(struct mesh* m, float w, float h, int tilt)
         m->indices[3] = 1; m->indices[4] = 2; m->indices[5] = 3;
 
         /* Colorize each vertex with a unique hue */
-        for (int i = 0; i < m->vertex_count; i++) {
+        for (uint32_t i = 0; i < m->vertex_count; i++) {
                 float hue = (float)i / (float)m->vertex_count * 360.0f;
                 float s = 0.8f, v = 0.9f;
                 float c = v * s;
@@ -338,6 +355,7 @@ void init_plane(struct mesh* m, float w, float h, int tilt)
 
 void init_vert_plane(struct mesh* m, float x)
 {
+        memset(m, 0, sizeof(*m));
         m->vertex_count = 4;
         m->vertices = malloc(m->vertex_count * sizeof(struct vertex));
         m->index_count = 6;
@@ -371,7 +389,7 @@ void init_vert_plane(struct mesh* m, float x)
         m->indices[3] = 1; m->indices[4] = 2; m->indices[5] = 3;
 
         /* Colorize each vertex with a unique hue */
-        for (int i = 0; i < m->vertex_count; i++) {
+        for (uint32_t i = 0; i < m->vertex_count; i++) {
                 float hue = (float)i / (float)m->vertex_count * 360.0f;
                 float s = 0.8f, v = 0.9f;
                 float c = v * s;
@@ -0,0 +1,386 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "km_bvh.h"
+
+// Past this depth, nodes are split by count instead of by position.
+// This bounds the depth of the tree for badly distributed items.
+#define BVH_MAX_SPATIAL_DEPTH 40
+// Traversal stack size, must be larger than the max depth of the tree
+#define BVH_STACK_SIZE 128
+
+struct bvh_build_entry
+{
+        uint32_t node;
+        uint32_t depth;
+};
+
+struct bvh_stack_entry
+{
+        uint32_t node;
+        float t;
+};
+
+void aabb_empty(struct aabb* b)
+{
+        b->min = (struct vec3){ .a = { INFINITY, INFINITY, INFINITY } };
+        b->max = (struct vec3){ .a = { -INFINITY, -INFINITY, -INFINITY } };
+}
+
+void aabb_extend(struct aabb* b, struct vec3 p)
+{
+        b->min.x = MIN(b->min.x, p.x);
+        b->min.y = MIN(b->min.y, p.y);
+        b->min.z = MIN(b->min.z, p.z);
+        b->max.x = MAX(b->max.x, p.x);
+        b->max.y = MAX(b->max.y, p.y);
+        b->max.z = MAX(b->max.z, p.z);
+}
+
+void aabb_union(struct aabb* b, const struct aabb* o)
+{
+        aabb_extend(b, o->min);
+        aabb_extend(b, o->max);
+}
+
+int aabb_seg_overlap(const struct aabb* b,
+                     struct vec3 o,
+                     struct vec3 d,
+                     float t_max,
+                     float* t_enter)
+{
+        float t0 = 0.0f;
+        float t1 = t_max;
+
+        for (int i = 0; i < 3; i++)
+        {
+                if (d.a[i] == 0.0f)
+                {
+                        // Parallel to the slab, must start inside it
+                        if (o.a[i] < b->min.a[i] || o.a[i] > b->max.a[i])
+                        {
+                                return 0;
+                        }
+                        continue;
+                }
+
+                float inv = 1.0f / d.a[i];
+                float tn = (b->min.a[i] - o.a[i]) * inv;
+                float tf = (b->max.a[i] - o.a[i]) * inv;
+
+                if (tn > tf)
+                {
+                        float tmp = tn;
+                        tn = tf;
+                        tf = tmp;
+                }
+
+                t0 = MAX(t0, tn);
+                t1 = MIN(t1, tf);
+                if (t0 > t1)
+                {
+                        return 0;
+                }
+        }
+
+        if (t_enter)
+        {
+                *t_enter = t0;
+        }
+
+        return 1;
+}
+
+int bvh_build(struct bvh* b, const struct aabb* boxes, uint32_t n)
+{
+        struct bvh_build_entry* stack;
+        struct vec3* centroids;
+        uint32_t sp = 0;
+
+        bvh_free(b);
+
+        if (n == 0)
+        {
+                return 0;
+        }
+
+        // A binary tree with n leaves has 2n - 1 nodes
+        b->nodes = malloc(((size_t)n * 2 - 1) * sizeof(struct bvh_node));
+        b->items = malloc((size_t)n * sizeof(uint32_t));
+        centroids = malloc((size_t)n * sizeof(struct vec3));
+        stack = malloc((size_t)n * sizeof(struct bvh_build_entry));
+
+        if (b->nodes == NULL ||
+            b->items == NULL ||
+            centroids == NULL ||
+            stack == NULL)
+        {
+                free(centroids);
+                free(stack);
+                bvh_free(b);
+                return -1;
+        }
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+                b->items[i] = i;
+                centroids[i] = vec3_scalarm(vec3_add(boxes[i].min,
+                                                     boxes[i].max),
+                                            0.5f);
+        }
+        b->item_count = n;
+
+        b->nodes[0].first = 0;
+        b->nodes[0].count = n;
+        b->node_count = 1;
+        stack[sp++] = (struct bvh_build_entry){ .node = 0, .depth = 0 };
+
+        while (sp > 0)
+        {
+                struct bvh_build_entry e = stack[--sp];
+                struct bvh_node* node = b->nodes + e.node;
+                uint32_t* items = b->items + node->first;
+                struct aabb cb;
+                uint32_t left = 0;
+
+                aabb_empty(&node->box);
+                aabb_empty(&cb);
+                for (uint32_t i = 0; i < node->count; i++)
+                {
+                        aabb_union(&node->box, boxes + items[i]);
+                        aabb_extend(&cb, centroids[items[i]]);
+                }
+
+                if (node->count <= BVH_LEAF_SIZE)
+                {
+                        continue;
+                }
+
+                // Split at the middle of the longest centroid axis
+                struct vec3 ext = vec3_sub(cb.max, cb.min);
+                int axis = 0;
+
+                if (ext.y > ext.a[axis]) axis = 1;
+                if (ext.z > ext.a[axis]) axis = 2;
+
+                if (e.depth < BVH_MAX_SPATIAL_DEPTH && ext.a[axis] > 0.0f)
+                {
+                        float mid = (cb.min.a[axis] + cb.max.a[axis]) * 0.5f;
+                        uint32_t right = node->count;
+
+                        while (left < right)
+                        {
+                                if (centroids[items[left]].a[axis] < mid)
+                                {
+                                        left++;
+                                }
+                                else
+                                {
+                                        uint32_t tmp = items[left];
+                                        items[left] = items[--right];
+                                        items[right] = tmp;
+                                }
+                        }
+                }
+
+                if (left == 0 || left == node->count)
+                {
+                        // All centroids on one side, split by count
+                        left = node->count / 2;
+                }
+
+                uint32_t c = b->node_count;
+                b->nodes[c].first = node->first;
+                b->nodes[c].count = left;
+                b->nodes[c + 1].first = node->first + left;
+                b->nodes[c + 1].count = node->count - left;
+                b->node_count += 2;
+
+                node->first = c;
+                node->count = 0;
+
+                stack[sp++] = (struct bvh_build_entry){
+                        .node = c, .depth = e.depth + 1
+                };
+                stack[sp++] = (struct bvh_build_entry){
+                        .node = c + 1, .depth = e.depth + 1
+                };
+        }
+
+        free(centroids);
+        free(stack);
+
+        // Release the nodes that were not needed
+        struct bvh_node* nodes = realloc(b->nodes,
+                                         b->node_count *
+                                         sizeof(struct bvh_node));
+        if (nodes)
+        {
+                b->nodes = nodes;
+        }
+
+        return 0;
+}
+
+void bvh_refit(struct bvh* b, const struct aabb* boxes)
+{
+        // Children are always stored after their parent, so a reverse
+        // walk updates the children before their parent.
+        for (uint32_t i = b->node_count; i-- > 0;)
+        {
+                struct bvh_node* node = b->nodes + i;
+
+                if (node->count > 0)
+                {
+                        aabb_empty(&node->box);
+                        for (uint32_t j = 0; j < node->count; j++)
+                        {
+                                aabb_union(&node->box,
+                                           boxes + b->items[node->first + j]);
+                        }
+                }
+                else
+                {
+                        node->box = b->nodes[node->first].box;
+                        aabb_union(&node->box, &b->nodes[node->first + 1].box);
+                }
+        }
+}
+
+void bvh_translate(struct bvh* b, struct vec3 v)
+{
+        for (uint32_t i = 0; i < b->node_count; i++)
+        {
+                b->nodes[i].box.min = vec3_add(b->nodes[i].box.min, v);
+                b->nodes[i].box.max = vec3_add(b->nodes[i].box.max, v);
+        }
+}
+
+/*
+ * Test the segment against a box grown by r on all sides. The grown
+ * box contains every point within r of the box, so nothing a sphere
+ * of radius r swept along the segment can touch is missed.
+ */
+static int sweep_overlap(const struct aabb* b,
+                         float r,
+                         struct vec3 o,
+                         struct vec3 d,
+                         float t_max,
+                         float* t_enter)
+{
+        struct aabb g = *b;
+
+        for (int i = 0; i < 3; i++)
+        {
+                g.min.a[i] -= r;
+                g.max.a[i] += r;
+        }
+
+        return aabb_seg_overlap(&g, o, d, t_max, t_enter);
+}
+
+void bvh_traverse_seg(const struct bvh* b,
+                      struct vec3 o,
+                      struct vec3 d,
+                      float t_max,
+                      bvh_leaf_fn fn,
+                      void* ctx)
+{
+        bvh_traverse_sweep(b, o, d, 0.0f, t_max, fn, ctx);
+}
+
+void bvh_traverse_sweep(const struct bvh* b,
+                        struct vec3 o,
+                        struct vec3 d,
+                        float r,
+                        float t_max,
+                        bvh_leaf_fn fn,
+                        void* ctx)
+{
+        struct bvh_stack_entry stack[BVH_STACK_SIZE];
+        int sp = 0;
+        float t;
+
+        if (b->node_count == 0 ||
+            !sweep_overlap(&b->nodes[0].box, r, o, d, t_max, &t))
+        {
+                return;
+        }
+
+        stack[sp++] = (struct bvh_stack_entry){ .node = 0, .t = t };
+
+        while (sp > 0)
+        {
+                struct bvh_stack_entry e = stack[--sp];
+                const struct bvh_node* node = b->nodes + e.node;
+
+                if (e.t > t_max)
+                {
+                        // A closer hit was found after this node was pushed
+                        continue;
+                }
+
+                if (node->count > 0)
+                {
+                        fn(ctx, b->items + node->first, node->count, &t_max);
+                        continue;
+                }
+
+                float t0;
+                float t1;
+                int h0 = sweep_overlap(&b->nodes[node->first].box, r,
+                                       o, d, t_max, &t0);
+                int h1 = sweep_overlap(&b->nodes[node->first + 1].box, r,
+                                       o, d, t_max, &t1);
+
+                // Push the far child first so the near one is visited next
+                if (h0 && h1)
+                {
+                        struct bvh_stack_entry c0 = { node->first, t0 };
+                        struct bvh_stack_entry c1 = { node->first + 1, t1 };
+
+                        if (t0 <= t1)
+                        {
+                                stack[sp++] = c1;
+                                stack[sp++] = c0;
+                        }
+                        else
+                        {
+                                stack[sp++] = c0;
+                                stack[sp++] = c1;
+                        }
+                }
+                else if (h0)
+                {
+                        stack[sp++] = (struct bvh_stack_entry){
+                                node->first, t0
+                        };
+                }
+                else if (h1)
+                {
+                        stack[sp++] = (struct bvh_stack_entry){
+                                node->first + 1, t1
+                        };
+                }
+        }
+}
+
+void bvh_free(struct bvh* b)
+{
+        free(b->nodes);
+        free(b->items);
+
+        memset(b, 0, sizeof(*b));
+}
@@ -0,0 +1,177 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#ifndef KM_BVH_H
+#define KM_BVH_H
+
+#include <stdint.h>
+#include "km_math.h"
+
+// Max number of items stored in a leaf
+#define BVH_LEAF_SIZE 8
+
+struct aabb
+{
+        struct vec3 min;
+        struct vec3 max;
+};
+
+/*
+  A node is either an interior node (count == 0) with its two children
+  stored at nodes[first] and nodes[first + 1], or a leaf holding the
+  items items[first] .. items[first + count - 1].
+*/
+struct bvh_node
+{
+        struct aabb box;
+        uint32_t first;
+        uint32_t count;
+};
+
+struct bvh
+{
+        struct bvh_node* nodes;
+        uint32_t node_count;
+        // Item (e.g. triangle) indices, grouped per leaf
+        uint32_t* items;
+        uint32_t item_count;
+};
+
+/**
+ * Callback invoked for each leaf a query overlaps.
+ * @param ctx the user provided context
+ * @param items the items in the leaf
+ * @param count number of items in the leaf
+ * @param t_max the current end of the query segment. The callback
+ *        may shorten it when a closer hit is found, which prunes the
+ *        rest of the traversal.
+ * @return void
+ */
+typedef void (*bvh_leaf_fn)(void* ctx,
+                            const uint32_t* items,
+                            uint32_t count,
+                            float* t_max);
+
+/**
+ * Reset a box so that any point extended into it becomes the box.
+ * @param b the box to reset
+ * @return void
+ */
+void aabb_empty(struct aabb* b);
+
+/**
+ * Grow a box to include a point.
+ * @param b the box to grow
+ * @param p the point to include
+ * @return void
+ */
+void aabb_extend(struct aabb* b, struct vec3 p);
+
+/**
+ * Grow a box to include another box.
+ * @param b the box to grow
+ * @param o the box to include
+ * @return void
+ */
+void aabb_union(struct aabb* b, const struct aabb* o);
+
+/**
+ * Test a segment o + t * d, t in [0, t_max] against a box.
+ * @param b the box
+ * @param o segment origin
+ * @param d segment direction
+ * @param t_max the end of the segment, in |d| units
+ * @param t_enter the parametric entry point, if not NULL
+ * @return 1 if the segment overlaps the box
+ */
+int aabb_seg_overlap(const struct aabb* b,
+                     struct vec3 o,
+                     struct vec3 d,
+                     float t_max,
+                     float* t_enter);
+
+/**
+ * Build a BVH over an array of item bounding boxes.
+ * Any previous content in the bvh is released.
+ * @param b the bvh to build
+ * @param boxes one box per item
+ * @param n the number of items
+ * @return 0 on success, -1 on failure
+ */
+int bvh_build(struct bvh* b, const struct aabb* boxes, uint32_t n);
+
+/**
+ * Refit all node boxes after the items have moved. The tree topology
+ * is kept, so the quality of the tree degrades if items move far.
+ * @param b the bvh to refit
+ * @param boxes one box per item, same order as when built
+ * @return void
+ */
+void bvh_refit(struct bvh* b, const struct aabb* boxes);
+
+/**
+ * Translate all node boxes.
+ * @param b the bvh to translate
+ * @param v the offset
+ * @return void
+ */
+void bvh_translate(struct bvh* b, struct vec3 v);
+
+/**
+ * Visit all leaves overlapping the segment o + t * d, t in [0, t_max].
+ * Nodes are visited front to back, and nodes beyond the (possibly
+ * shortened) t_max are skipped.
+ * @param b the bvh to traverse
+ * @param o segment origin
+ * @param d segment direction
+ * @param t_max the end of the segment, in |d| units
+ * @param fn leaf callback
+ * @param ctx context passed to the leaf callback
+ * @return void
+ */
+void bvh_traverse_seg(const struct bvh* b,
+                      struct vec3 o,
+                      struct vec3 d,
+                      float t_max,
+                      bvh_leaf_fn fn,
+                      void* ctx);
+
+/**
+ * Visit all leaves a sphere of radius r, with its center swept along
+ * the segment o + t * d, t in [0, t_max], may touch. The boxes are
+ * grown by r, so leaves are visited conservatively, in the same order
+ * as bvh_traverse_seg.
+ * @param b the bvh to traverse
+ * @param o segment origin
+ * @param d segment direction
+ * @param r the sphere's radius, 0 is the same as bvh_traverse_seg
+ * @param t_max the end of the segment, in |d| units
+ * @param fn leaf callback
+ * @param ctx context passed to the leaf callback
+ * @return void
+ */
+void bvh_traverse_sweep(const struct bvh* b,
+                        struct vec3 o,
+                        struct vec3 d,
+                        float r,
+                        float t_max,
+                        bvh_leaf_fn fn,
+                        void* ctx);
+
+/**
+ * Free all memory held by a bvh. All members are set to zero.
+ * @param b the bvh to free
+ * @return void
+ */
+void bvh_free(struct bvh* b);
+
+#endif /* KM_BVH_H */
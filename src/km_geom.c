@@ -12,12 +12,17 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <float.h>
 #include <math.h>
 #include <string.h>
 #include "km_geom.h"
 #include "km_phys.h"
 #include "km_plat.h"
-#include "../lib/cJSON.h"
+#include "km_bvh.h"
+#include "km_triblock.h"
+#include "km_meshio.h"
+#include "km_terrain.h"
+#include "km_pool.h"
 
 void print_vertex(const struct vertex* v)
 {
@@ -33,33 +38,33 @@ void mesh_get_tri(struct vertex** restrict v0,
                   const struct mesh* m,
                   uint32_t i)
 {
-        *v0 = m->vertices + m->indices[i * 3 + 0];
-        *v1 = m->vertices + m->indices[i * 3 + 1];
-        *v2 = m->vertices + m->indices[i * 3 + 2];
+        *v0 = m->vertices + mesh_index(m, i * 3 + 0);
+        *v1 = m->vertices + mesh_index(m, i * 3 + 1);
+        *v2 = m->vertices + mesh_index(m, i * 3 + 2);
 }
 
-int ray_tri_intersect(const struct particle* r,
-                      const struct vec3* v0,
-                      const struct vec3* v1,
-                      const struct vec3* v2,
-                      float* t,
-                      float* u,
-                      float* v)
+/*
+ * Moller-Trumbore with the triangle's edges e1 = v1 - v0 and
+ * e2 = v2 - v0 already computed.
+ */
+static int ray_tri_edges(const struct particle* r,
+                         const struct vec3* v0,
+                         const struct vec3* e1,
+                         const struct vec3* e2,
+                         float* t,
+                         float* u,
+                         float* v)
 {
         const float epsilon = 1e-6f;
-        struct vec3 e1;
-        struct vec3 e2;
         struct vec3 p;
         struct vec3 s;
         struct vec3 q;
         float f;
         float inv_f;
 
-        e1 = vec3_sub(*v1, *v0);
-        e2 = vec3_sub(*v2, *v0);
-        p = vec3_cross(r->v, e2);
+        p = vec3_cross(r->v, *e2);
 
-        f = vec3_dot(e1, p);
+        f = vec3_dot(*e1, p);
         if (fabs(f) < epsilon)
         {
                 // Ray is parallel to the triangle's plane
@@ -74,14 +79,14 @@ int ray_tri_intersect(const struct particle* r,
                 return 0;
         }
 
-        q = vec3_cross(s, e1);
+        q = vec3_cross(s, *e1);
         *v = inv_f * vec3_dot(r->v, q);
         if (*v < 0.0f || *u + *v > 1.0f)
         {
                 return 0;
         }
 
-        *t = inv_f * vec3_dot(e2, q);
+        *t = inv_f * vec3_dot(*e2, q);
         if (*t < epsilon)
         {
                 // particle is already behind triangle
@@ -91,900 +96,2327 @@ int ray_tri_intersect(const struct particle* r,
         return 1;
 }
 
-int compute_toi(struct collision* toi,
-                struct particle* p,
-                struct mesh* meshes,
-                int mesh_count)
+int ray_tri_intersect(const struct particle* r,
+                      const struct vec3* v0,
+                      const struct vec3* v1,
+                      const struct vec3* v2,
+                      float* t,
+                      float* u,
+                      float* v)
 {
-        int coll_test;
-        int ret = 0;
+        struct vec3 e1 = vec3_sub(*v1, *v0);
+        struct vec3 e2 = vec3_sub(*v2, *v0);
 
-        toi->t = INFINITY;
+        return ray_tri_edges(r, v0, &e1, &e2, t, u, v);
+}
 
-        for (int s = 0; s < mesh_count; s++)
-        {
-                struct mesh* cm = meshes + s;
-                uint32_t num_tri = cm->index_count / 3;
+/*
+ * Compute the cached data for triangle i from its vertices.
+ */
+static void mesh_tri_compute(struct mesh_tri* t,
+                             const struct mesh* m,
+                             uint32_t i)
+{
+        struct vertex* v0;
+        struct vertex* v1;
+        struct vertex* v2;
+
+        mesh_get_tri(&v0, &v1, &v2, m, i);
+        t->e1 = vec3_sub(v1->pos, v0->pos);
+        t->e2 = vec3_sub(v2->pos, v0->pos);
+        t->n = vec3_norm(vec3_cross(t->e1, t->e2));
+        t->d = vec3_dot(t->n, v0->pos);
+}
 
-                for (uint32_t ti = 0; ti < num_tri; ti++)
-                {
-                        struct vec3 e1;
-                        struct vec3 e2;
+// Pad the triangle boxes a bit, so flat (axis aligned) triangles
+// don't end up with a zero thickness box.
+#define TRI_BOX_PAD 1e-4f
+
+// Distance, in cell units, at which the grid walk also tests
+// the neighbouring cell
+#define GRID_EDGE_EPS 1e-3f
+// Max distance, in cell units, of a vertex from its place in the
+// grid for mesh_check_grid. Well below GRID_EDGE_EPS.
+#define GRID_VERTEX_EPS 1e-4f
+// Max number of triangles visited by point_on_mesh_walk before
+// falling back to a full search
+#define MESH_WALK_STEPS 32
+// Grid rows per pool work item in mesh_heightmap_pool
+#define HEIGHTMAP_CHUNK_ROWS 8
 
-                        struct vertex* v0;
-                        struct vertex* v1;
-                        struct vertex* v2;
-                        float t;
-                        float u;
-                        float v;
+/*
+ * A regular heightfield as generated by gen_mesh. Cell (ix, iz)
+ * holds triangles 2 * (iz * cx + ix) and 2 * (iz * cx + ix) + 1.
+ */
+struct grid_info
+{
+        float x0;
+        float z0;
+        float dx;
+        float dz;
+        // number of cells in each direction
+        int cx;
+        int cz;
+};
+
+static int mesh_build_blocks(struct mesh* m);
+
+struct toi_query
+{
+        struct collision* toi;
+        const struct particle* p;
+        struct mesh* m;
+        int hit;
+};
 
-                        mesh_get_tri(&v0,
-                                     &v1,
-                                     &v2,
-                                     cm,
-                                     ti);
+struct toi_tree_query
+{
+        struct collision* toi;
+        const struct particle* p;
+        struct mesh* meshes;
+        int hit;
+};
 
-                        coll_test = ray_tri_intersect(p,
-                                                      &v0->pos,
-                                                      &v1->pos,
-                                                      &v2->pos,
-                                                      &t,
-                                                      &u,
-                                                      &v);
+static struct vec3 tri_normal(const struct mesh* m, uint32_t ti)
+{
+        struct vertex* v0;
+        struct vertex* v1;
+        struct vertex* v2;
 
-                        if (coll_test)
-                        {
-                                if (t < toi->t)
-                                {
-                                        e1 = vec3_sub(v1->pos, v0->pos);
-                                        e2 = vec3_sub(v2->pos, v0->pos);
-                                        toi->n = vec3_norm(vec3_cross(e1, e2));
-                                        toi->t = t;
-                                        toi->m = cm;
-                                        toi->ti = ti;
-                                        ret = 1;
-                                }
-                        }
-                }
+        if (m->tris)
+        {
+                return m->tris[ti].n;
         }
 
-        return ret;
-}
-
-int point_on_mesh(struct mesh* m, struct vec3 p)
-{
-        for (uint32_t i = 0; i < m->index_count / 3; i++)
-        {
-                struct vertex* v0;
-                struct vertex* v1;
-                struct vertex* v2;
-                struct vec3 e1;
-                struct vec3 e2;
-                struct vec3 n;
-                struct vec3 dv;
-                float d;
+        mesh_get_tri(&v0, &v1, &v2, m, ti);
 
-                mesh_get_tri(&v0, &v1, &v2, m, i);
-                e1 = vec3_sub(v1->pos, v0->pos);
-                e2 = vec3_sub(v2->pos, v0->pos);
-                n = vec3_norm(vec3_cross(e1, e2));
+        struct vec3 e1 = vec3_sub(v1->pos, v0->pos);
+        struct vec3 e2 = vec3_sub(v2->pos, v0->pos);
 
-                dv = vec3_sub(p, m->vertices[m->indices[i*3]].pos);
-                d = vec3_dot(dv, n);
-                if (d > MAX_CONTACT_DIST || d < 0.0f)
-                {
-                        continue;
-                }
+        return vec3_norm(vec3_cross(e1, e2));
+}
 
-                // Check the sign of the dot product against all inward
-                // pointing normals
-                if (vec3_dot(m->inward_normals[i * 3 + 0], dv) < 0.0f)
-                {
-                        continue;
-                }
-                dv = vec3_sub(p, m->vertices[m->indices[i*3 + 1]].pos);
-                if (vec3_dot(m->inward_normals[i * 3 + 1], dv) < 0.0f)
-                {
-                        continue;
-                }
-                dv = vec3_sub(p, m->vertices[m->indices[i*3 + 2]].pos);
-                if (vec3_dot(m->inward_normals[i * 3 + 2], dv) < 0.0f)
-                {
-                        continue;
-                }
+/*
+ * Signed distance from p to the plane of triangle ti, along its normal
+ * n (from tri_normal). Uses the cached plane offset when present.
+ */
+static float tri_plane_dist(const struct mesh* m,
+                            uint32_t ti,
+                            struct vec3 n,
+                            struct vec3 p)
+{
+        struct vertex* v0;
+        struct vertex* v1;
+        struct vertex* v2;
 
-                // Point is on or just above
-                return 1;
+        if (m->tris)
+        {
+                return vec3_dot(p, n) - m->tris[ti].d;
         }
 
-        return 0;
-}
-
-void mesh_free(struct mesh* m)
-{
-        free(m->vertices);
-        free(m->indices);
-        free(m->inward_normals);
+        mesh_get_tri(&v0, &v1, &v2, m, ti);
 
-        memset(m, 0, sizeof(*m));
+        return vec3_dot(vec3_sub(p, v0->pos), n);
 }
 
-static char* read_file(const char* path)
+/*
+ * Record a hit at t with triangle ti, if it is the closest one so far.
+ * Ties are resolved to the lowest mesh and triangle index so the
+ * result does not depend on the order the triangles are visited in.
+ * The normal is the triangle's unless n is given.
+ */
+static int toi_record(struct collision* toi,
+                      struct mesh* m,
+                      uint32_t ti,
+                      float t,
+                      float t_max,
+                      const struct vec3* n)
 {
-        FILE* f = fopen(path, "rb");
-        if (!f)
+        if (t > t_max || t > toi->t)
         {
-                return NULL;
+                return 0;
         }
 
-        fseek(f, 0, SEEK_END);
-        long len = ftell(f);
-        fseek(f, 0, SEEK_SET);
-
-        char* buf = malloc((unsigned long)len + 1);
-        if (!buf)
+        if (t == toi->t)
         {
-                fclose(f);
-                return NULL;
+                if (m > toi->m || (m == toi->m && ti > toi->ti))
+                {
+                        return 0;
+                }
         }
 
-        size_t nr = fread(buf, 1, (unsigned long)len, f);
-        fclose(f);
-
-        if ((long)nr != len)
-        {
-                free(buf);
-                return NULL;
-        }
+        toi->n = n ? *n : tri_normal(m, ti);
+        toi->t = t;
+        toi->m = m;
+        toi->ti = ti;
 
-        buf[len] = '\0';
-        return buf;
+        return 1;
 }
 
-static struct mesh* parse_mesh(const cJSON* json_mesh)
+/*
+ * Test a single triangle and record it if it is the closest one so far.
+ */
+static int toi_tri(struct collision* toi,
+                   const struct particle* p,
+                   struct mesh* m,
+                   uint32_t ti,
+                   float t_max)
 {
-        struct mesh* m = malloc(sizeof(*m));
-        if (!m)
-        {
-                return NULL;
-        }
-        memset(m, 0, sizeof(*m));
-        m->static_mu = 0.5f;
-        m->dynamic_mu = 0.5f;
+        struct vertex* v0;
+        struct vertex* v1;
+        struct vertex* v2;
+        float t;
+        float u;
+        float v;
+        int hit;
 
-        /* restitution */
-        cJSON* rest = cJSON_GetObjectItem(json_mesh, "restitution");
-        if (cJSON_IsNumber(rest))
-        {
-                m->restitution = (float)rest->valuedouble;
-        }
+        mesh_get_tri(&v0, &v1, &v2, m, ti);
 
-        /* friction coefficients (optional) */
-        cJSON* smu = cJSON_GetObjectItem(json_mesh, "static_mu");
-        if (cJSON_IsNumber(smu))
-        {
-                m->static_mu = (float)smu->valuedouble;
-        }
-        cJSON* dmu = cJSON_GetObjectItem(json_mesh, "dynamic_mu");
-        if (cJSON_IsNumber(dmu))
+        if (m->tris)
         {
-                m->dynamic_mu = (float)dmu->valuedouble;
+                hit = ray_tri_edges(p, &v0->pos,
+                                    &m->tris[ti].e1, &m->tris[ti].e2,
+                                    &t, &u, &v);
         }
-
-        /* grid dimensions (optional) */
-        cJSON* gx = cJSON_GetObjectItem(json_mesh, "grid_x");
-        if (cJSON_IsNumber(gx))
+        else
         {
-                m->grid_x = (uint16_t)gx->valuedouble;
+                hit = ray_tri_intersect(p, &v0->pos, &v1->pos, &v2->pos,
+                                        &t, &u, &v);
         }
-        cJSON* gz = cJSON_GetObjectItem(json_mesh, "grid_z");
-        if (cJSON_IsNumber(gz))
+        if (!hit)
         {
-                m->grid_z = (uint16_t)gz->valuedouble;
+                return 0;
         }
 
-        /* vertices */
-        cJSON* verts = cJSON_GetObjectItem(json_mesh, "vertices");
-        if (!cJSON_IsArray(verts))
-        {
-                printf("failed to get vertices\n");
-                free(m);
-                return NULL;
-        }
+        return toi_record(toi, m, ti, t, t_max, NULL);
+}
 
-        int vc = cJSON_GetArraySize(verts);
-        m->vertex_count = (uint16_t)vc;
-        m->vertices = malloc((unsigned long)vc * sizeof(struct vertex));
-        if (!m->vertices)
-        {
-                free(m);
-                return NULL;
-        }
-#ifdef DEBUG
-        printf("found %d vertices\n", vc);
-#endif
+/*
+ * Test the bvh items [first, first + count) using the mesh's
+ * triangle blocks.
+ */
+static int toi_blocks(struct collision* toi,
+                      const struct particle* p,
+                      struct mesh* m,
+                      uint32_t first,
+                      uint32_t count,
+                      float* t_max)
+{
+        uint32_t end = first + count;
+        int hit = 0;
 
-        for (int i = 0; i < vc; i++)
+        for (uint32_t j = first / TRI_BLOCK_SIZE;
+             j * TRI_BLOCK_SIZE < end;
+             j++)
         {
-                cJSON* v = cJSON_GetArrayItem(verts, i);
-                if (!cJSON_IsObject(v))
-                {
-                        fprintf(stderr, "vertex %d: expected object\n", i);
-                        free(m->vertices);
-                        free(m);
-                        return NULL;
-                }
-
-                cJSON* pos = cJSON_GetObjectItem(v, "position");
-                if (!cJSON_IsArray(pos) || cJSON_GetArraySize(pos) < 3)
-                {
-                        fprintf(stderr, "vertex %d: 'position' must be an "
-                                "array with at least 3 elements\n", i);
-                        free(m->vertices);
-                        free(m);
-                        return NULL;
-                }
-
-                cJSON* px = cJSON_GetArrayItem(pos, 0);
-                cJSON* py = cJSON_GetArrayItem(pos, 1);
-                cJSON* pz = cJSON_GetArrayItem(pos, 2);
-                if (!cJSON_IsNumber(px) || !cJSON_IsNumber(py) ||
-                    !cJSON_IsNumber(pz))
-                {
-                        fprintf(stderr, "vertex %d: 'position' elements "
-                                "must be numbers\n", i);
-                        free(m->vertices);
-                        free(m);
-                        return NULL;
-                }
-
-                m->vertices[i].pos.x = (float)px->valuedouble;
-                m->vertices[i].pos.y = (float)py->valuedouble;
-                m->vertices[i].pos.z = (float)pz->valuedouble;
-
-                /* color (optional, default: 0.3, 0.6, 0.8, 1.0) */
-                cJSON* col = cJSON_GetObjectItem(v, "color");
-                if (cJSON_IsArray(col) && cJSON_GetArraySize(col) >= 4)
+                const struct tri_block* b = m->blocks + j;
+                uint32_t base = j * TRI_BLOCK_SIZE;
+                uint32_t lo = first > base ? first - base : 0;
+                uint32_t hi = MIN(end - base, TRI_BLOCK_SIZE);
+                unsigned int lanes = ((1u << hi) - 1) & ~((1u << lo) - 1);
+                float t[TRI_BLOCK_SIZE];
+                unsigned int hits = tri_block_intersect(b, p, lanes, t);
+
+                for (uint32_t l = 0; hits; l++)
                 {
-                        cJSON* cr = cJSON_GetArrayItem(col, 0);
-                        cJSON* cg = cJSON_GetArrayItem(col, 1);
-                        cJSON* cb = cJSON_GetArrayItem(col, 2);
-                        cJSON* ca = cJSON_GetArrayItem(col, 3);
-                        if (cJSON_IsNumber(cr) && cJSON_IsNumber(cg) &&
-                            cJSON_IsNumber(cb) && cJSON_IsNumber(ca))
+                        if (!(hits & (1u << l)))
                         {
-                                m->vertices[i].color.x = (float)cr->valuedouble;
-                                m->vertices[i].color.y = (float)cg->valuedouble;
-                                m->vertices[i].color.z = (float)cb->valuedouble;
-                                m->vertices[i].color.w = (float)ca->valuedouble;
+                                continue;
                         }
-                        else
+                        hits &= ~(1u << l);
+
+                        if (toi_record(toi, m, b->ti[l], t[l], *t_max,
+                                       NULL))
                         {
-                                m->vertices[i].color = (struct vec4)
-                                        {.x = 0.3f, .y = 0.6f,
-                                         .z = 0.8f, .w = 1.0f};
+                                *t_max = toi->t;
+                                hit = 1;
                         }
                 }
-                else
-                {
-                        m->vertices[i].color = (struct vec4)
-                                {.x = 0.3f, .y = 0.6f,
-                                 .z = 0.8f, .w = 1.0f};
-                }
-#ifdef DEBUG
-                printf("vertex %d\n", i);
-                print_vertex(m->vertices + i);
-#endif
         }
 
-        /* indices */
-        cJSON* idxs = cJSON_GetObjectItem(json_mesh, "indices");
-        if (!cJSON_IsArray(idxs))
-        {
-                free(m->vertices);
-                free(m);
-                printf("failed to get indices\n");
-                return NULL;
-        }
+        return hit;
+}
 
-        int ic = cJSON_GetArraySize(idxs);
-        m->index_count = (uint32_t)ic;
-        m->indices = malloc((unsigned long)ic * sizeof(uint16_t));
-        if (!m->indices)
+static void toi_leaf(void* ctx,
+                     const uint32_t* items,
+                     uint32_t count,
+                     float* t_max)
+{
+        struct toi_query* q = ctx;
+
+        if (q->m->blocks)
         {
-                free(m->vertices);
-                free(m);
-                return NULL;
+                uint32_t first = (uint32_t)(items - q->m->bvh->items);
+
+                if (toi_blocks(q->toi, q->p, q->m, first, count, t_max))
+                {
+                        q->hit = 1;
+                }
+                return;
         }
-#ifdef DEBUG
-        printf("found %d indices\n", ic);
-#endif
 
-        for (int i = 0; i < ic; i++)
+        for (uint32_t i = 0; i < count; i++)
         {
-                cJSON* idx = cJSON_GetArrayItem(idxs, i);
-                if (!cJSON_IsNumber(idx))
+                if (toi_tri(q->toi, q->p, q->m, items[i], *t_max))
                 {
-                        fprintf(stderr, "index %d: expected a number\n", i);
-                        free(m->indices);
-                        free(m->vertices);
-                        free(m);
-                        return NULL;
+                        *t_max = q->toi->t;
+                        q->hit = 1;
                 }
-                m->indices[i] = (uint16_t)idx->valuedouble;
         }
+}
 
-        m->inward_normals = malloc((size_t)ic * sizeof(struct vec3));
-        if (!m->inward_normals)
+static int mesh_grid_info(const struct mesh* m, struct grid_info* g)
+{
+        uint32_t gx = m->grid_x;
+        uint32_t gz = m->grid_z;
+
+        // The layout is validated once by mesh_check_grid, the counts
+        // are checked again so clearing grid_x disables the grid
+        if (!m->is_grid || gx < 2 || gz < 2 ||
+            m->vertex_count != gx * gz ||
+            m->index_count != (gx - 1) * (gz - 1) * 6)
         {
-                free(m->indices);
-                free(m->vertices);
-                free(m);
-                return NULL;
+                return 0;
         }
-        mesh_normalize(m);
-        mesh_inward_normalize(m);
 
-        return m;
+        g->x0 = m->vertices[0].pos.x;
+        g->z0 = m->vertices[0].pos.z;
+        g->dx = m->vertices[1].pos.x - g->x0;
+        g->dz = m->vertices[gx].pos.z - g->z0;
+        g->cx = (int)gx - 1;
+        g->cz = (int)gz - 1;
+
+        return 1;
 }
 
-struct mesh* load_meshes(const char* p, int* count)
+/*
+ * Test if coordinate a is the expected grid coordinate e, within
+ * GRID_VERTEX_EPS cells and the rounding of e.
+ */
+static int grid_coord_ok(float a, float e, float d)
 {
-        *count = 0;
+        float eps = GRID_VERTEX_EPS * d + 4.0f * FLT_EPSILON * fabsf(e);
 
-        char* data = read_file(p);
-        if (!data)
-        {
-                printf("failed to parse read file\n");
-                return NULL;
-        }
+        return fabsf(a - e) <= eps;
+}
 
-        cJSON* root = cJSON_Parse(data);
-        free(data);
-        if (!root)
+static int grid_layout_ok(const struct mesh* m)
+{
+        uint32_t gx = m->grid_x;
+        uint32_t gz = m->grid_z;
+        uint32_t i = 0;
+        float x0;
+        float z0;
+        float dx;
+        float dz;
+
+        if (gx < 2 || gz < 2 ||
+            m->vertex_count != gx * gz ||
+            m->index_count != (gx - 1) * (gz - 1) * 6)
         {
-                printf("failed to parse json data\n");
-                return NULL;
+                return 0;
         }
 
-        cJSON* meshes = cJSON_GetObjectItem(root, "meshes");
-        if (!cJSON_IsArray(meshes))
+        // The triangles must be laid out as done by gen_mesh
+        for (uint32_t iz = 0; iz < gz - 1; iz++)
         {
-                printf("failed to get meshes\n");
-                cJSON_Delete(root);
-                return NULL;
+                for (uint32_t ix = 0; ix < gx - 1; ix++)
+                {
+                        uint32_t v = iz * gx + ix;
+
+                        if (mesh_index(m, i + 0) != v ||
+                            mesh_index(m, i + 1) != v + gx ||
+                            mesh_index(m, i + 2) != v + 1 ||
+                            mesh_index(m, i + 3) != v + 1 ||
+                            mesh_index(m, i + 4) != v + gx ||
+                            mesh_index(m, i + 5) != v + gx + 1)
+                        {
+                                return 0;
+                        }
+                        i += 6;
+                }
         }
 
-        size_t n = (size_t)cJSON_GetArraySize(meshes);
-        if (n == 0)
+        // and the vertices evenly spaced in the xz plane
+        x0 = m->vertices[0].pos.x;
+        z0 = m->vertices[0].pos.z;
+        dx = m->vertices[1].pos.x - x0;
+        dz = m->vertices[gx].pos.z - z0;
+        if (!(dx > 0.0f && dz > 0.0f))
         {
-                printf("failed to get array size\n");
-                cJSON_Delete(root);
-                return NULL;
+                return 0;
         }
 
-        if (n > UINT16_MAX)
+        for (uint32_t iz = 0; iz < gz; iz++)
         {
-                printf("too many meshes found: %zu\n", n);
-                cJSON_Delete(root);
-                return NULL;
-        }
+                float z = z0 + (float)iz * dz;
 
-#ifdef DEBUG
-        printf("found %zu meshes\n", n);
-#endif
+                for (uint32_t ix = 0; ix < gx; ix++)
+                {
+                        const struct vertex* v = m->vertices + iz * gx + ix;
 
-        /* Parse each mesh into its own allocation */
-        struct mesh** tmp = malloc(n * sizeof(struct mesh*));
-        if (!tmp)
-        {
-                cJSON_Delete(root);
-                return NULL;
-        }
+                        float x = x0 + (float)ix * dx;
 
-        int parsed = 0;
-        for (int i = 0; i < (int)n; i++)
-        {
-                cJSON* item = cJSON_GetArrayItem(meshes, i);
-                tmp[i] = parse_mesh(item);
-                if (!tmp[i])
-                {
-                        /* Clean up previously parsed meshes */
-                        for (int j = 0; j < parsed; j++)
+                        if (!grid_coord_ok(v->pos.x, x, dx) ||
+                            !grid_coord_ok(v->pos.z, z, dz))
                         {
-                                mesh_free(tmp[j]);
-                                free(tmp[j]);
+                                return 0;
                         }
-                        free(tmp);
-                        cJSON_Delete(root);
-                        return NULL;
                 }
-                parsed++;
         }
 
-        cJSON_Delete(root);
+        return 1;
+}
 
-        /* Consolidate into a single contiguous array */
-        struct mesh* result = malloc(n * sizeof(struct mesh));
-        if (!result)
-        {
-                for (int i = 0; i < (int)n; i++)
-                {
-                        mesh_free(tmp[i]);
-                        free(tmp[i]);
-                }
-                free(tmp);
-                return NULL;
-        }
+int mesh_check_grid(struct mesh* m)
+{
+        m->is_grid = (uint8_t)grid_layout_ok(m);
+
+        return m->is_grid;
+}
+
+int mesh_is_grid(const struct mesh* m)
+{
+        struct grid_info g;
+
+        return mesh_grid_info(m, &g);
+}
+
+/*
+ * Test both triangles in cell (ix, iz), if the cell is in the grid.
+ */
+static int grid_cell_toi(struct collision* toi,
+                         const struct particle* p,
+                         struct mesh* m,
+                         const struct grid_info* g,
+                         int ix,
+                         int iz,
+                         float t_max)
+{
+        int hit = 0;
 
-        for (int i = 0; i < (int)n; i++)
+        if (ix < 0 || iz < 0 || ix >= g->cx || iz >= g->cz)
         {
-                result[i] = *tmp[i];
-                free(tmp[i]);
+                return 0;
         }
-        free(tmp);
 
-        *count = (int)n;
-        return result;
+        uint32_t ti = 2 * (uint32_t)(iz * g->cx + ix);
+
+        hit |= toi_tri(toi, p, m, ti, t_max);
+        hit |= toi_tri(toi, p, m, ti + 1, t_max);
+
+        return hit;
 }
 
-int write_meshes(const char* p, const struct mesh* meshes, int count)
+/*
+ * Walk the cells under the particle's swept segment in the xz plane
+ * (2D DDA) and only test the triangles in the visited cells.
+ */
+static int grid_toi(struct collision* toi,
+                    const struct particle* p,
+                    struct mesh* m,
+                    const struct grid_info* g,
+                    float t_max)
 {
-        cJSON* root = cJSON_CreateObject();
-        if (!root)
+        // Work in cell units
+        float o[2] = { (p->p.x - g->x0) / g->dx, (p->p.z - g->z0) / g->dz };
+        float d[2] = { p->v.x / g->dx, p->v.z / g->dz };
+        float ext[2] = { (float)g->cx, (float)g->cz };
+        int cell[2];
+        int step[2];
+        float t_next[2];
+        float t_delta[2];
+        float t0 = 0.0f;
+        float t1 = t_max;
+        float t_in;
+        int hit = 0;
+
+        // Clip the segment to the grid
+        for (int i = 0; i < 2; i++)
         {
-                return -1;
-        }
+                if (d[i] == 0.0f)
+                {
+                        if (o[i] < 0.0f || o[i] > ext[i])
+                        {
+                                return 0;
+                        }
+                        continue;
+                }
 
-        cJSON* jarr = cJSON_AddArrayToObject(root, "meshes");
-        if (!jarr)
+                float tn = -o[i] / d[i];
+                float tf = (ext[i] - o[i]) / d[i];
+
+                t0 = MAX(t0, MIN(tn, tf));
+                t1 = MIN(t1, MAX(tn, tf));
+        }
+        if (t0 > t1)
         {
-                cJSON_Delete(root);
-                return -1;
+                return 0;
         }
 
-        for (int i = 0; i < count; i++)
+        for (int i = 0; i < 2; i++)
         {
-                const struct mesh* m = &meshes[i];
-                cJSON* jmesh = cJSON_CreateObject();
-                if (!jmesh)
-                {
-                        cJSON_Delete(root);
-                        return -1;
-                }
+                float start = o[i] + d[i] * t0;
 
-                cJSON_AddNumberToObject(jmesh, "restitution", m->restitution);
-                cJSON_AddNumberToObject(jmesh, "static_mu", m->static_mu);
-                cJSON_AddNumberToObject(jmesh, "dynamic_mu", m->dynamic_mu);
+                cell[i] = (int)floorf(start);
+                cell[i] = MAX(0, MIN(cell[i], (int)ext[i] - 1));
 
-                if (m->grid_x > 0 && m->grid_z > 0)
+                if (d[i] > 0.0f)
                 {
-                        cJSON_AddNumberToObject(jmesh, "grid_x", m->grid_x);
-                        cJSON_AddNumberToObject(jmesh, "grid_z", m->grid_z);
+                        step[i] = 1;
+                        t_delta[i] = 1.0f / d[i];
+                        t_next[i] = ((float)(cell[i] + 1) - o[i]) / d[i];
                 }
-
-                /* vertices */
-                cJSON* jverts = cJSON_AddArrayToObject(jmesh, "vertices");
-                for (int vi = 0; vi < m->vertex_count; vi++)
+                else if (d[i] < 0.0f)
+                {
+                        step[i] = -1;
+                        t_delta[i] = -1.0f / d[i];
+                        t_next[i] = ((float)cell[i] - o[i]) / d[i];
+                }
+                else
                 {
-                        const struct vertex* v = &m->vertices[vi];
-                        cJSON* jv = cJSON_CreateObject();
+                        step[i] = 0;
+                        t_delta[i] = INFINITY;
+                        t_next[i] = INFINITY;
+                }
+        }
+
+        t_in = t0;
+        for (;;)
+        {
+                float t_exit = MIN(t_next[0], t_next[1]);
+                float lo[2];
+                float hi[2];
 
-                        cJSON* pos = cJSON_CreateFloatArray(v->pos.a, 3);
-                        cJSON_AddItemToObject(jv, "position", pos);
+                hit |= grid_cell_toi(toi, p, m, g, cell[0], cell[1], t_max);
 
-                        cJSON* col = cJSON_CreateFloatArray(v->color.a, 4);
-                        cJSON_AddItemToObject(jv, "color", col);
+                // The segment's extent in this cell. If it's within
+                // rounding distance of a cell border, test the neighbour
+                // as well so hits on shared edges are not missed.
+                for (int i = 0; i < 2; i++)
+                {
+                        float a = o[i] + d[i] * t_in;
+                        float b = o[i] + d[i] * MIN(t_exit, t1);
 
-                        cJSON_AddItemToArray(jverts, jv);
+                        lo[i] = MIN(a, b) - (float)cell[i];
+                        hi[i] = MAX(a, b) - (float)cell[i];
+                }
+                for (int dz = -1; dz <= 1; dz++)
+                {
+                        for (int dx = -1; dx <= 1; dx++)
+                        {
+                                if ((dx || dz) &&
+                                    (dx >= 0 || lo[0] < GRID_EDGE_EPS) &&
+                                    (dx <= 0 || hi[0] > 1.0f - GRID_EDGE_EPS) &&
+                                    (dz >= 0 || lo[1] < GRID_EDGE_EPS) &&
+                                    (dz <= 0 || hi[1] > 1.0f - GRID_EDGE_EPS))
+                                {
+                                        hit |= grid_cell_toi(toi, p, m, g,
+                                                             cell[0] + dx,
+                                                             cell[1] + dz,
+                                                             t_max);
+                                }
+                        }
                 }
 
-                /* indices */
-                cJSON* jidxs = cJSON_AddArrayToObject(jmesh, "indices");
-                for (int ii = 0; (uint32_t)ii < m->index_count; ii++)
+                // Nothing in later cells can be closer than this hit
+                if (hit && toi->t < t_exit)
                 {
-                        cJSON_AddItemToArray(jidxs,
-                                cJSON_CreateNumber(m->indices[ii]));
+                        break;
+                }
+                if (t_exit > t1)
+                {
+                        break;
                 }
 
-                cJSON_AddItemToArray(jarr, jmesh);
+                int axis = t_next[0] < t_next[1] ? 0 : 1;
+
+                cell[axis] += step[axis];
+                t_next[axis] += t_delta[axis];
+                t_in = t_exit;
+                if (cell[axis] < 0 || cell[axis] >= (int)ext[axis])
+                {
+                        break;
+                }
         }
 
-        char* json_str = cJSON_Print(root);
-        cJSON_Delete(root);
-        if (!json_str)
+        return hit;
+}
+
+/*
+ * The first t in [0, t_max] where a t^2 + 2 b t + c = 0, i.e. where a
+ * squared distance that shrinks along the sweep reaches the squared
+ * radius. c <= 0 means touching already at t = 0.
+ */
+static int sweep_root(float a, float b, float c, float t_max, float* t)
+{
+        float disc = b * b - a * c;
+
+        // Moving away, or passing by
+        if (!(b < 0.0f) || !(a > 0.0f) || disc < 0.0f)
         {
-                return -1;
+                return 0;
         }
-
-        FILE* f = fopen(p, "w");
-        if (!f)
+        if (c <= 0.0f)
         {
-                free(json_str);
-                return -1;
+                *t = 0.0f;
+                return 1;
         }
 
-        fputs(json_str, f);
-        fclose(f);
-        free(json_str);
+        *t = (-b - sqrtf(disc)) / a;
+
+        return *t <= t_max;
+}
+
+/*
+ * The sphere against the edge a + s * e, s in [0, 1]. Solved against
+ * the infinite cylinder around the edge, the ends are left to the
+ * vertices.
+ */
+static int sweep_edge(const struct particle* p,
+                      struct vec3 a,
+                      struct vec3 e,
+                      float t_max,
+                      float* t,
+                      struct vec3* n)
+{
+        struct vec3 m = vec3_sub(p->p, a);
+        float ee = vec3_dot(e, e);
+        float ed = vec3_dot(e, p->v);
+        float em = vec3_dot(e, m);
+        float qa = ee * vec3_dot(p->v, p->v) - ed * ed;
+        float qb = ee * vec3_dot(m, p->v) - em * ed;
+        float qc = ee * (vec3_dot(m, m) - p->rad * p->rad) - em * em;
+        float s;
+
+        if (!(ee > 0.0f) || !sweep_root(qa, qb, qc, t_max, t))
+        {
+                return 0;
+        }
+
+        s = (em + *t * ed) / ee;
+        if (s < 0.0f || s > 1.0f)
+        {
+                return 0;
+        }
+
+        m = vec3_add(m, vec3_scalarm(p->v, *t));
+        *n = vec3_norm(vec3_sub(m, vec3_scalarm(e, s)));
+
+        return 1;
+}
+
+static int sweep_vertex(const struct particle* p,
+                        struct vec3 a,
+                        float t_max,
+                        float* t,
+                        struct vec3* n)
+{
+        struct vec3 m = vec3_sub(p->p, a);
+        float qa = vec3_dot(p->v, p->v);
+        float qb = vec3_dot(m, p->v);
+        float qc = vec3_dot(m, m) - p->rad * p->rad;
+
+        if (!sweep_root(qa, qb, qc, t_max, t))
+        {
+                return 0;
+        }
+
+        *n = vec3_norm(vec3_add(m, vec3_scalarm(p->v, *t)));
+
+        return 1;
+}
+
+// Is q, in the triangle's plane, inside the triangle
+static int tri_contains(struct vec3 q,
+                        struct vec3 v0,
+                        struct vec3 e1,
+                        struct vec3 e2)
+{
+        struct vec3 d = vec3_sub(q, v0);
+        float d00 = vec3_dot(e1, e1);
+        float d01 = vec3_dot(e1, e2);
+        float d11 = vec3_dot(e2, e2);
+        float d20 = vec3_dot(d, e1);
+        float d21 = vec3_dot(d, e2);
+        float u = d11 * d20 - d01 * d21;
+        float v = d00 * d21 - d01 * d20;
+
+        // Scaled by the (positive) determinant
+        return u >= 0.0f && v >= 0.0f && u + v <= d00 * d11 - d01 * d01;
+}
+
+/*
+ * Sweep the particle as a sphere of radius p->rad against triangle ti
+ * and record the first contact. The face is tested first, a contact
+ * inside it is always the first one. Otherwise the first contact is
+ * with an edge or a vertex. The normal points from the contact to the
+ * sphere's center. A sphere touching the triangle at the start hits
+ * at t = 0 if it moves towards it, and is ignored otherwise.
+ */
+static int sphere_tri(struct collision* toi,
+                      const struct particle* p,
+                      struct mesh* m,
+                      uint32_t ti,
+                      float t_max)
+{
+        struct vertex* v[3];
+        struct vec3 n = tri_normal(m, ti);
+        struct vec3 e[3];
+        struct vec3 e2;
+        float r = p->rad;
+        float pad = MAX_CONTACT_DIST;
+        float s0;
+        float s1;
+        float vn;
+        float t_hit = INFINITY;
+        struct vec3 n_hit;
+
+        mesh_get_tri(v + 0, v + 1, v + 2, m, ti);
+
+        // Both ends of the sweep out of reach of the plane, on the
+        // same side. The culls are padded, an edge or vertex contact
+        // can be computed a little before the plane is reached, and
+        // must not be lost when t_max shrinks to just before it.
+        s0 = tri_plane_dist(m, ti, n, p->p);
+        vn = vec3_dot(p->v, n);
+        s1 = s0 + vn * t_max;
+        if ((s0 > r + pad && s1 > r + pad) ||
+            (s0 < -r - pad && s1 < -r - pad))
+        {
+                return 0;
+        }
+
+        // Work on the side the sphere starts on
+        if (s0 < 0.0f)
+        {
+                n = vec3_scalarm(n, -1.0f);
+                s0 = -s0;
+                vn = -vn;
+        }
+
+        e[0] = vec3_sub(v[1]->pos, v[0]->pos);
+        e[1] = vec3_sub(v[2]->pos, v[1]->pos);
+        e[2] = vec3_sub(v[0]->pos, v[2]->pos);
+        e2 = vec3_scalarm(e[2], -1.0f);
+
+        if (s0 < r)
+        {
+                struct vec3 q = vec3_sub(p->p, vec3_scalarm(n, s0));
+
+                // Touching the face already, only a hit when moving
+                // further into it
+                if (tri_contains(q, v[0]->pos, e[0], e2))
+                {
+                        return vn < 0.0f &&
+                                toi_record(toi, m, ti, 0.0f, t_max, &n);
+                }
+        }
+        else if (vn < 0.0f)
+        {
+                // Where the sphere reaches the plane. Edges and vertices
+                // can't be touched before it does.
+                float t = (s0 - r) / -vn;
+                struct vec3 c = vec3_add(p->p, vec3_scalarm(p->v, t));
+
+                if ((s0 - r - pad) / -vn > t_max)
+                {
+                        return 0;
+                }
+                if (tri_contains(vec3_sub(c, vec3_scalarm(n, r)),
+                                 v[0]->pos, e[0], e2))
+                {
+                        return toi_record(toi, m, ti, t, t_max, &n);
+                }
+        }
+        else
+        {
+                return 0;
+        }
+
+        for (int i = 0; i < 3; i++)
+        {
+                float t;
+                struct vec3 nt;
+
+                if (sweep_edge(p, v[i]->pos, e[i], MIN(t_max, t_hit),
+                               &t, &nt) && t < t_hit)
+                {
+                        t_hit = t;
+                        n_hit = nt;
+                }
+                if (sweep_vertex(p, v[i]->pos, MIN(t_max, t_hit),
+                                 &t, &nt) && t < t_hit)
+                {
+                        t_hit = t;
+                        n_hit = nt;
+                }
+        }
+        if (t_hit > t_max)
+        {
+                return 0;
+        }
+
+        return toi_record(toi, m, ti, t_hit, t_max, &n_hit);
+}
+
+static void sphere_leaf(void* ctx,
+                        const uint32_t* items,
+                        uint32_t count,
+                        float* t_max)
+{
+        struct toi_query* q = ctx;
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+                if (sphere_tri(q->toi, q->p, q->m, items[i], *t_max))
+                {
+                        *t_max = q->toi->t;
+                        q->hit = 1;
+                }
+        }
+}
+
+/*
+ * Grid meshes: test the triangles in the cells under the sweep's XZ
+ * bounding box, grown by the radius.
+ */
+static int sphere_grid(struct collision* toi,
+                       const struct particle* p,
+                       struct mesh* m,
+                       const struct grid_info* g,
+                       float t_max)
+{
+        struct vec3 end = vec3_add(p->p, vec3_scalarm(p->v, t_max));
+        float r = p->rad + MAX_CONTACT_DIST;
+        float x0 = (MIN(p->p.x, end.x) - r - g->x0) / g->dx;
+        float x1 = (MAX(p->p.x, end.x) + r - g->x0) / g->dx;
+        float z0 = (MIN(p->p.z, end.z) - r - g->z0) / g->dz;
+        float z1 = (MAX(p->p.z, end.z) + r - g->z0) / g->dz;
+        int hit = 0;
+
+        // Also catches NaN
+        if (!(x1 >= 0.0f && z1 >= 0.0f &&
+              x0 < (float)g->cx && z0 < (float)g->cz))
+        {
+                return 0;
+        }
+
+        int ix0 = MAX(0, (int)floorf(x0));
+        int ix1 = MIN(g->cx - 1, (int)floorf(x1));
+        int iz0 = MAX(0, (int)floorf(z0));
+        int iz1 = MIN(g->cz - 1, (int)floorf(z1));
+
+        for (int iz = iz0; iz <= iz1; iz++)
+        {
+                for (int ix = ix0; ix <= ix1; ix++)
+                {
+                        uint32_t ti = 2 * (uint32_t)(iz * g->cx + ix);
+
+                        for (uint32_t k = 0; k < 2; k++)
+                        {
+                                if (sphere_tri(toi, p, m, ti + k, t_max))
+                                {
+                                        t_max = toi->t;
+                                        hit = 1;
+                                }
+                        }
+                }
+        }
+
+        return hit;
+}
+
+static int sphere_mesh_toi(struct collision* toi,
+                           const struct particle* p,
+                           struct mesh* m,
+                           float t_max)
+{
+        struct toi_query q = {
+                .toi = toi,
+                .p = p,
+                .m = m,
+                .hit = 0
+        };
+        struct grid_info g;
+
+        if (mesh_grid_info(m, &g))
+        {
+                return sphere_grid(toi, p, m, &g, t_max);
+        }
+
+        if (m->bvh)
+        {
+                bvh_traverse_sweep(m->bvh, p->p, p->v, p->rad, t_max,
+                                   sphere_leaf, &q);
+
+                return q.hit;
+        }
+
+        for (uint32_t ti = 0; ti < m->index_count / 3; ti++)
+        {
+                if (sphere_tri(toi, p, m, ti, t_max))
+                {
+                        t_max = toi->t;
+                        q.hit = 1;
+                }
+        }
+
+        return q.hit;
+}
+
+/*
+ * Find the first collision with the mesh for t in (0, t_max].
+ * Particles with a radius are swept as spheres.
+ */
+static int mesh_toi(struct collision* toi,
+                    const struct particle* p,
+                    struct mesh* m,
+                    float t_max)
+{
+        struct toi_query q = {
+                .toi = toi,
+                .p = p,
+                .m = m,
+                .hit = 0
+        };
+
+        struct grid_info g;
+
+        if (p->rad > 0.0f)
+        {
+                return sphere_mesh_toi(toi, p, m, t_max);
+        }
+
+        if (mesh_grid_info(m, &g))
+        {
+                return grid_toi(toi, p, m, &g, t_max);
+        }
+
+        if (m->bvh)
+        {
+                bvh_traverse_seg(m->bvh, p->p, p->v, t_max, toi_leaf, &q);
+
+                return q.hit;
+        }
+
+        for (uint32_t ti = 0; ti < m->index_count / 3; ti++)
+        {
+                if (toi_tri(toi, p, m, ti, t_max))
+                {
+                        t_max = toi->t;
+                        q.hit = 1;
+                }
+        }
+
+        return q.hit;
+}
+
+static void toi_tree_leaf(void* ctx,
+                          const uint32_t* items,
+                          uint32_t count,
+                          float* t_max)
+{
+        struct toi_tree_query* q = ctx;
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+                if (mesh_toi(q->toi, q->p, q->meshes + items[i], *t_max))
+                {
+                        *t_max = q->toi->t;
+                        q->hit = 1;
+                }
+        }
+}
+
+int compute_toi(struct collision* toi,
+                struct particle* p,
+                struct mesh* meshes,
+                int mesh_count)
+{
+        int ret = 0;
+
+        toi->t = INFINITY;
+
+        for (int s = 0; s < mesh_count; s++)
+        {
+                if (mesh_toi(toi, p, meshes + s, MIN(1.0f, toi->t)))
+                {
+                        ret = 1;
+                }
+        }
+
+        return ret;
+}
+
+int compute_toi_tree(struct collision* toi,
+                     struct particle* p,
+                     const struct bvh* tree,
+                     struct mesh* meshes)
+{
+        struct toi_tree_query q = {
+                .toi = toi,
+                .p = p,
+                .meshes = meshes,
+                .hit = 0
+        };
+
+        toi->t = INFINITY;
+        bvh_traverse_sweep(tree, p->p, p->v, MAX(p->rad, 0.0f), 1.0f,
+                           toi_tree_leaf, &q);
+
+        return q.hit;
+}
+
+static void toi_chunk(void* ctx, struct mesh* m, float* t_max)
+{
+        struct toi_tree_query* q = ctx;
+
+        if (mesh_toi(q->toi, q->p, m, *t_max))
+        {
+                *t_max = q->toi->t;
+                q->hit = 1;
+        }
+}
+
+int compute_toi_terrain(struct collision* toi,
+                        struct particle* p,
+                        const struct terrain* ter)
+{
+        struct toi_tree_query q = {
+                .toi = toi,
+                .p = p,
+                .meshes = NULL,
+                .hit = 0
+        };
+
+        toi->t = INFINITY;
+        terrain_query_sweep(ter, p->p, p->v, MAX(p->rad, 0.0f),
+                            toi_chunk, &q);
+
+        return q.hit;
+}
+
+/*
+ * Test if p is on or just above triangle i.
+ */
+static int tri_point_on(const struct mesh* m, uint32_t i, struct vec3 p)
+{
+        struct vertex* v0;
+        struct vertex* v1;
+        struct vertex* v2;
+        struct vec3 dv;
+        float d = tri_plane_dist(m, i, tri_normal(m, i), p);
+
+        if (d > MAX_CONTACT_DIST || d < 0.0f)
+        {
+                return 0;
+        }
+
+        // Check the sign of the dot product against all inward
+        // pointing normals
+        mesh_get_tri(&v0, &v1, &v2, m, i);
+        dv = vec3_sub(p, v0->pos);
+        if (vec3_dot(m->inward_normals[i * 3 + 0], dv) < 0.0f)
+        {
+                return 0;
+        }
+        dv = vec3_sub(p, v1->pos);
+        if (vec3_dot(m->inward_normals[i * 3 + 1], dv) < 0.0f)
+        {
+                return 0;
+        }
+        dv = vec3_sub(p, v2->pos);
+        if (vec3_dot(m->inward_normals[i * 3 + 2], dv) < 0.0f)
+        {
+                return 0;
+        }
+
+        // Point is on or just above
+        return 1;
+}
+
+/*
+ * Test the two triangles in cell (ix, iz) if the cell is in the grid.
+ */
+static int grid_cell_point_on(const struct mesh* m,
+                              const struct grid_info* g,
+                              int ix,
+                              int iz,
+                              struct vec3 p,
+                              uint32_t* ti)
+{
+        if (ix < 0 || iz < 0 || ix >= g->cx || iz >= g->cz)
+        {
+                return 0;
+        }
+
+        uint32_t i = 2 * (uint32_t)(iz * g->cx + ix);
+
+        if (tri_point_on(m, i, p))
+        {
+                *ti = i;
+                return 1;
+        }
+        if (tri_point_on(m, i + 1, p))
+        {
+                *ti = i + 1;
+                return 1;
+        }
+
+        return 0;
+}
+
+static int grid_point_on_mesh(const struct mesh* m,
+                              const struct grid_info* g,
+                              struct vec3 p,
+                              uint32_t* ti)
+{
+        float fx = (p.x - g->x0) / g->dx;
+        float fz = (p.z - g->z0) / g->dz;
+        int ix;
+        int iz;
+
+        // Anything further away than a cell can't be on the mesh
+        if (fx < -1.0f || fz < -1.0f ||
+            fx > (float)g->cx + 1.0f || fz > (float)g->cz + 1.0f)
+        {
+                return 0;
+        }
+
+        ix = (int)floorf(fx);
+        iz = (int)floorf(fz);
+        ix = MAX(0, MIN(ix, g->cx - 1));
+        iz = MAX(0, MIN(iz, g->cz - 1));
+
+        if (grid_cell_point_on(m, g, ix, iz, p, ti))
+        {
+                return 1;
+        }
+
+        // On steep slopes, a point just above the surface can be above
+        // a neighbouring cell.
+        for (int dz = -1; dz <= 1; dz++)
+        {
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                        if ((dx || dz) &&
+                            grid_cell_point_on(m, g, ix + dx, iz + dz,
+                                               p, ti))
+                        {
+                                return 1;
+                        }
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Find a triangle p is on or just above.
+ */
+static int find_point_on_mesh(const struct mesh* m,
+                              struct vec3 p,
+                              uint32_t* ti)
+{
+        struct grid_info g;
+
+        if (mesh_grid_info(m, &g))
+        {
+                return grid_point_on_mesh(m, &g, p, ti);
+        }
+
+        for (uint32_t i = 0; i < m->index_count / 3; i++)
+        {
+                if (tri_point_on(m, i, p))
+                {
+                        *ti = i;
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+int point_on_mesh(struct mesh* m, struct vec3 p)
+{
+        uint32_t ti;
+
+        return find_point_on_mesh(m, p, &ti);
+}
+
+/*
+ * Return the edge of triangle i that p is the furthest outside of,
+ * measured in the triangle's plane, or -1 if p is inside all edges.
+ */
+static int tri_outside_edge(const struct mesh* m, uint32_t i, struct vec3 p)
+{
+        float min_d = 0.0f;
+        int edge = -1;
+
+        for (uint32_t k = 0; k < 3; k++)
+        {
+                struct vec3 v = m->vertices[mesh_index(m, i * 3 + k)].pos;
+                float d = vec3_dot(m->inward_normals[i * 3 + k],
+                                   vec3_sub(p, v));
+
+                if (d < min_d)
+                {
+                        min_d = d;
+                        edge = (int)k;
+                }
+        }
+
+        return edge;
+}
+
+int point_on_mesh_walk(struct mesh* m, struct vec3 p, uint32_t* ti)
+{
+        uint32_t tc = m->index_count / 3;
+        uint32_t t = *ti;
+
+        if (t < tc)
+        {
+                for (int step = 0; step < MESH_WALK_STEPS; step++)
+                {
+                        int e = tri_outside_edge(m, t, p);
+
+                        if (e < 0)
+                        {
+                                if (tri_point_on(m, t, p))
+                                {
+                                        *ti = t;
+                                        return 1;
+                                }
+                                // Above or below this triangle, let the
+                                // full search decide.
+                                break;
+                        }
+
+                        if (!m->adjacency ||
+                            m->adjacency[t * 3 + (uint32_t)e] == MESH_NO_ADJ)
+                        {
+                                break;
+                        }
+                        t = m->adjacency[t * 3 + (uint32_t)e];
+                }
+        }
+
+        return find_point_on_mesh(m, p, ti);
+}
+
+void mesh_free(struct mesh* m)
+{
+        if (!m->mapped)
+        {
+                free(m->vertices);
+                free(m->indices);
+                free(m->indices32);
+                free(m->inward_normals);
+        }
+        free(m->adjacency);
+        free(m->tris);
+        free(m->blocks);
+        if (m->bvh)
+        {
+                bvh_free(m->bvh);
+                free(m->bvh);
+        }
+
+        memset(m, 0, sizeof(*m));
+}
+
+struct mesh* load_meshes(const char* p, int* count)
+{
+        struct mesh_json_error err;
+        struct mesh* meshes;
+
+        *count = 0;
+
+        if (mesh_bin_probe(p))
+        {
+                return load_meshes_bin(p, count);
+        }
+
+        meshes = load_meshes_json(p, count, &err);
+        if (!meshes)
+        {
+                fprintf(stderr, "%s:%llu: %s\n", p,
+                        (unsigned long long)err.offset, err.msg);
+        }
+
+        return meshes;
+}
+
+int write_meshes(const char* p, const struct mesh* meshes, int count)
+{
+        size_t pl = strlen(p);
+        size_t el = strlen(MESH_BIN_EXT);
+        FILE* f;
+        int ret;
+
+        if (pl >= el && strcmp(p + pl - el, MESH_BIN_EXT) == 0)
+        {
+                return write_meshes_bin(p, meshes, count);
+        }
+
+        f = fopen(p, "w");
+        if (!f)
+        {
+                return -1;
+        }
+
+        ret = write_meshes_json(f, meshes, count, 0);
+        if (fclose(f) != 0)
+        {
+                ret = -1;
+        }
+
+        return ret;
+}
+
+struct mesh* gen_mesh(float x, float z, float d)
+{
+        unsigned int count_x = (unsigned int)(x / d) + 1;
+        unsigned int count_z = (unsigned int)(z / d) + 1;
+
+        if (count_x > UINT16_MAX || count_z > UINT16_MAX)
+        {
+                fprintf(stderr, "too large mesh (%u x %u)\n",
+                        count_x, count_z);
+                return NULL;
+        }
+        struct mesh* m = malloc(sizeof(*m));
+        struct vertex* v;
+        uint64_t v_count = (uint64_t)count_x * count_z;
+        uint64_t q_count = (uint64_t)(count_x - 1) * (count_z - 1);
+        uint64_t i_count = q_count * 6;
+        size_t ip = 0;
+
+        if (!m)
+        {
+                return NULL;
+        }
+        memset(m, 0, sizeof(*m));
+
+        if (v_count > UINT32_MAX || i_count > UINT32_MAX)
+        {
+                free(m);
+                fprintf(stderr, "too large mesh v count %llu idx count %llu\n",
+                        (unsigned long long)v_count,
+                        (unsigned long long)i_count);
+                return NULL;
+        }
+
+        m->grid_x = (uint16_t)count_x;
+        m->grid_z = (uint16_t)count_z;
+
+        if (d > x || d > z)
+        {
+                printf("invalid %f x %f z %f\n", d, x, z);
+                free(m);
+                return NULL;
+        }
+
+        m->vertices = malloc((size_t)v_count * sizeof(struct vertex));
+        // 16 bit indices if all vertices can be addressed
+        if (v_count - 1 > UINT16_MAX)
+        {
+                m->indices32 = malloc((size_t)i_count * sizeof(uint32_t));
+        }
+        else
+        {
+                m->indices = malloc((size_t)i_count * sizeof(uint16_t));
+        }
+        m->inward_normals = malloc((size_t)i_count * sizeof(struct vec3));
+        m->vertex_count = (uint32_t)v_count;
+        m->index_count = (uint32_t)i_count;
+
+        if (m->vertices == NULL ||
+            (m->indices == NULL && m->indices32 == NULL) ||
+            m->inward_normals == NULL)
+        {
+                free(m->vertices);
+                free(m->indices);
+                free(m->indices32);
+                free(m->inward_normals);
+                free(m);
+                return NULL;
+        }
+
+        for (unsigned int iz = 0; iz < count_z; iz++)
+        {
+                for (unsigned int ix = 0; ix < count_x; ix++)
+                {
+                        v = m->vertices + ip;
+
+                        v->pos.x = (float)ix * d;
+                        v->pos.y = 0.0f;
+                        v->pos.z = (float)iz * d;
+
+                        v->color.x = 0.2f;
+                        v->color.y = 0.2f;
+                        v->color.z = 0.7f;
+                        v->color.w = 1.0f;
+
+#ifdef DEBUG
+                        printf("%zu %f %f\n", ip, v->pos.x, v->pos.z);
+#endif
+                        ip++;
+                }
+        }
+
+        ip = 0;
+        // Iterate through each quad
+        for (unsigned int iz = 0; iz < count_z - 1; iz++)
+        {
+                for (unsigned int ix = 0; ix < count_x - 1; ix++)
+                {
+                        uint32_t q[6] = {
+                                // first triangle
+                                iz * count_x + ix,
+                                (iz + 1) * count_x + ix,
+                                iz * count_x + 1 + ix,
+                                // second triangle
+                                iz * count_x + 1 + ix,
+                                (iz + 1) * count_x + ix,
+                                (iz + 1) * count_x + 1 + ix
+                        };
+
+                        for (int k = 0; k < 6; k++)
+                        {
+                                if (m->indices32)
+                                {
+                                        m->indices32[ip++] = q[k];
+                                }
+                                else
+                                {
+                                        m->indices[ip++] = (uint16_t)q[k];
+                                }
+                        }
+
+#ifdef DEBUG
+                        printf("%d %d (%u %u %u) (%u %u %u)\n",
+                               ix, iz, q[0], q[1], q[2], q[3], q[4], q[5]);
+#endif
+                }
+        }
+
+        mesh_check_grid(m);
+        mesh_normalize(m);
+        mesh_inward_normalize(m);
+        if (mesh_build_tris(m) != 0 ||
+            mesh_build_bvh(m) != 0 ||
+            mesh_build_adjacency(m) != 0)
+        {
+                mesh_free(m);
+                free(m);
+                return NULL;
+        }
+
+        return m;
+}
+
+struct heightmap_job
+{
+        struct mesh* m;
+        struct grid_info g;
+        const float* peak_x;
+        const float* peak_z;
+        const float* peak_h;
+        int peaks;
+        float radius;
+};
+
+// Clamp a cell coordinate to [0, n]
+static uint32_t heightmap_clamp(float v, int n)
+{
+        if (!(v > 0.0f))
+        {
+                return 0;
+        }
+        if (v > (float)n)
+        {
+                return (uint32_t)n;
+        }
+
+        return (uint32_t)v;
+}
+
+/*
+ * Heights for the grid rows [begin, end). Each peak only visits the
+ * vertices in the bounding rectangle of its radius, padded by a cell.
+ * The vertices outside it would only have added 0, and the peaks are
+ * added in the same order as for the whole mesh, so the heights are
+ * the same down to the last bit.
+ */
+static void heightmap_rows(void* ctx, uint32_t begin, uint32_t end)
+{
+        const struct heightmap_job* job = ctx;
+        const struct grid_info* g = &job->g;
+        struct vertex* v = job->m->vertices;
+        uint32_t gx = (uint32_t)g->cx + 1;
+        float r = job->radius;
+
+        for (uint32_t i = begin * gx; i < end * gx; i++)
+        {
+                v[i].pos.y = 0.0f;
+        }
+
+        for (int p = 0; p < job->peaks; p++)
+        {
+                float px = job->peak_x[p];
+                float pz = job->peak_z[p];
+                uint32_t x0 = heightmap_clamp(
+                        floorf((px - r - g->x0) / g->dx) - 1.0f, g->cx);
+                uint32_t x1 = heightmap_clamp(
+                        ceilf((px + r - g->x0) / g->dx) + 1.0f, g->cx);
+                uint32_t z0 = heightmap_clamp(
+                        floorf((pz - r - g->z0) / g->dz) - 1.0f, g->cz);
+                uint32_t z1 = heightmap_clamp(
+                        ceilf((pz + r - g->z0) / g->dz) + 1.0f, g->cz);
+
+                z0 = MAX(z0, begin);
+                z1 = MIN(z1, end - 1);
+                if (z0 > z1)
+                {
+                        continue;
+                }
+                for (uint32_t z = z0; z <= z1; z++)
+                {
+                        for (uint32_t x = x0; x <= x1; x++)
+                        {
+                                struct vertex* vx = v + z * gx + x;
+                                float dx = vx->pos.x - px;
+                                float dz = vx->pos.z - pz;
+                                float dist = sqrtf(dx * dx + dz * dz);
+                                float falloff = 1.0f - dist / r;
+
+                                if (falloff > 0.0f)
+                                {
+                                        vx->pos.y += job->peak_h[p] * falloff;
+                                }
+                        }
+                }
+        }
+}
+
+/* For each vertex, sum contributions from all peaks */
+static void heightmap_all(const struct heightmap_job* job)
+{
+        struct mesh* m = job->m;
+
+        for (uint32_t i = 0; i < m->vertex_count; i++)
+        {
+                float h = 0.0f;
+                float vx = m->vertices[i].pos.x;
+                float vz = m->vertices[i].pos.z;
+
+                for (int p = 0; p < job->peaks; p++)
+                {
+                        float dx = vx - job->peak_x[p];
+                        float dz = vz - job->peak_z[p];
+                        float dist = sqrtf(dx * dx + dz * dz);
+                        float falloff = 1.0f - dist / job->radius;
+
+                        if (falloff > 0.0f)
+                        {
+                                h += job->peak_h[p] * falloff;
+                        }
+                }
+
+                m->vertices[i].pos.y = h;
+        }
+}
+
+void mesh_heightmap(struct mesh* m, int peaks, float max_height, float radius)
+{
+        mesh_heightmap_pool(m, peaks, max_height, radius, NULL);
+}
+
+void mesh_heightmap_pool(struct mesh* m,
+                         int peaks,
+                         float max_height,
+                         float radius,
+                         struct km_pool* pool)
+{
+        /* Find mesh extents in xz plane */
+        float min_x = m->vertices[0].pos.x;
+        float max_x = min_x;
+        float min_z = m->vertices[0].pos.z;
+        float max_z = min_z;
+
+        for (uint32_t i = 1; i < m->vertex_count; i++)
+        {
+                float x = m->vertices[i].pos.x;
+                float z = m->vertices[i].pos.z;
+                if (x < min_x) min_x = x;
+                if (x > max_x) max_x = x;
+                if (z < min_z) min_z = z;
+                if (z > max_z) max_z = z;
+        }
+
+        float range_x = max_x - min_x;
+        float range_z = max_z - min_z;
+
+        /* Generate random peak positions and heights */
+        peaks = MAX(peaks, 0);
+        float* peak_x = malloc((unsigned long)peaks * sizeof(float));
+        float* peak_z = malloc((unsigned long)peaks * sizeof(float));
+        float* peak_h = malloc((unsigned long)peaks * sizeof(float));
+
+        rand_u01_fill(peak_x, (size_t)peaks);
+        rand_u01_fill(peak_z, (size_t)peaks);
+        rand_u01_fill(peak_h, (size_t)peaks);
+        for (int i = 0; i < peaks; i++)
+        {
+                peak_x[i] = min_x + range_x * peak_x[i];
+                peak_z[i] = min_z + range_z * peak_z[i];
+                peak_h[i] = max_height * peak_h[i];
+        }
+
+        mesh_heightmap_peaks(m, peak_x, peak_z, peak_h, peaks, radius, pool);
+
+        free(peak_x);
+        free(peak_z);
+        free(peak_h);
+}
+
+void mesh_heightmap_peaks(struct mesh* m,
+                          const float* peak_x,
+                          const float* peak_z,
+                          const float* peak_h,
+                          int peaks,
+                          float radius,
+                          struct km_pool* pool)
+{
+        struct heightmap_job job = {
+                .m = m,
+                .peak_x = peak_x,
+                .peak_z = peak_z,
+                .peak_h = peak_h,
+                .peaks = peaks,
+                .radius = radius,
+        };
+
+        /* On a grid, only visit the vertices within each peak's reach */
+        if (radius > 0.0f && mesh_grid_info(m, &job.g))
+        {
+                uint32_t rows = (uint32_t)job.g.cz + 1;
+
+                if (pool)
+                {
+                        km_pool_run(pool, rows, HEIGHTMAP_CHUNK_ROWS,
+                                    heightmap_rows, &job);
+                }
+                else
+                {
+                        heightmap_rows(&job, 0, rows);
+                }
+        }
+        else
+        {
+                heightmap_all(&job);
+        }
+
+        mesh_normalize(m);
+        mesh_inward_normalize(m);
+        mesh_refit_bvh(m);
+}
+
+void mesh_normalize(struct mesh* m)
+{
+        for (uint32_t i = 0; i < m->vertex_count; i++)
+        {
+                m->vertices[i].normal = (struct vec3){ .a = {0.0f, 0.0f, 0.0f} };
+        }
+
+        // Iterate through all triangles, add the normal to each vertex
+        // the cross product is proportional to the triangle's area, which
+        // makes bigger triangles contribute more to the normal
+        for (uint32_t i = 0; i < m->index_count / 3; i++)
+        {
+                struct vertex* v0;
+                struct vertex* v1;
+                struct vertex* v2;
+                struct vec3 e1;
+                struct vec3 e2;
+                struct vec3 n;
+
+                mesh_get_tri(&v0, &v1, &v2, m, i);
+
+                e1 = vec3_sub(v1->pos, v0->pos);
+                e2 = vec3_sub(v2->pos, v0->pos);
+
+                n = vec3_cross(e1, e2);
+
+                v0->normal = vec3_add(v0->normal, n);
+                v1->normal = vec3_add(v1->normal, n);
+                v2->normal = vec3_add(v2->normal, n);
+        }
+
+        for (uint32_t i = 0; i < m->vertex_count; i++)
+        {
+                m->vertices[i].normal = vec3_norm(m->vertices[i].normal);
+        }
+}
+
+/*
+ * Normal of grid vertex (x, z) from the slope between its neighbours,
+ * one sided at the border.
+ */
+static struct vec3 grid_normal(const struct mesh* m,
+                               const struct grid_info* g,
+                               uint32_t x,
+                               uint32_t z)
+{
+        const struct vertex* v = m->vertices;
+        uint32_t nx = (uint32_t)g->cx + 1;
+        uint32_t nz = (uint32_t)g->cz + 1;
+        uint32_t xl = x > 0 ? x - 1 : x;
+        uint32_t xr = x + 1 < nx ? x + 1 : x;
+        uint32_t zu = z > 0 ? z - 1 : z;
+        uint32_t zd = z + 1 < nz ? z + 1 : z;
+        float sx = (v[z * nx + xr].pos.y - v[z * nx + xl].pos.y) /
+                ((float)(xr - xl) * g->dx);
+        float sz = (v[zd * nx + x].pos.y - v[zu * nx + x].pos.y) /
+                ((float)(zd - zu) * g->dz);
+
+        return vec3_norm((struct vec3){ .a = { -sx, 1.0f, -sz } });
+}
+
+int mesh_grid_normalize(struct mesh* m)
+{
+        struct grid_info g;
+
+        if (!mesh_grid_info(m, &g))
+        {
+                return -1;
+        }
+
+        for (uint32_t z = 0; z <= (uint32_t)g.cz; z++)
+        {
+                for (uint32_t x = 0; x <= (uint32_t)g.cx; x++)
+                {
+                        m->vertices[z * m->grid_x + x].normal =
+                                grid_normal(m, &g, x, z);
+                }
+        }
+
+        return 0;
+}
+
+int mesh_grid_normalize_dirty(struct mesh* m, const uint8_t* dirty)
+{
+        struct grid_info g;
+        uint32_t nx = m->grid_x;
+        int count = 0;
+
+        if (!mesh_grid_info(m, &g))
+        {
+                return -1;
+        }
+
+        for (uint32_t z = 0; z <= (uint32_t)g.cz; z++)
+        {
+                for (uint32_t x = 0; x < nx; x++)
+                {
+                        uint32_t i = z * nx + x;
+
+                        // The normal depends on the four neighbours
+                        if (!dirty[i] &&
+                            !(x > 0 && dirty[i - 1]) &&
+                            !(x + 1 < nx && dirty[i + 1]) &&
+                            !(z > 0 && dirty[i - nx]) &&
+                            !(z < (uint32_t)g.cz && dirty[i + nx]))
+                        {
+                                continue;
+                        }
+
+                        m->vertices[i].normal =
+                                grid_normal(m, &g, x, z);
+                        count++;
+                }
+        }
+
+        return count;
+}
+
+void mesh_inward_normalize(struct mesh* m)
+{
+        // Iterate through all triangles,
+        for (uint32_t i = 0; i < m->index_count / 3; i++)
+        {
+                struct vertex* v0;
+                struct vertex* v1;
+                struct vertex* v2;
+                struct vec3 e1;
+                struct vec3 e2;
+                struct vec3 e3;
+                struct vec3 n;
+
+                mesh_get_tri(&v0, &v1, &v2, m, i);
+
+                e1 = vec3_sub(v1->pos, v0->pos);
+                e2 = vec3_sub(v2->pos, v1->pos);
+                e3 = vec3_sub(v0->pos, v2->pos);
+                // Only used to calculate the surface normal
+                n = vec3_sub(v2->pos, v0->pos);
+
+                n = vec3_norm(vec3_cross(e1, n));
+
+                m->inward_normals[i * 3 + 0] = vec3_norm(vec3_cross(n, e1));
+                m->inward_normals[i * 3 + 1] = vec3_norm(vec3_cross(n, e2));
+                m->inward_normals[i * 3 + 2] = vec3_norm(vec3_cross(n, e3));
+
+                if (m->tris)
+                {
+                        mesh_tri_compute(m->tris + i, m, i);
+                }
+        }
+}
+
+void mesh_translate(struct mesh* m, struct vec3 v)
+{
+        for (uint32_t i = 0; i < m->vertex_count; i++)
+        {
+                m->vertices[i].pos = vec3_add(m->vertices[i].pos, v);
+        }
+
+        if (m->bvh)
+        {
+                bvh_translate(m->bvh, v);
+        }
+        if (m->blocks && mesh_build_blocks(m) != 0)
+        {
+                free(m->blocks);
+                m->blocks = NULL;
+                m->block_count = 0;
+        }
+
+        // Recompute rather than offset the planes, so the cache is
+        // exactly what would be computed from the moved vertices
+        if (m->tris)
+        {
+                mesh_build_tris(m);
+        }
+}
+
+void mesh_bounds(const struct mesh* m, struct aabb* b)
+{
+        if (m->bvh && m->bvh->node_count > 0)
+        {
+                *b = m->bvh->nodes[0].box;
+                return;
+        }
+
+        aabb_empty(b);
+        for (uint32_t i = 0; i < m->index_count; i++)
+        {
+                aabb_extend(b, m->vertices[mesh_index(m, i)].pos);
+        }
+}
+
+static struct aabb* mesh_tri_boxes(const struct mesh* m)
+{
+        uint32_t num_tri = m->index_count / 3;
+        struct aabb* boxes = malloc((size_t)MAX(num_tri, 1) *
+                                    sizeof(struct aabb));
+        struct vec3 pad = { .a = { TRI_BOX_PAD, TRI_BOX_PAD, TRI_BOX_PAD } };
+
+        if (!boxes)
+        {
+                return NULL;
+        }
+
+        for (uint32_t i = 0; i < num_tri; i++)
+        {
+                struct vertex* v0;
+                struct vertex* v1;
+                struct vertex* v2;
+
+                mesh_get_tri(&v0, &v1, &v2, m, i);
+
+                aabb_empty(boxes + i);
+                aabb_extend(boxes + i, v0->pos);
+                aabb_extend(boxes + i, v1->pos);
+                aabb_extend(boxes + i, v2->pos);
+                boxes[i].min = vec3_sub(boxes[i].min, pad);
+                boxes[i].max = vec3_add(boxes[i].max, pad);
+        }
+
+        return boxes;
+}
+
+/*
+ * (Re)build the transposed triangle blocks, in the order of the
+ * bvh's items.
+ */
+static int mesh_build_blocks(struct mesh* m)
+{
+        uint32_t n = m->bvh->item_count;
+        uint32_t bc = (n + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+
+        if (!m->blocks)
+        {
+                m->blocks = aligned_alloc(TRI_BLOCK_ALIGN,
+                                          (size_t)MAX(bc, 1) *
+                                          sizeof(struct tri_block));
+                if (!m->blocks)
+                {
+                        return -1;
+                }
+                m->block_count = bc;
+        }
+        memset(m->blocks, 0, (size_t)bc * sizeof(struct tri_block));
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+                struct tri_block* b = m->blocks + i / TRI_BLOCK_SIZE;
+                uint32_t l = i % TRI_BLOCK_SIZE;
+                uint32_t ti = m->bvh->items[i];
+                struct vertex* v0;
+                struct vertex* v1;
+                struct vertex* v2;
+
+                mesh_get_tri(&v0, &v1, &v2, m, ti);
+
+                struct vec3 e1 = vec3_sub(v1->pos, v0->pos);
+                struct vec3 e2 = vec3_sub(v2->pos, v0->pos);
+
+                b->v0x[l] = v0->pos.x;
+                b->v0y[l] = v0->pos.y;
+                b->v0z[l] = v0->pos.z;
+                b->e1x[l] = e1.x;
+                b->e1y[l] = e1.y;
+                b->e1z[l] = e1.z;
+                b->e2x[l] = e2.x;
+                b->e2y[l] = e2.y;
+                b->e2z[l] = e2.z;
+                b->ti[l] = ti;
+        }
 
         return 0;
 }
 
-struct mesh* gen_mesh(float x, float z, float d)
+int mesh_build_bvh(struct mesh* m)
 {
-        unsigned int count_x = (unsigned int)(x / d) + 1;
-        unsigned int count_z = (unsigned int)(z / d) + 1;
+        struct aabb* boxes = mesh_tri_boxes(m);
+        int ret;
 
-        if (count_x > UINT16_MAX || count_z > UINT16_MAX)
+        if (!boxes)
         {
-                fprintf(stderr, "too large mesh (%u x %u)\n",
-                        count_x, count_z);
-                return NULL;
+                return -1;
         }
-        struct mesh* m = malloc(sizeof(*m));
-        struct vertex* v;
-        unsigned int v_count = count_x * count_z;
-        unsigned int q_count = (count_x - 1) * (count_z - 1);
-        unsigned int t_count = q_count * 2;
-        unsigned long long i_count = t_count * 3;
-        int ip = 0;
 
-        if (!m)
+        if (!m->bvh)
         {
-                return NULL;
+                m->bvh = calloc(1, sizeof(struct bvh));
+                if (!m->bvh)
+                {
+                        free(boxes);
+                        return -1;
+                }
         }
 
-        if (v_count > UINT16_MAX || i_count > UINT32_MAX)
+        ret = bvh_build(m->bvh, boxes, m->index_count / 3);
+        free(boxes);
+
+        if (ret == 0)
         {
-                free(m);
-                fprintf(stderr, "too large mesh v count %u idx count %llu\n",
-                        v_count, i_count);
-                return NULL;
+                free(m->blocks);
+                m->blocks = NULL;
+                m->block_count = 0;
+                ret = mesh_build_blocks(m);
         }
 
-        m->grid_x = (uint16_t)count_x;
-        m->grid_z = (uint16_t)count_z;
+        return ret;
+}
 
-        if (d > x || d > z)
+void mesh_refit_bvh(struct mesh* m)
+{
+        if (!m->bvh)
         {
-                printf("invalid %f x %f z %f\n", d, x, z);
-                free(m);
-                return NULL;
+                return;
         }
 
-        m->vertices = malloc((size_t)v_count * sizeof(struct vertex));
-        m->indices = malloc((size_t)i_count * sizeof(uint16_t));
-        m->inward_normals = malloc((size_t)i_count * sizeof(struct vec3));
-        m->vertex_count = (uint16_t)v_count;
-        m->index_count = (uint32_t)i_count;
-
-        if (m->vertices == NULL ||
-            m->indices == NULL ||
-            m->inward_normals == NULL)
+        struct aabb* boxes = mesh_tri_boxes(m);
+        if (!boxes)
         {
-                free(m->vertices);
-                free(m->indices);
-                free(m->inward_normals);
-                free(m);
-                return NULL;
+                // Can't refit, fall back to no bvh at all
+                bvh_free(m->bvh);
+                free(m->bvh);
+                m->bvh = NULL;
+                return;
         }
 
-        for (unsigned int iz = 0; iz < count_z; iz++)
-        {
-                for (unsigned int ix = 0; ix < count_x; ix++)
-                {
-                        v = m->vertices + ip;
+        bvh_refit(m->bvh, boxes);
+        free(boxes);
 
-                        v->pos.x = (float)ix * d;
-                        v->pos.y = 0.0f;
-                        v->pos.z = (float)iz * d;
+        if (mesh_build_blocks(m) != 0)
+        {
+                // Not fatal, the leaves are tested triangle by triangle
+                free(m->blocks);
+                m->blocks = NULL;
+                m->block_count = 0;
+        }
+}
 
-                        v->color.x = 0.2f;
-                        v->color.y = 0.2f;
-                        v->color.z = 0.7f;
-                        v->color.w = 1.0f;
+int mesh_build_tris(struct mesh* m)
+{
+        uint32_t tc = m->index_count / 3;
 
-#ifdef DEBUG
-                        printf("%d %f %f\n", ip, v->pos.x, v->pos.z);
-#endif
-                        ip++;
+        if (!m->tris)
+        {
+                m->tris = malloc((size_t)MAX(tc, 1) * sizeof(struct mesh_tri));
+                if (!m->tris)
+                {
+                        return -1;
                 }
         }
 
-        ip = 0;
-        // Iterate through each quad
-        for (unsigned int iz = 0; iz < count_z - 1; iz++)
+        for (uint32_t i = 0; i < tc; i++)
         {
-                for (unsigned int ix = 0; ix < count_x - 1; ix++)
-                {
-                        // first triangle
-                        m->indices[ip++] = (uint16_t)(iz * count_x +ix);
-                        m->indices[ip++] = (uint16_t)((iz + 1) * count_x + ix);
-                        m->indices[ip++] = (uint16_t)(iz * count_x + 1 + ix);
-
-                        // second triangle
-                        m->indices[ip++] = (uint16_t)(iz * count_x + 1 + ix);
-                        m->indices[ip++] = (uint16_t)((iz + 1) * count_x + ix);
-                        m->indices[ip++] = (uint16_t)((iz + 1) * count_x + 1 + ix);
-
-#ifdef DEBUG
-                        printf("%d %d (%d %d %d) (%d %d %d)\n",
-                               ix, iz,
-                               m->indices[ip-6],
-                               m->indices[ip-5],
-                               m->indices[ip-4],
-                               m->indices[ip-3],
-                               m->indices[ip-2],
-                               m->indices[ip-1]);
-#endif
-                }
+                mesh_tri_compute(m->tris + i, m, i);
         }
 
-        mesh_normalize(m);
-        mesh_inward_normalize(m);
+        return 0;
+}
 
-        return m;
+void mesh_invalidate_tris(struct mesh* m)
+{
+        free(m->tris);
+        m->tris = NULL;
 }
 
-void mesh_heightmap(struct mesh* m, int peaks, float max_height, float radius)
+struct mesh_edge
 {
-        /* Find mesh extents in xz plane */
-        float min_x = m->vertices[0].pos.x;
-        float max_x = min_x;
-        float min_z = m->vertices[0].pos.z;
-        float max_z = min_z;
+        // lowest vertex index in the high bits, so edges sort by vertex
+        uint32_t key_hi;
+        uint32_t key_lo;
+        // triangle * 3 + edge
+        uint32_t te;
+};
+
+static int edge_cmp(const void* a, const void* b)
+{
+        const struct mesh_edge* ea = a;
+        const struct mesh_edge* eb = b;
 
-        for (uint16_t i = 1; i < m->vertex_count; i++)
+        if (ea->key_hi != eb->key_hi)
         {
-                float x = m->vertices[i].pos.x;
-                float z = m->vertices[i].pos.z;
-                if (x < min_x) min_x = x;
-                if (x > max_x) max_x = x;
-                if (z < min_z) min_z = z;
-                if (z > max_z) max_z = z;
+                return ea->key_hi < eb->key_hi ? -1 : 1;
+        }
+        if (ea->key_lo != eb->key_lo)
+        {
+                return ea->key_lo < eb->key_lo ? -1 : 1;
         }
 
-        float range_x = max_x - min_x;
-        float range_z = max_z - min_z;
+        return ea->te < eb->te ? -1 : ea->te > eb->te;
+}
 
-        /* Generate random peak positions and heights */
-        float* peak_x = malloc((unsigned long)peaks * sizeof(float));
-        float* peak_z = malloc((unsigned long)peaks * sizeof(float));
-        float* peak_h = malloc((unsigned long)peaks * sizeof(float));
+int mesh_build_adjacency(struct mesh* m)
+{
+        uint32_t n = m->index_count / 3 * 3;
+        struct mesh_edge* edges;
+        uint32_t* adj;
 
-        for (int i = 0; i < peaks; i++)
+        adj = malloc((size_t)MAX(n, 1) * sizeof(uint32_t));
+        edges = malloc((size_t)MAX(n, 1) * sizeof(struct mesh_edge));
+        if (!adj || !edges)
         {
-                peak_x[i] = min_x + range_x * rand_u01();
-                peak_z[i] = min_z + range_z * rand_u01();
-                peak_h[i] = max_height * rand_u01();
+                free(adj);
+                free(edges);
+                return -1;
         }
 
-        /* For each vertex, sum contributions from all peaks */
-        for (uint16_t i = 0; i < m->vertex_count; i++)
+        for (uint32_t i = 0; i < n; i++)
         {
-                float h = 0.0f;
-                float vx = m->vertices[i].pos.x;
-                float vz = m->vertices[i].pos.z;
+                uint32_t a = mesh_index(m, i);
+                uint32_t b = mesh_index(m, i - i % 3 + (i % 3 + 1) % 3);
 
-                for (int p = 0; p < peaks; p++)
-                {
-                        float dx = vx - peak_x[p];
-                        float dz = vz - peak_z[p];
-                        float dist = sqrtf(dx * dx + dz * dz);
-                        float falloff = 1.0f - dist / radius;
+                edges[i].key_hi = MIN(a, b);
+                edges[i].key_lo = MAX(a, b);
+                edges[i].te = i;
+                adj[i] = MESH_NO_ADJ;
+        }
 
-                        if (falloff > 0.0f)
-                        {
-                                h += peak_h[p] * falloff;
-                        }
-                }
+        qsort(edges, n, sizeof(struct mesh_edge), edge_cmp);
 
-                m->vertices[i].pos.y = h;
+        // Only link edges shared by exactly two triangles
+        for (uint32_t i = 0; i < n;)
+        {
+                uint32_t j = i + 1;
+
+                while (j < n &&
+                       edges[j].key_hi == edges[i].key_hi &&
+                       edges[j].key_lo == edges[i].key_lo)
+                {
+                        j++;
+                }
+                if (j - i == 2)
+                {
+                        adj[edges[i].te] = edges[i + 1].te / 3;
+                        adj[edges[i + 1].te] = edges[i].te / 3;
+                }
+                i = j;
         }
 
-        free(peak_x);
-        free(peak_z);
-        free(peak_h);
+        free(edges);
+        free(m->adjacency);
+        m->adjacency = adj;
 
-        mesh_normalize(m);
-        mesh_inward_normalize(m);
+        return 0;
 }
 
-void mesh_normalize(struct mesh* m)
+int meshes_build_bvh(struct bvh* b, const struct mesh* m, int mc)
 {
-        for (uint16_t i = 0; i < m->vertex_count; i++)
+        struct aabb* boxes = malloc((size_t)MAX(mc, 1) * sizeof(struct aabb));
+        int ret;
+
+        if (!boxes)
         {
-                m->vertices[i].normal = (struct vec3){ .a = {0.0f, 0.0f, 0.0f} };
+                return -1;
         }
 
-        // Iterate through all triangles, add the normal to each vertex
-        // the cross product is proportional to the triangle's area, which
-        // makes bigger triangles contribute more to the normal
-        for (uint32_t i = 0; i < m->index_count / 3; i++)
+        for (int i = 0; i < mc; i++)
         {
-                struct vertex* v0;
-                struct vertex* v1;
-                struct vertex* v2;
-                struct vec3 e1;
-                struct vec3 e2;
-                struct vec3 n;
+                mesh_bounds(m + i, boxes + i);
+        }
 
-                mesh_get_tri(&v0, &v1, &v2, m, i);
+        ret = bvh_build(b, boxes, (uint32_t)mc);
+        free(boxes);
 
-                e1 = vec3_sub(v1->pos, v0->pos);
-                e2 = vec3_sub(v2->pos, v0->pos);
+        return ret;
+}
 
-                n = vec3_cross(e1, e2);
+int meshes_refit_bvh(struct bvh* b, const struct mesh* m, int mc)
+{
+        struct aabb* boxes = malloc((size_t)MAX(mc, 1) * sizeof(struct aabb));
 
-                v0->normal = vec3_add(v0->normal, n);
-                v1->normal = vec3_add(v1->normal, n);
-                v2->normal = vec3_add(v2->normal, n);
+        if (!boxes)
+        {
+                return -1;
         }
 
-        for (uint16_t i = 0; i < m->vertex_count; i++)
+        for (int i = 0; i < mc; i++)
         {
-                m->vertices[i].normal = vec3_norm(m->vertices[i].normal);
+                mesh_bounds(m + i, boxes + i);
         }
+
+        bvh_refit(b, boxes);
+        free(boxes);
+
+        return 0;
 }
 
-void mesh_inward_normalize(struct mesh* m)
+/*
+ * Color stops (normalized height 0..1):
+ *   0.00  dark     (0.05, 0.05, 0.05)
+ *   0.33  green    (0.15, 0.45, 0.10)
+ *   0.66  brown    (0.45, 0.30, 0.15)
+ *   1.00  sand     (0.82, 0.75, 0.55)
+ */
+static const float terrain_stops[] = { 0.0f, 0.33f, 0.66f, 1.0f };
+static const float terrain_colors[][3] = {
+        { 0.05f, 0.05f, 0.05f },
+        { 0.15f, 0.45f, 0.10f },
+        { 0.45f, 0.30f, 0.15f },
+        { 0.82f, 0.75f, 0.55f },
+};
+
+/*
+ * Color stops (normalized height 0..1):
+ *   0.00  deep blue   (0.02, 0.05, 0.20)
+ *   0.50  ocean blue  (0.05, 0.20, 0.55)
+ *   1.00  light cyan  (0.40, 0.70, 0.85)
+ */
+static const float water_stops[] = { 0.0f, 0.50f, 1.0f };
+static const float water_colors[][3] = {
+        { 0.02f, 0.05f, 0.20f },
+        { 0.05f, 0.20f, 0.55f },
+        { 0.40f, 0.70f, 0.85f },
+};
+
+static void gradient_color(struct vec4* c,
+                           const float* stops,
+                           const float (*colors)[3],
+                           int n_stops,
+                           float t)
 {
-        // Iterate through all triangles,
-        for (uint32_t i = 0; i < m->index_count / 3; i++)
+        /* Find which segment t falls into */
+        int seg = n_stops - 2;
+        for (int s = 0; s < n_stops - 1; s++)
         {
-                struct vertex* v0;
-                struct vertex* v1;
-                struct vertex* v2;
-                struct vec3 e1;
-                struct vec3 e2;
-                struct vec3 e3;
-                struct vec3 n;
+                if (t <= stops[s + 1])
+                {
+                        seg = s;
+                        break;
+                }
+        }
 
-                mesh_get_tri(&v0, &v1, &v2, m, i);
+        /* Interpolate within the segment */
+        float seg_range = stops[seg + 1] - stops[seg];
+        float local_t = (t - stops[seg]) / seg_range;
 
-                e1 = vec3_sub(v1->pos, v0->pos);
-                e2 = vec3_sub(v2->pos, v1->pos);
-                e3 = vec3_sub(v0->pos, v2->pos);
-                // Only used to calculate the surface normal
-                n = vec3_sub(v2->pos, v0->pos);
+        c->x = colors[seg][0] + (colors[seg + 1][0] - colors[seg][0]) * local_t;
+        c->y = colors[seg][1] + (colors[seg + 1][1] - colors[seg][1]) * local_t;
+        c->z = colors[seg][2] + (colors[seg + 1][2] - colors[seg][2]) * local_t;
+        c->w = 1.0f;
+}
 
-                n = vec3_norm(vec3_cross(e1, n));
+static void mesh_height_range(const struct mesh* m, float* min_y, float* max_y)
+{
+        *min_y = m->vertices[0].pos.y;
+        *max_y = *min_y;
 
-                m->inward_normals[i * 3 + 0] = vec3_norm(vec3_cross(n, e1));
-                m->inward_normals[i * 3 + 1] = vec3_norm(vec3_cross(n, e2));
-                m->inward_normals[i * 3 + 2] = vec3_norm(vec3_cross(n, e3));
+        for (uint32_t i = 1; i < m->vertex_count; i++)
+        {
+                float y = m->vertices[i].pos.y;
+                if (y < *min_y) *min_y = y;
+                if (y > *max_y) *max_y = y;
         }
 }
 
-void mesh_translate(struct mesh* m, struct vec3 v)
+static void mesh_colorize_stops(struct mesh* m,
+                                const float* stops,
+                                const float (*colors)[3],
+                                int n_stops)
 {
-        for (uint16_t i = 0; i < m->vertex_count; i++)
+        float min_y;
+        float max_y;
+
+        mesh_height_range(m, &min_y, &max_y);
+
+        float range = max_y - min_y;
+        if (range < 1e-6f)
         {
-                m->vertices[i].pos = vec3_add(m->vertices[i].pos, v);
+                range = 1.0f;
+        }
+
+        for (uint32_t i = 0; i < m->vertex_count; i++)
+        {
+                float t = (m->vertices[i].pos.y - min_y) / range;
+
+                gradient_color(&m->vertices[i].color, stops, colors,
+                               n_stops, t);
         }
 }
 
 void mesh_colorize(struct mesh* m)
 {
-        /* Find min/max height (y) */
-        float min_y = m->vertices[0].pos.y;
-        float max_y = min_y;
+        mesh_colorize_stops(m, terrain_stops, terrain_colors, 4);
+}
+
+void mesh_colorize_water(struct mesh* m)
+{
+        mesh_colorize_stops(m, water_stops, water_colors, 3);
+}
 
-        for (uint16_t i = 1; i < m->vertex_count; i++)
+void color_lut_init(struct color_lut* lut, enum color_gradient g)
+{
+        for (int i = 0; i < COLOR_LUT_SIZE; i++)
         {
-                float y = m->vertices[i].pos.y;
-                if (y < min_y) min_y = y;
-                if (y > max_y) max_y = y;
+                float t = (float)i / (float)(COLOR_LUT_SIZE - 1);
+
+                if (g == GRADIENT_WATER)
+                {
+                        gradient_color(lut->c + i, water_stops,
+                                       water_colors, 3, t);
+                }
+                else
+                {
+                        gradient_color(lut->c + i, terrain_stops,
+                                       terrain_colors, 4, t);
+                }
         }
+}
 
+/*
+ * Scale and offset that map a height in [min_y, max_y] to a LUT
+ * entry, rounded to the nearest.
+ */
+static void lut_scale(float min_y, float max_y, float* scale, float* off)
+{
         float range = max_y - min_y;
+
         if (range < 1e-6f)
         {
                 range = 1.0f;
         }
 
-        /*
-         * Color stops (normalized height 0..1):
-         *   0.00  dark     (0.05, 0.05, 0.05)
-         *   0.33  green    (0.15, 0.45, 0.10)
-         *   0.66  brown    (0.45, 0.30, 0.15)
-         *   1.00  sand     (0.82, 0.75, 0.55)
-         */
-        const float stops[] = { 0.0f, 0.33f, 0.66f, 1.0f };
-        const float colors[][3] = {
-                { 0.05f, 0.05f, 0.05f },
-                { 0.15f, 0.45f, 0.10f },
-                { 0.45f, 0.30f, 0.15f },
-                { 0.82f, 0.75f, 0.55f },
-        };
-        const int n_stops = 4;
+        *scale = (float)(COLOR_LUT_SIZE - 1) / range;
+        *off = 0.5f - min_y * *scale;
+}
+
+static uint32_t lut_index(float y, float scale, float off)
+{
+        float f = y * scale + off;
 
-        for (uint16_t i = 0; i < m->vertex_count; i++)
+        // Heights out of the range are clamped, also catches NaN
+        if (!(f > 0.0f))
         {
-                float t = (m->vertices[i].pos.y - min_y) / range;
+                return 0;
+        }
+        if (f > (float)(COLOR_LUT_SIZE - 1))
+        {
+                return COLOR_LUT_SIZE - 1;
+        }
 
-                /* Find which segment t falls into */
-                int seg = n_stops - 2;
-                for (int s = 0; s < n_stops - 1; s++)
-                {
-                        if (t <= stops[s + 1])
-                        {
-                                seg = s;
-                                break;
-                        }
-                }
+        return (uint32_t)f;
+}
 
-                /* Interpolate within the segment */
-                float seg_range = stops[seg + 1] - stops[seg];
-                float local_t = (t - stops[seg]) / seg_range;
+void mesh_colorize_lut(struct mesh* m, const struct color_lut* lut)
+{
+        float min_y;
+        float max_y;
 
-                m->vertices[i].color.x = colors[seg][0] +
-                        (colors[seg + 1][0] - colors[seg][0]) * local_t;
-                m->vertices[i].color.y = colors[seg][1] +
-                        (colors[seg + 1][1] - colors[seg][1]) * local_t;
-                m->vertices[i].color.z = colors[seg][2] +
-                        (colors[seg + 1][2] - colors[seg][2]) * local_t;
-                m->vertices[i].color.w = 1.0f;
-        }
+        mesh_height_range(m, &min_y, &max_y);
+        mesh_colorize_lut_range(m, lut, min_y, max_y);
 }
 
-void mesh_colorize_water(struct mesh* m)
+void mesh_colorize_lut_range(struct mesh* m,
+                             const struct color_lut* lut,
+                             float min_y,
+                             float max_y)
 {
-        /* Find min/max height (y) */
-        float min_y = m->vertices[0].pos.y;
-        float max_y = min_y;
+        float scale;
+        float off;
 
-        for (uint16_t i = 1; i < m->vertex_count; i++)
+        lut_scale(min_y, max_y, &scale, &off);
+        for (uint32_t i = 0; i < m->vertex_count; i++)
         {
-                float y = m->vertices[i].pos.y;
-                if (y < min_y) min_y = y;
-                if (y > max_y) max_y = y;
-        }
+                struct vertex* v = m->vertices + i;
 
-        float range = max_y - min_y;
-        if (range < 1e-6f)
-        {
-                range = 1.0f;
+                v->color = lut->c[lut_index(v->pos.y, scale, off)];
         }
+}
 
-        /*
-         * Color stops (normalized height 0..1):
-         *   0.00  deep blue   (0.02, 0.05, 0.20)
-         *   0.50  ocean blue  (0.05, 0.20, 0.55)
-         *   1.00  light cyan  (0.40, 0.70, 0.85)
-         */
-        const float stops[] = { 0.0f, 0.50f, 1.0f };
-        const float colors[][3] = {
-                { 0.02f, 0.05f, 0.20f },
-                { 0.05f, 0.20f, 0.55f },
-                { 0.40f, 0.70f, 0.85f },
-        };
-        const int n_stops = 3;
+int mesh_grid_colorize_normalize(struct mesh* m,
+                                 const struct color_lut* lut,
+                                 float min_y,
+                                 float max_y)
+{
+        struct grid_info g;
+        float scale;
+        float off;
 
-        for (uint16_t i = 0; i < m->vertex_count; i++)
+        if (!mesh_grid_info(m, &g))
         {
-                float t = (m->vertices[i].pos.y - min_y) / range;
+                return -1;
+        }
 
-                int seg = n_stops - 2;
-                for (int s = 0; s < n_stops - 1; s++)
+        lut_scale(min_y, max_y, &scale, &off);
+        for (uint32_t z = 0; z <= (uint32_t)g.cz; z++)
+        {
+                for (uint32_t x = 0; x <= (uint32_t)g.cx; x++)
                 {
-                        if (t <= stops[s + 1])
-                        {
-                                seg = s;
-                                break;
-                        }
-                }
+                        struct vertex* v = m->vertices + z * m->grid_x + x;
 
-                float seg_range = stops[seg + 1] - stops[seg];
-                float local_t = (t - stops[seg]) / seg_range;
-
-                m->vertices[i].color.x = colors[seg][0] +
-                        (colors[seg + 1][0] - colors[seg][0]) * local_t;
-                m->vertices[i].color.y = colors[seg][1] +
-                        (colors[seg + 1][1] - colors[seg][1]) * local_t;
-                m->vertices[i].color.z = colors[seg][2] +
-                        (colors[seg + 1][2] - colors[seg][2]) * local_t;
-                m->vertices[i].color.w = 1.0f;
+                        v->normal = grid_normal(m, &g, x, z);
+                        v->color = lut->c[lut_index(v->pos.y, scale, off)];
+                }
         }
+
+        return 0;
 }
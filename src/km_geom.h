@@ -13,12 +13,20 @@
 #ifndef KM_GEOM_H
 #define KM_GEOM_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include "km_math.h"
 
 #define MAX_CONTACT_DIST 0.002f
+// Number of entries in a color lookup table
+#define COLOR_LUT_SIZE 256
 
 struct particle;
+struct bvh;
+struct aabb;
+struct tri_block;
+struct terrain;
+struct km_pool;
 
 struct vertex
 {
@@ -27,12 +35,35 @@ struct vertex
         struct vec4 color;
 };
 
+enum color_gradient
+{
+        // dark, green, brown to sand, as mesh_colorize
+        GRADIENT_TERRAIN = 0,
+        // deep blue to light cyan, as mesh_colorize_water
+        GRADIENT_WATER
+};
+
+// Colors of a gradient, from the lowest to the highest height
+struct color_lut
+{
+        struct vec4 c[COLOR_LUT_SIZE];
+};
+
 /*
-  Access triangle i. All triangles should be encoded in CCW order.
-  *v0 = &mesh.vertices[mesh.indices[i * 3 + 0]];
-  *v1 = &mesh.vertices[mesh.indices[i * 3 + 1]];
-  *v2 = &mesh.vertices[mesh.indices[i * 3 + 2]];
+  Cached per triangle data, derived from the vertex positions.
 */
+struct mesh_tri
+{
+        // v1 - v0
+        struct vec3 e1;
+        // v2 - v0
+        struct vec3 e2;
+        // unit face normal, CCW
+        struct vec3 n;
+        // plane offset, dot(n, x) == d for any x in the plane
+        float d;
+};
+
 struct mesh
 {
         struct vertex* vertices;
@@ -43,17 +74,62 @@ struct mesh
         float static_mu;
         // dynamic friction coefficient
         float dynamic_mu;
-        uint16_t vertex_count;
+        uint32_t vertex_count;
         uint32_t index_count;
         // Indices to the triangles, in CCW
         // the vertices are i * 3 + 0,1,2
+        // 16 bit indices are used when all fit, otherwise indices is
+        // NULL and indices32 is used. Read them with mesh_index.
         uint16_t* indices;
+        uint32_t* indices32;
         // If the mesh is rectangle, these are the number of vertices
-        // in each direction.
+        // in each direction. A mesh laid out as by gen_mesh (see
+        // mesh_is_grid) is queried by walking its cells.
         uint16_t grid_x;
         uint16_t grid_z;
+        // Set by mesh_check_grid if the layout matches grid_x, grid_z
+        uint8_t is_grid;
+        // Bounding volume hierarchy over the triangles, may be NULL
+        struct bvh* bvh;
+        // Three per triangle, the triangle on the other side of edge
+        // i * 3 + k (vertex k to k + 1), or MESH_NO_ADJ. May be NULL.
+        uint32_t* adjacency;
+        // One per triangle, see mesh_build_tris. May be NULL.
+        struct mesh_tri* tris;
+        // The triangles in bvh item order, transposed in blocks of
+        // TRI_BLOCK_SIZE for the SIMD intersection kernels. Built
+        // together with the bvh. May be NULL.
+        struct tri_block* blocks;
+        uint32_t block_count;
+        // Set if vertices, indices and inward_normals point into a
+        // mapped file (see mesh_file_open), mesh_free leaves them
+        uint8_t mapped;
 };
 
+// No triangle on the other side of an edge
+#define MESH_NO_ADJ UINT32_MAX
+
+/**
+ * Get an index from a mesh, whichever the index width.
+ * @param m the mesh
+ * @param i the index to get, i * 3 + k is vertex k of triangle i
+ * @return the vertex index
+ */
+static inline uint32_t mesh_index(const struct mesh* m, uint32_t i)
+{
+        return m->indices32 ? m->indices32[i] : m->indices[i];
+}
+
+/**
+ * Get the size of a mesh's indices.
+ * @param m the mesh
+ * @return 2 or 4
+ */
+static inline size_t mesh_index_size(const struct mesh* m)
+{
+        return m->indices32 ? sizeof(uint32_t) : sizeof(uint16_t);
+}
+
 struct collision
 {
         struct vec3 n;
@@ -70,7 +146,11 @@ struct collision
 void print_vertex(const struct vertex* v);
 
 /**
- * Load a triangle (CCW) from the mesh
+ * Load a triangle (CCW) from the mesh. All triangles should be encoded
+ * in CCW order. Triangle n is
+ *   *v0 = &mesh.vertices[mesh_index(&mesh, n * 3 + 0)];
+ *   *v1 = &mesh.vertices[mesh_index(&mesh, n * 3 + 1)];
+ *   *v2 = &mesh.vertices[mesh_index(&mesh, n * 3 + 2)];
  * @params v0 the first vertex of the triangle
  * @params v0 the second vertex of the triangle
  * @params v0 the third vertex of the triangle
@@ -103,6 +183,15 @@ int ray_tri_intersect(const struct particle* r,
 
 /**
  * Find the mesh that the particle p first will collide with.
+ * Only collisions within the particle's displacement p.v are
+ * reported, i.e. 0 < t <= 1. Grid meshes are queried by walking the
+ * cells under the swept segment, meshes with a bvh are traversed with
+ * the swept segment, other meshes are tested triangle by triangle.
+ * A particle with a radius is swept as a sphere, and hits a face,
+ * an edge or a vertex when its surface reaches it. The normal then
+ * points from the contact to the center, and t is 0 if the sphere
+ * already touches a triangle and moves into it. The queries are grown
+ * by the radius and triangles out of reach of their plane are skipped.
  * @param t the toi to populate
  * @param p the particle
  * @param m an array of meshes to test against
@@ -114,19 +203,81 @@ int compute_toi(struct collision* t,
                 struct mesh* m,
                 int mc);
 
+/**
+ * Same as compute_toi, but the meshes are culled with a bvh built
+ * over the meshes' bounding boxes (see meshes_build_bvh).
+ * @param t the toi to populate
+ * @param p the particle
+ * @param tree the bvh over the meshes
+ * @param m the array of meshes the tree was built from
+ * @return 1 if a collision happend, 0 otherwise
+ */
+int compute_toi_tree(struct collision* t,
+                     struct particle* p,
+                     const struct bvh* tree,
+                     struct mesh* m);
+
+/**
+ * Same as compute_toi, but only the terrain chunks in the cells the
+ * particle's displacement overlaps are tested.
+ * @param t the toi to populate
+ * @param p the particle
+ * @param ter the terrain
+ * @return 1 if a collision happend, 0 otherwise
+ */
+int compute_toi_terrain(struct collision* t,
+                        struct particle* p,
+                        const struct terrain* ter);
+
 /**
  * Test if a position is on or just above the mesh.
- * This iterate through all triangles and performs a check
- * for each triangle if the point is on or just above the
- * surface.
+ * For grid meshes only the triangles in and around the cell below the
+ * point are checked, otherwise this iterate through all triangles and
+ * performs a check for each triangle if the point is on or just above
+ * the surface.
  * @param m the mesh to test against
  * @param p the point
  * @return 1 is on or just above the mesh, otherwise 0
  */
 int point_on_mesh(struct mesh* m, struct vec3 p);
 
+/**
+ * Same as point_on_mesh, but starts at a known triangle, e.g. the one
+ * an object was last in contact with, and walks towards p through the
+ * mesh's adjacency table. Only if the walk doesn't end up on a triangle
+ * p is on, the whole mesh is searched.
+ * @param m the mesh to test against
+ * @param p the point
+ * @param ti the triangle to start at. Updated with the triangle p is
+ *        on, if any.
+ * @return 1 is on or just above the mesh, otherwise 0
+ */
+int point_on_mesh_walk(struct mesh* m, struct vec3 p, uint32_t* ti);
+
+/**
+ * Validate the grid layout of a mesh and store the result in is_grid.
+ * The grid dimensions must match the vertex and index counts, every
+ * triangle must be laid out as by gen_mesh, cell by cell, row by row,
+ * and every vertex must be at its place on the evenly spaced xz grid.
+ * Only the y coordinate of the vertices may differ between cells.
+ * Done when a mesh is generated or loaded, call it again after
+ * changing the indices or the xz coordinates of the vertices.
+ * @param m the mesh
+ * @return 1 if the mesh is a grid, 0 otherwise
+ */
+int mesh_check_grid(struct mesh* m);
+
+/**
+ * Test if a mesh is a regular heightfield, as generated by gen_mesh.
+ * Uses the result of the last mesh_check_grid, so this is cheap.
+ * @param m the mesh
+ * @return 1 if the mesh is a grid, 0 otherwise
+ */
+int mesh_is_grid(const struct mesh* m);
+
 /**
  * Read the provided json file, and return an array of meshes.
+ * Binary mesh files (see km_meshio.h) are detected and read as well.
  * @param p the path to the JSON file to read.
  * @param count the number of meshes read and returned
  * @return pointer to the meshes, or NULL if read failed.
@@ -134,7 +285,8 @@ int point_on_mesh(struct mesh* m, struct vec3 p);
 struct mesh* load_meshes(const char* p, int* count);
 
 /**
- * Write an array of meshes to a JSON file.
+ * Write an array of meshes to a JSON file. If the path ends with
+ * MESH_BIN_EXT, the binary mesh format is written instead.
  * @param p the path to the output JSON file.
  * @param meshes pointer to the array of meshes to write.
  * @param count the number of meshes in the array.
@@ -168,15 +320,107 @@ struct mesh* gen_mesh(float x, float z, float d);
 void mesh_normalize(struct mesh* m);
 
 /**
- * Translate the mesh by the provided vector
+ * Recreate the normals of a grid mesh from the height differences
+ * between each vertex's neighbours, in one pass over the vertices.
+ * @param m the mesh to create normals for
+ * @return 0 on success, -1 if the mesh is not a grid
+ */
+int mesh_grid_normalize(struct mesh* m);
+
+/**
+ * Same as mesh_grid_normalize, but only for the vertices that are
+ * marked dirty or have a dirty neighbour, i.e. the normals that
+ * depend on a modified height.
+ * @param m the mesh to create normals for
+ * @param dirty one flag per vertex, non zero if the height changed
+ * @return number of normals recreated, -1 if the mesh is not a grid
+ */
+int mesh_grid_normalize_dirty(struct mesh* m, const uint8_t* dirty);
+
+/**
+ * Translate the mesh by the provided vector. The mesh's bvh, if any,
+ * is translated as well.
  * @param m the mesh to translate
  * @param v the offset
  * @return void
  */
 void mesh_translate(struct mesh* m, struct vec3 v);
 
+/**
+ * Compute the bounding box of a mesh.
+ * @param m the mesh
+ * @param b the box to populate
+ * @return void
+ */
+void mesh_bounds(const struct mesh* m, struct aabb* b);
+
+/**
+ * Build (or rebuild) the bvh over the triangles in the mesh.
+ * Must be called when the topology of the mesh changes.
+ * @param m the mesh to build the bvh for
+ * @return 0 on success, -1 on failure
+ */
+int mesh_build_bvh(struct mesh* m);
+
+/**
+ * Refit the mesh's bvh after vertices have moved, e.g. after updating
+ * vertex positions by hand. mesh_translate and mesh_heightmap keep the
+ * bvh up to date. Does nothing if the mesh has no bvh.
+ * @param m the mesh to refit the bvh for
+ * @return void
+ */
+void mesh_refit_bvh(struct mesh* m);
+
+/**
+ * Build, or rebuild, the per triangle cache (edges, normal and plane)
+ * used by the collision queries. Meshes created with parse_mesh or
+ * gen_mesh already have it, and mesh_translate, mesh_heightmap and
+ * mesh_inward_normalize keep it up to date. After moving vertices by
+ * any other means, it must be rebuilt or invalidated.
+ * @param m the mesh
+ * @return 0 on success, -1 on failure
+ */
+int mesh_build_tris(struct mesh* m);
+
+/**
+ * Drop the per triangle cache, the queries then compute the data from
+ * the vertices on each call. Useful for meshes that change every step.
+ * @param m the mesh
+ * @return void
+ */
+void mesh_invalidate_tris(struct mesh* m);
+
+/**
+ * Build the edge adjacency table for a mesh. Only edges shared by
+ * exactly two triangles (by vertex index) are linked. Meshes created
+ * with parse_mesh or gen_mesh already have it.
+ * @param m the mesh
+ * @return 0 on success, -1 on failure
+ */
+int mesh_build_adjacency(struct mesh* m);
+
+/**
+ * Build a bvh over the bounding boxes of an array of meshes.
+ * @param b the bvh to build
+ * @param m the array of meshes
+ * @param mc the number of meshes
+ * @return 0 on success, -1 on failure
+ */
+int meshes_build_bvh(struct bvh* b, const struct mesh* m, int mc);
+
+/**
+ * Refit a bvh built with meshes_build_bvh after any of the meshes
+ * have been modified.
+ * @param b the bvh to refit
+ * @param m the array of meshes
+ * @param mc the number of meshes
+ * @return 0 on success, -1 on failure
+ */
+int meshes_refit_bvh(struct bvh* b, const struct mesh* m, int mc);
+
 /**
  * Generate inward pointing normals for each edge for each triangle.
+ * The per triangle cache is refreshed too, if the mesh has one.
  * @param m the mesh to update with inward pointing normals
  * @return void
  */
@@ -184,7 +428,8 @@ void mesh_inward_normalize(struct mesh* m);
 
 /**
  * Generate a heightmap on a mesh using scattered peaks with falloff.
- * Normals are recreated once the height map is done.
+ * Normals are recreated once the height map is done. On a grid mesh
+ * each peak only visits the vertices within its radius.
  * @param m the mesh to apply heights to
  * @param peaks the number of random peaks to generate
  * @param max_height maximum height of any single peak
@@ -193,6 +438,44 @@ void mesh_inward_normalize(struct mesh* m);
  */
 void mesh_heightmap(struct mesh* m, int peaks, float max_height, float radius);
 
+/**
+ * Same as mesh_heightmap, with the rows of a grid mesh split over the
+ * threads of a pool. The heights do not depend on the number of
+ * threads.
+ * @param m the mesh to apply heights to
+ * @param peaks the number of random peaks to generate
+ * @param max_height maximum height of any single peak
+ * @param radius the influence radius of each peak
+ * @param pool the pool to run on, may be NULL
+ * @return void
+ */
+void mesh_heightmap_pool(struct mesh* m,
+                         int peaks,
+                         float max_height,
+                         float radius,
+                         struct km_pool* pool);
+
+/**
+ * Apply a given set of peaks to a mesh, the heights are the sum of
+ * each peak's height times its falloff. Normals are recreated.
+ * @param m the mesh to apply heights to
+ * @param peak_x x of each peak
+ * @param peak_z z of each peak
+ * @param peak_h height of each peak
+ * @param peaks the number of peaks
+ * @param radius the influence radius of each peak
+ * @param pool split the rows of a grid mesh over the pool's threads,
+ *        may be NULL
+ * @return void
+ */
+void mesh_heightmap_peaks(struct mesh* m,
+                          const float* peak_x,
+                          const float* peak_z,
+                          const float* peak_h,
+                          int peaks,
+                          float radius,
+                          struct km_pool* pool);
+
 /**
  * Colorize a mesh based on vertex height (y).
  * Applies a smooth gradient from dark (low) through green,
@@ -211,6 +494,54 @@ void mesh_colorize(struct mesh* m);
  */
 void mesh_colorize_water(struct mesh* m);
 
+/**
+ * Fill a lookup table with one of the gradients used by
+ * mesh_colorize and mesh_colorize_water, entry i holds the color for
+ * the normalized height i / (COLOR_LUT_SIZE - 1).
+ * @param lut the table to fill
+ * @param g the gradient
+ * @return void
+ */
+void color_lut_init(struct color_lut* lut, enum color_gradient g);
+
+/**
+ * Colorize a mesh based on vertex height (y), with the color looked
+ * up in a table instead of searched for in the gradient's stops.
+ * @param m the mesh to colorize
+ * @param lut the gradient
+ * @return void
+ */
+void mesh_colorize_lut(struct mesh* m, const struct color_lut* lut);
+
+/**
+ * Same as mesh_colorize_lut, but for a fixed height range, so no pass
+ * to find the range is needed. Heights outside of it get the color
+ * of the nearest end.
+ * @param m the mesh to colorize
+ * @param lut the gradient
+ * @param min_y the height of the first color
+ * @param max_y the height of the last color
+ * @return void
+ */
+void mesh_colorize_lut_range(struct mesh* m,
+                             const struct color_lut* lut,
+                             float min_y,
+                             float max_y);
+
+/**
+ * Colorize a grid mesh as mesh_colorize_lut_range, and recreate its
+ * normals as mesh_grid_normalize, in a single pass over the vertices.
+ * @param m the mesh
+ * @param lut the gradient
+ * @param min_y the height of the first color
+ * @param max_y the height of the last color
+ * @return 0 on success, -1 if the mesh is not a grid
+ */
+int mesh_grid_colorize_normalize(struct mesh* m,
+                                 const struct color_lut* lut,
+                                 float min_y,
+                                 float max_y);
+
 /**
  * Free all memory held by a mesh.
  * After the memory is freed, all members are set to zero.
@@ -0,0 +1,1614 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "km_meshio.h"
+#include "km_geom.h"
+
+static uint64_t bin_align(uint64_t off)
+{
+        return (off + MESH_BIN_ALIGN - 1) & ~(uint64_t)(MESH_BIN_ALIGN - 1);
+}
+
+/*
+  Check that a block of n elements of size sz at off is within the
+  file and aligned.
+*/
+static int bin_block_ok(size_t size, uint64_t off, uint64_t n, uint64_t sz)
+{
+        if (off % MESH_BIN_ALIGN != 0 || off > size)
+        {
+                return 0;
+        }
+
+        return n <= (size - off) / sz;
+}
+
+// Size of a mesh table entry in a file of the given version
+static size_t bin_entry_size(uint32_t version)
+{
+        return version == 1 ?
+                offsetof(struct mesh_bin_entry, index_size) :
+                sizeof(struct mesh_bin_entry);
+}
+
+static void bin_entry(const void* base, uint32_t i, struct mesh_bin_entry* e)
+{
+        const struct mesh_bin_header* h = base;
+        size_t sz = bin_entry_size(h->version);
+
+        memset(e, 0, sizeof(*e));
+        memcpy(e, (const char*)(h + 1) + i * sz, sz);
+        if (h->version == 1)
+        {
+                e->index_size = sizeof(uint16_t);
+        }
+}
+
+static int bin_check(const void* base, size_t size)
+{
+        const struct mesh_bin_header* h = base;
+        struct mesh_bin_entry e;
+
+        if (size < sizeof(*h) ||
+            memcmp(h->magic, MESH_BIN_MAGIC, 4) != 0)
+        {
+                fprintf(stderr, "not a binary mesh file\n");
+                return -1;
+        }
+        if (h->byte_order != 1 ||
+            h->version < 1 || h->version > MESH_BIN_VERSION ||
+            h->vertex_size != sizeof(struct vertex))
+        {
+                fprintf(stderr, "unsupported binary mesh file, version %u\n",
+                        h->version);
+                return -1;
+        }
+        if (h->mesh_count == 0 || h->mesh_count > UINT16_MAX ||
+            h->mesh_count > (size - sizeof(*h)) / bin_entry_size(h->version))
+        {
+                fprintf(stderr, "invalid mesh count: %u\n", h->mesh_count);
+                return -1;
+        }
+
+        for (uint32_t i = 0; i < h->mesh_count; i++)
+        {
+                const char* idx;
+
+                bin_entry(base, i, &e);
+                if ((e.index_size != sizeof(uint16_t) &&
+                     e.index_size != sizeof(uint32_t)) ||
+                    e.index_count % 3 != 0 ||
+                    !bin_block_ok(size, e.vertex_off, e.vertex_count,
+                                  sizeof(struct vertex)) ||
+                    !bin_block_ok(size, e.index_off, e.index_count,
+                                  e.index_size) ||
+                    !bin_block_ok(size, e.normal_off, e.index_count,
+                                  sizeof(struct vec3)))
+                {
+                        fprintf(stderr, "mesh %u: invalid block\n", i);
+                        return -1;
+                }
+
+                idx = (const char*)base + e.index_off;
+                for (uint32_t k = 0; k < e.index_count; k++)
+                {
+                        uint32_t v = e.index_size == sizeof(uint16_t) ?
+                                ((const uint16_t*)idx)[k] :
+                                ((const uint32_t*)idx)[k];
+
+                        if (v >= e.vertex_count)
+                        {
+                                fprintf(stderr, "mesh %u: index %u out of "
+                                        "range\n", i, k);
+                                return -1;
+                        }
+                }
+        }
+
+        return 0;
+}
+
+/*
+  Set up the meshes from a checked file. If copy is set, the arrays
+  are copied to their own allocations, otherwise they point into the
+  file.
+*/
+static struct mesh* bin_meshes(void* base, int copy)
+{
+        const struct mesh_bin_header* h = base;
+        struct mesh* meshes = calloc(h->mesh_count, sizeof(struct mesh));
+        char* b = base;
+
+        if (!meshes)
+        {
+                return NULL;
+        }
+
+        for (uint32_t i = 0; i < h->mesh_count; i++)
+        {
+                struct mesh* m = meshes + i;
+                struct mesh_bin_entry e;
+                size_t vs;
+                size_t is;
+                size_t ns;
+                void* idx;
+
+                bin_entry(base, i, &e);
+                vs = e.vertex_count * sizeof(struct vertex);
+                is = e.index_count * (size_t)e.index_size;
+                ns = e.index_count * sizeof(struct vec3);
+
+                m->restitution = e.restitution;
+                m->static_mu = e.static_mu;
+                m->dynamic_mu = e.dynamic_mu;
+                m->grid_x = e.grid_x;
+                m->grid_z = e.grid_z;
+                m->vertex_count = e.vertex_count;
+                m->index_count = e.index_count;
+
+                if (copy)
+                {
+                        m->vertices = malloc(vs);
+                        idx = malloc(is);
+                        m->inward_normals = malloc(ns);
+                }
+                else
+                {
+                        m->vertices = (void*)(b + e.vertex_off);
+                        idx = b + e.index_off;
+                        m->inward_normals = (void*)(b + e.normal_off);
+                        m->mapped = 1;
+                }
+                if (e.index_size == sizeof(uint16_t))
+                {
+                        m->indices = idx;
+                }
+                else
+                {
+                        m->indices32 = idx;
+                }
+                if (!m->vertices || !idx || !m->inward_normals)
+                {
+                        goto fail;
+                }
+                if (copy)
+                {
+                        memcpy(m->vertices, b + e.vertex_off, vs);
+                        memcpy(idx, b + e.index_off, is);
+                        memcpy(m->inward_normals, b + e.normal_off, ns);
+                }
+
+                mesh_check_grid(m);
+                if (mesh_build_tris(m) != 0 ||
+                    mesh_build_bvh(m) != 0 ||
+                    mesh_build_adjacency(m) != 0)
+                {
+                        goto fail;
+                }
+        }
+
+        return meshes;
+fail:
+        for (uint32_t i = 0; i < h->mesh_count; i++)
+        {
+                mesh_free(meshes + i);
+        }
+        free(meshes);
+
+        return NULL;
+}
+
+/*
+ * Map a binary mesh file and check its header and table.
+ * @return 0 on success, -1 on failure
+ */
+static int bin_map(const char* p, void** base, size_t* size)
+{
+        struct stat st;
+        int fd = open(p, O_RDONLY);
+
+        if (fd < 0)
+        {
+                return -1;
+        }
+        if (fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+                close(fd);
+                return -1;
+        }
+
+        *size = (size_t)st.st_size;
+        // Private and writable, so the meshes can be modified in
+        // memory. Pages are only copied when written to.
+        *base = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (*base == MAP_FAILED)
+        {
+                return -1;
+        }
+
+        if (bin_check(*base, *size) != 0)
+        {
+                munmap(*base, *size);
+                return -1;
+        }
+
+        return 0;
+}
+
+int mesh_file_open(struct mesh_file* f, const char* p)
+{
+        memset(f, 0, sizeof(*f));
+        if (bin_map(p, &f->base, &f->size) != 0)
+        {
+                memset(f, 0, sizeof(*f));
+                return -1;
+        }
+
+        f->meshes = bin_meshes(f->base, 0);
+        if (!f->meshes)
+        {
+                mesh_file_close(f);
+                return -1;
+        }
+        f->count = (int)((const struct mesh_bin_header*)f->base)->mesh_count;
+
+        return 0;
+}
+
+void mesh_file_close(struct mesh_file* f)
+{
+        for (int i = 0; i < f->count; i++)
+        {
+                mesh_free(f->meshes + i);
+        }
+        free(f->meshes);
+        if (f->base)
+        {
+                munmap(f->base, f->size);
+        }
+        memset(f, 0, sizeof(*f));
+}
+
+int mesh_bin_probe(const char* p)
+{
+        char magic[4];
+        FILE* f = fopen(p, "rb");
+        size_t nr;
+
+        if (!f)
+        {
+                return 0;
+        }
+        nr = fread(magic, 1, sizeof(magic), f);
+        fclose(f);
+
+        return nr == sizeof(magic) && memcmp(magic, MESH_BIN_MAGIC, 4) == 0;
+}
+
+struct mesh* load_meshes_bin(const char* p, int* count)
+{
+        struct mesh* meshes;
+        void* base;
+        size_t size;
+
+        *count = 0;
+
+        // Only map the file, the meshes are copied out of it
+        if (bin_map(p, &base, &size) != 0)
+        {
+                return NULL;
+        }
+
+        meshes = bin_meshes(base, 1);
+        if (meshes)
+        {
+                *count = (int)((const struct mesh_bin_header*)base)->mesh_count;
+        }
+        munmap(base, size);
+
+        return meshes;
+}
+
+static int bin_write_block(FILE* f, uint64_t* pos, uint64_t off,
+                           const void* data, size_t size)
+{
+        static const char zero[MESH_BIN_ALIGN];
+
+        // Pad up to the block's offset
+        if (fwrite(zero, 1, (size_t)(off - *pos), f) != off - *pos ||
+            fwrite(data, 1, size, f) != size)
+        {
+                return -1;
+        }
+        *pos = off + size;
+
+        return 0;
+}
+
+int write_meshes_bin(const char* p, const struct mesh* meshes, int count)
+{
+        struct mesh_bin_header h = {
+                .magic = MESH_BIN_MAGIC,
+                .version = MESH_BIN_VERSION,
+                .byte_order = 1,
+                .vertex_size = sizeof(struct vertex),
+        };
+        struct mesh_bin_entry* e;
+        uint64_t pos;
+        int ret = 0;
+        FILE* f;
+
+        if (count <= 0 || count > UINT16_MAX)
+        {
+                return -1;
+        }
+        h.mesh_count = (uint32_t)count;
+
+        e = calloc((size_t)count, sizeof(*e));
+        if (!e)
+        {
+                return -1;
+        }
+
+        // Lay out the blocks
+        pos = sizeof(h) + (uint64_t)count * sizeof(*e);
+        for (int i = 0; i < count; i++)
+        {
+                const struct mesh* m = meshes + i;
+
+                e[i].restitution = m->restitution;
+                e[i].static_mu = m->static_mu;
+                e[i].dynamic_mu = m->dynamic_mu;
+                e[i].grid_x = m->grid_x;
+                e[i].grid_z = m->grid_z;
+                e[i].vertex_count = m->vertex_count;
+                e[i].index_count = m->index_count;
+                e[i].index_size = (uint32_t)mesh_index_size(m);
+                e[i].vertex_off = bin_align(pos);
+                pos = e[i].vertex_off +
+                        m->vertex_count * sizeof(struct vertex);
+                e[i].index_off = bin_align(pos);
+                pos = e[i].index_off +
+                        m->index_count * mesh_index_size(m);
+                e[i].normal_off = bin_align(pos);
+                pos = e[i].normal_off +
+                        m->index_count * sizeof(struct vec3);
+        }
+
+        f = fopen(p, "wb");
+        if (!f)
+        {
+                free(e);
+                return -1;
+        }
+
+        pos = 0;
+        if (bin_write_block(f, &pos, 0, &h, sizeof(h)) != 0 ||
+            bin_write_block(f, &pos, pos, e, (size_t)count * sizeof(*e)) != 0)
+        {
+                ret = -1;
+        }
+        for (int i = 0; i < count && !ret; i++)
+        {
+                const struct mesh* m = meshes + i;
+
+                if (bin_write_block(f, &pos, e[i].vertex_off, m->vertices,
+                                    m->vertex_count *
+                                    sizeof(struct vertex)) != 0 ||
+                    bin_write_block(f, &pos, e[i].index_off,
+                                    m->indices32 ? (const void*)m->indices32 :
+                                    (const void*)m->indices,
+                                    m->index_count *
+                                    mesh_index_size(m)) != 0 ||
+                    bin_write_block(f, &pos, e[i].normal_off,
+                                    m->inward_normals,
+                                    m->index_count *
+                                    sizeof(struct vec3)) != 0)
+                {
+                        ret = -1;
+                }
+        }
+
+        if (fclose(f) != 0)
+        {
+                ret = -1;
+        }
+        free(e);
+
+        return ret;
+}
+
+/*
+  Streaming JSON mesh reader. The file is read through a fixed size
+  buffer, and the values are parsed straight into the mesh arrays,
+  without building a DOM. Object keys are matched without regard to
+  case, and the first of any duplicate keys is used, as cJSON does.
+*/
+
+#define JSON_CHUNK (64 * 1024)
+#define JSON_MAX_DEPTH 64
+#define JSON_KEY_LEN 32
+// Longer numbers than this are rejected
+#define JSON_NUM_LEN 64
+
+struct json_in
+{
+        FILE* f;
+        char* buf;
+        size_t size;
+        // Number of valid bytes in buf
+        size_t len;
+        size_t pos;
+        // File offset of buf[0]
+        uint64_t off;
+        struct mesh_json_error* err;
+};
+
+static uint64_t json_offset(const struct json_in* in)
+{
+        return in->off + in->pos;
+}
+
+static int json_error_at(struct json_in* in, uint64_t off, const char* msg)
+{
+        if (in->err->msg[0] == '\0')
+        {
+                in->err->offset = off;
+                snprintf(in->err->msg, sizeof(in->err->msg), "%s", msg);
+        }
+
+        return -1;
+}
+
+static int json_error(struct json_in* in, const char* msg)
+{
+        return json_error_at(in, json_offset(in), msg);
+}
+
+static int json_fill(struct json_in* in)
+{
+        in->off += in->len;
+        in->pos = 0;
+        in->len = fread(in->buf, 1, in->size, in->f);
+
+        return in->len > 0;
+}
+
+// Next byte without consuming it, or -1 at the end of the file
+static inline int json_peek(struct json_in* in)
+{
+        if (in->pos == in->len && !json_fill(in))
+        {
+                return -1;
+        }
+
+        return (unsigned char)in->buf[in->pos];
+}
+
+// Skip whitespace, and peek at the next byte
+static int json_ws(struct json_in* in)
+{
+        for (;;)
+        {
+                int c = json_peek(in);
+
+                if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+                {
+                        return c;
+                }
+                in->pos++;
+        }
+}
+
+static int json_expect(struct json_in* in, int c, const char* msg)
+{
+        if (json_ws(in) != c)
+        {
+                return json_error(in, msg);
+        }
+        in->pos++;
+
+        return 0;
+}
+
+static int json_literal(struct json_in* in, const char* lit)
+{
+        for (const char* l = lit; *l; l++)
+        {
+                if (json_peek(in) != *l)
+                {
+                        return json_error(in, "invalid literal");
+                }
+                in->pos++;
+        }
+
+        return 0;
+}
+
+/*
+  Parse a string. Up to n - 1 bytes are stored in out, which may be
+  NULL. Escapes other than \uXXXX are decoded, those become '?'.
+*/
+static int json_string(struct json_in* in, char* out, size_t n)
+{
+        size_t k = 0;
+
+        if (json_expect(in, '"', "expected a string") != 0)
+        {
+                return -1;
+        }
+
+        for (;;)
+        {
+                int c = json_peek(in);
+
+                if (c < 0)
+                {
+                        return json_error(in, "unterminated string");
+                }
+                in->pos++;
+                if (c == '"')
+                {
+                        break;
+                }
+                if (c == '\\')
+                {
+                        c = json_peek(in);
+                        in->pos++;
+                        switch (c)
+                        {
+                        case 'b': c = '\b'; break;
+                        case 'f': c = '\f'; break;
+                        case 'n': c = '\n'; break;
+                        case 'r': c = '\r'; break;
+                        case 't': c = '\t'; break;
+                        case '"':
+                        case '\\':
+                        case '/':
+                                break;
+                        case 'u':
+                                for (int i = 0; i < 4; i++)
+                                {
+                                        if (!isxdigit(json_peek(in)))
+                                        {
+                                                return json_error(in,
+                                                        "invalid escape");
+                                        }
+                                        in->pos++;
+                                }
+                                c = '?';
+                                break;
+                        default:
+                                return json_error(in, "invalid escape");
+                        }
+                }
+                if (out && k + 1 < n)
+                {
+                        out[k++] = (char)c;
+                }
+        }
+        if (out)
+        {
+                out[k] = '\0';
+        }
+
+        return 0;
+}
+
+static int json_is_number(int c)
+{
+        return c == '-' || (c >= '0' && c <= '9');
+}
+
+static int json_number(struct json_in* in, double* v)
+{
+        char num[JSON_NUM_LEN + 1];
+        size_t k = 0;
+        char* end;
+
+        for (;;)
+        {
+                int c = json_peek(in);
+
+                if (!((c >= '0' && c <= '9') || c == '+' || c == '-' ||
+                      c == 'e' || c == 'E' || c == '.'))
+                {
+                        break;
+                }
+                if (k == JSON_NUM_LEN)
+                {
+                        return json_error(in, "number too long");
+                }
+                num[k++] = (char)c;
+                in->pos++;
+        }
+        num[k] = '\0';
+
+        *v = strtod(num, &end);
+        if (k == 0 || end != num + k)
+        {
+                return json_error(in, "invalid number");
+        }
+
+        return 0;
+}
+
+static int json_skip(struct json_in* in, int depth);
+
+/*
+  Iterate over an array. Call with first set to 1 before the first
+  element.
+  @return 1 if there is another element, 0 at the end, -1 on error
+*/
+static int json_array_next(struct json_in* in, int* first)
+{
+        int c = json_ws(in);
+
+        if (*first)
+        {
+                if (c != '[')
+                {
+                        return json_error(in, "expected an array");
+                }
+                in->pos++;
+                *first = 0;
+                if (json_ws(in) == ']')
+                {
+                        in->pos++;
+                        return 0;
+                }
+                return 1;
+        }
+
+        if (c == ',')
+        {
+                in->pos++;
+                return 1;
+        }
+        if (c == ']')
+        {
+                in->pos++;
+                return 0;
+        }
+
+        return json_error(in, "expected ',' or ']'");
+}
+
+/*
+  Iterate over an object, the key of the next member is stored in key.
+  Call with first set to 1 before the first member.
+  @return 1 if there is another member, 0 at the end, -1 on error
+*/
+static int json_object_next(struct json_in* in, int* first, char* key)
+{
+        int c = json_ws(in);
+
+        if (*first)
+        {
+                if (c != '{')
+                {
+                        return json_error(in, "expected an object");
+                }
+                in->pos++;
+                *first = 0;
+                if (json_ws(in) == '}')
+                {
+                        in->pos++;
+                        return 0;
+                }
+        }
+        else if (c == ',')
+        {
+                in->pos++;
+        }
+        else if (c == '}')
+        {
+                in->pos++;
+                return 0;
+        }
+        else
+        {
+                return json_error(in, "expected ',' or '}'");
+        }
+
+        if (json_string(in, key, JSON_KEY_LEN) != 0 ||
+            json_expect(in, ':', "expected ':'") != 0)
+        {
+                return -1;
+        }
+
+        return 1;
+}
+
+static int json_skip(struct json_in* in, int depth)
+{
+        char key[JSON_KEY_LEN];
+        int first = 1;
+        int r;
+        double v;
+
+        if (depth > JSON_MAX_DEPTH)
+        {
+                return json_error(in, "nesting too deep");
+        }
+
+        switch (json_ws(in))
+        {
+        case '{':
+                while ((r = json_object_next(in, &first, key)) == 1)
+                {
+                        if (json_skip(in, depth + 1) != 0)
+                        {
+                                return -1;
+                        }
+                }
+                return r;
+        case '[':
+                while ((r = json_array_next(in, &first)) == 1)
+                {
+                        if (json_skip(in, depth + 1) != 0)
+                        {
+                                return -1;
+                        }
+                }
+                return r;
+        case '"':
+                return json_string(in, NULL, 0);
+        case 't':
+                return json_literal(in, "true");
+        case 'f':
+                return json_literal(in, "false");
+        case 'n':
+                return json_literal(in, "null");
+        default:
+                if (json_is_number(json_peek(in)))
+                {
+                        return json_number(in, &v);
+                }
+                return json_error(in, "expected a value");
+        }
+}
+
+/*
+  Parse a number if the value is one, otherwise skip it.
+  @return 1 if a number was parsed, 0 if skipped, -1 on error
+*/
+static int json_opt_number(struct json_in* in, double* v)
+{
+        if (json_is_number(json_ws(in)))
+        {
+                return json_number(in, v) == 0 ? 1 : -1;
+        }
+
+        return json_skip(in, 1) == 0 ? 0 : -1;
+}
+
+/*
+  Parse an array, and store the first n elements that are numbers in
+  v. Other elements are skipped.
+  @return the number of elements, or -1 on error. Bit i of mask is
+          set if element i < n was a number.
+*/
+static long json_numbers(struct json_in* in, double* v, int n,
+                         unsigned int* mask)
+{
+        int first = 1;
+        long count = 0;
+        int r;
+
+        *mask = 0;
+        while ((r = json_array_next(in, &first)) == 1)
+        {
+                double tmp;
+                int num = json_opt_number(in, &tmp);
+
+                if (num < 0)
+                {
+                        return -1;
+                }
+                if (num && count < n)
+                {
+                        v[count] = tmp;
+                        *mask |= 1u << count;
+                }
+                count++;
+        }
+
+        return r == 0 ? count : -1;
+}
+
+// Seen keys, only the first of any duplicates is used
+#define KEY_REST 0x01
+#define KEY_SMU  0x02
+#define KEY_DMU  0x04
+#define KEY_GX   0x08
+#define KEY_GZ   0x10
+#define KEY_VERT 0x20
+#define KEY_IDX  0x40
+
+static int json_key(const char* key, const char* name, int bit, int* seen)
+{
+        if (*seen & bit || strcasecmp(key, name) != 0)
+        {
+                return 0;
+        }
+        *seen |= bit;
+
+        return 1;
+}
+
+// Store the value if it is a number, otherwise keep the default
+static int json_opt_float(struct json_in* in, float* f)
+{
+        double d;
+        int num = json_opt_number(in, &d);
+
+        if (num == 1)
+        {
+                *f = (float)d;
+        }
+
+        return num < 0 ? -1 : 0;
+}
+
+static int json_opt_dim(struct json_in* in, uint16_t* dim)
+{
+        double d;
+        int num = json_opt_number(in, &d);
+
+        if (num == 1)
+        {
+                if (!(d >= 0.0 && d <= UINT16_MAX))
+                {
+                        return json_error(in, "grid dimension out of range");
+                }
+                *dim = (uint16_t)d;
+        }
+
+        return num < 0 ? -1 : 0;
+}
+
+static void* json_grow(void* p, size_t* cap, size_t n, size_t sz)
+{
+        size_t c = *cap;
+        void* np;
+
+        if (n < c)
+        {
+                return p;
+        }
+        c = c ? c * 2 : 256;
+        np = realloc(p, c * sz);
+        if (np)
+        {
+                *cap = c;
+        }
+
+        return np;
+}
+
+static int json_vertex(struct json_in* in, struct vertex* v)
+{
+        char key[JSON_KEY_LEN];
+        int first = 1;
+        int pos = 0;
+        int col = 0;
+        int r;
+
+        v->color = (struct vec4){ .x = 0.3f, .y = 0.6f, .z = 0.8f, .w = 1.0f };
+
+        while ((r = json_object_next(in, &first, key)) == 1)
+        {
+                double d[4];
+                unsigned int mask;
+                long n;
+
+                if (!pos && strcasecmp(key, "position") == 0)
+                {
+                        uint64_t at;
+
+                        json_ws(in);
+                        at = json_offset(in);
+                        pos = 1;
+                        n = json_numbers(in, d, 3, &mask);
+                        if (n < 0)
+                        {
+                                return -1;
+                        }
+                        if (n < 3 || mask != 0x7)
+                        {
+                                return json_error_at(in, at, "'position' "
+                                        "must be an array of at least "
+                                        "3 numbers");
+                        }
+                        v->pos.x = (float)d[0];
+                        v->pos.y = (float)d[1];
+                        v->pos.z = (float)d[2];
+                }
+                else if (!col && strcasecmp(key, "color") == 0)
+                {
+                        col = 1;
+                        n = json_numbers(in, d, 4, &mask);
+                        if (n < 0)
+                        {
+                                return -1;
+                        }
+                        // Anything but 4 numbers keeps the default
+                        if (n >= 4 && mask == 0xf)
+                        {
+                                v->color.x = (float)d[0];
+                                v->color.y = (float)d[1];
+                                v->color.z = (float)d[2];
+                                v->color.w = (float)d[3];
+                        }
+                }
+                else if (json_skip(in, 1) != 0)
+                {
+                        return -1;
+                }
+        }
+        if (r == 0 && !pos)
+        {
+                return json_error(in, "vertex without 'position'");
+        }
+
+        return r;
+}
+
+static int json_vertices(struct json_in* in, struct mesh* m, size_t* cap)
+{
+        int first = 1;
+        size_t n = 0;
+        int r;
+
+        while ((r = json_array_next(in, &first)) == 1)
+        {
+                struct vertex* v;
+
+                if (n == UINT32_MAX)
+                {
+                        return json_error(in, "too many vertices");
+                }
+                v = json_grow(m->vertices, cap, n, sizeof(struct vertex));
+                if (!v)
+                {
+                        return json_error(in, "out of memory");
+                }
+                m->vertices = v;
+                if (json_vertex(in, m->vertices + n) != 0)
+                {
+                        return -1;
+                }
+                n++;
+        }
+        m->vertex_count = (uint32_t)n;
+
+        return r;
+}
+
+// Switch to 32 bit indices, when one does not fit in 16 bits
+static int json_widen(struct mesh* m, size_t n, size_t cap)
+{
+        uint32_t* idx = malloc(cap * sizeof(uint32_t));
+
+        if (!idx)
+        {
+                return -1;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+                idx[i] = m->indices[i];
+        }
+        free(m->indices);
+        m->indices = NULL;
+        m->indices32 = idx;
+
+        return 0;
+}
+
+static int json_indices(struct json_in* in, struct mesh* m, size_t* cap)
+{
+        int first = 1;
+        size_t n = 0;
+        int r;
+
+        while ((r = json_array_next(in, &first)) == 1)
+        {
+                double d;
+
+                if (n == UINT32_MAX)
+                {
+                        return json_error(in, "too many indices");
+                }
+                if (m->indices32)
+                {
+                        uint32_t* idx = json_grow(m->indices32, cap, n,
+                                                  sizeof(uint32_t));
+
+                        if (!idx)
+                        {
+                                return json_error(in, "out of memory");
+                        }
+                        m->indices32 = idx;
+                }
+                else
+                {
+                        uint16_t* idx = json_grow(m->indices, cap, n,
+                                                  sizeof(uint16_t));
+
+                        if (!idx)
+                        {
+                                return json_error(in, "out of memory");
+                        }
+                        m->indices = idx;
+                }
+                if (!json_is_number(json_ws(in)))
+                {
+                        return json_error(in, "index: expected a number");
+                }
+                if (json_number(in, &d) != 0)
+                {
+                        return -1;
+                }
+                if (!(d >= 0.0 && d <= UINT32_MAX))
+                {
+                        return json_error(in, "index out of range");
+                }
+                if (!m->indices32 && d > UINT16_MAX &&
+                    json_widen(m, n, *cap) != 0)
+                {
+                        return json_error(in, "out of memory");
+                }
+                if (m->indices32)
+                {
+                        m->indices32[n++] = (uint32_t)d;
+                }
+                else
+                {
+                        m->indices[n++] = (uint16_t)d;
+                }
+        }
+        m->index_count = (uint32_t)n;
+
+        return r;
+}
+
+static int json_mesh(struct json_in* in, struct mesh* m)
+{
+        char key[JSON_KEY_LEN];
+        size_t vcap = 0;
+        size_t icap = 0;
+        int first = 1;
+        int seen = 0;
+        int r;
+
+        memset(m, 0, sizeof(*m));
+        m->static_mu = 0.5f;
+        m->dynamic_mu = 0.5f;
+
+        while ((r = json_object_next(in, &first, key)) == 1)
+        {
+                if (json_key(key, "vertices", KEY_VERT, &seen))
+                {
+                        // Known up front for grids
+                        if (m->grid_x && m->grid_z && !m->vertices)
+                        {
+                                vcap = (size_t)m->grid_x * m->grid_z;
+                                m->vertices = malloc(vcap *
+                                                     sizeof(struct vertex));
+                        }
+                        r = json_vertices(in, m, &vcap);
+                }
+                else if (json_key(key, "indices", KEY_IDX, &seen))
+                {
+                        if (m->grid_x > 1 && m->grid_z > 1 && !m->indices &&
+                            !m->indices32)
+                        {
+                                icap = (size_t)(m->grid_x - 1) *
+                                        (size_t)(m->grid_z - 1) * 6;
+                                if ((size_t)m->grid_x * m->grid_z >
+                                    UINT16_MAX + 1)
+                                {
+                                        m->indices32 = malloc(icap *
+                                                sizeof(uint32_t));
+                                }
+                                else
+                                {
+                                        m->indices = malloc(icap *
+                                                sizeof(uint16_t));
+                                }
+                        }
+                        r = json_indices(in, m, &icap);
+                }
+                else if (json_key(key, "restitution", KEY_REST, &seen))
+                {
+                        r = json_opt_float(in, &m->restitution);
+                }
+                else if (json_key(key, "static_mu", KEY_SMU, &seen))
+                {
+                        r = json_opt_float(in, &m->static_mu);
+                }
+                else if (json_key(key, "dynamic_mu", KEY_DMU, &seen))
+                {
+                        r = json_opt_float(in, &m->dynamic_mu);
+                }
+                else if (json_key(key, "grid_x", KEY_GX, &seen))
+                {
+                        r = json_opt_dim(in, &m->grid_x);
+                }
+                else if (json_key(key, "grid_z", KEY_GZ, &seen))
+                {
+                        r = json_opt_dim(in, &m->grid_z);
+                }
+                else
+                {
+                        r = json_skip(in, 1);
+                }
+
+                if (r < 0)
+                {
+                        return -1;
+                }
+        }
+        if (r < 0)
+        {
+                return -1;
+        }
+
+        if (!(seen & KEY_VERT))
+        {
+                return json_error(in, "failed to get vertices");
+        }
+        if (!(seen & KEY_IDX))
+        {
+                return json_error(in, "failed to get indices");
+        }
+        for (uint32_t i = 0; i < m->index_count; i++)
+        {
+                if (mesh_index(m, i) >= m->vertex_count)
+                {
+                        return json_error(in, "index out of range");
+                }
+        }
+
+        m->inward_normals = malloc((size_t)m->index_count *
+                                   sizeof(struct vec3));
+        if (!m->inward_normals)
+        {
+                return json_error(in, "out of memory");
+        }
+        mesh_check_grid(m);
+        mesh_normalize(m);
+        mesh_inward_normalize(m);
+        if (mesh_build_tris(m) != 0 ||
+            mesh_build_bvh(m) != 0 ||
+            mesh_build_adjacency(m) != 0)
+        {
+                return json_error(in, "out of memory");
+        }
+
+        return 0;
+}
+
+static struct mesh* json_meshes(struct json_in* in, int* count)
+{
+        char key[JSON_KEY_LEN];
+        struct mesh* meshes = NULL;
+        size_t cap = 0;
+        size_t n = 0;
+        int first = 1;
+        int found = 0;
+        int r;
+
+        while ((r = json_object_next(in, &first, key)) == 1)
+        {
+                int afirst = 1;
+
+                if (found || strcasecmp(key, "meshes") != 0)
+                {
+                        r = json_skip(in, 1);
+                        if (r < 0)
+                        {
+                                break;
+                        }
+                        continue;
+                }
+
+                found = 1;
+                while ((r = json_array_next(in, &afirst)) == 1)
+                {
+                        struct mesh* tmp;
+
+                        if (n == UINT16_MAX)
+                        {
+                                r = json_error(in, "too many meshes");
+                                break;
+                        }
+                        tmp = json_grow(meshes, &cap, n, sizeof(struct mesh));
+                        if (!tmp)
+                        {
+                                r = json_error(in, "out of memory");
+                                break;
+                        }
+                        meshes = tmp;
+                        if (json_mesh(in, meshes + n) != 0)
+                        {
+                                // Free the partial mesh too
+                                n++;
+                                r = -1;
+                                break;
+                        }
+                        n++;
+                }
+                if (r < 0)
+                {
+                        break;
+                }
+        }
+
+        if (r == 0 && n == 0)
+        {
+                r = json_error(in, found ? "no meshes found" :
+                               "failed to get meshes");
+        }
+        if (r < 0)
+        {
+                for (size_t i = 0; i < n; i++)
+                {
+                        mesh_free(meshes + i);
+                }
+                free(meshes);
+                return NULL;
+        }
+
+        *count = (int)n;
+        return meshes;
+}
+
+struct mesh* read_meshes_json(FILE* f,
+                              size_t chunk,
+                              int* count,
+                              struct mesh_json_error* err)
+{
+        struct mesh_json_error tmp;
+        struct json_in in = {
+                .f = f,
+                .size = chunk ? chunk : JSON_CHUNK,
+                .err = err ? err : &tmp,
+        };
+        struct mesh* meshes;
+
+        *count = 0;
+        in.err->offset = 0;
+        in.err->msg[0] = '\0';
+
+        in.buf = malloc(in.size);
+        if (!in.buf)
+        {
+                json_error(&in, "out of memory");
+                return NULL;
+        }
+
+        meshes = json_meshes(&in, count);
+        if (!meshes && ferror(f))
+        {
+                snprintf(in.err->msg, sizeof(in.err->msg), "read error");
+        }
+        free(in.buf);
+
+        return meshes;
+}
+
+struct mesh* load_meshes_json(const char* p,
+                              int* count,
+                              struct mesh_json_error* err)
+{
+        FILE* f = fopen(p, "rb");
+        struct mesh* meshes;
+
+        *count = 0;
+        if (!f)
+        {
+                if (err)
+                {
+                        err->offset = 0;
+                        snprintf(err->msg, sizeof(err->msg),
+                                 "failed to open file");
+                }
+                return NULL;
+        }
+
+        meshes = read_meshes_json(f, 0, count, err);
+        fclose(f);
+
+        return meshes;
+}
+
+/*
+  Streaming JSON mesh writer. The output is formatted into a fixed
+  size buffer, which is flushed to the stream or file descriptor when
+  full.
+*/
+
+struct json_out
+{
+        char* buf;
+        size_t len;
+        FILE* f;
+        int fd;
+        int failed;
+};
+
+static void json_flush(struct json_out* out)
+{
+        size_t done = 0;
+
+        if (out->failed)
+        {
+                out->len = 0;
+                return;
+        }
+
+        if (out->f)
+        {
+                done = fwrite(out->buf, 1, out->len, out->f);
+        }
+        else
+        {
+                while (done < out->len)
+                {
+                        ssize_t n = write(out->fd, out->buf + done,
+                                          out->len - done);
+
+                        if (n < 0)
+                        {
+                                if (errno == EINTR)
+                                {
+                                        continue;
+                                }
+                                break;
+                        }
+                        done += (size_t)n;
+                }
+        }
+        if (done != out->len)
+        {
+                out->failed = 1;
+        }
+        out->len = 0;
+}
+
+static void json_put(struct json_out* out, const char* s, size_t n)
+{
+        if (out->len + n > JSON_CHUNK)
+        {
+                json_flush(out);
+        }
+        memcpy(out->buf + out->len, s, n);
+        out->len += n;
+}
+
+static void json_puts(struct json_out* out, const char* s)
+{
+        json_put(out, s, strlen(s));
+}
+
+static void json_put_uint(struct json_out* out, uint32_t v)
+{
+        char tmp[10];
+        size_t k = sizeof(tmp);
+
+        do
+        {
+                tmp[--k] = (char)('0' + v % 10);
+                v /= 10;
+        } while (v);
+
+        json_put(out, tmp + k, sizeof(tmp) - k);
+}
+
+/*
+  The shortest decimal that reads back as the same float. If p
+  digits round trip, so do p + 1, so the precision is found with a
+  binary search. Nine digits always round trip.
+*/
+static void json_put_float(struct json_out* out, float v)
+{
+        char tmp[32];
+        int lo = 1;
+        int hi = 9;
+        int n;
+
+        if (!isfinite(v))
+        {
+                // Not representable in JSON, as cJSON does
+                json_put(out, "null", 4);
+                return;
+        }
+        if (fabsf(v) < 1e7f && v == (float)(int32_t)v)
+        {
+                if (signbit(v) && v == 0.0f)
+                {
+                        json_put(out, "-0", 2);
+                        return;
+                }
+                n = snprintf(tmp, sizeof(tmp), "%d", (int)v);
+                json_put(out, tmp, (size_t)n);
+                return;
+        }
+
+        while (lo < hi)
+        {
+                int mid = (lo + hi) / 2;
+
+                snprintf(tmp, sizeof(tmp), "%.*g", mid, (double)v);
+                if ((float)strtod(tmp, NULL) == v)
+                {
+                        hi = mid;
+                }
+                else
+                {
+                        lo = mid + 1;
+                }
+        }
+        n = snprintf(tmp, sizeof(tmp), "%.*g", lo, (double)v);
+        json_put(out, tmp, (size_t)n);
+}
+
+static void json_put_floats(struct json_out* out, const float* v, int n,
+                            const char* sep)
+{
+        json_put(out, "[", 1);
+        for (int i = 0; i < n; i++)
+        {
+                if (i)
+                {
+                        json_puts(out, sep);
+                }
+                json_put_float(out, v[i]);
+        }
+        json_put(out, "]", 1);
+}
+
+// Start a member, with the given indentation when pretty printing
+static void json_key_out(struct json_out* out, const char* key,
+                         int indent, int compact)
+{
+        if (!compact)
+        {
+                json_put(out, "\n\t\t\t\t", (size_t)indent + 1);
+        }
+        json_put(out, "\"", 1);
+        json_puts(out, key);
+        json_puts(out, compact ? "\":" : "\": ");
+}
+
+static void json_mesh_out(struct json_out* out,
+                          const struct mesh* m,
+                          int compact)
+{
+        const char* sep = compact ? "," : ", ";
+
+        json_puts(out, compact ? "{" : "\t\t{");
+        json_key_out(out, "restitution", 3, compact);
+        json_put_float(out, m->restitution);
+        json_put(out, ",", 1);
+        json_key_out(out, "static_mu", 3, compact);
+        json_put_float(out, m->static_mu);
+        json_put(out, ",", 1);
+        json_key_out(out, "dynamic_mu", 3, compact);
+        json_put_float(out, m->dynamic_mu);
+        json_put(out, ",", 1);
+        if (m->grid_x > 0 && m->grid_z > 0)
+        {
+                json_key_out(out, "grid_x", 3, compact);
+                json_put_uint(out, m->grid_x);
+                json_put(out, ",", 1);
+                json_key_out(out, "grid_z", 3, compact);
+                json_put_uint(out, m->grid_z);
+                json_put(out, ",", 1);
+        }
+
+        json_key_out(out, "vertices", 3, compact);
+        json_put(out, "[", 1);
+        for (uint32_t i = 0; i < m->vertex_count; i++)
+        {
+                const struct vertex* v = m->vertices + i;
+
+                json_puts(out, i ? (compact ? "," : ",\n\t\t\t\t") :
+                          (compact ? "" : "\n\t\t\t\t"));
+                json_puts(out, compact ? "{\"position\":" :
+                          "{\"position\": ");
+                json_put_floats(out, v->pos.a, 3, sep);
+                json_puts(out, compact ? ",\"color\":" : ", \"color\": ");
+                json_put_floats(out, v->color.a, 4, sep);
+                json_put(out, "}", 1);
+        }
+        json_puts(out, compact ? "]," : "\n\t\t\t],");
+
+        // One triangle per line
+        json_key_out(out, "indices", 3, compact);
+        json_put(out, "[", 1);
+        for (uint32_t i = 0; i < m->index_count; i++)
+        {
+                if (i)
+                {
+                        json_puts(out, compact || i % 3 ? sep : ",\n\t\t\t\t");
+                }
+                else if (!compact)
+                {
+                        json_puts(out, "\n\t\t\t\t");
+                }
+                json_put_uint(out, mesh_index(m, i));
+        }
+        json_puts(out, compact ? "]}" : "\n\t\t\t]\n\t\t}");
+}
+
+static int json_meshes_out(struct json_out* out,
+                           const struct mesh* meshes,
+                           int count,
+                           int compact)
+{
+        out->buf = malloc(JSON_CHUNK);
+        if (!out->buf)
+        {
+                return -1;
+        }
+
+        json_puts(out, compact ? "{\"meshes\":[" : "{\n\t\"meshes\": [\n");
+        for (int i = 0; i < count; i++)
+        {
+                if (i)
+                {
+                        json_puts(out, compact ? "," : ",\n");
+                }
+                json_mesh_out(out, meshes + i, compact);
+        }
+        json_puts(out, compact ? "]}" : "\n\t]\n}\n");
+        json_flush(out);
+        free(out->buf);
+
+        return out->failed ? -1 : 0;
+}
+
+int write_meshes_json(FILE* f,
+                      const struct mesh* meshes,
+                      int count,
+                      int compact)
+{
+        struct json_out out = { .f = f };
+
+        return json_meshes_out(&out, meshes, count, compact);
+}
+
+int write_meshes_json_fd(int fd,
+                         const struct mesh* meshes,
+                         int count,
+                         int compact)
+{
+        struct json_out out = { .fd = fd };
+
+        return json_meshes_out(&out, meshes, count, compact);
+}
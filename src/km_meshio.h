@@ -0,0 +1,194 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#ifndef KM_MESHIO_H
+#define KM_MESHIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct mesh;
+
+/*
+  Binary mesh container. All values are stored in the host's byte
+  order, and the blocks have the same layout as in memory, so that a
+  mapped file can be used in place.
+
+  file header          struct mesh_bin_header
+  mesh table           struct mesh_bin_entry, one per mesh
+  blocks               per mesh: vertices (struct vertex), indices
+                       (uint16_t or uint32_t), inward normals
+                       (struct vec3, one per index). Each block
+                       starts at a multiple of MESH_BIN_ALIGN from
+                       the start of the file.
+
+  Version 1 files have no index_size in the mesh table, and always
+  use 16 bit indices.
+*/
+#define MESH_BIN_MAGIC "KMSH"
+#define MESH_BIN_VERSION 2
+#define MESH_BIN_ALIGN 64
+// File name extension write_meshes uses to pick the binary format
+#define MESH_BIN_EXT ".kmsh"
+
+struct mesh_bin_header
+{
+        char magic[4];
+        uint32_t version;
+        // Written as 1, reads back as something else on a host
+        // with the other byte order
+        uint32_t byte_order;
+        // sizeof(struct vertex) of the writer
+        uint32_t vertex_size;
+        uint32_t mesh_count;
+        uint32_t reserved;
+};
+
+struct mesh_bin_entry
+{
+        float restitution;
+        float static_mu;
+        float dynamic_mu;
+        uint16_t grid_x;
+        uint16_t grid_z;
+        uint32_t vertex_count;
+        uint32_t index_count;
+        // Byte offsets from the start of the file
+        uint64_t vertex_off;
+        uint64_t index_off;
+        uint64_t normal_off;
+        // 2 or 4 bytes, since version 2
+        uint32_t index_size;
+        uint32_t reserved;
+};
+
+/*
+  A mapped mesh file. The meshes' vertex, index and inward normal
+  arrays point into the mapping. The mapping is private, so the
+  meshes may be modified without changing the file.
+*/
+struct mesh_file
+{
+        void* base;
+        size_t size;
+        struct mesh* meshes;
+        int count;
+};
+
+/**
+ * Map a binary mesh file, and set up its meshes to use the data in
+ * place. The triangle cache, bvh and adjacency are built for each mesh.
+ * @param f the mesh file to initialize
+ * @param p the path to the file
+ * @return 0 on success, -1 on failure
+ */
+int mesh_file_open(struct mesh_file* f, const char* p);
+
+/**
+ * Free the meshes and unmap the file.
+ * @param f the mesh file
+ * @return void
+ */
+void mesh_file_close(struct mesh_file* f);
+
+/**
+ * Test if a file is a binary mesh file.
+ * @param p the path to the file
+ * @return 1 if the file starts with MESH_BIN_MAGIC, 0 otherwise
+ */
+int mesh_bin_probe(const char* p);
+
+/**
+ * Read a binary mesh file into meshes that own their memory, in the
+ * same way as load_meshes.
+ * @param p the path to the file
+ * @param count the number of meshes read and returned
+ * @return pointer to the meshes, or NULL if read failed.
+ */
+struct mesh* load_meshes_bin(const char* p, int* count);
+
+/**
+ * Write an array of meshes to a binary mesh file.
+ * @param p the path to the output file
+ * @param meshes pointer to the array of meshes to write
+ * @param count the number of meshes in the array
+ * @return 0 on success, -1 on failure
+ */
+int write_meshes_bin(const char* p, const struct mesh* meshes, int count);
+
+struct mesh_json_error
+{
+        // Byte offset in the file where the error was found
+        uint64_t offset;
+        char msg[80];
+};
+
+/**
+ * Read meshes from a JSON stream, in the format written by
+ * write_meshes. The stream is read in chunks, and the vertices and
+ * indices are parsed straight into the mesh arrays, without holding
+ * the file or a DOM of it in memory.
+ * @param f the stream to read
+ * @param chunk size of the read buffer in bytes, 0 for the default
+ * @param count the number of meshes read and returned
+ * @param err set to the offset and cause of the first error, may
+ *        be NULL
+ * @return pointer to the meshes, or NULL if read failed.
+ */
+struct mesh* read_meshes_json(FILE* f,
+                              size_t chunk,
+                              int* count,
+                              struct mesh_json_error* err);
+
+/**
+ * Same as read_meshes_json, but opens the provided path.
+ * @param p the path to the JSON file to read
+ * @param count the number of meshes read and returned
+ * @param err set to the offset and cause of the first error, may
+ *        be NULL
+ * @return pointer to the meshes, or NULL if read failed.
+ */
+struct mesh* load_meshes_json(const char* p,
+                              int* count,
+                              struct mesh_json_error* err);
+
+/**
+ * Write an array of meshes as JSON to a stream, in the format read by
+ * read_meshes_json. The output goes through a fixed size buffer, no
+ * DOM or string of the whole document is built. Floats are written
+ * with the fewest digits that read back as the same value.
+ * @param f the stream to write to
+ * @param meshes pointer to the array of meshes to write
+ * @param count the number of meshes in the array
+ * @param compact 1 to leave out all whitespace, 0 to pretty print
+ * @return 0 on success, -1 on failure
+ */
+int write_meshes_json(FILE* f,
+                      const struct mesh* meshes,
+                      int count,
+                      int compact);
+
+/**
+ * Same as write_meshes_json, but writes to a file descriptor.
+ * @param fd the file descriptor to write to
+ * @param meshes pointer to the array of meshes to write
+ * @param count the number of meshes in the array
+ * @param compact 1 to leave out all whitespace, 0 to pretty print
+ * @return 0 on success, -1 on failure
+ */
+int write_meshes_json_fd(int fd,
+                         const struct mesh* meshes,
+                         int count,
+                         int compact);
+
+#endif /* KM_MESHIO_H */
@@ -0,0 +1,179 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "km_particles.h"
+#include "km_phys.h"
+
+// Number of arrays in struct particles
+#define PARTICLES_ARRAYS 11
+// Alignment, in bytes, of each array
+#define PARTICLES_ALIGN 64
+#define PARTICLES_ALIGN_F (PARTICLES_ALIGN / sizeof(float))
+
+int particles_init(struct particles* ps, uint32_t cap)
+{
+        // Round up so that every array starts on an aligned address
+        size_t stride = ((size_t)cap + PARTICLES_ALIGN_F - 1) /
+                PARTICLES_ALIGN_F * PARTICLES_ALIGN_F;
+        float* buf;
+
+        memset(ps, 0, sizeof(*ps));
+
+        stride = stride ? stride : PARTICLES_ALIGN_F;
+        buf = aligned_alloc(PARTICLES_ALIGN,
+                            stride * PARTICLES_ARRAYS * sizeof(float));
+        if (!buf)
+        {
+                return -1;
+        }
+
+        ps->cap = cap;
+        ps->px = buf + stride * 0;
+        ps->py = buf + stride * 1;
+        ps->pz = buf + stride * 2;
+        ps->vx = buf + stride * 3;
+        ps->vy = buf + stride * 4;
+        ps->vz = buf + stride * 5;
+        ps->ax = buf + stride * 6;
+        ps->ay = buf + stride * 7;
+        ps->az = buf + stride * 8;
+        ps->m = buf + stride * 9;
+        ps->cd = buf + stride * 10;
+
+        return 0;
+}
+
+void particles_free(struct particles* ps)
+{
+        // All arrays share the allocation starting at px
+        free(ps->px);
+
+        memset(ps, 0, sizeof(*ps));
+}
+
+int particles_gather(struct particles* ps,
+                     const struct object* objs,
+                     uint32_t n)
+{
+        if (n > ps->cap)
+        {
+                return -1;
+        }
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+                const struct object* o = objs + i;
+
+                ps->px[i] = o->p.p.x;
+                ps->py[i] = o->p.p.y;
+                ps->pz[i] = o->p.p.z;
+                ps->vx[i] = o->p.v.x;
+                ps->vy[i] = o->p.v.y;
+                ps->vz[i] = o->p.v.z;
+                ps->ax[i] = o->p.a.x;
+                ps->ay[i] = o->p.a.y;
+                ps->az[i] = o->p.a.z;
+                ps->m[i] = o->m;
+                ps->cd[i] = o->area * o->drag_c;
+        }
+        ps->count = n;
+
+        return 0;
+}
+
+void particles_scatter(const struct particles* ps, struct object* objs)
+{
+        for (uint32_t i = 0; i < ps->count; i++)
+        {
+                struct object* o = objs + i;
+
+                o->p.p.x = ps->px[i];
+                o->p.p.y = ps->py[i];
+                o->p.p.z = ps->pz[i];
+                o->p.v.x = ps->vx[i];
+                o->p.v.y = ps->vy[i];
+                o->p.v.z = ps->vz[i];
+                o->p.a.x = ps->ax[i];
+                o->p.a.y = ps->ay[i];
+                o->p.a.z = ps->az[i];
+        }
+}
+
+/*
+ * Same operations, in the same order, as vverlet_step and drag_force.
+ * No branches or calls (sqrtf is inlined as errno is not used, see the
+ * Makefile) so the loop can be vectorised.
+ */
+static void vverlet_kernel(uint32_t n,
+                           float* restrict px,
+                           float* restrict py,
+                           float* restrict pz,
+                           float* restrict vx,
+                           float* restrict vy,
+                           float* restrict vz,
+                           float* restrict ax,
+                           float* restrict ay,
+                           float* restrict az,
+                           const float* restrict m,
+                           const float* restrict cd,
+                           struct vec3 g,
+                           float half_rho,
+                           float dt)
+{
+        for (uint32_t i = 0; i < n; i++)
+        {
+                float x;
+                float y;
+                float z;
+                float vs;
+                float fx;
+                float fy;
+                float fz;
+
+                // velocity half step
+                x = vx[i] + ax[i] * dt * 0.5f;
+                y = vy[i] + ay[i] * dt * 0.5f;
+                z = vz[i] + az[i] * dt * 0.5f;
+
+                px[i] += x * dt;
+                py[i] += y * dt;
+                pz[i] += z * dt;
+
+                // gravity and drag
+                vs = sqrtf(x * x + y * y + z * z);
+                fx = m[i] * g.x - half_rho * vs * x * cd[i];
+                fy = m[i] * g.y - half_rho * vs * y * cd[i];
+                fz = m[i] * g.z - half_rho * vs * z * cd[i];
+
+                ax[i] = fx / m[i];
+                ay[i] = fy / m[i];
+                az[i] = fz / m[i];
+
+                // velocity take two
+                vx[i] = x + ax[i] * dt * 0.5f;
+                vy[i] = y + ay[i] * dt * 0.5f;
+                vz[i] = z + az[i] * dt * 0.5f;
+        }
+}
+
+void update_particles(const struct world* w, struct particles* ps)
+{
+        vverlet_kernel(ps->count,
+                       ps->px, ps->py, ps->pz,
+                       ps->vx, ps->vy, ps->vz,
+                       ps->ax, ps->ay, ps->az,
+                       ps->m, ps->cd,
+                       w->g, w->air_density * 0.5f, w->dt);
+}
@@ -0,0 +1,95 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#ifndef KM_PARTICLES_H
+#define KM_PARTICLES_H
+
+#include <stdint.h>
+
+struct object;
+struct world;
+
+/*
+  Structure of arrays store for large numbers of free flying particles
+  (debris, sparks etc). Only the state needed by the integrator is kept,
+  each array holds count elements and is 64 byte aligned.
+  Particles are not collided with the world's surfaces.
+*/
+struct particles
+{
+        uint32_t count;
+        uint32_t cap;
+        // Position
+        float* px;
+        float* py;
+        float* pz;
+        // Velocity
+        float* vx;
+        float* vy;
+        float* vz;
+        // Acceleration
+        float* ax;
+        float* ay;
+        float* az;
+        // Mass
+        float* m;
+        // Drag, area * drag coefficient
+        float* cd;
+};
+
+/**
+ * Allocate storage for cap particles. count is set to zero.
+ * @param ps the particle store
+ * @param cap the max number of particles
+ * @return 0 on success, -1 on failure
+ */
+int particles_init(struct particles* ps, uint32_t cap);
+
+/**
+ * Free the particle store. All members are set to zero.
+ * @param ps the particle store
+ * @return void
+ */
+void particles_free(struct particles* ps);
+
+/**
+ * Copy the state of an array of objects into the store, replacing
+ * any particles already in it.
+ * @param ps the particle store
+ * @param objs the objects to copy from
+ * @param n number of objects, must not be larger than the capacity
+ * @return 0 on success, -1 if n is larger than the capacity
+ */
+int particles_gather(struct particles* ps,
+                     const struct object* objs,
+                     uint32_t n);
+
+/**
+ * Copy position, velocity and acceleration back to an array of
+ * objects. The other members of the objects are left as is.
+ * @param ps the particle store
+ * @param objs the objects to copy to, at least ps->count
+ * @return void
+ */
+void particles_scatter(const struct particles* ps, struct object* objs);
+
+/**
+ * Run one velocity verlet step with gravity and air drag for all
+ * particles. Gives the same result as update_object for an object that
+ * doesn't collide with anything.
+ * @param w the world instance to use
+ * @param ps the particles to update
+ * @return void
+ */
+void update_particles(const struct world* w, struct particles* ps);
+
+#endif /* KM_PARTICLES_H */
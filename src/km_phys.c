@@ -18,6 +18,11 @@
 #include "km_phys.h"
 #include "km_math.h"
 #include "km_geom.h"
+#include "km_bvh.h"
+#include "km_pool.h"
+#include "km_water.h"
+#include "km_sap.h"
+#include "km_spatial.h"
 
 // Clamp ratio, if the collision is close to head on, the
 // impulse force gives a lot of impulse damping in the
@@ -25,6 +30,15 @@
 // lower than the dynamic friction so adjust for that.
 #define CCR 0.7f
 
+// Objects per work item in update_objects_parallel. Small enough to
+// let idle threads steal from threads stuck with colliding objects.
+#define UPDATE_CHUNK 16
+
+// Rays per work item in world_raycast_batch
+#define RAYCAST_CHUNK 32
+// Bits per axis of the Morton code rays are sorted by
+#define MORTON_BITS 10
+
 void print_particle(const struct particle* p)
 {
         printf("pos: %f %f %f\n", p->p.x, p->p.y, p->p.z);
@@ -40,12 +54,285 @@ void object_set_m(struct object* o, float m)
         o->m_inv = 1.0f / m;
 }
 
+void object_wake(struct object* o)
+{
+        o->steady_state = 0;
+        o->sleep_timer = 0.0f;
+}
+
+void object_apply_impulse(struct object* o, struct vec3 j)
+{
+        o->p.v = vec3_add(o->p.v, vec3_scalarm(j, o->m_inv));
+        object_wake(o);
+}
+
+int active_set_init(struct active_set* s,
+                    const struct object* objs,
+                    int n)
+{
+        s->idx = malloc((size_t)MAX(n, 1) * sizeof(int));
+        s->in_set = calloc((size_t)MAX(n, 1), 1);
+        s->objs = objs;
+        s->count = 0;
+        s->n = n;
+        if (!s->idx || !s->in_set)
+        {
+                active_set_free(s);
+                return -1;
+        }
+
+        active_set_sync(s, objs);
+
+        return 0;
+}
+
+void active_set_free(struct active_set* s)
+{
+        free(s->idx);
+        free(s->in_set);
+        s->idx = NULL;
+        s->in_set = NULL;
+        s->objs = NULL;
+        s->count = 0;
+        s->n = 0;
+}
+
+/*
+ * Add object i to the set, unless it is already there.
+ * @return 1 if it was added
+ */
+static int active_set_add(struct active_set* s, int i)
+{
+        if (s->in_set[i])
+        {
+                return 0;
+        }
+        s->in_set[i] = 1;
+        s->idx[s->count++] = i;
+
+        return 1;
+}
+
+int active_set_sync(struct active_set* s, const struct object* objs)
+{
+        int added = 0;
+
+        for (int i = 0; i < s->n; i++)
+        {
+                if (!objs[i].steady_state)
+                {
+                        added += active_set_add(s, i);
+                }
+        }
+
+        return added;
+}
+
+void active_set_wake(struct active_set* s, struct object* objs, int i)
+{
+        assert(i >= 0 && i < s->n);
+
+        active_set_add(s, i);
+        object_wake(objs + i);
+}
+
+void active_set_impulse(struct active_set* s,
+                        struct object* objs,
+                        int i,
+                        struct vec3 j)
+{
+        active_set_wake(s, objs, i);
+        object_apply_impulse(objs + i, j);
+}
+
+int active_set_wake_mesh(struct active_set* s,
+                         struct object* objs,
+                         const struct mesh* m)
+{
+        int woken = 0;
+
+        for (int i = 0; i < s->n; i++)
+        {
+                struct object* o = objs + i;
+
+                if (o->contact_mesh != m)
+                {
+                        continue;
+                }
+
+                // The contact is no longer valid, let the object
+                // find the new surface
+                o->contact_mesh = NULL;
+                woken += active_set_add(s, i);
+                object_wake(o);
+        }
+
+        return woken;
+}
+
+struct wake_near
+{
+        struct active_set* s;
+        struct object* objs;
+        int woken;
+};
+
+static void wake_near_fn(void* ctx, uint32_t i)
+{
+        struct wake_near* w = ctx;
+
+        if (!w->s->in_set[i])
+        {
+                active_set_wake(w->s, w->objs, (int)i);
+                w->woken++;
+        }
+}
+
+int active_set_wake_near(struct active_set* s,
+                         struct object* objs,
+                         const struct spatial_hash* h,
+                         struct vec3 p,
+                         float r)
+{
+        struct wake_near w = { .s = s, .objs = objs, .woken = 0 };
+
+        spatial_hash_query(h, objs, p, r, wake_near_fn, &w);
+
+        return w.woken;
+}
+
+void world_wake(const struct world* w, struct object* o)
+{
+        struct active_set* s = w->active_set;
+
+        if (s)
+        {
+                assert(o >= s->objs && o < s->objs + s->n);
+                active_set_add(s, (int)(o - s->objs));
+        }
+        object_wake(o);
+}
+
 void default_world(struct world* w, int fps)
 {
         w->g = (struct vec3){ .a = {0.0f, -KM_PHYS_G, 0.0f} };
         w->dt = 1.0f / (float)fps;
         w->air_density = KM_PHYS_AIR_DENS;
         w->ss_thr   = 0.008f * 0.008f; // 8mm/s
+        w->sleep_time = 0.0f;
+        w->surface_bvh = NULL;
+        w->terrain = NULL;
+        w->pool = NULL;
+        w->active_set = NULL;
+}
+
+int world_build_bvh(struct world* w)
+{
+        for (int i = 0; i < w->surface_count; i++)
+        {
+                if (!w->surfaces[i].bvh && mesh_build_bvh(w->surfaces + i))
+                {
+                        return -1;
+                }
+        }
+
+        if (!w->surface_bvh)
+        {
+                w->surface_bvh = calloc(1, sizeof(struct bvh));
+                if (!w->surface_bvh)
+                {
+                        return -1;
+                }
+        }
+
+        if (meshes_build_bvh(w->surface_bvh, w->surfaces, w->surface_count))
+        {
+                world_free_bvh(w);
+                return -1;
+        }
+
+        return 0;
+}
+
+void world_refit_bvh(struct world* w)
+{
+        if (!w->surface_bvh)
+        {
+                return;
+        }
+
+        if (meshes_refit_bvh(w->surface_bvh, w->surfaces, w->surface_count))
+        {
+                // Fall back to testing all surfaces
+                world_free_bvh(w);
+        }
+}
+
+void world_free_bvh(struct world* w)
+{
+        if (w->surface_bvh)
+        {
+                bvh_free(w->surface_bvh);
+                free(w->surface_bvh);
+                w->surface_bvh = NULL;
+        }
+}
+
+int world_start_pool(struct world* w, int threads)
+{
+        world_stop_pool(w);
+
+        w->pool = km_pool_create(threads);
+
+        return w->pool ? 0 : -1;
+}
+
+void world_stop_pool(struct world* w)
+{
+        km_pool_free(w->pool);
+        w->pool = NULL;
+}
+
+struct update_job
+{
+        int step;
+        const struct world* w;
+        struct object* objs;
+};
+
+static void update_chunk(void* ctx, uint32_t begin, uint32_t end)
+{
+        struct update_job* job = ctx;
+
+        for (uint32_t i = begin; i < end; i++)
+        {
+                update_object(job->step, job->w, job->objs + i);
+        }
+}
+
+void update_objects_parallel(int step,
+                             const struct world* w,
+                             struct object* objs,
+                             int n)
+{
+        struct update_job job = {
+                .step = step,
+                .w = w,
+                .objs = objs
+        };
+
+        if (n <= 0)
+        {
+                return;
+        }
+
+        if (!w->pool)
+        {
+                update_chunk(&job, 0, (uint32_t)n);
+                return;
+        }
+
+        km_pool_run(w->pool, (uint32_t)n, UPDATE_CHUNK, update_chunk, &job);
 }
 
 void update_objects(int step,
@@ -67,6 +354,67 @@ void update_objects(int step,
         }
 }
 
+void update_active_objects(int step,
+                           const struct world* w,
+                           struct object* objs,
+                           struct active_set* s)
+{
+        int i = 0;
+
+        while (i < s->count)
+        {
+                struct object* o = objs + s->idx[i];
+
+                update_object(step, w, o);
+
+                if (o->steady_state)
+                {
+                        // Fell asleep, the order in the set does
+                        // not matter
+                        s->in_set[s->idx[i]] = 0;
+                        s->idx[i] = s->idx[--s->count];
+                        continue;
+                }
+                i++;
+        }
+}
+
+/*
+ * The first collision with the world's surfaces and terrain, for the
+ * segment p.p to p.p + p.v.
+ */
+static int world_toi(const struct world* w,
+                     struct collision* toi,
+                     struct particle* p)
+{
+        int coll;
+
+        if (w->surface_bvh)
+        {
+                coll = compute_toi_tree(toi, p, w->surface_bvh,
+                                        w->surfaces);
+        }
+        else
+        {
+                coll = compute_toi(toi, p, w->surfaces,
+                                   w->surface_count);
+        }
+
+        if (w->terrain)
+        {
+                struct collision tt;
+
+                if (compute_toi_terrain(&tt, p, w->terrain) &&
+                    (!coll || tt.t < toi->t))
+                {
+                        *toi = tt;
+                        coll = 1;
+                }
+        }
+
+        return coll;
+}
+
 void update_object(int step, const struct world* w, struct object* o)
 {
         float remaining = w->dt;
@@ -86,15 +434,16 @@ void update_object(int step, const struct world* w, struct object* o)
                 struct particle p = {0};
                 struct collision toi;
                 float v_normal;
-                int coll = 0;
+                int coll;
 
                 // use current pos and the tentative displacement
                 p.p = o->p.p;
+                p.rad = o->p.rad;
                 p.v.x = (o->p.v.x + o->p.a.x * remaining * 0.5f) * remaining;
                 p.v.y = (o->p.v.y + o->p.a.y * remaining * 0.5f) * remaining;
                 p.v.z = (o->p.v.z + o->p.a.z * remaining * 0.5f) * remaining;
 
-                coll = compute_toi(&toi, &p, w->surfaces, w->surface_count);
+                coll = world_toi(w, &toi, &p);
 
                 // t is time to impact, measured in this step's displacement
                 if (!coll || toi.t > 1)
@@ -103,8 +452,16 @@ void update_object(int step, const struct world* w, struct object* o)
                         // Check if the object is on a surface
                         if (o->contact_mesh)
                         {
-                                if (!point_on_mesh(o->contact_mesh,
-                                                   o->p.p))
+                                // A sphere touches the surface a radius
+                                // below its center
+                                struct vec3 c = vec3_sub(
+                                        o->p.p,
+                                        vec3_scalarm(o->contact_normal,
+                                                     o->p.rad));
+
+                                if (!point_on_mesh_walk(o->contact_mesh,
+                                                        c,
+                                                        &o->contact_tri))
                                 {
                                         // Object slide off
                                         o->contact_mesh = NULL;
@@ -153,6 +510,7 @@ void update_object(int step, const struct world* w, struct object* o)
                         // clamp object to mesh
                         o->contact_mesh = toi.m;
                         o->contact_normal = toi.n;
+                        o->contact_tri = toi.ti;
                         // TODO: update compute toi to ignore the mesh
                         // the particle is snapped to.
                 }
@@ -164,7 +522,18 @@ void update_object(int step, const struct world* w, struct object* o)
         // is the object at rest?
         if (vabs < w->ss_thr && o->contact_mesh)
         {
-                o->steady_state = 1;
+                // Only sleep after being at rest for a while, so an
+                // object that stops for a single step (e.g. at the
+                // turning point of a slope) keeps going
+                o->sleep_timer += w->dt;
+                if (o->sleep_timer >= w->sleep_time)
+                {
+                        o->steady_state = 1;
+                }
+        }
+        else
+        {
+                o->sleep_timer = 0.0f;
         }
 }
 
@@ -225,6 +594,16 @@ void vverlet_step(const struct world* w, struct object* o, float dt)
         o->p.v.z += o->p.a.z * dt * 0.5f;
 }
 
+/*
+ * Coulomb friction impulse for a collision with normal impulse jn,
+ * clamped so a near head on collision does not stop all tangential
+ * movement.
+ */
+static float coulomb_jf(float mu, float jn, float m, struct vec3 vt)
+{
+        return MIN(mu * fabsf(jn), CCR * m * sqrtf(vec3_dot(vt, vt)));
+}
+
 void collide_object(struct mesh* m,
                     struct object* o,
                     struct vec3 n,
@@ -253,7 +632,7 @@ void collide_object(struct mesh* m,
         {
                 float jn = -factor * o->m;
                 struct vec3 vt_dir = vec3_norm(vt);
-                float jf = MIN(mu * fabsf(jn), CCR * o->m * sqrtf(vec3_dot(vt, vt)));
+                float jf = coulomb_jf(mu, jn, o->m, vt);
 
                 struct vec3 res = vec3_scalarm(vt_dir, jf * o->m_inv);
                 o->p.v = vec3_sub(o->p.v, res);
@@ -268,6 +647,417 @@ void collide_object(struct mesh* m,
         o->p.v = vec3_sub(o->p.v, ns);
 }
 
+/*
+ * Impulse on a from a collision with b, -J is applied to b. Each
+ * object moves as if it had the inverse mass ia and ib. Zero if the
+ * objects are moving apart.
+ */
+static struct vec3 contact_impulse(const struct object* a,
+                                   const struct object* b,
+                                   struct vec3 n,
+                                   float ia,
+                                   float ib)
+{
+        struct vec3 vr = vec3_sub(a->p.v, b->p.v);
+        float vn = vec3_dot(vr, n);
+        struct vec3 vt = vec3_sub(vr, vec3_scalarm(n, vn));
+        float rc = sqrtf(a->restitution * b->restitution);
+        float mu = sqrtf(a->dynamic_mu * b->dynamic_mu);
+        float m;
+        float jn;
+        struct vec3 j;
+
+        if (vn >= 0.0f || !(ia + ib > 0.0f))
+        {
+                return (struct vec3){0};
+        }
+
+        // The same impulses as collide_object, with the reduced mass
+        m = 1.0f / (ia + ib);
+        jn = -(1.0f + rc) * vn * m;
+        j = vec3_scalarm(n, jn);
+        if (!vec3_iszero(vt))
+        {
+                float jf = coulomb_jf(mu, jn, m, vt);
+
+                j = vec3_sub(j, vec3_scalarm(vec3_norm(vt), jf));
+        }
+
+        return j;
+}
+
+// A sleeping object is only woken by an impulse that moves it faster
+// than the world's steady state threshold
+static int wakes(const struct world* w, const struct object* o, struct vec3 j)
+{
+        struct vec3 dv = vec3_scalarm(j, o->m_inv);
+
+        return o->steady_state && vec3_dot(dv, dv) > w->ss_thr;
+}
+
+/*
+ * Move an object by d, but not through the world's surfaces: stop 1mm
+ * short of the first one in the way, as update_object does. The contact
+ * cache is dropped, the object finds its surface again when updated.
+ * @return the part of d that was moved, 0 to 1
+ */
+static float world_push(const struct world* w, struct object* o, struct vec3 d)
+{
+        struct particle p = {0};
+        struct collision toi;
+        float t = 1.0f;
+
+        p.p = o->p.p;
+        p.rad = o->p.rad;
+        p.v = d;
+        if (world_toi(w, &toi, &p) && toi.t <= 1.0f)
+        {
+                t = toi.t;
+                d = vec3_add(vec3_scalarm(d, t),
+                             vec3_scalarm(toi.n, 0.001f));
+        }
+        o->p.p = vec3_add(o->p.p, d);
+        o->contact_mesh = NULL;
+
+        return t;
+}
+
+int collide_objects(const struct world* w, struct object* a, struct object* b)
+{
+        struct vec3 d = vec3_sub(a->p.p, b->p.p);
+        float r = a->p.rad + b->p.rad;
+        float dist2 = vec3_dot(d, d);
+        struct vec3 n = (struct vec3){ .a = {0.0f, 1.0f, 0.0f} };
+        struct vec3 j;
+        float ia;
+        float ib;
+        float dist;
+        float pen;
+        float left;
+
+        if (!(dist2 < r * r) || (a->steady_state && b->steady_state))
+        {
+                return 0;
+        }
+
+        dist = sqrtf(dist2);
+        if (dist > 0.0f)
+        {
+                n = vec3_scalarm(d, 1.0f / dist);
+        }
+
+        // Sleeping objects stay put, unless hit hard enough
+        j = contact_impulse(a, b, n, a->m_inv, b->m_inv);
+        if (wakes(w, a, j))
+        {
+                world_wake(w, a);
+        }
+        if (wakes(w, b, vec3_scalarm(j, -1.0f)))
+        {
+                world_wake(w, b);
+        }
+        ia = a->steady_state ? 0.0f : a->m_inv;
+        ib = b->steady_state ? 0.0f : b->m_inv;
+        if (!(ia + ib > 0.0f))
+        {
+                return 0;
+        }
+
+        // Separate the spheres, then bounce. What a surface keeps a
+        // from moving is left to b.
+        pen = (r - dist) / (ia + ib);
+        left = 0.0f;
+        if (ia > 0.0f)
+        {
+                left = pen * ia;
+                left -= left * world_push(w, a, vec3_scalarm(n, left));
+        }
+        if (ib > 0.0f)
+        {
+                world_push(w, b, vec3_scalarm(n, -(pen * ib + left)));
+        }
+        j = contact_impulse(a, b, n, ia, ib);
+        a->p.v = vec3_add(a->p.v, vec3_scalarm(j, ia));
+        b->p.v = vec3_sub(b->p.v, vec3_scalarm(j, ib));
+
+        return 1;
+}
+
+int collide_pairs(const struct world* w,
+                  struct object* objs,
+                  const struct sap_pair* pairs,
+                  uint32_t count)
+{
+        int contacts = 0;
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+                contacts += collide_objects(w,
+                                            objs + pairs[i].a,
+                                            objs + pairs[i].b);
+        }
+
+        return contacts;
+}
+
+int update_objects_sap(int step,
+                       const struct world* w,
+                       struct object* objs,
+                       int n,
+                       struct sap* s)
+{
+        int pairs;
+
+        update_objects(step, w, objs, n, 0);
+        pairs = sap_update(s, objs);
+        if (pairs < 0)
+        {
+                return -1;
+        }
+
+        return collide_pairs(w, objs, s->pairs, (uint32_t)pairs);
+}
+
+/*
+ * Barycentric coordinates of p in triangle ti, p = v0 + u e1 + v e2.
+ * Computed from the hit point, as the triangle block test only gives t.
+ */
+static void tri_barycentric(const struct mesh* m,
+                            uint32_t ti,
+                            struct vec3 p,
+                            float* u,
+                            float* v)
+{
+        struct vertex* v0;
+        struct vertex* v1;
+        struct vertex* v2;
+        struct vec3 e1;
+        struct vec3 e2;
+        struct vec3 d;
+        float d00;
+        float d01;
+        float d11;
+        float den;
+
+        mesh_get_tri(&v0, &v1, &v2, m, ti);
+        e1 = vec3_sub(v1->pos, v0->pos);
+        e2 = vec3_sub(v2->pos, v0->pos);
+        d = vec3_sub(p, v0->pos);
+        d00 = vec3_dot(e1, e1);
+        d01 = vec3_dot(e1, e2);
+        d11 = vec3_dot(e2, e2);
+        den = d00 * d11 - d01 * d01;
+        if (den == 0.0f)
+        {
+                *u = 0.0f;
+                *v = 0.0f;
+                return;
+        }
+
+        *u = (d11 * vec3_dot(d, e1) - d01 * vec3_dot(d, e2)) / den;
+        *v = (d00 * vec3_dot(d, e2) - d01 * vec3_dot(d, e1)) / den;
+}
+
+int world_raycast(const struct world* w,
+                  struct vec3 o,
+                  struct vec3 d,
+                  float t_max,
+                  struct ray_hit* hit)
+{
+        struct particle p = {0};
+        struct collision toi;
+
+        *hit = (struct ray_hit){ .t = INFINITY };
+
+        // The same segment a moving object tests
+        p.p = o;
+        p.v = vec3_scalarm(d, t_max);
+        if (!(t_max > 0.0f) || !world_toi(w, &toi, &p) || toi.t > 1.0f)
+        {
+                return 0;
+        }
+
+        hit->t = toi.t * t_max;
+        hit->n = toi.n;
+        hit->m = toi.m;
+        hit->ti = toi.ti;
+        tri_barycentric(toi.m, toi.ti,
+                        vec3_add(o, vec3_scalarm(p.v, toi.t)),
+                        &hit->u, &hit->v);
+
+        return 1;
+}
+
+struct raycast_job
+{
+        const struct world* w;
+        const struct vec3* o;
+        const struct vec3* d;
+        const float* t_max;
+        struct ray_hit* hits;
+        // Ray indices, in Morton order of the origins
+        const uint32_t* order;
+};
+
+static void raycast_chunk(void* ctx, uint32_t begin, uint32_t end)
+{
+        const struct raycast_job* job = ctx;
+
+        for (uint32_t k = begin; k < end; k++)
+        {
+                uint32_t i = job->order[k];
+
+                world_raycast(job->w, job->o[i], job->d[i], job->t_max[i],
+                              job->hits + i);
+        }
+}
+
+// Spread the low MORTON_BITS bits of x to every third bit
+static uint32_t morton_spread(uint32_t x)
+{
+        x &= 0x3FF;
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x << 8)) & 0x0300F00F;
+        x = (x | (x << 4)) & 0x030C30C3;
+        x = (x | (x << 2)) & 0x09249249;
+
+        return x;
+}
+
+static uint32_t morton_axis(float v, float lo, float scale)
+{
+        float q = (v - lo) * scale;
+
+        // Also catches NaN
+        if (!(q > 0.0f))
+        {
+                return 0;
+        }
+
+        return (uint32_t)MIN(q, (float)((1 << MORTON_BITS) - 1));
+}
+
+/*
+ * Order the rays by the Morton code of their origin within the
+ * origins' bounds, so rays run one after another start near each
+ * other and visit the same nodes and triangles. Stable LSD radix sort,
+ * 8 bits per pass.
+ */
+static int raycast_order(const struct vec3* o, uint32_t n, uint32_t* order)
+{
+        uint32_t* code = malloc((size_t)n * 2 * sizeof(uint32_t));
+        uint32_t* tmp = malloc((size_t)n * sizeof(uint32_t));
+        uint32_t* key;
+        struct vec3 lo = o[0];
+        struct vec3 hi = o[0];
+        float scale[3];
+
+        if (!code || !tmp)
+        {
+                free(code);
+                free(tmp);
+                return -1;
+        }
+        key = code + n;
+
+        for (uint32_t i = 1; i < n; i++)
+        {
+                for (int a = 0; a < 3; a++)
+                {
+                        lo.a[a] = MIN(lo.a[a], o[i].a[a]);
+                        hi.a[a] = MAX(hi.a[a], o[i].a[a]);
+                }
+        }
+        for (int a = 0; a < 3; a++)
+        {
+                float ext = hi.a[a] - lo.a[a];
+
+                scale[a] = ext > 0.0f ?
+                        (float)(1 << MORTON_BITS) / ext : 0.0f;
+        }
+        for (uint32_t i = 0; i < n; i++)
+        {
+                code[i] = morton_spread(morton_axis(o[i].x, lo.x, scale[0])) |
+                        morton_spread(morton_axis(o[i].y, lo.y, scale[1])) << 1 |
+                        morton_spread(morton_axis(o[i].z, lo.z, scale[2])) << 2;
+                order[i] = i;
+        }
+
+        for (int shift = 0; shift < 3 * MORTON_BITS; shift += 8)
+        {
+                uint32_t count[257] = {0};
+
+                for (uint32_t i = 0; i < n; i++)
+                {
+                        key[i] = code[order[i]];
+                        count[((key[i] >> shift) & 0xFF) + 1]++;
+                }
+                for (int b = 0; b < 256; b++)
+                {
+                        count[b + 1] += count[b];
+                }
+                for (uint32_t i = 0; i < n; i++)
+                {
+                        tmp[count[(key[i] >> shift) & 0xFF]++] = order[i];
+                }
+                memcpy(order, tmp, n * sizeof(uint32_t));
+        }
+
+        free(code);
+        free(tmp);
+
+        return 0;
+}
+
+int world_raycast_batch(const struct world* w,
+                        const struct vec3* o,
+                        const struct vec3* d,
+                        const float* t_max,
+                        struct ray_hit* hits,
+                        int n)
+{
+        struct raycast_job job = {
+                .w = w,
+                .o = o,
+                .d = d,
+                .t_max = t_max,
+                .hits = hits
+        };
+        uint32_t* order;
+        int count = 0;
+
+        if (n <= 0)
+        {
+                return 0;
+        }
+
+        order = malloc((size_t)n * sizeof(uint32_t));
+        if (!order || raycast_order(o, (uint32_t)n, order))
+        {
+                free(order);
+                return -1;
+        }
+        job.order = order;
+
+        if (w->pool)
+        {
+                km_pool_run(w->pool, (uint32_t)n, RAYCAST_CHUNK,
+                            raycast_chunk, &job);
+        }
+        else
+        {
+                raycast_chunk(&job, 0, (uint32_t)n);
+        }
+        free(order);
+
+        for (int i = 0; i < n; i++)
+        {
+                count += hits[i].m != NULL;
+        }
+
+        return count;
+}
+
 struct vec3 drag_force(const struct world* w, const struct object* o)
 {
         struct vec3 f;
@@ -324,7 +1114,7 @@ struct vec3 friction_force_coulomb(const struct mesh* m,
         float mu = sqrtf(m->dynamic_mu * o->dynamic_mu);
         float jn = -(1.0f + rc) * vn * o->m;
         struct vec3 vt_dir = vec3_norm(vt);
-        float jf = MIN(mu * fabsf(jn), CCR * o->m * sqrtf(vec3_dot(vt, vt)));
+        float jf = coulomb_jf(mu, jn, o->m, vt);
 
         // only update the friction part, collision resolving updates
         // the velocity to move away from the surface
@@ -371,15 +1161,48 @@ int init_water(struct water* w, struct mesh* v, struct mesh* d)
         w->h = d1;
         w->d = d;
 
+        // The water surface moves every step, a triangle cache would
+        // always be stale
+        mesh_invalidate_tris(v);
+
         w->c = 1.5f; // wave propagation of 1.5m/s
         w->z = malloc(v->vertex_count * sizeof(struct vertex));
+        w->damp = malloc(v->vertex_count * sizeof(float));
+        if (!w->z || !w->damp)
+        {
+                free_water(w);
+                return -1;
+        }
 
         // copy the vertices as is
         memcpy(w->z, v->vertices, v->vertex_count * sizeof(struct vertex));
 
+        // The ground is static, the damping only needs to be
+        // recomputed when it is modified
+        update_water_damping(w, v, 0, 0, v->grid_x, v->grid_z);
+
         return 0;
 }
 
+void free_water(struct water* w)
+{
+        free(w->z);
+        free(w->damp);
+        w->z = NULL;
+        w->damp = NULL;
+}
+
+void update_water_damping(struct water* w,
+                          const struct mesh* v,
+                          uint32_t x0,
+                          uint32_t z0,
+                          uint32_t x1,
+                          uint32_t z1)
+{
+        water_damping_fill(w->damp, v->grid_x, v->grid_z, w->d,
+                           x0, z0, x1, z1);
+}
+
 void update_water(struct water* w, struct mesh* v, float dt)
 {
         struct vertex* tmp;
@@ -420,24 +1243,8 @@ void update_water(struct water* w, struct mesh* v, float dt)
                                 v->vertices[y * stride + x].pos.y;
                         new += new2;
 
-                        float gh = w->d->vertices[y * stride + x].pos.y;
-
-                        float d;
-
-                        if (gh > 0.299f)
-                        {
-                                d = 0.0f;
-                        }
-                        else if (gh < -0.2999f)
-                        {
-                                d = 1.0f;
-                        }
-                        else
-                        {
-                                d = -0.6f * gh + 0.5f;
-                        }
-
-                        v->vertices[y * stride + x].pos.y = d * new;
+                        v->vertices[y * stride + x].pos.y =
+                                w->damp[y * stride + x] * new;
                 }
         }
 }
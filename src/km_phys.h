@@ -13,11 +13,18 @@
 #ifndef KM_PHYS_H
 #define KM_PHYS_H
 
+#include <stdint.h>
 #include "km_math.h"
 
 struct object;
 struct mesh;
 struct vertex;
+struct bvh;
+struct km_pool;
+struct terrain;
+struct sap;
+struct sap_pair;
+struct spatial_hash;
 
 // m/s2
 #define KM_PHYS_G 9.818f
@@ -50,8 +57,10 @@ struct object
         float area;
         // the drag coefficient
         float drag_c;
-        // Set to 1 if this object is not moving
+        // Set to 1 if this object is not moving (asleep)
         char steady_state;
+        // For how long the object has been at rest, in seconds
+        float sleep_timer;
         // restitution constant for collisions
         float restitution;
         // static friction coefficient
@@ -61,6 +70,8 @@ struct object
         // Persistent contact cache
         struct mesh* contact_mesh;
         struct vec3 contact_normal;
+        // The triangle in contact_mesh the object is on
+        uint32_t contact_tri;
 };
 
 struct world
@@ -75,12 +86,62 @@ struct world
         struct mesh* surfaces;
         // Number of meshes
         int surface_count;
+        // Optional bvh over the surfaces, see world_build_bvh
+        struct bvh* surface_bvh;
+        // Optional terrain chunks, tested in addition to the surfaces
+        struct terrain* terrain;
+        // Optional worker threads, see world_start_pool
+        struct km_pool* pool;
         // Any water in the world
         struct mesh* waters;
         // Number of meshes
         int water_count;
         // threshod for squared velocity to considered to be in a steady state
         float ss_thr;
+        // For how long an object must stay below ss_thr before it is
+        // put to sleep, in seconds. 0 puts it to sleep at once.
+        float sleep_time;
+        // If set, objects woken with world_wake, e.g. by
+        // collide_objects, are added to it. Must be created with the
+        // objects that are updated.
+        struct active_set* active_set;
+};
+
+/*
+  The objects that are awake. Sleeping objects are not in the set, so
+  they cost nothing when updated with update_active_objects. Objects
+  are added back when woken through one of the active_set_wake calls,
+  world_wake, or picked up by active_set_sync when woken otherwise.
+*/
+struct active_set
+{
+        // Indices of the awake objects, in no particular order
+        int* idx;
+        // One per object, set if the object is in idx
+        uint8_t* in_set;
+        // The objects the set was created with
+        const struct object* objs;
+        // Number of awake objects
+        int count;
+        // Total number of objects
+        int n;
+};
+
+/*
+  The first hit of a ray cast. t is INFINITY and m is NULL for a miss.
+*/
+struct ray_hit
+{
+        // Distance along the ray, in units of its direction's length
+        float t;
+        // Normal of the triangle hit
+        struct vec3 n;
+        struct mesh* m;
+        // Index of the triangle in m
+        uint32_t ti;
+        // Barycentric coordinates of the hit, p = v0 + u e1 + v e2
+        float u;
+        float v;
 };
 
 struct water
@@ -88,10 +149,12 @@ struct water
         float c;
         float h;
         // the surface for which the water is above/under
-        // used to apply as a damping mask to the wave updates
+        // used to compute the damping mask
         struct mesh* d;
-        // the buffer with the last state
-        // Todo, replace witha simpel MxN float array?
+        // damping mask, one per vertex, see water_damping
+        float* damp;
+        // the buffer with the last state. See struct water_grid
+        // for a faster solver on packed float arrays.
         struct vertex* z;
 };
 
@@ -109,12 +172,149 @@ void print_particle(const struct particle* p);
  */
 void object_set_m(struct object* o, float m);
 
+/**
+ * Wake an object up, and reset its sleep timer. This does not add the
+ * object to an active_set, use active_set_wake or world_wake for
+ * objects updated with update_active_objects.
+ * @param o the object
+ * @return void
+ */
+void object_wake(struct object* o);
+
+/**
+ * Wake an object up, and add it to the world's active_set if any.
+ * @param w the world
+ * @param o the object, one of the objects of w->active_set
+ * @return void
+ */
+void world_wake(const struct world* w, struct object* o);
+
+/**
+ * Apply an impulse to an object, and wake it up. Like object_wake,
+ * this does not add the object to an active_set, see
+ * active_set_impulse.
+ * @param o the object
+ * @param j the impulse, in Ns
+ * @return void
+ */
+void object_apply_impulse(struct object* o, struct vec3 j);
+
+/**
+ * Create a set with the objects that are awake.
+ * @param s the set to initialize
+ * @param objs the objects
+ * @param n number of objects
+ * @return 0 on success, -1 on failure
+ */
+int active_set_init(struct active_set* s,
+                    const struct object* objs,
+                    int n);
+
+/**
+ * Free the set's memory.
+ * @param s the set
+ * @return void
+ */
+void active_set_free(struct active_set* s);
+
+/**
+ * Add the objects that are awake but missing from the set, e.g. after
+ * waking them with object_wake or object_apply_impulse. Visits every
+ * object, prefer the active_set_wake calls when the object is known.
+ * @param s the set
+ * @param objs the objects the set was created with
+ * @return the number of objects added
+ */
+int active_set_sync(struct active_set* s, const struct object* objs);
+
+/**
+ * Wake an object up, and add it to the set if it is not there.
+ * @param s the set
+ * @param objs the objects the set was created with
+ * @param i index of the object to wake
+ * @return void
+ */
+void active_set_wake(struct active_set* s, struct object* objs, int i);
+
+/**
+ * Apply an impulse to an object, and add it to the set.
+ * @param s the set
+ * @param objs the objects the set was created with
+ * @param i index of the object
+ * @param j the impulse, in Ns
+ * @return void
+ */
+void active_set_impulse(struct active_set* s,
+                        struct object* objs,
+                        int i,
+                        struct vec3 j);
+
+/**
+ * Wake all objects resting on a mesh. Must be called after the mesh
+ * is modified (e.g. mesh_heightmap, mesh_translate or
+ * water_grid_store), otherwise the objects keep floating where the
+ * old surface was.
+ * @param s the set
+ * @param objs the objects the set was created with
+ * @param m the modified mesh
+ * @return the number of objects woken up
+ */
+int active_set_wake_mesh(struct active_set* s,
+                         struct object* objs,
+                         const struct mesh* m);
+
+/**
+ * Wake all objects missing from the set whose bounding sphere is
+ * within r of p, e.g. when a moving object comes in contact with its
+ * neighbours. The neighbours are found through the broadphase hash,
+ * so objects that moved since it was built are placed where they were
+ * then.
+ * @param s the set
+ * @param objs the objects the set was created with
+ * @param h the hash, built from objs
+ * @param p the point
+ * @param r the distance
+ * @return the number of objects woken up
+ */
+int active_set_wake_near(struct active_set* s,
+                         struct object* objs,
+                         const struct spatial_hash* h,
+                         struct vec3 p,
+                         float r);
+
 /**
  * v and d must have the same spacing, and each vertex must have the
- * same x and z position.
+ * same x and z position. The damping mask is computed from d, which
+ * may be NULL for no damping.
  */
 int init_water(struct water* w, struct mesh* v, struct mesh* d);
 
+/**
+ * Free the water's buffers.
+ * @param w the water
+ * @return void
+ */
+void free_water(struct water* w);
+
+/**
+ * Recompute the damping mask for a rectangle of cells after the
+ * ground (w->d) has been modified. Cells x0 <= x < x1, z0 <= z < z1
+ * are updated, the rectangle is clipped to the grid.
+ * @param w the water
+ * @param v the water mesh
+ * @param x0 first column
+ * @param z0 first row
+ * @param x1 one past the last column
+ * @param z1 one past the last row
+ * @return void
+ */
+void update_water_damping(struct water* w,
+                          const struct mesh* v,
+                          uint32_t x0,
+                          uint32_t z0,
+                          uint32_t x1,
+                          uint32_t z1);
+
 void update_water(struct water* w, struct mesh* v, float dt);
 
 /**
@@ -125,6 +325,48 @@ void update_water(struct water* w, struct mesh* v, float dt);
  */
 void default_world(struct world*, int);
 
+/**
+ * Build a bvh over the world's surfaces. Each surface's own bvh
+ * is built if missing. The tree is used by update_object to only
+ * test the surfaces the object may hit.
+ * @param w the world
+ * @return 0 on success, -1 on failure
+ */
+int world_build_bvh(struct world* w);
+
+/**
+ * Refit the world's bvh after any surface has been modified
+ * (e.g. after mesh_translate or mesh_heightmap).
+ * @param w the world
+ * @return void
+ */
+void world_refit_bvh(struct world* w);
+
+/**
+ * Start the world's worker pool, used by update_objects_parallel.
+ * The world's surfaces must not be modified while objects are
+ * updated in parallel.
+ * @param w the world
+ * @param threads number of threads, including the calling thread.
+ *        If less than 1, one per online CPU.
+ * @return 0 on success, -1 on failure
+ */
+int world_start_pool(struct world* w, int threads);
+
+/**
+ * Stop the world's worker pool, if any.
+ * @param w the world
+ * @return void
+ */
+void world_stop_pool(struct world* w);
+
+/**
+ * Free the world's bvh. The surfaces' own bvhs are not freed.
+ * @param w the world
+ * @return void
+ */
+void world_free_bvh(struct world* w);
+
 /**
  * Run one update step for all objects using the provided world.
  * @param the current step
@@ -136,6 +378,90 @@ void default_world(struct world*, int);
  */
 void update_objects(int, const struct world*, struct object*, int, char);
 
+/**
+ * Same as update_objects, but the objects are updated in parallel on
+ * the world's worker pool. The result for each object is identical to
+ * the serial update. Runs serially if the world has no pool.
+ * @param step the current step
+ * @param w the world instance to use
+ * @param objs the objects to update
+ * @param n number of objects
+ * @return void
+ */
+void update_objects_parallel(int step,
+                             const struct world* w,
+                             struct object* objs,
+                             int n);
+
+/**
+ * Run one update step for all objects, then collide the objects with
+ * each other. The broadphase finds the overlapping pairs, which are
+ * resolved with collide_pairs.
+ * @param step the current step
+ * @param w the world instance to use
+ * @param objs the objects to update
+ * @param n number of objects
+ * @param s the broadphase, created for objs with sap_init
+ * @return number of pairs in contact, -1 on failure
+ */
+int update_objects_sap(int step,
+                       const struct world* w,
+                       struct object* objs,
+                       int n,
+                       struct sap* s);
+
+/**
+ * Run one update step for the objects in a set. Objects that fall
+ * asleep are removed from the set. The result for each object is
+ * identical to update_objects.
+ * @param step the current step
+ * @param w the world instance to use
+ * @param objs the objects the set was created with
+ * @param s the set
+ * @return void
+ */
+void update_active_objects(int step,
+                           const struct world* w,
+                           struct object* objs,
+                           struct active_set* s);
+
+/**
+ * Cast a ray against the world's surfaces and terrain, the same way a
+ * moving object is tested.
+ * @param w the world
+ * @param o the origin
+ * @param d the direction, need not be normalized
+ * @param t_max the farthest hit to report, o + t_max * d. Must be
+ *        finite.
+ * @param hit the first hit, set for a miss too
+ * @return 1 if the ray hit, 0 otherwise
+ */
+int world_raycast(const struct world* w,
+                  struct vec3 o,
+                  struct vec3 d,
+                  float t_max,
+                  struct ray_hit* hit);
+
+/**
+ * Cast many rays, with the same result for each ray as world_raycast.
+ * The rays are run in the order of their origins along a Morton curve,
+ * so consecutive rays touch the same parts of the world, and are split
+ * over the world's worker pool if it has one.
+ * @param w the world
+ * @param o the origin of each ray
+ * @param d the direction of each ray
+ * @param t_max the farthest hit to report for each ray
+ * @param hits the first hit of each ray
+ * @param n number of rays
+ * @return number of rays that hit, -1 on failure
+ */
+int world_raycast_batch(const struct world* w,
+                        const struct vec3* o,
+                        const struct vec3* d,
+                        const float* t_max,
+                        struct ray_hit* hits,
+                        int n);
+
 /**
  * Run one update step for one objects using the provided world.
  * @param the current step
@@ -171,6 +497,34 @@ void collide_object(struct mesh* m,
                     struct vec3 n,
                     float vn);
 
+/**
+ * Collide two objects' bounding spheres. If they overlap they are
+ * pushed apart along the line between their centers, but not through
+ * the world's surfaces, which also drops their contact cache. If they
+ * are moving towards each other they bounce with the same restitution
+ * and Coulomb friction as collide_object, using the restitution and
+ * friction of both objects. A sleeping object does not move unless the
+ * collision is hard enough to wake it, see world_wake.
+ * @param w the world, for its steady state threshold and surfaces
+ * @param a the first object
+ * @param b the second object
+ * @return 1 if the objects were in contact, 0 if not
+ */
+int collide_objects(const struct world* w, struct object* a, struct object* b);
+
+/**
+ * Run collide_objects for each pair, in order.
+ * @param w the world
+ * @param objs the objects
+ * @param pairs the pairs, as indices into objs
+ * @param count number of pairs
+ * @return number of pairs in contact
+ */
+int collide_pairs(const struct world* w,
+                  struct object* objs,
+                  const struct sap_pair* pairs,
+                  uint32_t count);
+
 /**
  * Quantize forces near zero to zero.
  * @param The force vector to quantize
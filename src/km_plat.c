@@ -11,21 +11,25 @@
 */
 
 #include <stdlib.h>
+#include <unistd.h>
 #include "km_plat.h"
 #if __linux__
 # include <errno.h>
-# include <stdint.h>
 # include <sys/random.h>
 #endif
 
-float rand_u01(void)
+// State of rand_u01 and rand_u01_fill, each thread has its own
+static _Thread_local struct rand_state thread_rand;
+static _Thread_local int thread_rand_seeded;
+
+// Fill buf with bytes from the OS' random source
+static void plat_entropy(void* buf, size_t len)
 {
 #if __APPLE__
-        return (float)arc4random() / (float)UINT32_MAX;
+        arc4random_buf(buf, len);
 #elif __linux__
-        uint32_t x;
-        unsigned char *p = (unsigned char*)&x;
-        size_t left = sizeof(x);
+        unsigned char *p = buf;
+        size_t left = len;
 
         while (left > 0)
         {
@@ -41,9 +45,99 @@ float rand_u01(void)
                 p += (size_t)n;
                 left -= (size_t)n;
         }
-
-        return (float)x / (float)UINT32_MAX;
 #else
 # error "Unknown target OS"
 #endif
 }
+
+static uint64_t splitmix64(uint64_t* x)
+{
+        uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+
+        return z ^ (z >> 31);
+}
+
+static uint64_t rotl(uint64_t x, int k)
+{
+        return (x << k) | (x >> (64 - k));
+}
+
+static struct rand_state* thread_state(void)
+{
+        if (!thread_rand_seeded)
+        {
+                uint64_t seed;
+
+                plat_entropy(&seed, sizeof(seed));
+                rand_state_seed(&thread_rand, seed);
+                thread_rand_seeded = 1;
+        }
+
+        return &thread_rand;
+}
+
+void rand_state_seed(struct rand_state* r, uint64_t seed)
+{
+        // splitmix64 never gives four zero words, the only bad state
+        for (int i = 0; i < 4; i++)
+        {
+                r->s[i] = splitmix64(&seed);
+        }
+}
+
+uint64_t rand_state_next(struct rand_state* r)
+{
+        // xoshiro256**
+        uint64_t* s = r->s;
+        uint64_t res = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+
+        return res;
+}
+
+float rand_state_u01(struct rand_state* r)
+{
+        // The top 24 bits, all a float can hold
+        return (float)(rand_state_next(r) >> 40) * 0x1.0p-24f;
+}
+
+void rand_state_u01_fill(struct rand_state* r, float* out, size_t n)
+{
+        for (size_t i = 0; i < n; i++)
+        {
+                out[i] = rand_state_u01(r);
+        }
+}
+
+void rand_seed(uint64_t seed)
+{
+        rand_state_seed(&thread_rand, seed);
+        thread_rand_seeded = 1;
+}
+
+float rand_u01(void)
+{
+        return rand_state_u01(thread_state());
+}
+
+void rand_u01_fill(float* out, size_t n)
+{
+        rand_state_u01_fill(thread_state(), out, n);
+}
+
+int plat_cpu_count(void)
+{
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+        return n < 1 ? 1 : (int)n;
+}
@@ -13,11 +13,81 @@
 #ifndef KM_PLAT_H
 #define KM_PLAT_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  State of a xoshiro256** pseudo random generator. The same seed gives
+  the same sequence on all platforms.
+*/
+struct rand_state
+{
+        uint64_t s[4];
+};
+
+/**
+ * Seed a random generator.
+ * @param r the generator
+ * @param seed any value, including 0
+ * @return void
+ */
+void rand_state_seed(struct rand_state* r, uint64_t seed);
+
+/**
+ * Generate the next 64 random bits.
+ * @param r the generator
+ * @return 64 random bits
+ */
+uint64_t rand_state_next(struct rand_state* r);
+
+/**
+ * Generate a random value that's uniformly distributed in [0, 1).
+ * @param r the generator
+ * @return a random float, 0 <= v < 1
+ */
+float rand_state_u01(struct rand_state* r);
+
 /**
- * Generate a random value that's uniformly distributed between 0 and 1
+ * Fill an array with random values uniformly distributed in [0, 1),
+ * the same values as from n calls to rand_state_u01.
+ * @param r the generator
+ * @param out the array to fill
+ * @param n number of values
+ * @return void
+ */
+void rand_state_u01_fill(struct rand_state* r, float* out, size_t n);
+
+/**
+ * Seed the calling thread's generator used by rand_u01 and
+ * rand_u01_fill. Unless seeded, each thread's generator is seeded
+ * from the OS' random source on first use.
+ * @param seed any value, including 0
+ * @return void
+ */
+void rand_seed(uint64_t seed);
+
+/**
+ * Generate a random value that's uniformly distributed in [0, 1),
+ * from the calling thread's generator.
  * @param void
- * @return a random float between 0 and 1
+ * @return a random float, 0 <= v < 1
  */
 float rand_u01(void);
 
+/**
+ * Fill an array with random values uniformly distributed in [0, 1),
+ * from the calling thread's generator.
+ * @param out the array to fill
+ * @param n number of values
+ * @return void
+ */
+void rand_u01_fill(float* out, size_t n);
+
+/**
+ * Get the number of online CPUs.
+ * @param void
+ * @return the number of online CPUs, at least 1
+ */
+int plat_cpu_count(void);
+
 #endif /* KM_PLAT_H */
@@ -0,0 +1,249 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "km_pool.h"
+#include "km_plat.h"
+#include "km_math.h"
+
+#define POOL_CACHE_LINE 64
+
+/*
+  The part of the items owned by one thread. The owner and any thief
+  take chunks from the same cursor, so no item is processed twice.
+  Each range is on its own cache line to avoid false sharing.
+*/
+struct pool_range
+{
+        _Alignas(POOL_CACHE_LINE) _Atomic uint64_t next;
+        uint64_t end;
+};
+
+struct pool_worker
+{
+        struct km_pool* p;
+        int id;
+};
+
+struct km_pool
+{
+        pthread_mutex_t lock;
+        // Signalled when a new job is posted, or the pool is stopped
+        pthread_cond_t work;
+        // Signalled when the last worker is done with a job
+        pthread_cond_t done;
+        pthread_t* threads;
+        struct pool_worker* workers;
+        // Total number of threads, including the caller of km_pool_run
+        int thread_count;
+        // Incremented for each job
+        uint64_t generation;
+        // Number of workers still running the current job
+        int busy;
+        int stop;
+        // The current job
+        km_pool_fn fn;
+        void* ctx;
+        uint32_t chunk;
+        struct pool_range* ranges;
+};
+
+static void pool_work(struct km_pool* p, int self)
+{
+        // Own range first, then steal from the others
+        for (int k = 0; k < p->thread_count; k++)
+        {
+                struct pool_range* r = p->ranges +
+                        (self + k) % p->thread_count;
+
+                for (;;)
+                {
+                        uint64_t b = atomic_fetch_add(&r->next, p->chunk);
+
+                        if (b >= r->end)
+                        {
+                                break;
+                        }
+                        p->fn(p->ctx,
+                              (uint32_t)b,
+                              (uint32_t)MIN(b + p->chunk, r->end));
+                }
+        }
+}
+
+static void* pool_main(void* arg)
+{
+        struct pool_worker* w = arg;
+        struct km_pool* p = w->p;
+        uint64_t seen = 0;
+
+        pthread_mutex_lock(&p->lock);
+        for (;;)
+        {
+                while (p->generation == seen && !p->stop)
+                {
+                        pthread_cond_wait(&p->work, &p->lock);
+                }
+                if (p->stop)
+                {
+                        break;
+                }
+                seen = p->generation;
+                pthread_mutex_unlock(&p->lock);
+
+                pool_work(p, w->id);
+
+                pthread_mutex_lock(&p->lock);
+                if (--p->busy == 0)
+                {
+                        pthread_cond_signal(&p->done);
+                }
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        return NULL;
+}
+
+struct km_pool* km_pool_create(int threads)
+{
+        struct km_pool* p = calloc(1, sizeof(struct km_pool));
+        int started = 0;
+
+        if (!p)
+        {
+                return NULL;
+        }
+
+        p->thread_count = threads < 1 ? plat_cpu_count() : threads;
+        p->threads = calloc((size_t)p->thread_count, sizeof(pthread_t));
+        p->workers = calloc((size_t)p->thread_count,
+                            sizeof(struct pool_worker));
+        p->ranges = aligned_alloc(POOL_CACHE_LINE,
+                                  (size_t)p->thread_count *
+                                  sizeof(struct pool_range));
+        if (!p->threads || !p->workers || !p->ranges)
+        {
+                free(p->threads);
+                free(p->workers);
+                free(p->ranges);
+                free(p);
+                return NULL;
+        }
+
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->work, NULL);
+        pthread_cond_init(&p->done, NULL);
+
+        // Thread 0 is the caller of km_pool_run
+        for (int i = 1; i < p->thread_count; i++)
+        {
+                p->workers[i].p = p;
+                p->workers[i].id = i;
+                if (pthread_create(p->threads + i, NULL,
+                                   pool_main, p->workers + i) != 0)
+                {
+                        break;
+                }
+                started++;
+        }
+
+        if (started != p->thread_count - 1)
+        {
+                // Only join the threads that were started
+                p->thread_count = started + 1;
+                km_pool_free(p);
+                return NULL;
+        }
+
+        return p;
+}
+
+void km_pool_free(struct km_pool* p)
+{
+        if (!p)
+        {
+                return;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->stop = 1;
+        pthread_cond_broadcast(&p->work);
+        pthread_mutex_unlock(&p->lock);
+
+        for (int i = 1; i < p->thread_count; i++)
+        {
+                pthread_join(p->threads[i], NULL);
+        }
+
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->work);
+        pthread_cond_destroy(&p->done);
+        free(p->threads);
+        free(p->workers);
+        free(p->ranges);
+        free(p);
+}
+
+int km_pool_threads(const struct km_pool* p)
+{
+        return p->thread_count;
+}
+
+void km_pool_run(struct km_pool* p,
+                 uint32_t n,
+                 uint32_t chunk,
+                 km_pool_fn fn,
+                 void* ctx)
+{
+        uint64_t per;
+
+        chunk = MAX(chunk, 1);
+
+        if (p->thread_count == 1 || n <= chunk)
+        {
+                for (uint32_t b = 0; b < n; b += MIN(chunk, n - b))
+                {
+                        fn(ctx, b, b + MIN(chunk, n - b));
+                }
+                return;
+        }
+
+        per = ((uint64_t)n + (uint64_t)p->thread_count - 1) /
+                (uint64_t)p->thread_count;
+
+        pthread_mutex_lock(&p->lock);
+        p->fn = fn;
+        p->ctx = ctx;
+        p->chunk = chunk;
+        for (int i = 0; i < p->thread_count; i++)
+        {
+                uint64_t begin = MIN(per * (uint64_t)i, n);
+
+                atomic_store(&p->ranges[i].next, begin);
+                p->ranges[i].end = MIN(begin + per, n);
+        }
+        p->busy = p->thread_count - 1;
+        p->generation++;
+        pthread_cond_broadcast(&p->work);
+        pthread_mutex_unlock(&p->lock);
+
+        pool_work(p, 0);
+
+        pthread_mutex_lock(&p->lock);
+        while (p->busy > 0)
+        {
+                pthread_cond_wait(&p->done, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,71 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#ifndef KM_POOL_H
+#define KM_POOL_H
+
+#include <stdint.h>
+
+struct km_pool;
+
+/**
+ * Work function run by the pool.
+ * @param ctx the user provided context
+ * @param begin the first item to process
+ * @param end one past the last item to process
+ * @return void
+ */
+typedef void (*km_pool_fn)(void* ctx, uint32_t begin, uint32_t end);
+
+/**
+ * Create a pool of persistent worker threads.
+ * @param threads the total number of threads to run jobs on, including
+ *        the thread calling km_pool_run. If less than 1, the number
+ *        of online CPUs is used.
+ * @return the pool, or NULL on failure
+ */
+struct km_pool* km_pool_create(int threads);
+
+/**
+ * Stop all workers and free the pool.
+ * @param p the pool, may be NULL
+ * @return void
+ */
+void km_pool_free(struct km_pool* p);
+
+/**
+ * Get the number of threads jobs are run on.
+ * @param p the pool
+ * @return number of threads, including the calling thread
+ */
+int km_pool_threads(const struct km_pool* p);
+
+/**
+ * Run fn over the items [0, n) and wait for it to complete. The items
+ * are split evenly between the threads, which process their own part
+ * chunk by chunk. A thread that runs out of work steals chunks from
+ * the others. The calling thread takes part in the work.
+ * Must not be called concurrently on the same pool.
+ * @param p the pool
+ * @param n number of items
+ * @param chunk number of items to process per call to fn
+ * @param fn the work function
+ * @param ctx context passed to fn
+ * @return void
+ */
+void km_pool_run(struct km_pool* p,
+                 uint32_t n,
+                 uint32_t chunk,
+                 km_pool_fn fn,
+                 void* ctx);
+
+#endif /* KM_POOL_H */
@@ -0,0 +1,198 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stdlib.h>
+#include <math.h>
+#include "km_sap.h"
+#include "km_phys.h"
+
+#define SAP_MIN_PAIRS 64
+// Not in the active list
+#define SAP_NONE UINT32_MAX
+
+static float endpoint_value(const struct object* objs, uint32_t id)
+{
+        const struct particle* p = &objs[id >> 1].p;
+
+        return id & 1 ? p->p.x + p->rad : p->p.x - p->rad;
+}
+
+// Sorted endpoints move little, each is only shifted a short way
+static uint64_t insertion_sort(struct sap_endpoint* ep, uint32_t n)
+{
+        uint64_t swaps = 0;
+
+        for (uint32_t i = 1; i < n; i++)
+        {
+                struct sap_endpoint e = ep[i];
+                uint32_t j = i;
+
+                while (j > 0 && ep[j - 1].v > e.v)
+                {
+                        ep[j] = ep[j - 1];
+                        j--;
+                }
+                ep[j] = e;
+                swaps += i - j;
+        }
+
+        return swaps;
+}
+
+// Any order, for the first sort. Ties by id, as the stable
+// insertion_sort over the initial ids would leave them.
+static int endpoint_cmp(const void* a, const void* b)
+{
+        const struct sap_endpoint* p = a;
+        const struct sap_endpoint* q = b;
+        int pn = isnan(p->v);
+        int qn = isnan(q->v);
+
+        if (pn != qn)
+        {
+                return pn - qn;
+        }
+        if (!pn && p->v != q->v)
+        {
+                return p->v < q->v ? -1 : 1;
+        }
+        return p->id < q->id ? -1 : (p->id > q->id);
+}
+
+static int overlap_yz(const struct particle* a, const struct particle* b)
+{
+        float r = a->rad + b->rad;
+
+        return fabsf(a->p.y - b->p.y) <= r && fabsf(a->p.z - b->p.z) <= r;
+}
+
+static int add_pair(struct sap* s, uint32_t a, uint32_t b)
+{
+        if (s->pair_count == s->pair_cap)
+        {
+                uint32_t cap = s->pair_cap ? s->pair_cap * 2 : SAP_MIN_PAIRS;
+                struct sap_pair* p = realloc(s->pairs, cap * sizeof(*p));
+
+                if (!p)
+                {
+                        return -1;
+                }
+                s->pairs = p;
+                s->pair_cap = cap;
+        }
+
+        s->pairs[s->pair_count++] = (struct sap_pair){
+                .a = MIN(a, b),
+                .b = MAX(a, b)
+        };
+
+        return 0;
+}
+
+int sap_init(struct sap* s, const struct object* objs, int n)
+{
+        size_t cnt = (size_t)MAX(n, 1);
+
+        *s = (struct sap){0};
+        s->n = (uint32_t)MAX(n, 0);
+        s->ep = malloc(cnt * 2 * sizeof(*s->ep));
+        s->active = malloc(cnt * sizeof(*s->active));
+        s->active_pos = malloc(cnt * sizeof(*s->active_pos));
+        if (!s->ep || !s->active || !s->active_pos)
+        {
+                sap_free(s);
+                return -1;
+        }
+
+        for (uint32_t i = 0; i < s->n * 2; i++)
+        {
+                s->ep[i].id = i;
+                s->ep[i].v = endpoint_value(objs, i);
+        }
+        qsort(s->ep, s->n * 2, sizeof(*s->ep), endpoint_cmp);
+
+        return 0;
+}
+
+void sap_free(struct sap* s)
+{
+        free(s->ep);
+        free(s->pairs);
+        free(s->active);
+        free(s->active_pos);
+        *s = (struct sap){0};
+}
+
+int sap_update(struct sap* s, const struct object* objs)
+{
+        uint32_t count = 0;
+
+        for (uint32_t i = 0; i < s->n * 2; i++)
+        {
+                s->ep[i].v = endpoint_value(objs, s->ep[i].id);
+        }
+        s->swaps = insertion_sort(s->ep, s->n * 2);
+
+        // Sweep along x, each new box is tested against the open ones
+        s->pair_count = 0;
+        for (uint32_t i = 0; i < s->n; i++)
+        {
+                s->active_pos[i] = SAP_NONE;
+        }
+        for (uint32_t i = 0; i < s->n * 2; i++)
+        {
+                uint32_t id = s->ep[i].id;
+                uint32_t o = id >> 1;
+
+                if (!(objs[o].p.rad > 0.0f))
+                {
+                        continue;
+                }
+
+                // A NaN position can leave the end before the start,
+                // such an object is not paired
+                if (id & 1)
+                {
+                        uint32_t pos = s->active_pos[o];
+                        uint32_t last;
+
+                        if (pos == SAP_NONE)
+                        {
+                                continue;
+                        }
+                        last = s->active[--count];
+                        s->active[pos] = last;
+                        s->active_pos[last] = pos;
+                        s->active_pos[o] = SAP_NONE;
+                        continue;
+                }
+                if (s->active_pos[o] != SAP_NONE)
+                {
+                        continue;
+                }
+
+                for (uint32_t k = 0; k < count; k++)
+                {
+                        uint32_t other = s->active[k];
+
+                        if (overlap_yz(&objs[o].p, &objs[other].p) &&
+                            add_pair(s, o, other))
+                        {
+                                return -1;
+                        }
+                }
+                s->active_pos[o] = count;
+                s->active[count++] = o;
+        }
+
+        return (int)s->pair_count;
+}
@@ -0,0 +1,84 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#ifndef KM_SAP_H
+#define KM_SAP_H
+
+#include <stdint.h>
+
+struct object;
+
+/*
+  Sweep and prune broadphase over the objects' bounding spheres. The
+  start and end of each object's box along x are kept sorted. They
+  move little between steps, so insertion sort re-sorts them in close
+  to linear time.
+*/
+struct sap_endpoint
+{
+        float v;
+        // Object index << 1, and 1 for the end of the box
+        uint32_t id;
+};
+
+// Two objects whose boxes overlap, a < b
+struct sap_pair
+{
+        uint32_t a;
+        uint32_t b;
+};
+
+struct sap
+{
+        // 2 * n endpoints, sorted by v
+        struct sap_endpoint* ep;
+        uint32_t n;
+        // Overlapping pairs found by the last sap_update
+        struct sap_pair* pairs;
+        uint32_t pair_count;
+        uint32_t pair_cap;
+        // Objects whose box is open during the sweep, and the position
+        // of each object in it
+        uint32_t* active;
+        uint32_t* active_pos;
+        // Endpoint moves done by the last sap_update's sort
+        uint64_t swaps;
+};
+
+/**
+ * Create the broadphase for a set of objects, the endpoints are
+ * sorted from the objects' current positions.
+ * @param s the broadphase to initialize
+ * @param objs the objects
+ * @param n number of objects
+ * @return 0 on success, -1 on failure
+ */
+int sap_init(struct sap* s, const struct object* objs, int n);
+
+/**
+ * Free the broadphase.
+ * @param s the broadphase
+ * @return void
+ */
+void sap_free(struct sap* s);
+
+/**
+ * Re-sort the endpoints from the objects' positions and find the
+ * pairs whose boxes overlap on all axes. Objects with a radius of 0
+ * are never paired. The pairs are in s->pairs.
+ * @param s the broadphase
+ * @param objs the objects the broadphase was created with
+ * @return the number of pairs, -1 on failure
+ */
+int sap_update(struct sap* s, const struct object* objs);
+
+#endif /* KM_SAP_H */
@@ -18,6 +18,8 @@ typedef void (*animate_fn)(struct entity* e, float dt);
 struct entity
 {
         struct object o;
+        // State before the last physics step, for interpolation
+        struct particle prev;
         struct animation a;
         animate_fn animate;
         struct mesh* surfaces;
@@ -40,6 +42,9 @@ struct scene
         struct camera cam;
         struct entity* entities;
         int entity_count;
+        // How far into the next physics step to render the entities,
+        // between their prev and current state
+        float alpha;
 };
 
 /**
@@ -0,0 +1,474 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "km_spatial.h"
+#include "km_phys.h"
+#include "km_pool.h"
+#include "km_sap.h"
+
+#define SPATIAL_MIN_BUCKETS 16
+#define SPATIAL_MIN_PAIRS 64
+// Cells are clamped to this, to stay well within int32_t
+#define SPATIAL_MAX_CELL 1073741824.0f
+// Bits sorted per radix pass
+#define SPATIAL_RADIX_BITS 8
+#define SPATIAL_RADIX (1u << SPATIAL_RADIX_BITS)
+
+struct build_job
+{
+        struct spatial_hash* h;
+        const struct object* objs;
+        // The pass' input and output pairs, and its digit
+        const uint32_t* src_keys;
+        const uint32_t* src_idx;
+        uint32_t* dst_keys;
+        uint32_t* dst_idx;
+        uint32_t shift;
+};
+
+struct pairs_ctx
+{
+        struct spatial_hash* h;
+        const struct object* objs;
+        uint32_t i;
+        int err;
+};
+
+static int32_t to_cell(float v)
+{
+        float f = floorf(v);
+
+        // Also catches NaN
+        if (!(f > -SPATIAL_MAX_CELL))
+        {
+                f = -SPATIAL_MAX_CELL;
+        }
+        if (f > SPATIAL_MAX_CELL)
+        {
+                f = SPATIAL_MAX_CELL;
+        }
+
+        return (int32_t)f;
+}
+
+static uint32_t cell_bucket(const struct spatial_hash* h,
+                            int32_t cx,
+                            int32_t cy,
+                            int32_t cz)
+{
+        uint32_t k = (uint32_t)cx * 73856093u ^
+                (uint32_t)cy * 19349663u ^
+                (uint32_t)cz * 83492791u;
+
+        k ^= k >> 16;
+        k *= 0x45D9F3Bu;
+        k ^= k >> 16;
+
+        return k & (h->buckets - 1);
+}
+
+// The pairs of a block, [b * n / blocks, (b + 1) * n / blocks)
+static uint32_t block_start(const struct spatial_hash* h, uint32_t b)
+{
+        return (uint32_t)((uint64_t)h->n * b / h->blocks);
+}
+
+static int spatial_reserve(struct spatial_hash* h, uint32_t n, uint32_t blocks)
+{
+        uint32_t cap = MAX(h->cap, SPATIAL_MIN_BUCKETS / 2);
+        uint32_t buckets;
+
+        while (cap < n)
+        {
+                cap *= 2;
+        }
+        buckets = cap * 2;
+
+        if (cap != h->cap)
+        {
+                uint32_t* start = realloc(h->start,
+                                          (buckets + 1) * sizeof(uint32_t));
+                uint32_t* idx = start ?
+                        realloc(h->idx, cap * sizeof(uint32_t)) : NULL;
+                int32_t* cells = idx ?
+                        realloc(h->cells, cap * 3 * sizeof(int32_t)) : NULL;
+                uint32_t* bucket = cells ?
+                        realloc(h->bucket, cap * sizeof(uint32_t)) : NULL;
+                uint32_t* keys = bucket ?
+                        realloc(h->keys, cap * sizeof(uint32_t)) : NULL;
+                uint32_t* tmp_keys = keys ?
+                        realloc(h->tmp_keys, cap * sizeof(uint32_t)) : NULL;
+                uint32_t* tmp_idx = tmp_keys ?
+                        realloc(h->tmp_idx, cap * sizeof(uint32_t)) : NULL;
+
+                // Keep what was reallocated, so free finds it
+                h->start = start ? start : h->start;
+                h->idx = idx ? idx : h->idx;
+                h->cells = cells ? cells : h->cells;
+                h->bucket = bucket ? bucket : h->bucket;
+                h->keys = keys ? keys : h->keys;
+                h->tmp_keys = tmp_keys ? tmp_keys : h->tmp_keys;
+                h->tmp_idx = tmp_idx ? tmp_idx : h->tmp_idx;
+                if (!tmp_idx)
+                {
+                        return -1;
+                }
+                h->cap = cap;
+                h->buckets = buckets;
+        }
+
+        if (blocks != h->blocks)
+        {
+                uint32_t* counts = realloc(h->counts, (size_t)blocks *
+                                           SPATIAL_RADIX * sizeof(uint32_t));
+
+                if (!counts)
+                {
+                        return -1;
+                }
+                h->counts = counts;
+                h->blocks = blocks;
+        }
+
+        return 0;
+}
+
+// Find the cell and bucket of each object, the pairs to sort
+static void build_keys(void* ctx, uint32_t begin, uint32_t end)
+{
+        const struct build_job* job = ctx;
+        struct spatial_hash* h = job->h;
+
+        for (uint32_t b = begin; b < end; b++)
+        {
+                for (uint32_t i = block_start(h, b);
+                     i < block_start(h, b + 1); i++)
+                {
+                        struct vec3 p = job->objs[i].p.p;
+                        int32_t* c = h->cells + (size_t)i * 3;
+
+                        c[0] = to_cell(p.x * h->inv_cell);
+                        c[1] = to_cell(p.y * h->inv_cell);
+                        c[2] = to_cell(p.z * h->inv_cell);
+                        h->bucket[i] = cell_bucket(h, c[0], c[1], c[2]);
+                        job->dst_keys[i] = h->bucket[i];
+                        job->dst_idx[i] = i;
+                }
+        }
+}
+
+// Count the digits of each block's pairs
+static void build_count(void* ctx, uint32_t begin, uint32_t end)
+{
+        const struct build_job* job = ctx;
+        struct spatial_hash* h = job->h;
+
+        for (uint32_t b = begin; b < end; b++)
+        {
+                uint32_t* counts = h->counts + (size_t)b * SPATIAL_RADIX;
+
+                memset(counts, 0, SPATIAL_RADIX * sizeof(uint32_t));
+                for (uint32_t i = block_start(h, b);
+                     i < block_start(h, b + 1); i++)
+                {
+                        counts[(job->src_keys[i] >> job->shift) &
+                               (SPATIAL_RADIX - 1)]++;
+                }
+        }
+}
+
+// Place each pair at its block's next offset for its digit
+static void build_scatter(void* ctx, uint32_t begin, uint32_t end)
+{
+        const struct build_job* job = ctx;
+        struct spatial_hash* h = job->h;
+
+        for (uint32_t b = begin; b < end; b++)
+        {
+                uint32_t* offs = h->counts + (size_t)b * SPATIAL_RADIX;
+
+                for (uint32_t i = block_start(h, b);
+                     i < block_start(h, b + 1); i++)
+                {
+                        uint32_t k = job->src_keys[i];
+                        uint32_t o = offs[(k >> job->shift) &
+                                          (SPATIAL_RADIX - 1)]++;
+
+                        job->dst_keys[o] = k;
+                        job->dst_idx[o] = job->src_idx[i];
+                }
+        }
+}
+
+/*
+ * Each block of the sorted keys writes the start of the buckets whose
+ * first object it holds, and of the empty buckets before them.
+ */
+static void build_starts(void* ctx, uint32_t begin, uint32_t end)
+{
+        const struct build_job* job = ctx;
+        struct spatial_hash* h = job->h;
+
+        for (uint32_t b = begin; b < end; b++)
+        {
+                for (uint32_t i = block_start(h, b);
+                     i < block_start(h, b + 1); i++)
+                {
+                        uint32_t k = h->keys[i];
+                        uint32_t e = i ? h->keys[i - 1] + 1 : 0;
+
+                        for (; e <= k; e++)
+                        {
+                                h->start[e] = i;
+                        }
+                }
+                // The empty buckets after the last object
+                if (b == h->blocks - 1)
+                {
+                        uint32_t e = h->n ? h->keys[h->n - 1] + 1 : 0;
+
+                        for (; e <= h->buckets; e++)
+                        {
+                                h->start[e] = h->n;
+                        }
+                }
+        }
+}
+
+static void build_run(struct km_pool* pool,
+                      struct build_job* job,
+                      km_pool_fn fn)
+{
+        if (pool)
+        {
+                km_pool_run(pool, job->h->blocks, 1, fn, job);
+        }
+        else
+        {
+                fn(job, 0, job->h->blocks);
+        }
+}
+
+void spatial_hash_init(struct spatial_hash* h)
+{
+        memset(h, 0, sizeof(*h));
+}
+
+void spatial_hash_free(struct spatial_hash* h)
+{
+        free(h->start);
+        free(h->idx);
+        free(h->cells);
+        free(h->bucket);
+        free(h->keys);
+        free(h->tmp_keys);
+        free(h->tmp_idx);
+        free(h->counts);
+        free(h->pairs);
+        memset(h, 0, sizeof(*h));
+}
+
+int spatial_hash_build(struct spatial_hash* h,
+                       const struct object* objs,
+                       int n,
+                       struct km_pool* pool)
+{
+        struct build_job job = { .h = h, .objs = objs };
+        uint32_t blocks = pool ? (uint32_t)km_pool_threads(pool) : 1;
+        uint32_t passes = 0;
+        float max_rad = 0.0f;
+
+        n = MAX(n, 0);
+        if (spatial_reserve(h, (uint32_t)n, blocks))
+        {
+                return -1;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+                max_rad = MAX(max_rad, objs[i].p.rad);
+        }
+        h->max_rad = max_rad;
+        h->cell = max_rad > 0.0f ? 2.0f * max_rad : 1.0f;
+        h->inv_cell = 1.0f / h->cell;
+        h->n = (uint32_t)n;
+
+        while (((uint64_t)1 << (passes * SPATIAL_RADIX_BITS)) < h->buckets)
+        {
+                passes++;
+        }
+
+        // Start in the buffers that leave the result in keys and idx
+        job.dst_keys = passes % 2 ? h->tmp_keys : h->keys;
+        job.dst_idx = passes % 2 ? h->tmp_idx : h->idx;
+        build_run(pool, &job, build_keys);
+
+        // Stable LSD radix sort on the bucket, the objects of a bucket
+        // stay in object order. The result is the same for any number
+        // of blocks.
+        for (uint32_t p = 0; p < passes; p++)
+        {
+                uint32_t off = 0;
+
+                job.src_keys = job.dst_keys;
+                job.src_idx = job.dst_idx;
+                job.dst_keys = job.src_keys == h->keys ? h->tmp_keys : h->keys;
+                job.dst_idx = job.src_idx == h->idx ? h->tmp_idx : h->idx;
+                job.shift = p * SPATIAL_RADIX_BITS;
+
+                build_run(pool, &job, build_count);
+                // Digit by digit, each block's offset. Only
+                // SPATIAL_RADIX * blocks counts, whatever the size.
+                for (uint32_t d = 0; d < SPATIAL_RADIX; d++)
+                {
+                        for (uint32_t b = 0; b < blocks; b++)
+                        {
+                                uint32_t* c = h->counts +
+                                        (size_t)b * SPATIAL_RADIX + d;
+                                uint32_t cnt = *c;
+
+                                *c = off;
+                                off += cnt;
+                        }
+                }
+                build_run(pool, &job, build_scatter);
+        }
+
+        build_run(pool, &job, build_starts);
+
+        return 0;
+}
+
+static int same_cell(const int32_t* c, int32_t cx, int32_t cy, int32_t cz)
+{
+        return c[0] == cx && c[1] == cy && c[2] == cz;
+}
+
+static int within(const struct object* o, struct vec3 p, float r)
+{
+        struct vec3 d = vec3_sub(o->p.p, p);
+        float lim = r + o->p.rad;
+
+        return vec3_dot(d, d) <= lim * lim;
+}
+
+void spatial_hash_query(const struct spatial_hash* h,
+                        const struct object* objs,
+                        struct vec3 p,
+                        float r,
+                        spatial_hash_fn fn,
+                        void* ctx)
+{
+        float reach = r + h->max_rad;
+        int32_t x0 = to_cell((p.x - reach) * h->inv_cell);
+        int32_t x1 = to_cell((p.x + reach) * h->inv_cell);
+        int32_t y0 = to_cell((p.y - reach) * h->inv_cell);
+        int32_t y1 = to_cell((p.y + reach) * h->inv_cell);
+        int32_t z0 = to_cell((p.z - reach) * h->inv_cell);
+        int32_t z1 = to_cell((p.z + reach) * h->inv_cell);
+        uint64_t cells = (uint64_t)((int64_t)x1 - x0 + 1) *
+                (uint64_t)((int64_t)y1 - y0 + 1) *
+                (uint64_t)((int64_t)z1 - z0 + 1);
+
+        if (h->n == 0 || !(r >= 0.0f))
+        {
+                return;
+        }
+
+        // A query larger than the scene, test every object instead
+        if (cells > h->n)
+        {
+                for (uint32_t i = 0; i < h->n; i++)
+                {
+                        if (within(objs + i, p, r))
+                        {
+                                fn(ctx, i);
+                        }
+                }
+                return;
+        }
+
+        for (int32_t cz = z0; cz <= z1; cz++)
+        {
+                for (int32_t cy = y0; cy <= y1; cy++)
+                {
+                        for (int32_t cx = x0; cx <= x1; cx++)
+                        {
+                                uint32_t b = cell_bucket(h, cx, cy, cz);
+
+                                for (uint32_t k = h->start[b];
+                                     k < h->start[b + 1]; k++)
+                                {
+                                        uint32_t i = h->idx[k];
+
+                                        // Other cells share the bucket
+                                        if (same_cell(h->cells + i * 3,
+                                                      cx, cy, cz) &&
+                                            within(objs + i, p, r))
+                                        {
+                                                fn(ctx, i);
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+static void pair_found(void* ctx, uint32_t j)
+{
+        struct pairs_ctx* pc = ctx;
+        struct spatial_hash* h = pc->h;
+
+        if (j <= pc->i || !(pc->objs[j].p.rad > 0.0f) || pc->err)
+        {
+                return;
+        }
+
+        if (h->pair_count == h->pair_cap)
+        {
+                uint32_t cap = h->pair_cap ? h->pair_cap * 2 :
+                        SPATIAL_MIN_PAIRS;
+                struct sap_pair* p = realloc(h->pairs, cap * sizeof(*p));
+
+                if (!p)
+                {
+                        pc->err = 1;
+                        return;
+                }
+                h->pairs = p;
+                h->pair_cap = cap;
+        }
+        h->pairs[h->pair_count++] = (struct sap_pair){ .a = pc->i, .b = j };
+}
+
+int spatial_hash_pairs(struct spatial_hash* h, const struct object* objs)
+{
+        struct pairs_ctx pc = { .h = h, .objs = objs };
+
+        h->pair_count = 0;
+        for (uint32_t i = 0; i < h->n && !pc.err; i++)
+        {
+                const struct particle* p = &objs[i].p;
+
+                if (!(p->rad > 0.0f))
+                {
+                        continue;
+                }
+                pc.i = i;
+                spatial_hash_query(h, objs, p->p, p->rad, pair_found, &pc);
+        }
+
+        return pc.err ? -1 : (int)h->pair_count;
+}
@@ -0,0 +1,128 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#ifndef KM_SPATIAL_H
+#define KM_SPATIAL_H
+
+#include <stdint.h>
+#include "km_math.h"
+
+struct object;
+struct km_pool;
+struct sap_pair;
+
+/*
+  Uniform grid over the objects' positions, with cubic cells twice the
+  largest radius. The cells are hashed into a table of buckets, and
+  rebuilt each step with a radix sort of the (bucket, object) pairs, so
+  the objects of a bucket are next to each other in one array.
+*/
+struct spatial_hash
+{
+        // Side of a cell, and 1 / cell
+        float cell;
+        float inv_cell;
+        // Largest radius of the hashed objects
+        float max_rad;
+        // Number of buckets, a power of two
+        uint32_t buckets;
+        // Number of hashed objects
+        uint32_t n;
+        // The objects in bucket b are idx[start[b]] to
+        // idx[start[b + 1] - 1], in increasing order
+        uint32_t* start;
+        uint32_t* idx;
+        // Cell, 3 per object, and bucket of each object
+        int32_t* cells;
+        uint32_t* bucket;
+        // Sort buffers for the build: the bucket of each idx entry,
+        // and a second set of keys and indices to sort into
+        uint32_t* keys;
+        uint32_t* tmp_keys;
+        uint32_t* tmp_idx;
+        // Per digit counts of each block of pairs, for the build
+        uint32_t* counts;
+        uint32_t blocks;
+        // Number of objects the arrays have room for
+        uint32_t cap;
+        // Pairs found by spatial_hash_pairs, a < b
+        struct sap_pair* pairs;
+        uint32_t pair_count;
+        uint32_t pair_cap;
+};
+
+/**
+ * Callback invoked for each object found by a query.
+ * @param ctx the user provided context
+ * @param i the index of the object
+ * @return void
+ */
+typedef void (*spatial_hash_fn)(void* ctx, uint32_t i);
+
+/**
+ * Initialize an empty spatial hash.
+ * @param h the hash to initialize
+ * @return void
+ */
+void spatial_hash_init(struct spatial_hash* h);
+
+/**
+ * Free the hash's arrays.
+ * @param h the hash
+ * @return void
+ */
+void spatial_hash_free(struct spatial_hash* h);
+
+/**
+ * Hash all objects from their current positions. The arrays are grown
+ * as needed. The result is the same with or without a pool, and for
+ * any number of threads.
+ * @param h the hash
+ * @param objs the objects
+ * @param n number of objects
+ * @param pool split the work over the pool's threads, may be NULL
+ * @return 0 on success, -1 on failure
+ */
+int spatial_hash_build(struct spatial_hash* h,
+                       const struct object* objs,
+                       int n,
+                       struct km_pool* pool);
+
+/**
+ * Find the objects whose bounding sphere is within r of a point,
+ * i.e. |o.p - p| <= r + o.rad. Each object is reported once.
+ * @param h the hash, built from objs
+ * @param objs the objects
+ * @param p the point
+ * @param r the distance
+ * @param fn called for each object found
+ * @param ctx context passed to fn
+ * @return void
+ */
+void spatial_hash_query(const struct spatial_hash* h,
+                        const struct object* objs,
+                        struct vec3 p,
+                        float r,
+                        spatial_hash_fn fn,
+                        void* ctx);
+
+/**
+ * Find the pairs of objects whose bounding spheres touch or overlap,
+ * as input to collide_pairs. Objects with a radius of 0 are never
+ * paired. The pairs are in h->pairs, ordered by a.
+ * @param h the hash, built from objs
+ * @param objs the objects
+ * @return the number of pairs, -1 on failure
+ */
+int spatial_hash_pairs(struct spatial_hash* h, const struct object* objs);
+
+#endif /* KM_SPATIAL_H */
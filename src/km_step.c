@@ -0,0 +1,82 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <math.h>
+#include "km_step.h"
+#include "km_phys.h"
+
+int stepper_init(struct stepper* s, float dt, int max_steps)
+{
+        *s = (struct stepper){0};
+
+        if (!(dt > 0.0f) || max_steps < 1)
+        {
+                return -1;
+        }
+
+        s->dt_ns = llroundf(dt * 1e9f);
+        s->max_steps = max_steps;
+
+        return s->dt_ns > 0 ? 0 : -1;
+}
+
+int stepper_advance(struct stepper* s, int64_t elapsed_ns)
+{
+        int64_t n;
+
+        if (elapsed_ns > 0)
+        {
+                s->acc_ns += elapsed_ns;
+        }
+
+        n = s->acc_ns / s->dt_ns;
+        s->acc_ns -= n * s->dt_ns;
+        if (n > s->max_steps)
+        {
+                // Spiral of death, drop the time that can't be caught up
+                s->dropped_ns += (n - s->max_steps) * s->dt_ns;
+                s->capped_frames++;
+                n = s->max_steps;
+        }
+
+        s->frames++;
+        s->steps += (uint64_t)n;
+        if (n > s->peak_steps)
+        {
+                s->peak_steps = (int)n;
+        }
+
+        return (int)n;
+}
+
+float stepper_alpha(const struct stepper* s)
+{
+        return (float)((double)s->acc_ns / (double)s->dt_ns);
+}
+
+static float lerp(float a, float b, float t)
+{
+        return a + (b - a) * t;
+}
+
+void particle_interpolate(struct particle* out,
+                          const struct particle* prev,
+                          const struct particle* cur,
+                          float alpha)
+{
+        *out = *cur;
+        for (int i = 0; i < 3; i++)
+        {
+                out->p.a[i] = lerp(prev->p.a[i], cur->p.a[i], alpha);
+                out->r.a[i] = lerp(prev->r.a[i], cur->r.a[i], alpha);
+        }
+}
@@ -0,0 +1,88 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#ifndef KM_STEP_H
+#define KM_STEP_H
+
+#include <stdint.h>
+
+struct particle;
+
+/*
+  Runs the physics at a fixed time step, independent of the frame
+  rate. Each frame adds the elapsed time to an accumulator and runs
+  as many whole steps as fit in it. The time left over is used to
+  interpolate between the last two physics states when rendering.
+*/
+struct stepper
+{
+        // The fixed time step, in nano seconds
+        int64_t dt_ns;
+        // Time not yet simulated, less than dt_ns after each frame
+        int64_t acc_ns;
+        // Most steps to run in one frame, to let a slow frame catch
+        // up without each frame taking longer than the last
+        int max_steps;
+        // Number of frames and steps run
+        uint64_t frames;
+        uint64_t steps;
+        // Frames that needed more than max_steps steps, and the time
+        // that was dropped for them
+        uint64_t capped_frames;
+        int64_t dropped_ns;
+        // Most steps run in a single frame
+        int peak_steps;
+};
+
+/**
+ * Initialize a stepper, with nothing accumulated.
+ * @param s the stepper
+ * @param dt the fixed time step, in seconds
+ * @param max_steps most steps to run per frame, at least 1
+ * @return 0 on success, -1 if dt or max_steps is not positive
+ */
+int stepper_init(struct stepper* s, float dt, int max_steps);
+
+/**
+ * Add the time elapsed since the last frame and get the number of
+ * fixed steps to run. If more than max_steps would be needed, the
+ * time for the extra steps is dropped and the frame is counted as
+ * capped.
+ * @param s the stepper
+ * @param elapsed_ns time since the last frame, in nano seconds
+ * @return the number of steps to run, 0 to max_steps
+ */
+int stepper_advance(struct stepper* s, int64_t elapsed_ns);
+
+/**
+ * Get how far the accumulated time is into the next step.
+ * @param s the stepper
+ * @return the interpolation factor between the previous and the
+ *         current physics state, 0 <= alpha < 1
+ */
+float stepper_alpha(const struct stepper* s);
+
+/**
+ * Interpolate the position and rotation of a particle, other members
+ * are taken from the current state.
+ * @param out the interpolated particle
+ * @param prev the state before the last step
+ * @param cur the state after the last step
+ * @param alpha the interpolation factor, 0 gives prev, 1 gives cur
+ * @return void
+ */
+void particle_interpolate(struct particle* out,
+                          const struct particle* prev,
+                          const struct particle* cur,
+                          float alpha);
+
+#endif /* KM_STEP_H */
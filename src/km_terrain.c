@@ -0,0 +1,348 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stdlib.h>
+#include <math.h>
+#include "km_terrain.h"
+#include "km_geom.h"
+
+#define TERRAIN_MIN_CAP 16
+// Cells are clamped to this, to stay well within int32_t
+#define TERRAIN_MAX_CELL 1073741824.0f
+
+static uint32_t cell_hash(int32_t cx, int32_t cz)
+{
+        uint64_t k = ((uint64_t)(uint32_t)cx << 32) | (uint32_t)cz;
+
+        k *= 0x9E3779B97F4A7C15ull;
+
+        return (uint32_t)(k >> 32);
+}
+
+// The slot holding the cell, or the empty slot it would go in
+static uint32_t find_slot(const struct terrain_chunk* slots,
+                          uint32_t cap,
+                          int32_t cx,
+                          int32_t cz)
+{
+        uint32_t mask = cap - 1;
+        uint32_t i = cell_hash(cx, cz) & mask;
+
+        while (slots[i].m && (slots[i].cx != cx || slots[i].cz != cz))
+        {
+                i = (i + 1) & mask;
+        }
+
+        return i;
+}
+
+static int terrain_grow(struct terrain* t)
+{
+        uint32_t cap = t->cap * 2;
+        struct terrain_chunk* slots = calloc(cap, sizeof(*slots));
+
+        if (!slots)
+        {
+                return -1;
+        }
+
+        for (uint32_t i = 0; i < t->cap; i++)
+        {
+                const struct terrain_chunk* c = t->slots + i;
+
+                if (c->m)
+                {
+                        slots[find_slot(slots, cap, c->cx, c->cz)] = *c;
+                }
+        }
+
+        free(t->slots);
+        t->slots = slots;
+        t->cap = cap;
+
+        return 0;
+}
+
+static int32_t to_cell(float v)
+{
+        float f = floorf(v);
+
+        // Also catches NaN
+        if (!(f > -TERRAIN_MAX_CELL))
+        {
+                f = -TERRAIN_MAX_CELL;
+        }
+        if (f > TERRAIN_MAX_CELL)
+        {
+                f = TERRAIN_MAX_CELL;
+        }
+
+        return (int32_t)f;
+}
+
+int terrain_init(struct terrain* t, float chunk_size)
+{
+        if (!(chunk_size > 0.0f))
+        {
+                return -1;
+        }
+
+        t->chunk_size = chunk_size;
+        t->inv_size = 1.0f / chunk_size;
+        t->cap = TERRAIN_MIN_CAP;
+        t->count = 0;
+        t->slots = calloc(t->cap, sizeof(*t->slots));
+
+        return t->slots ? 0 : -1;
+}
+
+void terrain_free(struct terrain* t)
+{
+        free(t->slots);
+        t->slots = NULL;
+        t->cap = 0;
+        t->count = 0;
+}
+
+void terrain_cell(const struct terrain* t,
+                  struct vec3 p,
+                  int32_t* cx,
+                  int32_t* cz)
+{
+        *cx = to_cell(p.x * t->inv_size);
+        *cz = to_cell(p.z * t->inv_size);
+}
+
+int terrain_add(struct terrain* t, int32_t cx, int32_t cz, struct mesh* m)
+{
+        uint32_t i;
+
+        if (!m)
+        {
+                return -1;
+        }
+
+        // Keep the load at most 1/2
+        if ((t->count + 1) * 2 > t->cap && terrain_grow(t))
+        {
+                return -1;
+        }
+
+        i = find_slot(t->slots, t->cap, cx, cz);
+        if (!t->slots[i].m)
+        {
+                t->count++;
+        }
+        t->slots[i] = (struct terrain_chunk){ .cx = cx, .cz = cz, .m = m };
+
+        return 0;
+}
+
+struct mesh* terrain_remove(struct terrain* t, int32_t cx, int32_t cz)
+{
+        uint32_t mask = t->cap - 1;
+        uint32_t i = find_slot(t->slots, t->cap, cx, cz);
+        uint32_t j = i;
+        struct mesh* m = t->slots[i].m;
+
+        if (!m)
+        {
+                return NULL;
+        }
+
+        t->slots[i].m = NULL;
+        t->count--;
+
+        // Shift back the chunks after the hole that would no longer
+        // be found from their home slot, so no tombstones are needed
+        for (;;)
+        {
+                uint32_t k;
+
+                j = (j + 1) & mask;
+                if (!t->slots[j].m)
+                {
+                        break;
+                }
+
+                k = cell_hash(t->slots[j].cx, t->slots[j].cz) & mask;
+                // Stay if the home slot k is cyclically in (i, j]
+                if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                {
+                        continue;
+                }
+
+                t->slots[i] = t->slots[j];
+                t->slots[j].m = NULL;
+                i = j;
+        }
+
+        return m;
+}
+
+struct mesh* terrain_get(const struct terrain* t, int32_t cx, int32_t cz)
+{
+        return t->slots[find_slot(t->slots, t->cap, cx, cz)].m;
+}
+
+void terrain_query_seg(const struct terrain* t,
+                       struct vec3 o,
+                       struct vec3 d,
+                       terrain_chunk_fn fn,
+                       void* ctx)
+{
+        terrain_query_sweep(t, o, d, 0.0f, fn, ctx);
+}
+
+/*
+ * The cells whose chunks a sphere, grown by pad, may touch while its
+ * center moves along o + d * t for ta <= t <= tb.
+ */
+struct cell_rect
+{
+        int32_t x0;
+        int32_t x1;
+        int32_t z0;
+        int32_t z1;
+};
+
+static void sweep_rect(const struct terrain* t,
+                       struct vec3 o,
+                       struct vec3 d,
+                       float pad,
+                       float ta,
+                       float tb,
+                       struct cell_rect* r)
+{
+        float xa = o.x + d.x * ta;
+        float xb = o.x + d.x * tb;
+        float za = o.z + d.z * ta;
+        float zb = o.z + d.z * tb;
+
+        r->x0 = to_cell((MIN(xa, xb) - pad) * t->inv_size);
+        r->x1 = to_cell((MAX(xa, xb) + pad) * t->inv_size);
+        r->z0 = to_cell((MIN(za, zb) - pad) * t->inv_size);
+        r->z1 = to_cell((MAX(za, zb) + pad) * t->inv_size);
+}
+
+static int in_rect(const struct cell_rect* r, int32_t cx, int32_t cz)
+{
+        return cx >= r->x0 && cx <= r->x1 && cz >= r->z0 && cz <= r->z1;
+}
+
+// Where o + d * t leaves cell c along one axis, INFINITY if never
+static float cell_exit(const struct terrain* t, float o, float d, int32_t c)
+{
+        if (d > 0.0f)
+        {
+                return (((float)c + 1.0f) * t->chunk_size - o) / d;
+        }
+        if (d < 0.0f)
+        {
+                return ((float)c * t->chunk_size - o) / d;
+        }
+        return INFINITY;
+}
+
+void terrain_query_sweep(const struct terrain* t,
+                         struct vec3 o,
+                         struct vec3 d,
+                         float r,
+                         terrain_chunk_fn fn,
+                         void* ctx)
+{
+        // Chunks share their edges, visit the neighbour when the
+        // segment touches an edge
+        float pad = MAX_CONTACT_DIST + r;
+        float t_max = 1.0f;
+        float t_in = 0.0f;
+        int32_t x0 = to_cell((MIN(o.x, o.x + d.x) - pad) * t->inv_size);
+        int32_t x1 = to_cell((MAX(o.x, o.x + d.x) + pad) * t->inv_size);
+        int32_t z0 = to_cell((MIN(o.z, o.z + d.z) - pad) * t->inv_size);
+        int32_t z1 = to_cell((MAX(o.z, o.z + d.z) + pad) * t->inv_size);
+        int32_t cx = to_cell(o.x * t->inv_size);
+        int32_t cz = to_cell(o.z * t->inv_size);
+        uint64_t cells = (uint64_t)((int64_t)x1 - x0 + 1) *
+                (uint64_t)((int64_t)z1 - z0 + 1);
+        // Each step crosses a cell edge in x or z
+        uint64_t steps = (uint64_t)((int64_t)x1 - x0 + 1) +
+                (uint64_t)((int64_t)z1 - z0 + 1);
+        // Empty
+        struct cell_rect prev = { 1, 0, 1, 0 };
+        struct cell_rect cur;
+
+        if (t->count == 0)
+        {
+                return;
+        }
+
+        // A long segment over few chunks, scan the chunks instead
+        if (cells > t->count)
+        {
+                for (uint32_t i = 0; i < t->cap; i++)
+                {
+                        const struct terrain_chunk* c = t->slots + i;
+
+                        if (c->m &&
+                            c->cx >= x0 && c->cx <= x1 &&
+                            c->cz >= z0 && c->cz <= z1)
+                        {
+                                fn(ctx, c->m, &t_max);
+                        }
+                }
+                return;
+        }
+
+        // Walk the cells along d, visiting the chunks the sphere may
+        // touch during each cell's part of the segment. Those not seen
+        // in the previous part are first reached in this one, so the
+        // walk ends when the part starts after the closest hit.
+        for (uint64_t s = 0; s <= steps && t_in <= t_max; s++)
+        {
+                float tx = cell_exit(t, o.x, d.x, cx);
+                float tz = cell_exit(t, o.z, d.z, cz);
+                float t_out = MAX(MIN(MIN(tx, tz), 1.0f), t_in);
+
+                sweep_rect(t, o, d, pad, t_in, t_out, &cur);
+                // Nearest the start first
+                for (int32_t j = 0; j <= cur.z1 - cur.z0; j++)
+                {
+                        int32_t z = d.z < 0.0f ? cur.z1 - j : cur.z0 + j;
+
+                        for (int32_t i = 0; i <= cur.x1 - cur.x0; i++)
+                        {
+                                int32_t x = d.x < 0.0f ?
+                                        cur.x1 - i : cur.x0 + i;
+                                struct mesh* m;
+
+                                if (in_rect(&prev, x, z))
+                                {
+                                        continue;
+                                }
+                                m = terrain_get(t, x, z);
+                                if (m)
+                                {
+                                        fn(ctx, m, &t_max);
+                                }
+                        }
+                }
+                prev = cur;
+
+                if (!(t_out < 1.0f))
+                {
+                        break;
+                }
+                cx += tx <= t_out ? (d.x > 0.0f ? 1 : -1) : 0;
+                cz += tz <= t_out ? (d.z > 0.0f ? 1 : -1) : 0;
+                t_in = t_out;
+        }
+}
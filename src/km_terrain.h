@@ -0,0 +1,157 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#ifndef KM_TERRAIN_H
+#define KM_TERRAIN_H
+
+#include <stdint.h>
+#include "km_math.h"
+
+struct mesh;
+
+/*
+  Terrain split into square chunks of chunk_size x chunk_size in the
+  XZ plane. Chunk (cx, cz) covers x in [cx, cx + 1) * chunk_size and
+  z in [cz, cz + 1) * chunk_size, in any height. The chunks are kept
+  in an open addressing hash table keyed by the cell, so a query only
+  looks at the cells it overlaps, however large the terrain is.
+*/
+struct terrain_chunk
+{
+        int32_t cx;
+        int32_t cz;
+        // NULL for an empty slot
+        struct mesh* m;
+};
+
+struct terrain
+{
+        float chunk_size;
+        // 1 / chunk_size
+        float inv_size;
+        // Hash table, cap is a power of two
+        struct terrain_chunk* slots;
+        uint32_t cap;
+        // Number of chunks
+        uint32_t count;
+};
+
+/**
+ * Callback invoked for each chunk a query overlaps.
+ * @param ctx the user provided context
+ * @param m the chunk's mesh
+ * @param t_max the current end of the query segment. The callback
+ *        may shorten it when a closer hit is found, chunks first
+ *        reached after it are then not visited.
+ * @return void
+ */
+typedef void (*terrain_chunk_fn)(void* ctx, struct mesh* m, float* t_max);
+
+/**
+ * Initialize an empty terrain.
+ * @param t the terrain to initialize
+ * @param chunk_size the side of a chunk, in meters
+ * @return 0 on success, -1 on failure
+ */
+int terrain_init(struct terrain* t, float chunk_size);
+
+/**
+ * Free the terrain's table. The chunks' meshes are not freed.
+ * @param t the terrain
+ * @return void
+ */
+void terrain_free(struct terrain* t);
+
+/**
+ * Get the cell a position is in.
+ * @param t the terrain
+ * @param p the position
+ * @param cx set to the cell's x
+ * @param cz set to the cell's z
+ * @return void
+ */
+void terrain_cell(const struct terrain* t,
+                  struct vec3 p,
+                  int32_t* cx,
+                  int32_t* cz);
+
+/**
+ * Add a chunk, or replace the mesh of an existing one. The mesh is
+ * not copied, and must stay valid until it is removed. Its vertices
+ * should be within the chunk's cell, chunks that stick out of their
+ * cell may be missed by queries.
+ * @param t the terrain
+ * @param cx the chunk's cell x
+ * @param cz the chunk's cell z
+ * @param m the chunk's mesh
+ * @return 0 on success, -1 on failure
+ */
+int terrain_add(struct terrain* t, int32_t cx, int32_t cz, struct mesh* m);
+
+/**
+ * Remove a chunk. Objects in contact with the chunk must be woken
+ * (see active_set_wake_mesh) before the mesh is freed.
+ * @param t the terrain
+ * @param cx the chunk's cell x
+ * @param cz the chunk's cell z
+ * @return the chunk's mesh, or NULL if there was no such chunk
+ */
+struct mesh* terrain_remove(struct terrain* t, int32_t cx, int32_t cz);
+
+/**
+ * Get a chunk.
+ * @param t the terrain
+ * @param cx the chunk's cell x
+ * @param cz the chunk's cell z
+ * @return the chunk's mesh, or NULL if there is no such chunk
+ */
+struct mesh* terrain_get(const struct terrain* t, int32_t cx, int32_t cz);
+
+/**
+ * Visit the chunks the segment o + d * t, 0 <= t <= 1, may hit, i.e.
+ * the chunks in the cells its XZ bounding box overlaps.
+ * @param t the terrain
+ * @param o the start of the segment
+ * @param d the segment
+ * @param fn the callback
+ * @param ctx passed to the callback
+ * @return void
+ */
+void terrain_query_seg(const struct terrain* t,
+                       struct vec3 o,
+                       struct vec3 d,
+                       terrain_chunk_fn fn,
+                       void* ctx);
+
+/**
+ * Visit the chunks a sphere of radius r, with its center swept along
+ * the segment o + d * t, 0 <= t <= 1, may touch. The cells are walked
+ * along d, so the chunks are visited roughly in the order the sphere
+ * reaches them, and the walk stops at the callback's t_max. A segment
+ * spanning more cells than there are chunks tests every chunk in its
+ * XZ bounding box, grown by r, instead.
+ * @param t the terrain
+ * @param o the start of the segment
+ * @param d the segment
+ * @param r the sphere's radius, 0 is the same as terrain_query_seg
+ * @param fn the callback
+ * @param ctx passed to the callback
+ * @return void
+ */
+void terrain_query_sweep(const struct terrain* t,
+                         struct vec3 o,
+                         struct vec3 d,
+                         float r,
+                         terrain_chunk_fn fn,
+                         void* ctx);
+
+#endif /* KM_TERRAIN_H */
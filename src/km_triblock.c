@@ -0,0 +1,414 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <math.h>
+#include "km_triblock.h"
+#include "km_phys.h"
+
+#if defined(__x86_64__)
+# include <immintrin.h>
+# define TRI_BLOCK_SSE 1
+# if defined(__GNUC__)
+#  define TRI_BLOCK_AVX2 1
+# endif
+#elif defined(__aarch64__)
+# include <arm_neon.h>
+# define TRI_BLOCK_NEON 1
+#endif
+
+/*
+  All kernels perform the same operations as ray_tri_intersect, in the
+  same order and without fused multiply-adds, so every lane gets the
+  exact same result as the scalar code. A lane is rejected when any of
+  the scalar code's early outs would have been taken.
+*/
+
+// Same epsilon as ray_tri_intersect
+#define TRI_EPS 1e-6f
+
+typedef unsigned int (*tri_block_fn)(const struct tri_block* b,
+                                     const struct particle* r,
+                                     float* t);
+
+static unsigned int block_scalar(const struct tri_block* b,
+                                 const struct particle* r,
+                                 float* t)
+{
+        unsigned int hits = 0;
+
+        for (int i = 0; i < TRI_BLOCK_SIZE; i++)
+        {
+                float px = r->v.y * b->e2z[i] - r->v.z * b->e2y[i];
+                float py = r->v.z * b->e2x[i] - r->v.x * b->e2z[i];
+                float pz = r->v.x * b->e2y[i] - r->v.y * b->e2x[i];
+                float f = b->e1x[i] * px + b->e1y[i] * py + b->e1z[i] * pz;
+                float inv;
+                float sx;
+                float sy;
+                float sz;
+                float u;
+                float v;
+                float qx;
+                float qy;
+                float qz;
+
+                if (fabsf(f) < TRI_EPS)
+                {
+                        continue;
+                }
+
+                inv = 1.0f / f;
+                sx = r->p.x - b->v0x[i];
+                sy = r->p.y - b->v0y[i];
+                sz = r->p.z - b->v0z[i];
+                u = inv * (sx * px + sy * py + sz * pz);
+                if (u < 0.0f || u > 1.0f)
+                {
+                        continue;
+                }
+
+                qx = sy * b->e1z[i] - sz * b->e1y[i];
+                qy = sz * b->e1x[i] - sx * b->e1z[i];
+                qz = sx * b->e1y[i] - sy * b->e1x[i];
+                v = inv * (r->v.x * qx + r->v.y * qy + r->v.z * qz);
+                if (v < 0.0f || u + v > 1.0f)
+                {
+                        continue;
+                }
+
+                t[i] = inv * (b->e2x[i] * qx + b->e2y[i] * qy + b->e2z[i] * qz);
+                if (t[i] < TRI_EPS)
+                {
+                        continue;
+                }
+
+                hits |= 1u << i;
+        }
+
+        return hits;
+}
+
+#ifdef TRI_BLOCK_SSE
+/*
+ * Four lanes starting at lane o.
+ */
+static unsigned int block_sse4(const struct tri_block* b,
+                               const struct particle* r,
+                               int o,
+                               float* t)
+{
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 eps = _mm_set1_ps(TRI_EPS);
+        const __m128 sign = _mm_set1_ps(-0.0f);
+        __m128 ox = _mm_set1_ps(r->p.x);
+        __m128 oy = _mm_set1_ps(r->p.y);
+        __m128 oz = _mm_set1_ps(r->p.z);
+        __m128 dx = _mm_set1_ps(r->v.x);
+        __m128 dy = _mm_set1_ps(r->v.y);
+        __m128 dz = _mm_set1_ps(r->v.z);
+        __m128 e1x = _mm_load_ps(b->e1x + o);
+        __m128 e1y = _mm_load_ps(b->e1y + o);
+        __m128 e1z = _mm_load_ps(b->e1z + o);
+        __m128 e2x = _mm_load_ps(b->e2x + o);
+        __m128 e2y = _mm_load_ps(b->e2y + o);
+        __m128 e2z = _mm_load_ps(b->e2z + o);
+        __m128 px, py, pz, f, inv, sx, sy, sz, u, v, qx, qy, qz, tt, miss;
+
+        // p = d x e2
+        px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        f = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+                       _mm_mul_ps(e1z, pz));
+        miss = _mm_cmplt_ps(_mm_andnot_ps(sign, f), eps);
+
+        inv = _mm_div_ps(one, f);
+        sx = _mm_sub_ps(ox, _mm_load_ps(b->v0x + o));
+        sy = _mm_sub_ps(oy, _mm_load_ps(b->v0y + o));
+        sz = _mm_sub_ps(oz, _mm_load_ps(b->v0z + o));
+        u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)),
+                       _mm_mul_ps(sz, pz));
+        u = _mm_mul_ps(inv, u);
+        miss = _mm_or_ps(miss, _mm_cmplt_ps(u, zero));
+        miss = _mm_or_ps(miss, _mm_cmpgt_ps(u, one));
+
+        // q = s x e1
+        qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                       _mm_mul_ps(dz, qz));
+        v = _mm_mul_ps(inv, v);
+        miss = _mm_or_ps(miss, _mm_cmplt_ps(v, zero));
+        miss = _mm_or_ps(miss, _mm_cmpgt_ps(_mm_add_ps(u, v), one));
+
+        tt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                        _mm_mul_ps(e2z, qz));
+        tt = _mm_mul_ps(inv, tt);
+        miss = _mm_or_ps(miss, _mm_cmplt_ps(tt, eps));
+
+        _mm_storeu_ps(t + o, tt);
+
+        return ~(unsigned int)_mm_movemask_ps(miss) & 0xfu;
+}
+
+static unsigned int block_sse(const struct tri_block* b,
+                              const struct particle* r,
+                              float* t)
+{
+        return block_sse4(b, r, 0, t) | (block_sse4(b, r, 4, t) << 4);
+}
+#endif
+
+#ifdef TRI_BLOCK_AVX2
+__attribute__((target("avx2")))
+static unsigned int block_avx2(const struct tri_block* b,
+                               const struct particle* r,
+                               float* t)
+{
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 one = _mm256_set1_ps(1.0f);
+        const __m256 eps = _mm256_set1_ps(TRI_EPS);
+        const __m256 sign = _mm256_set1_ps(-0.0f);
+        __m256 ox = _mm256_set1_ps(r->p.x);
+        __m256 oy = _mm256_set1_ps(r->p.y);
+        __m256 oz = _mm256_set1_ps(r->p.z);
+        __m256 dx = _mm256_set1_ps(r->v.x);
+        __m256 dy = _mm256_set1_ps(r->v.y);
+        __m256 dz = _mm256_set1_ps(r->v.z);
+        __m256 e1x = _mm256_load_ps(b->e1x);
+        __m256 e1y = _mm256_load_ps(b->e1y);
+        __m256 e1z = _mm256_load_ps(b->e1z);
+        __m256 e2x = _mm256_load_ps(b->e2x);
+        __m256 e2y = _mm256_load_ps(b->e2y);
+        __m256 e2z = _mm256_load_ps(b->e2z);
+        __m256 px, py, pz, f, inv, sx, sy, sz, u, v, qx, qy, qz, tt, miss;
+
+        // p = d x e2
+        px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+        py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+        pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+        f = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px),
+                                        _mm256_mul_ps(e1y, py)),
+                          _mm256_mul_ps(e1z, pz));
+        miss = _mm256_cmp_ps(_mm256_andnot_ps(sign, f), eps, _CMP_LT_OQ);
+
+        inv = _mm256_div_ps(one, f);
+        sx = _mm256_sub_ps(ox, _mm256_load_ps(b->v0x));
+        sy = _mm256_sub_ps(oy, _mm256_load_ps(b->v0y));
+        sz = _mm256_sub_ps(oz, _mm256_load_ps(b->v0z));
+        u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px),
+                                        _mm256_mul_ps(sy, py)),
+                          _mm256_mul_ps(sz, pz));
+        u = _mm256_mul_ps(inv, u);
+        miss = _mm256_or_ps(miss, _mm256_cmp_ps(u, zero, _CMP_LT_OQ));
+        miss = _mm256_or_ps(miss, _mm256_cmp_ps(u, one, _CMP_GT_OQ));
+
+        // q = s x e1
+        qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+        qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+        qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+        v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx),
+                                        _mm256_mul_ps(dy, qy)),
+                          _mm256_mul_ps(dz, qz));
+        v = _mm256_mul_ps(inv, v);
+        miss = _mm256_or_ps(miss, _mm256_cmp_ps(v, zero, _CMP_LT_OQ));
+        miss = _mm256_or_ps(miss, _mm256_cmp_ps(_mm256_add_ps(u, v), one,
+                                                _CMP_GT_OQ));
+
+        tt = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx),
+                                         _mm256_mul_ps(e2y, qy)),
+                           _mm256_mul_ps(e2z, qz));
+        tt = _mm256_mul_ps(inv, tt);
+        miss = _mm256_or_ps(miss, _mm256_cmp_ps(tt, eps, _CMP_LT_OQ));
+
+        _mm256_storeu_ps(t, tt);
+
+        return ~(unsigned int)_mm256_movemask_ps(miss) & 0xffu;
+}
+#endif
+
+#ifdef TRI_BLOCK_NEON
+/*
+ * Four lanes starting at lane o.
+ */
+static unsigned int block_neon4(const struct tri_block* b,
+                                const struct particle* r,
+                                int o,
+                                float* t)
+{
+        const float32x4_t zero = vdupq_n_f32(0.0f);
+        const float32x4_t one = vdupq_n_f32(1.0f);
+        const float32x4_t eps = vdupq_n_f32(TRI_EPS);
+        const uint32x4_t bits = { 1, 2, 4, 8 };
+        float32x4_t ox = vdupq_n_f32(r->p.x);
+        float32x4_t oy = vdupq_n_f32(r->p.y);
+        float32x4_t oz = vdupq_n_f32(r->p.z);
+        float32x4_t dx = vdupq_n_f32(r->v.x);
+        float32x4_t dy = vdupq_n_f32(r->v.y);
+        float32x4_t dz = vdupq_n_f32(r->v.z);
+        float32x4_t e1x = vld1q_f32(b->e1x + o);
+        float32x4_t e1y = vld1q_f32(b->e1y + o);
+        float32x4_t e1z = vld1q_f32(b->e1z + o);
+        float32x4_t e2x = vld1q_f32(b->e2x + o);
+        float32x4_t e2y = vld1q_f32(b->e2y + o);
+        float32x4_t e2z = vld1q_f32(b->e2z + o);
+        float32x4_t px, py, pz, f, inv, sx, sy, sz, u, v, qx, qy, qz, tt;
+        uint32x4_t miss;
+
+        // p = d x e2
+        px = vsubq_f32(vmulq_f32(dy, e2z), vmulq_f32(dz, e2y));
+        py = vsubq_f32(vmulq_f32(dz, e2x), vmulq_f32(dx, e2z));
+        pz = vsubq_f32(vmulq_f32(dx, e2y), vmulq_f32(dy, e2x));
+        f = vaddq_f32(vaddq_f32(vmulq_f32(e1x, px), vmulq_f32(e1y, py)),
+                      vmulq_f32(e1z, pz));
+        miss = vcltq_f32(vabsq_f32(f), eps);
+
+        inv = vdivq_f32(one, f);
+        sx = vsubq_f32(ox, vld1q_f32(b->v0x + o));
+        sy = vsubq_f32(oy, vld1q_f32(b->v0y + o));
+        sz = vsubq_f32(oz, vld1q_f32(b->v0z + o));
+        u = vaddq_f32(vaddq_f32(vmulq_f32(sx, px), vmulq_f32(sy, py)),
+                      vmulq_f32(sz, pz));
+        u = vmulq_f32(inv, u);
+        miss = vorrq_u32(miss, vcltq_f32(u, zero));
+        miss = vorrq_u32(miss, vcgtq_f32(u, one));
+
+        // q = s x e1
+        qx = vsubq_f32(vmulq_f32(sy, e1z), vmulq_f32(sz, e1y));
+        qy = vsubq_f32(vmulq_f32(sz, e1x), vmulq_f32(sx, e1z));
+        qz = vsubq_f32(vmulq_f32(sx, e1y), vmulq_f32(sy, e1x));
+        v = vaddq_f32(vaddq_f32(vmulq_f32(dx, qx), vmulq_f32(dy, qy)),
+                      vmulq_f32(dz, qz));
+        v = vmulq_f32(inv, v);
+        miss = vorrq_u32(miss, vcltq_f32(v, zero));
+        miss = vorrq_u32(miss, vcgtq_f32(vaddq_f32(u, v), one));
+
+        tt = vaddq_f32(vaddq_f32(vmulq_f32(e2x, qx), vmulq_f32(e2y, qy)),
+                       vmulq_f32(e2z, qz));
+        tt = vmulq_f32(inv, tt);
+        miss = vorrq_u32(miss, vcltq_f32(tt, eps));
+
+        vst1q_f32(t + o, tt);
+
+        return ~vaddvq_u32(vandq_u32(miss, bits)) & 0xfu;
+}
+
+static unsigned int block_neon(const struct tri_block* b,
+                               const struct particle* r,
+                               float* t)
+{
+        return block_neon4(b, r, 0, t) | (block_neon4(b, r, 4, t) << 4);
+}
+#endif
+
+struct block_kernel
+{
+        enum tri_block_isa isa;
+        tri_block_fn fn;
+};
+
+// Widest first
+static const struct block_kernel kernels[] = {
+#ifdef TRI_BLOCK_AVX2
+        {TRI_ISA_AVX2, block_avx2},
+#endif
+#ifdef TRI_BLOCK_NEON
+        {TRI_ISA_NEON, block_neon},
+#endif
+#ifdef TRI_BLOCK_SSE
+        {TRI_ISA_SSE, block_sse},
+#endif
+        {TRI_ISA_SCALAR, block_scalar}
+};
+
+// The kernel in use, picked on first use. Atomic, as the first use
+// may well be from several pool workers at once.
+static _Atomic(const struct block_kernel*) kernel;
+
+static const struct block_kernel* find_kernel(enum tri_block_isa isa)
+{
+        for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+        {
+                if (kernels[i].isa != isa)
+                {
+                        continue;
+                }
+#ifdef TRI_BLOCK_AVX2
+                if (isa == TRI_ISA_AVX2 && !__builtin_cpu_supports("avx2"))
+                {
+                        return NULL;
+                }
+#endif
+                return kernels + i;
+        }
+
+        return NULL;
+}
+
+static const struct block_kernel* get_kernel(void)
+{
+        const struct block_kernel* k =
+                atomic_load_explicit(&kernel, memory_order_acquire);
+        const struct block_kernel* best = NULL;
+
+        if (k)
+        {
+                return k;
+        }
+
+        for (size_t i = 0; !best; i++)
+        {
+                best = find_kernel(kernels[i].isa);
+        }
+
+        // Keep the kernel if another thread, or tri_block_set_isa,
+        // got there first
+        if (atomic_compare_exchange_strong_explicit(&kernel, &k, best,
+                                                    memory_order_acq_rel,
+                                                    memory_order_acquire))
+        {
+                k = best;
+        }
+
+        return k;
+}
+
+unsigned int tri_block_intersect(const struct tri_block* b,
+                                 const struct particle* r,
+                                 unsigned int lanes,
+                                 float t[TRI_BLOCK_SIZE])
+{
+        return get_kernel()->fn(b, r, t) & lanes;
+}
+
+enum tri_block_isa tri_block_get_isa(void)
+{
+        return get_kernel()->isa;
+}
+
+int tri_block_set_isa(enum tri_block_isa isa)
+{
+        const struct block_kernel* k = find_kernel(isa);
+
+        if (!k)
+        {
+                return -1;
+        }
+
+        atomic_store_explicit(&kernel, k, memory_order_release);
+
+        return 0;
+}
@@ -0,0 +1,84 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#ifndef KM_TRIBLOCK_H
+#define KM_TRIBLOCK_H
+
+#include <stdint.h>
+
+struct particle;
+
+// Number of triangles per block
+#define TRI_BLOCK_SIZE 8
+// Required alignment of a block, in bytes
+#define TRI_BLOCK_ALIGN 32
+
+/*
+  Eight triangles, transposed so that each lane can be loaded into a
+  SIMD register. Unused lanes are zeroed, which makes them degenerate
+  triangles that never report a hit.
+*/
+struct tri_block
+{
+        float v0x[TRI_BLOCK_SIZE];
+        float v0y[TRI_BLOCK_SIZE];
+        float v0z[TRI_BLOCK_SIZE];
+        // v1 - v0
+        float e1x[TRI_BLOCK_SIZE];
+        float e1y[TRI_BLOCK_SIZE];
+        float e1z[TRI_BLOCK_SIZE];
+        // v2 - v0
+        float e2x[TRI_BLOCK_SIZE];
+        float e2y[TRI_BLOCK_SIZE];
+        float e2z[TRI_BLOCK_SIZE];
+        // The triangle index (in the mesh) of each lane
+        uint32_t ti[TRI_BLOCK_SIZE];
+};
+
+enum tri_block_isa
+{
+        TRI_ISA_SCALAR = 0,
+        TRI_ISA_SSE,
+        TRI_ISA_AVX2,
+        TRI_ISA_NEON
+};
+
+/**
+ * Intersect a particle's ray with the triangles in a block.
+ * The result for each lane is exactly what ray_tri_intersect returns
+ * for the same triangle.
+ * @param b the block
+ * @param r the ray
+ * @param lanes bit mask with the lanes to test
+ * @param t the time of impact for each lane, only valid for hit lanes
+ * @return bit mask with the lanes that were hit
+ */
+unsigned int tri_block_intersect(const struct tri_block* b,
+                                 const struct particle* r,
+                                 unsigned int lanes,
+                                 float t[TRI_BLOCK_SIZE]);
+
+/**
+ * Get the kernel used by tri_block_intersect. Unless set with
+ * tri_block_set_isa, the widest one supported by the CPU is picked.
+ * @return the kernel in use
+ */
+enum tri_block_isa tri_block_get_isa(void);
+
+/**
+ * Force a kernel, e.g. for testing or benchmarking.
+ * @param isa the kernel to use
+ * @return 0 on success, -1 if the kernel is not supported on this CPU
+ */
+int tri_block_set_isa(enum tri_block_isa isa);
+
+#endif /* KM_TRIBLOCK_H */
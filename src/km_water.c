@@ -0,0 +1,259 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "km_water.h"
+#include "km_geom.h"
+#include "km_pool.h"
+
+// Alignment, in bytes, of each array
+#define WATER_ALIGN 64
+#define WATER_ALIGN_F (WATER_ALIGN / sizeof(float))
+// Rows per pool work item
+#define WATER_CHUNK_ROWS 16
+
+struct water_job
+{
+        const struct water_grid* g;
+        float a;
+        float b;
+};
+
+float water_damping(float gh)
+{
+        if (gh > 0.299f)
+        {
+                return 0.0f;
+        }
+        if (gh < -0.2999f)
+        {
+                return 1.0f;
+        }
+
+        return -0.6f * gh + 0.5f;
+}
+
+void water_damping_fill(float* damp,
+                        uint32_t nx,
+                        uint32_t nz,
+                        const struct mesh* d,
+                        uint32_t x0,
+                        uint32_t z0,
+                        uint32_t x1,
+                        uint32_t z1)
+{
+        x1 = MIN(x1, nx);
+        z1 = MIN(z1, nz);
+
+        for (uint32_t z = z0; z < z1; z++)
+        {
+                for (uint32_t x = x0; x < x1; x++)
+                {
+                        size_t i = (size_t)z * nx + x;
+
+                        damp[i] = d ? water_damping(d->vertices[i].pos.y) :
+                                1.0f;
+                }
+        }
+}
+
+int water_grid_init(struct water_grid* g,
+                    struct mesh* v,
+                    const struct mesh* d)
+{
+        size_t n;
+        size_t stride;
+        float* buf;
+
+        memset(g, 0, sizeof(*g));
+
+        if (v->grid_x < 2 || v->grid_z < 2)
+        {
+                return -1;
+        }
+        if (d && (v->grid_x != d->grid_x || v->grid_z != d->grid_z))
+        {
+                return -1;
+        }
+
+        n = (size_t)v->grid_x * v->grid_z;
+        stride = (n + WATER_ALIGN_F - 1) / WATER_ALIGN_F * WATER_ALIGN_F;
+        buf = aligned_alloc(WATER_ALIGN, stride * 3 * sizeof(float));
+        g->dirty = malloc(n);
+        if (!buf || !g->dirty)
+        {
+                free(buf);
+                free(g->dirty);
+                g->dirty = NULL;
+                return -1;
+        }
+
+        g->nx = v->grid_x;
+        g->nz = v->grid_z;
+        g->c = 1.5f; // wave propagation of 1.5m/s
+        g->h = v->vertices[1].pos.x - v->vertices[0].pos.x;
+        g->cur = buf;
+        g->prev = buf + stride;
+        g->damp = buf + stride * 2;
+
+        for (size_t i = 0; i < n; i++)
+        {
+                g->cur[i] = v->vertices[i].pos.y;
+        }
+        memcpy(g->prev, g->cur, n * sizeof(float));
+        water_damping_fill(g->damp, g->nx, g->nz, d,
+                           0, 0, g->nx, g->nz);
+
+        // The water surface moves every step, a triangle cache would
+        // always be stale
+        mesh_invalidate_tris(v);
+
+        return 0;
+}
+
+void water_grid_free(struct water_grid* g)
+{
+        // All arrays share the allocation starting at the lowest one
+        free(g->cur < g->prev ? g->cur : g->prev);
+        free(g->dirty);
+
+        memset(g, 0, sizeof(*g));
+}
+
+void water_grid_update_damping(struct water_grid* g,
+                               const struct mesh* d,
+                               uint32_t x0,
+                               uint32_t z0,
+                               uint32_t x1,
+                               uint32_t z1)
+{
+        water_damping_fill(g->damp, g->nx, g->nz, d, x0, z0, x1, z1);
+}
+
+/*
+ * The same operations, in the same order, as update_water. The
+ * previous heights are overwritten with the new ones. No branches or
+ * calls, so the loop can be vectorised.
+ */
+static void water_row(uint32_t n,
+                      float* restrict out,
+                      const float* restrict up,
+                      const float* restrict mid,
+                      const float* restrict down,
+                      const float* restrict damp,
+                      float a,
+                      float b)
+{
+        for (uint32_t x = 1; x < n - 1; x++)
+        {
+                float s = a * (up[x] + down[x] + mid[x - 1] + mid[x + 1]);
+                float p = b * mid[x] - out[x];
+
+                out[x] = damp[x] * (s + p);
+        }
+}
+
+static void water_rows(void* ctx, uint32_t begin, uint32_t end)
+{
+        const struct water_job* job = ctx;
+        const struct water_grid* g = job->g;
+        uint32_t nx = g->nx;
+
+        // Items are the interior rows, starting at row 1
+        for (uint32_t z = begin + 1; z < end + 1; z++)
+        {
+                size_t row = (size_t)z * nx;
+
+                water_row(nx,
+                          g->prev + row,
+                          g->cur + row - nx,
+                          g->cur + row,
+                          g->cur + row + nx,
+                          g->damp + row,
+                          job->a,
+                          job->b);
+        }
+}
+
+int water_grid_step(struct water_grid* g, float dt, struct km_pool* pool)
+{
+        struct water_job job = { .g = g };
+        float a = (g->c * dt) / g->h;
+        float s = g->c * g->c * dt * dt;
+        float* tmp;
+
+        s = s / (g->h * g->h);
+        if (s > 0.5f)
+        {
+                return -1;
+        }
+
+        a = a * a;
+        job.a = a;
+        job.b = 2.0f - 4.0f * a;
+
+        if (pool)
+        {
+                km_pool_run(pool, g->nz - 2, WATER_CHUNK_ROWS,
+                            water_rows, &job);
+        }
+        else
+        {
+                water_rows(&job, 0, g->nz - 2);
+        }
+
+        // The new heights are in prev
+        tmp = g->cur;
+        g->cur = g->prev;
+        g->prev = tmp;
+
+        return 0;
+}
+
+void water_grid_store(const struct water_grid* g, struct mesh* v)
+{
+        size_t n = (size_t)g->nx * g->nz;
+
+        for (size_t i = 0; i < n; i++)
+        {
+                v->vertices[i].pos.y = g->cur[i];
+        }
+}
+
+int water_grid_store_normals(struct water_grid* g,
+                             struct mesh* v,
+                             float eps)
+{
+        size_t n = (size_t)g->nx * g->nz;
+        int moved = 0;
+
+        for (size_t i = 0; i < n; i++)
+        {
+                float y = g->cur[i];
+
+                g->dirty[i] = fabsf(y - v->vertices[i].pos.y) > eps;
+                if (g->dirty[i])
+                {
+                        v->vertices[i].pos.y = y;
+                        moved++;
+                }
+        }
+
+        if (mesh_grid_normalize_dirty(v, g->dirty) < 0)
+        {
+                return -1;
+        }
+
+        return moved;
+}
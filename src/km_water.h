@@ -0,0 +1,150 @@
+/*
+* Copyright (C) 2026 Fredrik Skogman, skogman - at - gmail.com.
+*
+* The contents of this file are subject to the terms of the Common
+* Development and Distribution License (the "License"). You may not use this
+* file except in compliance with the License. You can obtain a copy of the
+* License at http://opensource.org/licenses/CDDL-1.0. See the License for the
+* specific language governing permissions and limitations under the License.
+* When distributing the software, include this License Header Notice in each
+* file and include the License file at http://opensource.org/licenses/CDDL-1.0.
+*/
+
+#ifndef KM_WATER_H
+#define KM_WATER_H
+
+#include <stdint.h>
+
+struct mesh;
+struct km_pool;
+
+/*
+  Wave solver for a grid water mesh, with the heights and the damping
+  mask kept in packed, row major nx * nz float arrays. Each array is
+  64 byte aligned. The mesh is only read when the grid is created, and
+  written to with water_grid_store.
+*/
+struct water_grid
+{
+        uint32_t nx;
+        uint32_t nz;
+        // Wave propagation speed, m/s
+        float c;
+        // Grid spacing
+        float h;
+        // Heights of the current and the previous step
+        float* cur;
+        float* prev;
+        // Damping, each new height is multiplied with it
+        float* damp;
+        // Vertices moved by water_grid_store_normals
+        uint8_t* dirty;
+};
+
+/**
+ * Get the damping of the water above ground at height gh. Shallow
+ * water is damped out, deep water is not.
+ * @param gh the height of the ground
+ * @return the damping, between 0 and 1
+ */
+float water_damping(float gh);
+
+/**
+ * Compute the damping for a rectangle of cells, from the heights of
+ * the ground below. Cells x0 <= x < x1, z0 <= z < z1 are written, the
+ * rectangle is clipped to the grid.
+ * @param damp the damping mask, row major nx * nz
+ * @param nx number of columns in the grid
+ * @param nz number of rows in the grid
+ * @param d the ground, with the same grid. NULL for no damping.
+ * @param x0 first column
+ * @param z0 first row
+ * @param x1 one past the last column
+ * @param z1 one past the last row
+ * @return void
+ */
+void water_damping_fill(float* damp,
+                        uint32_t nx,
+                        uint32_t nz,
+                        const struct mesh* d,
+                        uint32_t x0,
+                        uint32_t z0,
+                        uint32_t x1,
+                        uint32_t z1);
+
+/**
+ * Create a wave solver for a water mesh. Both current and previous
+ * heights are set to the mesh's heights.
+ * @param g the solver to initialize
+ * @param v the water mesh, must be a grid
+ * @param d the ground below the water, with the same grid as v and
+ *        the same x and z for each vertex. NULL for no damping.
+ * @return 0 on success, -1 on failure
+ */
+int water_grid_init(struct water_grid* g,
+                    struct mesh* v,
+                    const struct mesh* d);
+
+/**
+ * Free the solver's arrays. All members are set to zero.
+ * @param g the solver
+ * @return void
+ */
+void water_grid_free(struct water_grid* g);
+
+/**
+ * Recompute the damping for a rectangle of cells after the ground
+ * has been modified, see water_damping_fill.
+ * @param g the solver
+ * @param d the ground the solver was created with, NULL for no damping
+ * @param x0 first column
+ * @param z0 first row
+ * @param x1 one past the last column
+ * @param z1 one past the last row
+ * @return void
+ */
+void water_grid_update_damping(struct water_grid* g,
+                               const struct mesh* d,
+                               uint32_t x0,
+                               uint32_t z0,
+                               uint32_t x1,
+                               uint32_t z1);
+
+/**
+ * Run one step of the wave equation. The result is identical to
+ * update_water for the same mesh and ground. The border is left as
+ * is.
+ * @param g the solver
+ * @param dt the time step
+ * @param pool split the rows over the pool's threads, may be NULL
+ * @return 0 on success, -1 if the step would be unstable, the
+ *         heights are then not changed
+ */
+int water_grid_step(struct water_grid* g, float dt, struct km_pool* pool);
+
+/**
+ * Write the current heights to the y position of a mesh's vertices.
+ * If the mesh is also a surface objects rest on, wake them with
+ * active_set_wake_mesh afterwards.
+ * @param g the solver
+ * @param v the mesh, with the same grid as the solver
+ * @return void
+ */
+void water_grid_store(const struct water_grid* g, struct mesh* v);
+
+/**
+ * Write the heights that differ from the mesh's by more than eps, and
+ * recreate the normals that depend on them. Smaller changes are left
+ * out, so the mesh lags behind the solver by at most eps, and its
+ * normals always match its heights. As with water_grid_store, objects
+ * resting on the mesh must be woken with active_set_wake_mesh.
+ * @param g the solver
+ * @param v the mesh, with the same grid as the solver
+ * @param eps the smallest height change to write
+ * @return number of heights written, -1 if v is not a grid
+ */
+int water_grid_store_normals(struct water_grid* g,
+                             struct mesh* v,
+                             float eps);
+
+#endif /* KM_WATER_H */
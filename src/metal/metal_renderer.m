@@ -18,6 +18,7 @@
 #include "../km_geom.h"
 #include "metal_renderer.h"
 #include "../km_scene.h"
+#include "../km_step.h"
 
 /* ------------------------------------------------------------------ */
 /* Uniform data type (must match the Metal shader struct)               */
@@ -44,6 +45,7 @@ struct uniforms
 @property (nonatomic, strong) id<MTLBuffer> vertexBuffer;
 @property (nonatomic, strong) id<MTLBuffer> indexBuffer;
 @property (nonatomic) int indexCount;
+@property (nonatomic) MTLIndexType indexType;
 @end
 
 @implementation GpuMesh
@@ -228,11 +230,14 @@ static GpuMesh *upload_one_mesh(id<MTLDevice> device, const struct mesh *m)
                             length:vsize
                            options:MTLResourceStorageModeShared];
 
-        NSUInteger isize = m->index_count * sizeof(uint16_t);
+        NSUInteger isize = m->index_count * mesh_index_size(m);
         gm.indexBuffer = [device
-                newBufferWithBytes:m->indices
+                newBufferWithBytes:m->indices32 ? (const void *)m->indices32
+                                                : (const void *)m->indices
                             length:isize
                            options:MTLResourceStorageModeShared];
+        gm.indexType = m->indices32 ? MTLIndexTypeUInt32
+                                    : MTLIndexTypeUInt16;
 
         gm.indexCount = (int)m->index_count;
         return gm;
@@ -319,7 +324,7 @@ static void draw_mesh(id<MTLRenderCommandEncoder> enc,
 
         [enc drawIndexedPrimitives:MTLPrimitiveTypeTriangle
                         indexCount:(NSUInteger)gm.indexCount
-                         indexType:MTLIndexTypeUInt16
+                         indexType:gm.indexType
                        indexBuffer:gm.indexBuffer
                  indexBufferOffset:0];
 }
@@ -396,7 +401,11 @@ static void metal_render(struct renderer *r, struct scene* scene, float dt)
                 /* ---- Draw entities (per-entity transform) ---- */
                 for (int i = 0; i < scene->entity_count; i++) {
                         const struct entity *e = &scene->entities[i];
-                        const struct particle *p = &e->o.p;
+                        struct particle ip;
+                        const struct particle *p = &ip;
+
+                        particle_interpolate(&ip, &e->prev, &e->o.p,
+                                             scene->alpha);
 
                         /* Model = Translate * Rz * Ry * Rx */
                         float t[16], rx[16], ry[16], rz[16], tmp[16];
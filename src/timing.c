@@ -11,44 +11,44 @@
 */
 
 #include <assert.h>
+#include <errno.h>
 #include <time.h>
 #include "timing.h"
 
-void timing_start(struct timing* t)
+int64_t timing_now_ns(void)
 {
-        int res = gettimeofday(&t->tv, NULL);
+        struct timespec ts;
+        int res = clock_gettime(CLOCK_MONOTONIC, &ts);
 
         assert(res == 0);
+        (void)res;
+
+        return (int64_t)ts.tv_sec * TIMING_NS_PER_SEC + ts.tv_nsec;
 }
 
-long timing_dur_sec(const struct timing* t)
+void timing_start(struct timing* t)
 {
-        struct timeval now;
-        int res;
+        t->ns = timing_now_ns();
+}
 
-        res = gettimeofday(&now, NULL);
-        assert(res == 0);
+int64_t timing_dur_nsec(const struct timing* t)
+{
+        return timing_now_ns() - t->ns;
+}
 
-        return (long)(now.tv_sec - t->tv.tv_sec);
+long timing_dur_sec(const struct timing* t)
+{
+        return (long)(timing_dur_nsec(t) / TIMING_NS_PER_SEC);
 }
 
 long timing_dur_usec(const struct timing* t)
 {
-        struct timeval now;
-        int res;
-
-        res = gettimeofday(&now, NULL);
-        assert(res == 0);
-
-        return (long)((now.tv_sec * 1000000 + now.tv_usec) -
-                      (t->tv.tv_sec * 1000000 + t->tv.tv_usec));
+        return (long)(timing_dur_nsec(t) / 1000);
 }
 
 long timing_dur_msec(const struct timing* t)
 {
-        time_t usec = timing_dur_usec(t);
-
-        return (long)(usec / 1000);
+        return (long)(timing_dur_nsec(t) / 1000000);
 }
 
 long timing_current_millis(void)
@@ -75,18 +75,39 @@ long timing_current_usec(void)
 
 void timing_sleep(long ns)
 {
-        long start = timing_current_usec();
-        long left;
+        timing_sleep_until(timing_now_ns() + ns);
+}
 
-        // sleep for 80% of the request time
-        struct timespec sleep = {
-                .tv_sec = 0,
-                .tv_nsec = (long)((float)(ns) * 0.8f)
+void timing_sleep_until(int64_t deadline)
+{
+#if __APPLE__
+        // No clock_nanosleep, sleep what's left until the deadline
+        for (;;)
+        {
+                int64_t left = deadline - timing_now_ns();
+                struct timespec ts;
+
+                if (left <= 0)
+                {
+                        break;
+                }
+                ts.tv_sec = (time_t)(left / TIMING_NS_PER_SEC);
+                ts.tv_nsec = (long)(left % TIMING_NS_PER_SEC);
+                nanosleep(&ts, NULL);
+        }
+#else
+        struct timespec ts = {
+                .tv_sec = (time_t)(deadline / TIMING_NS_PER_SEC),
+                .tv_nsec = (long)(deadline % TIMING_NS_PER_SEC)
         };
-        nanosleep(&sleep, NULL);
 
-        left = ns / 1000 - (timing_current_usec() - start);
-        while (left > 0) {
-                left = ns / 1000 - (timing_current_usec() - start);
+        if (deadline <= 0)
+        {
+                return;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                               &ts, NULL) == EINTR)
+        {
         }
+#endif
 }
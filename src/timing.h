@@ -14,13 +14,30 @@
 #define __TIMING_H__
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/time.h>
 
+#define TIMING_NS_PER_SEC 1000000000LL
+
+/*
+  A timer, durations are measured on the monotonic clock and are not
+  affected by changes to the wall clock.
+*/
 struct timing
 {
-        struct timeval tv;
+        // Monotonic time at start, in nano seconds
+        int64_t ns;
 };
 
+/**
+ * Return the time of the monotonic clock, in nano seconds. The clock
+ * has an arbitrary start, only differences between two times are
+ * meaningful.
+ * @param void
+ * @return monotonic time in nano seconds.
+ */
+extern int64_t timing_now_ns(void);
+
 /**
  * Start a timer object.
  * @param the timing struct to initialize.
@@ -43,6 +60,13 @@ extern long timing_dur_sec(const struct timing*);
  */
 extern long timing_dur_usec(const struct timing*);
 
+/**
+ * Extract the duration from the time to the current time.
+ * @param the start time.
+ * @return the duration since the start time in nano seconds.
+ */
+extern int64_t timing_dur_nsec(const struct timing*);
+
 /**
  * Extract the duration from the time to the current time. Returned
  * value is truncated.
@@ -66,11 +90,19 @@ extern long timing_current_millis(void);
 extern long timing_current_usec(void);
 
 /**
- * Sleep using a hybrid mode. Uses nanosleep(2) for 80% of the time,
- * then busy waiting for the rest of the time.
- * This usually provides much better precision on some systems.
+ * Sleep for a duration on the monotonic clock.
  * @params ns the time to sleep in nanoseconds.
  */
 extern void timing_sleep(long ns);
 
+/**
+ * Sleep until the monotonic clock reaches a deadline. Returns at once
+ * if the deadline has passed. Fixed rate loops should advance the
+ * deadline by the period each iteration, as time spent between the
+ * sleeps then does not add up to a drift.
+ * @param deadline the time to wake up, as from timing_now_ns.
+ * @return void
+ */
+extern void timing_sleep_until(int64_t deadline);
+
 #endif /* __TIMING_H__ */
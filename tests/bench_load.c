@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "km_geom.h"
+#include "km_meshio.h"
+#include "timing.h"
+#include "../lib/cJSON.h"
+
+/*
+  Load time versus file size, for the streaming JSON loader and for
+  walking a cJSON DOM with cJSON_GetArrayItem, as load_meshes used to.
+  Built with the tests, but not run by make test.
+*/
+
+#define RUNS 3
+// The DOM walk is quadratic, only time it for smaller meshes
+#define DOM_MAX_VERTICES 5000
+
+static char* read_all(const char* p)
+{
+        FILE* f = fopen(p, "rb");
+        char* buf;
+        long len;
+
+        if (!f)
+        {
+                return NULL;
+        }
+        fseek(f, 0, SEEK_END);
+        len = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        buf = malloc((size_t)len + 1);
+        if (buf && fread(buf, 1, (size_t)len, f) != (size_t)len)
+        {
+                free(buf);
+                buf = NULL;
+        }
+        if (buf)
+        {
+                buf[len] = '\0';
+        }
+        fclose(f);
+
+        return buf;
+}
+
+// The old way: a DOM, and an O(i) lookup per array element
+static long dom_load_usec(const char* p)
+{
+        struct timing t;
+        volatile float sink = 0.0f;
+
+        timing_start(&t);
+
+        char* data = read_all(p);
+        cJSON* root = cJSON_Parse(data);
+        cJSON* meshes = cJSON_GetObjectItem(root, "meshes");
+        cJSON* m = cJSON_GetArrayItem(meshes, 0);
+        cJSON* verts = cJSON_GetObjectItem(m, "vertices");
+        cJSON* idxs = cJSON_GetObjectItem(m, "indices");
+        int vc = cJSON_GetArraySize(verts);
+        int ic = cJSON_GetArraySize(idxs);
+
+        for (int i = 0; i < vc; i++)
+        {
+                cJSON* v = cJSON_GetArrayItem(verts, i);
+                cJSON* pos = cJSON_GetObjectItem(v, "position");
+                cJSON* col = cJSON_GetObjectItem(v, "color");
+
+                for (int k = 0; k < 3; k++)
+                {
+                        sink += (float)cJSON_GetArrayItem(pos, k)->valuedouble;
+                }
+                for (int k = 0; k < 4; k++)
+                {
+                        sink += (float)cJSON_GetArrayItem(col, k)->valuedouble;
+                }
+        }
+        for (int i = 0; i < ic; i++)
+        {
+                sink += (float)cJSON_GetArrayItem(idxs, i)->valuedouble;
+        }
+
+        cJSON_Delete(root);
+        free(data);
+
+        return timing_dur_usec(&t);
+}
+
+static long stream_load_usec(const char* p)
+{
+        struct timing t;
+        struct mesh* m;
+        int count;
+        long us;
+
+        timing_start(&t);
+        m = load_meshes_json(p, &count, NULL);
+        us = timing_dur_usec(&t);
+
+        for (int i = 0; i < count; i++)
+        {
+                mesh_free(m + i);
+        }
+        free(m);
+
+        return us;
+}
+
+int main(void)
+{
+        static const float sides[] = { 15.0f, 31.0f, 63.0f, 127.0f, 254.0f };
+        char path[] = "/tmp/kfg_bench_XXXXXX";
+        int fd = mkstemp(path);
+
+        if (fd < 0)
+        {
+                return 1;
+        }
+        close(fd);
+
+        printf("%9s %9s %10s %10s %10s\n",
+               "vertices", "size (kB)", "dom (ms)", "stream (ms)", "MB/s");
+        for (size_t s = 0; s < sizeof(sides) / sizeof(sides[0]); s++)
+        {
+                struct mesh* m = gen_mesh(sides[s], sides[s], 1.0f);
+                long dom = 0;
+                long stream = 0;
+                struct stat st;
+
+                mesh_heightmap(m, 10, 5.0f, 8.0f);
+                mesh_colorize(m);
+                if (write_meshes(path, m, 1) != 0 || stat(path, &st) != 0)
+                {
+                        unlink(path);
+                        return 1;
+                }
+
+                for (int r = 0; r < RUNS; r++)
+                {
+                        long d = m->vertex_count <= DOM_MAX_VERTICES ?
+                                dom_load_usec(path) : -1;
+                        long st_us = stream_load_usec(path);
+
+                        dom = r == 0 || d < dom ? d : dom;
+                        stream = r == 0 || st_us < stream ? st_us : stream;
+                }
+
+                printf("%9u %9ld ", m->vertex_count, (long)st.st_size / 1024);
+                if (dom >= 0)
+                {
+                        printf("%10.2f ", (double)dom / 1000.0);
+                }
+                else
+                {
+                        printf("%10s ", "-");
+                }
+                printf("%10.2f %10.1f\n",
+                       (double)stream / 1000.0,
+                       (double)st.st_size / (double)stream);
+
+                mesh_free(m);
+                free(m);
+        }
+        unlink(path);
+
+        return 0;
+}
@@ -73,7 +73,7 @@ RUN_TESTS(tests)
  */
 static int free_fall(int duration, int freq)
 {
-        struct world w;
+        struct world w = {0};
         struct object o = {0};
         int steps;
         int ret = 0;
@@ -138,7 +138,7 @@ static int free_fall(int duration, int freq)
  */
 static int with_drag(int duration, int freq, float exp_p)
 {
-        struct world w;
+        struct world w = {0};
         struct object o = {0};
         int steps;
         int ret = 0;
@@ -199,7 +199,7 @@ static int with_drag(int duration, int freq, float exp_p)
  */
 static int upwards(int freq)
 {
-        struct world w;
+        struct world w = {0};
         struct object o = {0};
         struct vec3 f;
         int step;
@@ -259,7 +259,7 @@ static int upwards(int freq)
  */
 static int bounce(int freq)
 {
-        struct world w;
+        struct world w = {0};
         struct object o = {0};
         struct vec3 f;
         int step = 0;
@@ -1,6 +1,9 @@
+#include <math.h>
+#include <string.h>
 #include <unistd.h>
 #include "km_geom.h"
 #include "km_phys.h"
+#include "km_pool.h"
 #include "test.h"
 
 static struct vec3 tri_normal(void);
@@ -16,6 +19,13 @@ static int test_gen_mesh(void);
 static int test_gen_mesh_large(void);
 static int test_point_on_mesh(void);
 static int test_write_parse_mesh(void);
+static int test_grid_walk(void);
+static int test_grid_check(void);
+static int test_point_on_mesh_walk(void);
+static int test_mesh_tris(void);
+static int test_grid_normalize(void);
+static int test_colorize_lut(void);
+static int test_heightmap_grid(void);
 
 /* Shared triangle for all geom tests */
 static const struct vec3 v0 = { .a = { -1.0f, 0.0f, -2.0f } };
@@ -264,7 +274,7 @@ static int test_gen_mesh(void)
         ASSERT_IE(6, m->index_count);
 
         // All vertex normals should be 0, 1, 0
-        for (int i = 0; i < m->vertex_count; i++)
+        for (uint32_t i = 0; i < m->vertex_count; i++)
         {
                 struct vec3 n = {.a = { 0.0f, 1.0f, 0.0f } };
                 ASSERT_IE(1, vec3_approx(n, m->vertices[i].normal, F_THR));
@@ -481,7 +491,7 @@ static int test_write_parse_mesh(void)
         ASSERT_IE(m->grid_z, r->grid_z);
 
         // Vertex positions and colors
-        for (int i = 0; i < m->vertex_count; i++)
+        for (uint32_t i = 0; i < m->vertex_count; i++)
         {
                 if (!vec3_approx(m->vertices[i].pos,
                                  r->vertices[i].pos, F_THR))
@@ -504,7 +514,7 @@ static int test_write_parse_mesh(void)
         // Indices
         for (unsigned int i = 0; i < m->index_count; i++)
         {
-                ASSERT_IE(m->indices[i], r->indices[i]);
+                ASSERT_IE(mesh_index(m, i), mesh_index(r, i));
         }
 
         // Normals are recomputed from geometry, verify they match
@@ -540,6 +550,411 @@ static int test_write_parse_mesh(void)
         return ret;
 }
 
+static int test_grid_walk(void)
+{
+        struct mesh* m = gen_mesh(12.0f, 8.0f, 0.5f);
+        struct mesh flat;
+        int ret = 0;
+
+        mesh_translate(m, (struct vec3){.a = {-6.0f, 0.0f, -4.0f}});
+        mesh_heightmap(m, 8, 3.0f, 2.0f);
+
+        // Same triangles, but without the grid (and bvh), i.e. the
+        // reference linear scan
+        flat = *m;
+        flat.grid_x = 0;
+        flat.grid_z = 0;
+        flat.bvh = NULL;
+
+        ASSERT_IE(1, mesh_is_grid(m));
+        ASSERT_IE(0, mesh_is_grid(&flat));
+
+        for (int i = 0; i < 4000 && !ret; i++)
+        {
+                struct particle p = {0};
+                struct collision got;
+                struct collision exp;
+                int gc;
+                int ec;
+
+                p.p.x = (lcg_u01() - 0.5f) * 16.0f;
+                p.p.y = lcg_u01() * 5.0f;
+                p.p.z = (lcg_u01() - 0.5f) * 12.0f;
+                p.v.x = (lcg_u01() - 0.5f) * 10.0f;
+                p.v.y = (lcg_u01() - 0.7f) * 10.0f;
+                p.v.z = (lcg_u01() - 0.5f) * 10.0f;
+                // Axis aligned and vertical movement
+                if (i % 4 == 1)
+                {
+                        p.v.x = 0.0f;
+                }
+                else if (i % 4 == 2)
+                {
+                        p.v.x = 0.0f;
+                        p.v.z = 0.0f;
+                }
+
+                gc = compute_toi(&got, &p, m, 1);
+                ec = compute_toi(&exp, &p, &flat, 1);
+                if (gc != ec || (gc && (got.t != exp.t || got.ti != exp.ti)))
+                {
+                        printf("grid toi mismatch %d: got (%d %f %u) "
+                               "expected (%d %f %u)\n", i,
+                               gc, gc ? got.t : 0.0f, gc ? got.ti : 0,
+                               ec, ec ? exp.t : 0.0f, ec ? exp.ti : 0);
+                        ret = 1;
+                }
+
+                // Drop the point onto the surface to get a mix of
+                // points on and off the mesh
+                if (ec)
+                {
+                        p.p = vec3_add(p.p, vec3_scalarm(p.v, exp.t));
+                        p.p.y += (lcg_u01() - 0.5f) * 0.01f;
+                }
+                if (point_on_mesh(m, p.p) != point_on_mesh(&flat, p.p))
+                {
+                        printf("grid point_on_mesh mismatch %d\n", i);
+                        ret = 1;
+                }
+        }
+
+        mesh_free(m);
+        free(m);
+
+        return ret;
+}
+
+static int test_grid_check(void)
+{
+        struct mesh* m = gen_mesh(6.0f, 4.0f, 0.5f);
+        struct vertex* v = m->vertices + 3 * m->grid_x + 5;
+        struct vertex saved;
+        uint32_t i = 6 * (2 * (m->grid_x - 1u) + 3u);
+
+        ASSERT_IE(1, mesh_is_grid(m));
+
+        // Heights may differ, and moving the mesh keeps the grid
+        mesh_heightmap(m, 4, 1.0f, 1.0f);
+        mesh_translate(m, (struct vec3){.a = {-103.0f, 2.0f, 57.0f}});
+        ASSERT_IE(1, mesh_check_grid(m));
+        saved = *v;
+
+        // A vertex off its place in the xz grid, deep inside the mesh
+        v->pos.x += 0.01f;
+        ASSERT_IE(0, mesh_check_grid(m));
+        ASSERT_IE(0, mesh_is_grid(m));
+        *v = saved;
+        v->pos.z -= 0.01f;
+        ASSERT_IE(0, mesh_check_grid(m));
+        *v = saved;
+        ASSERT_IE(1, mesh_check_grid(m));
+
+        // A cell split along the other diagonal
+        m->indices[i + 2] = m->indices[i + 5];
+        m->indices[i + 3] = m->indices[i + 0];
+        ASSERT_IE(0, mesh_check_grid(m));
+        ASSERT_IE(0, mesh_is_grid(m));
+
+        mesh_free(m);
+        free(m);
+
+        return 0;
+}
+
+static int test_point_on_mesh_walk(void)
+{
+        struct mesh* m = gen_mesh(8.0f, 8.0f, 1.0f);
+        struct mesh flat;
+        uint32_t tc = m->index_count / 3;
+        uint32_t ti = 0;
+        int ret = 0;
+
+        mesh_heightmap(m, 4, 2.0f, 2.0f);
+
+        // Adjacency must be symmetric, and only the border edges are
+        // unlinked
+        int border = 0;
+        for (uint32_t i = 0; i < tc * 3; i++)
+        {
+                uint32_t n = m->adjacency[i];
+                int back = 0;
+
+                if (n == MESH_NO_ADJ)
+                {
+                        border++;
+                        continue;
+                }
+                for (uint32_t k = 0; k < 3; k++)
+                {
+                        back += m->adjacency[n * 3 + k] == i / 3;
+                }
+                ASSERT_IE(1, back);
+        }
+        ASSERT_IE(4 * 8, border);
+
+        // Walk without the grid to not hit the grid fast path
+        flat = *m;
+        flat.grid_x = 0;
+        flat.grid_z = 0;
+
+        for (int i = 0; i < 2000 && !ret; i++)
+        {
+                struct particle p = {0};
+                struct collision toi;
+
+                p.p.x = lcg_u01() * 8.0f;
+                p.p.y = 5.0f;
+                p.p.z = lcg_u01() * 8.0f;
+                p.v.y = -10.0f;
+
+                if (!compute_toi(&toi, &p, &flat, 1))
+                {
+                        continue;
+                }
+                p.p.y -= 10.0f * toi.t;
+                p.p.y += 0.0005f;
+
+                // Start at the previous triangle
+                uint32_t start = ti;
+                if (point_on_mesh_walk(&flat, p.p, &ti) !=
+                    point_on_mesh(&flat, p.p))
+                {
+                        printf("walk mismatch from %u\n", start);
+                        ret = 1;
+                }
+                ASSERT_IE(1, ti < tc);
+        }
+
+        // Beside the mesh, with a stale start triangle
+        ti = tc + 10;
+        ASSERT_IE(0, point_on_mesh_walk(&flat, (struct vec3){
+                                .a = { -1.0f, 0.0f, -1.0f } }, &ti));
+
+        mesh_free(m);
+        free(m);
+
+        return ret;
+}
+
+static int test_mesh_tris(void)
+{
+        struct mesh* m = gen_mesh(4.0f, 4.0f, 1.0f);
+        struct particle p = {0};
+        struct collision cached;
+        struct collision computed;
+
+        mesh_heightmap(m, 2, 1.0f, 2.0f);
+        mesh_translate(m, (struct vec3){.a = {-2.0f, 0.5f, -2.0f}});
+
+        for (uint32_t i = 0; i < m->index_count / 3; i++)
+        {
+                struct vertex* v0;
+                struct vertex* v1;
+                struct vertex* v2;
+
+                mesh_get_tri(&v0, &v1, &v2, m, i);
+                struct vec3 e1 = vec3_sub(v1->pos, v0->pos);
+                struct vec3 e2 = vec3_sub(v2->pos, v0->pos);
+                struct vec3 n = vec3_norm(vec3_cross(e1, e2));
+
+                ASSERT_FE(e1.x, m->tris[i].e1.x);
+                ASSERT_FE(e2.z, m->tris[i].e2.z);
+                ASSERT_FE(n.y, m->tris[i].n.y);
+                ASSERT_FE(vec3_dot(n, v0->pos), m->tris[i].d);
+        }
+
+        p.p = (struct vec3){.a = {0.3f, 4.0f, 0.2f}};
+        p.v = (struct vec3){.a = {0.5f, -5.0f, 0.1f}};
+
+        ASSERT_IE(1, compute_toi(&cached, &p, m, 1));
+        mesh_invalidate_tris(m);
+        ASSERT_IE(1, compute_toi(&computed, &p, m, 1));
+        ASSERT_FE(cached.t, computed.t);
+        ASSERT_FE(cached.n.y, computed.n.y);
+        ASSERT_IE(cached.ti, computed.ti);
+
+        mesh_free(m);
+        free(m);
+
+        return 0;
+}
+
+static int test_grid_normalize(void)
+{
+        struct mesh* m = gen_mesh(4.0f, 3.0f, 0.5f);
+        struct mesh* ref = gen_mesh(4.0f, 3.0f, 0.5f);
+        uint8_t* dirty = calloc(m->vertex_count, 1);
+        struct vec3 up = {.a = {0.0f, 1.0f, 0.0f}};
+        uint32_t i = 3 * (uint32_t)m->grid_x + 4;
+
+        // A plane, same as summing the triangle normals
+        for (uint32_t k = 0; k < m->vertex_count; k++)
+        {
+                m->vertices[k].pos.y = 0.5f * m->vertices[k].pos.x -
+                        0.25f * m->vertices[k].pos.z;
+        }
+        memcpy(ref->vertices, m->vertices,
+               m->vertex_count * sizeof(struct vertex));
+        ASSERT_IE(0, mesh_grid_normalize(m));
+        mesh_normalize(ref);
+        for (uint32_t k = 0; k < m->vertex_count; k++)
+        {
+                ASSERT_IE(1, vec3_approx(ref->vertices[k].normal,
+                                         m->vertices[k].normal, F_THR));
+        }
+
+        // Only the moved vertex and its neighbours are recreated
+        memcpy(ref->vertices, m->vertices,
+               m->vertex_count * sizeof(struct vertex));
+        m->vertices[i].pos.y += 1.0f;
+        ref->vertices[i].pos.y += 1.0f;
+        dirty[i] = 1;
+        ASSERT_IE(5, mesh_grid_normalize_dirty(m, dirty));
+        ASSERT_IE(0, mesh_grid_normalize(ref));
+        ASSERT_IE(0, memcmp(ref->vertices, m->vertices,
+                            m->vertex_count * sizeof(struct vertex)));
+        ASSERT_IE(1, !vec3_approx(up, m->vertices[i + 1].normal, F_THR));
+
+        // A corner has two neighbours
+        memset(dirty, 0, m->vertex_count);
+        dirty[0] = 1;
+        ASSERT_IE(3, mesh_grid_normalize_dirty(m, dirty));
+
+        // Not a grid
+        m->grid_x = 0;
+        ASSERT_IE(-1, mesh_grid_normalize(m));
+        ASSERT_IE(-1, mesh_grid_normalize_dirty(m, dirty));
+
+        free(dirty);
+        mesh_free(m);
+        free(m);
+        mesh_free(ref);
+        free(ref);
+
+        return 0;
+}
+
+static int test_colorize_lut(void)
+{
+        struct mesh* m = gen_mesh(6.0f, 6.0f, 0.25f);
+        struct mesh* ref = gen_mesh(6.0f, 6.0f, 0.25f);
+        struct color_lut lut[2];
+        // A table step, times the steepest gradient slope
+        float thr = 1.0f / (COLOR_LUT_SIZE - 1) * 1.25f;
+
+        color_lut_init(lut + 0, GRADIENT_TERRAIN);
+        color_lut_init(lut + 1, GRADIENT_WATER);
+        ASSERT_FE(0.05f, lut[0].c[0].x);
+        ASSERT_FE(0.55f, lut[0].c[COLOR_LUT_SIZE - 1].z);
+        ASSERT_FE(0.40f, lut[1].c[COLOR_LUT_SIZE - 1].x);
+
+        mesh_heightmap(m, 4, 2.0f, 2.0f);
+        memcpy(ref->vertices, m->vertices,
+               m->vertex_count * sizeof(struct vertex));
+
+        // Within the quantization of the table
+        for (int k = 0; k < 2; k++)
+        {
+                if (k == 0)
+                {
+                        mesh_colorize(ref);
+                }
+                else
+                {
+                        mesh_colorize_water(ref);
+                }
+                mesh_colorize_lut(m, lut + k);
+                for (uint32_t i = 0; i < m->vertex_count; i++)
+                {
+                        struct vec4 a = ref->vertices[i].color;
+                        struct vec4 b = m->vertices[i].color;
+
+                        ASSERT_IE(1, fabsf(a.x - b.x) <= thr);
+                        ASSERT_IE(1, fabsf(a.y - b.y) <= thr);
+                        ASSERT_IE(1, fabsf(a.z - b.z) <= thr);
+                        ASSERT_FE(1.0f, b.w);
+                }
+        }
+
+        // Fixed range, heights outside it are clamped
+        m->vertices[0].pos.y = -5.0f;
+        m->vertices[1].pos.y = 5.0f;
+        m->vertices[2].pos.y = 0.5f;
+        mesh_colorize_lut_range(m, lut, 0.0f, 1.0f);
+        ASSERT_FE(lut[0].c[0].y, m->vertices[0].color.y);
+        ASSERT_FE(lut[0].c[COLOR_LUT_SIZE - 1].y, m->vertices[1].color.y);
+        ASSERT_FE(lut[0].c[COLOR_LUT_SIZE / 2].y, m->vertices[2].color.y);
+
+        // Fused, same as coloring and normalizing one after the other
+        memcpy(ref->vertices, m->vertices,
+               m->vertex_count * sizeof(struct vertex));
+        mesh_colorize_lut_range(ref, lut + 1, -1.0f, 2.0f);
+        ASSERT_IE(0, mesh_grid_normalize(ref));
+        ASSERT_IE(0, mesh_grid_colorize_normalize(m, lut + 1, -1.0f, 2.0f));
+        ASSERT_IE(0, memcmp(ref->vertices, m->vertices,
+                            m->vertex_count * sizeof(struct vertex)));
+
+        mesh_free(m);
+        free(m);
+        mesh_free(ref);
+        free(ref);
+
+        return 0;
+}
+
+static int test_heightmap_grid(void)
+{
+        struct mesh* m[3];
+        struct km_pool* pool = km_pool_create(4);
+        float px[40];
+        float pz[40];
+        float ph[40];
+        int raised = 0;
+
+        for (int k = 0; k < 3; k++)
+        {
+                m[k] = gen_mesh(30.0f, 20.0f, 0.25f);
+                mesh_translate(m[k], (struct vec3){.a = {-15.0f, 0.0f, 0.0f}});
+        }
+        // Peaks inside, on the border and outside of the mesh
+        for (int p = 0; p < 40; p++)
+        {
+                px[p] = (lcg_u01() - 0.5f) * 36.0f;
+                pz[p] = lcg_u01() * 26.0f - 3.0f;
+                ph[p] = lcg_u01() * 3.0f;
+        }
+
+        // Every vertex and every peak as the reference
+        m[2]->grid_x = 0;
+        mesh_heightmap_peaks(m[0], px, pz, ph, 40, 2.5f, NULL);
+        mesh_heightmap_peaks(m[1], px, pz, ph, 40, 2.5f, pool);
+        mesh_heightmap_peaks(m[2], px, pz, ph, 40, 2.5f, NULL);
+        m[2]->grid_x = m[0]->grid_x;
+
+        for (uint32_t i = 0; i < m[0]->vertex_count; i++)
+        {
+                raised += m[0]->vertices[i].pos.y > 0.0f;
+        }
+        ASSERT_IE(1, raised > 1000);
+        ASSERT_IE(1, raised < (int)m[0]->vertex_count);
+        for (int k = 1; k < 3; k++)
+        {
+                ASSERT_IE(0, memcmp(m[0]->vertices, m[k]->vertices,
+                                    m[0]->vertex_count *
+                                    sizeof(struct vertex)));
+        }
+
+        km_pool_free(pool);
+        for (int k = 0; k < 3; k++)
+        {
+                mesh_free(m[k]);
+                free(m[k]);
+        }
+
+        return 0;
+}
+
 static struct test_entry tests[] = {
         {"ray_tri: hit",              test_ray_hit},
         {"ray_tri: far away",         test_ray_far},
@@ -552,6 +967,13 @@ static struct test_entry tests[] = {
         {"gen_mesh",                  test_gen_mesh},
         {"gen_large_mesh",            test_gen_mesh_large},
         {"point_on_mesh",             test_point_on_mesh},
-        {"write_parse_mesh",          test_write_parse_mesh}
+        {"write_parse_mesh",          test_write_parse_mesh},
+        {"grid_walk",                 test_grid_walk},
+        {"grid_check",                test_grid_check},
+        {"point_on_mesh_walk",        test_point_on_mesh_walk},
+        {"mesh_tris",                 test_mesh_tris},
+        {"grid_normalize",            test_grid_normalize},
+        {"colorize_lut",              test_colorize_lut},
+        {"heightmap_grid",            test_heightmap_grid}
 };
 RUN_TESTS(tests)
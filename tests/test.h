@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <stdint.h>
 #include "km_math.h"
 
 #define F_THR 0.0001f
@@ -29,6 +30,24 @@ static int float_approx(float a, float b, float thr)
         return fabsf(a - b) < thr;
 }
 
+/*
+ * Deterministic input for tests, so every run sees the same data.
+ * Define TEST_LCG_SEED before including this file for another sequence.
+ */
+#ifndef TEST_LCG_SEED
+#define TEST_LCG_SEED 4711u
+#endif
+
+__attribute__((unused))
+static uint32_t lcg_state = TEST_LCG_SEED;
+
+__attribute__((unused))
+static float lcg_u01(void)
+{
+        lcg_state = lcg_state * 1664525u + 1013904223u;
+        return (float)(lcg_state >> 8) / (float)(1u << 24);
+}
+
 #define RUN_TESTS(entries)                                        \
 int main(void)                                                    \
 {                                                                 \
@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include "km_bvh.h"
+#include "km_triblock.h"
+#include "km_geom.h"
+#include "km_phys.h"
+#define TEST_LCG_SEED 12345u
+#include "test.h"
+
+static int test_bvh_build(void);
+static int test_bvh_seg(void);
+static int test_toi_vs_brute(void);
+static int test_toi_translate(void);
+static int test_toi_tree(void);
+static int test_tri_block(void);
+
+/*
+ * Brute force reference: test every triangle of every mesh.
+ */
+static int brute_toi(struct collision* toi,
+                     const struct particle* p,
+                     struct mesh* meshes,
+                     int mc)
+{
+        int ret = 0;
+
+        toi->t = INFINITY;
+        for (int s = 0; s < mc; s++)
+        {
+                for (uint32_t ti = 0; ti < meshes[s].index_count / 3; ti++)
+                {
+                        struct vertex* v0;
+                        struct vertex* v1;
+                        struct vertex* v2;
+                        float t, u, v;
+
+                        mesh_get_tri(&v0, &v1, &v2, meshes + s, ti);
+                        if (ray_tri_intersect(p, &v0->pos, &v1->pos, &v2->pos,
+                                              &t, &u, &v) &&
+                            t <= 1.0f && t < toi->t)
+                        {
+                                toi->t = t;
+                                toi->m = meshes + s;
+                                toi->ti = ti;
+                                ret = 1;
+                        }
+                }
+        }
+
+        return ret;
+}
+
+static struct particle random_particle(float ext)
+{
+        struct particle p = {0};
+
+        p.p.x = (lcg_u01() - 0.5f) * ext;
+        p.p.y = lcg_u01() * 6.0f + 0.5f;
+        p.p.z = (lcg_u01() - 0.5f) * ext;
+        p.v.x = (lcg_u01() - 0.5f) * 8.0f;
+        p.v.y = -lcg_u01() * 8.0f;
+        p.v.z = (lcg_u01() - 0.5f) * 8.0f;
+
+        return p;
+}
+
+static int compare_toi(struct particle* p, struct mesh* m, int mc,
+                       int coll, const struct collision* toi)
+{
+        struct collision exp = {0};
+        int exp_coll = brute_toi(&exp, p, m, mc);
+
+        if (coll != exp_coll)
+        {
+                printf("collision mismatch got %d expected %d\n",
+                       coll, exp_coll);
+                return 1;
+        }
+        if (!coll)
+        {
+                return 0;
+        }
+        if (toi->t != exp.t || toi->m != exp.m || toi->ti != exp.ti)
+        {
+                printf("toi mismatch got (%f %u) expected (%f %u)\n",
+                       toi->t, toi->ti, exp.t, exp.ti);
+                return 1;
+        }
+
+        return 0;
+}
+
+static int test_bvh_build(void)
+{
+        struct bvh b = {0};
+        struct aabb boxes[100];
+        int seen[100] = {0};
+
+        for (int i = 0; i < 100; i++)
+        {
+                struct vec3 c = { .a = { lcg_u01() * 10.0f,
+                                         lcg_u01() * 10.0f,
+                                         lcg_u01() * 10.0f } };
+                aabb_empty(boxes + i);
+                aabb_extend(boxes + i, c);
+                aabb_extend(boxes + i, vec3_add(c, (struct vec3){
+                                        .a = { 0.1f, 0.1f, 0.1f } }));
+        }
+
+        ASSERT_IE(0, bvh_build(&b, boxes, 100));
+        ASSERT_IE(100, b.item_count);
+
+        for (uint32_t i = 0; i < b.node_count; i++)
+        {
+                struct bvh_node* n = b.nodes + i;
+
+                if (n->count == 0)
+                {
+                        continue;
+                }
+                if (n->count > BVH_LEAF_SIZE)
+                {
+                        printf("too large leaf %u\n", n->count);
+                        return 1;
+                }
+                for (uint32_t j = 0; j < n->count; j++)
+                {
+                        uint32_t item = b.items[n->first + j];
+                        seen[item]++;
+                        // The leaf must contain the item
+                        ASSERT_IE(1, boxes[item].min.x >= n->box.min.x);
+                        ASSERT_IE(1, boxes[item].max.y <= n->box.max.y);
+                }
+        }
+
+        for (int i = 0; i < 100; i++)
+        {
+                ASSERT_IE(1, seen[i]);
+        }
+
+        bvh_free(&b);
+        ASSERT_IE(0, b.node_count);
+
+        return 0;
+}
+
+static int test_bvh_seg(void)
+{
+        struct aabb b = {
+                .min = { .a = { 0.0f, 0.0f, 0.0f } },
+                .max = { .a = { 1.0f, 1.0f, 1.0f } }
+        };
+        struct vec3 o = { .a = { 0.5f, 2.0f, 0.5f } };
+        struct vec3 d = { .a = { 0.0f, -1.0f, 0.0f } };
+        float t;
+
+        // Segment too short
+        ASSERT_IE(0, aabb_seg_overlap(&b, o, d, 0.5f, &t));
+        // Long enough
+        ASSERT_IE(1, aabb_seg_overlap(&b, o, d, 1.5f, &t));
+        ASSERT_FE(1.0f, t);
+        // Pointing away
+        d.y = 1.0f;
+        ASSERT_IE(0, aabb_seg_overlap(&b, o, d, 10.0f, &t));
+        // Starting inside
+        o.y = 0.5f;
+        ASSERT_IE(1, aabb_seg_overlap(&b, o, d, 10.0f, &t));
+        ASSERT_FE(0.0f, t);
+        // Parallel to, but outside a slab
+        o.x = 2.0f;
+        ASSERT_IE(0, aabb_seg_overlap(&b, o, d, 10.0f, &t));
+
+        return 0;
+}
+
+static int test_toi_vs_brute(void)
+{
+        struct mesh* m = gen_mesh(20.0f, 20.0f, 0.5f);
+        int ret = 0;
+
+        mesh_translate(m, (struct vec3){ .a = { -10.0f, 0.0f, -10.0f } });
+        mesh_heightmap(m, 10, 4.0f, 5.0f);
+
+        for (int i = 0; i < 2000 && !ret; i++)
+        {
+                struct particle p = random_particle(24.0f);
+                struct collision toi;
+                int coll = compute_toi(&toi, &p, m, 1);
+
+                ret = compare_toi(&p, m, 1, coll, &toi);
+        }
+
+        mesh_free(m);
+        free(m);
+
+        return ret;
+}
+
+static int test_toi_translate(void)
+{
+        struct mesh* m = gen_mesh(4.0f, 4.0f, 1.0f);
+        struct particle p = {0};
+        struct collision toi;
+
+        p.p.y = 1.0f;
+        p.v.y = -2.0f;
+
+        // The mesh is rooted at the origin, so the particle is outside
+        // the mesh when it's moved
+        mesh_translate(m, (struct vec3){ .a = { 1.0f, 0.0f, 1.0f } });
+        ASSERT_IE(0, compute_toi(&toi, &p, m, 1));
+
+        mesh_translate(m, (struct vec3){ .a = { -3.0f, -0.5f, -3.0f } });
+        ASSERT_IE(1, compute_toi(&toi, &p, m, 1));
+        ASSERT_FE(0.75f, toi.t);
+
+        // Raise the vertices by hand and refit
+        for (uint16_t i = 0; i < m->vertex_count; i++)
+        {
+                m->vertices[i].pos.y = 0.5f;
+        }
+        mesh_build_tris(m);
+        mesh_refit_bvh(m);
+        ASSERT_IE(1, compute_toi(&toi, &p, m, 1));
+        ASSERT_FE(0.25f, toi.t);
+
+        mesh_free(m);
+        free(m);
+
+        return 0;
+}
+
+static int test_toi_tree(void)
+{
+        struct world w;
+        int ret = 0;
+
+        default_world(&w, 60);
+        w.surface_count = 3;
+        w.surfaces = calloc(3, sizeof(struct mesh));
+
+        for (int i = 0; i < w.surface_count; i++)
+        {
+                struct mesh* m = gen_mesh(8.0f, 8.0f, 0.5f);
+                mesh_translate(m, (struct vec3){
+                                .a = { -12.0f + 8.0f * (float)i,
+                                       (float)i, -4.0f } });
+                mesh_heightmap(m, 4, 2.0f, 3.0f);
+                w.surfaces[i] = *m;
+                free(m);
+        }
+
+        ASSERT_IE(0, world_build_bvh(&w));
+
+        for (int i = 0; i < 2000 && !ret; i++)
+        {
+                struct particle p = random_particle(24.0f);
+                struct collision toi;
+                int coll = compute_toi_tree(&toi, &p, w.surface_bvh,
+                                            w.surfaces);
+
+                ret = compare_toi(&p, w.surfaces, w.surface_count,
+                                  coll, &toi);
+        }
+
+        // Move one mesh and refit the world
+        mesh_translate(w.surfaces + 1, (struct vec3){ .a = { 0.0f, 2.0f, 0.0f } });
+        world_refit_bvh(&w);
+
+        for (int i = 0; i < 2000 && !ret; i++)
+        {
+                struct particle p = random_particle(24.0f);
+                struct collision toi;
+                int coll = compute_toi_tree(&toi, &p, w.surface_bvh,
+                                            w.surfaces);
+
+                ret = compare_toi(&p, w.surfaces, w.surface_count,
+                                  coll, &toi);
+        }
+
+        world_free_bvh(&w);
+        for (int i = 0; i < w.surface_count; i++)
+        {
+                mesh_free(w.surfaces + i);
+        }
+        free(w.surfaces);
+
+        return ret;
+}
+
+static int test_tri_block(void)
+{
+        struct mesh* m = gen_mesh(20.0f, 20.0f, 0.5f);
+        struct mesh flat;
+        enum tri_block_isa def = tri_block_get_isa();
+        int ret = 0;
+
+        mesh_translate(m, (struct vec3){ .a = { -10.0f, 0.0f, -10.0f } });
+        mesh_heightmap(m, 10, 4.0f, 5.0f);
+
+        // Without the grid, the bvh leaves are tested with the blocks
+        flat = *m;
+        flat.grid_x = 0;
+        flat.grid_z = 0;
+        ASSERT_IE(1, flat.blocks != NULL);
+
+        for (int isa = TRI_ISA_SCALAR; isa <= TRI_ISA_NEON && !ret; isa++)
+        {
+                if (tri_block_set_isa((enum tri_block_isa)isa) != 0)
+                {
+                        continue;
+                }
+
+                for (int i = 0; i < 1000 && !ret; i++)
+                {
+                        struct particle p = random_particle(24.0f);
+                        struct collision toi;
+                        int coll = compute_toi(&toi, &p, &flat, 1);
+
+                        ret = compare_toi(&p, &flat, 1, coll, &toi);
+
+                        // Every lane must match the scalar code
+                        for (uint32_t j = 0; j < flat.block_count; j++)
+                        {
+                                const struct tri_block* b = flat.blocks + j;
+                                float t[TRI_BLOCK_SIZE];
+                                unsigned int hits;
+
+                                hits = tri_block_intersect(b, &p, 0xffu, t);
+                                for (uint32_t l = 0; l < TRI_BLOCK_SIZE; l++)
+                                {
+                                        uint32_t k = j * TRI_BLOCK_SIZE + l;
+                                        struct vertex* v0;
+                                        struct vertex* v1;
+                                        struct vertex* v2;
+                                        float et, u, v;
+                                        int hit = 0;
+
+                                        if (k < flat.bvh->item_count)
+                                        {
+                                                mesh_get_tri(&v0, &v1, &v2,
+                                                             &flat, b->ti[l]);
+                                                hit = ray_tri_intersect(
+                                                        &p, &v0->pos,
+                                                        &v1->pos, &v2->pos,
+                                                        &et, &u, &v);
+                                        }
+                                        if (hit != !!(hits & (1u << l)) ||
+                                            (hit && et != t[l]))
+                                        {
+                                                printf("isa %d lane %u "
+                                                       "differs\n", isa, k);
+                                                ret = 1;
+                                        }
+                                }
+                        }
+                }
+        }
+
+        tri_block_set_isa(def);
+        mesh_free(m);
+        free(m);
+
+        return ret;
+}
+
+static struct test_entry tests[] = {
+        {"bvh_build",            test_bvh_build},
+        {"aabb_seg_overlap",     test_bvh_seg},
+        {"compute_toi vs brute", test_toi_vs_brute},
+        {"compute_toi translate", test_toi_translate},
+        {"compute_toi_tree",     test_toi_tree},
+        {"tri_block kernels",    test_tri_block},
+};
+RUN_TESTS(tests)
@@ -0,0 +1,550 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "km_geom.h"
+#include "km_phys.h"
+#include "km_meshio.h"
+#include "test.h"
+
+static int test_bin_roundtrip(void);
+static int test_bin_load_meshes(void);
+static int test_bin_invalid(void);
+static int test_json_chunks(void);
+static int test_json_schema(void);
+static int test_json_errors(void);
+static int test_json_write(void);
+static int test_json_write_floats(void);
+static int test_large_mesh(void);
+static int test_bin_version1(void);
+
+static struct mesh* make_meshes(void)
+{
+        struct mesh* meshes = calloc(2, sizeof(struct mesh));
+        struct mesh* a = gen_mesh(8.0f, 6.0f, 0.5f);
+        struct mesh* b = gen_mesh(2.0f, 2.0f, 1.0f);
+
+        mesh_translate(a, (struct vec3){ .a = { -4.0f, 0.0f, -3.0f } });
+        mesh_heightmap(a, 3, 1.5f, 2.0f);
+        mesh_colorize(a);
+        a->restitution = 0.4f;
+        a->static_mu = 0.6f;
+        a->dynamic_mu = 0.5f;
+        b->restitution = 0.9f;
+        meshes[0] = *a;
+        meshes[1] = *b;
+        free(a);
+        free(b);
+
+        return meshes;
+}
+
+static int mesh_equal(const struct mesh* a, const struct mesh* b)
+{
+        ASSERT_FE(a->restitution, b->restitution);
+        ASSERT_FE(a->static_mu, b->static_mu);
+        ASSERT_FE(a->dynamic_mu, b->dynamic_mu);
+        ASSERT_IE(a->grid_x, b->grid_x);
+        ASSERT_IE(a->grid_z, b->grid_z);
+        ASSERT_IE(a->vertex_count, b->vertex_count);
+        ASSERT_IE(a->index_count, b->index_count);
+        ASSERT_IE(0, memcmp(a->vertices, b->vertices,
+                            a->vertex_count * sizeof(struct vertex)));
+        ASSERT_IE(mesh_index_size(a), mesh_index_size(b));
+        ASSERT_IE(0, memcmp(a->indices32 ? (void*)a->indices32 :
+                            (void*)a->indices,
+                            b->indices32 ? (void*)b->indices32 :
+                            (void*)b->indices,
+                            a->index_count * mesh_index_size(a)));
+        ASSERT_IE(0, memcmp(a->inward_normals, b->inward_normals,
+                            a->index_count * sizeof(struct vec3)));
+
+        return 0;
+}
+
+static int test_bin_roundtrip(void)
+{
+        struct mesh* meshes = make_meshes();
+        char path[] = "/tmp/kfg_bin_XXXXXX";
+        struct mesh_file f;
+        struct particle p = {0};
+        struct collision toi;
+        int fd = mkstemp(path);
+
+        ASSERT_IE(1, fd >= 0);
+        close(fd);
+
+        ASSERT_IE(0, write_meshes_bin(path, meshes, 2));
+        ASSERT_IE(1, mesh_bin_probe(path));
+        ASSERT_IE(0, mesh_file_open(&f, path));
+        unlink(path);
+
+        ASSERT_IE(2, f.count);
+        for (int i = 0; i < 2; i++)
+        {
+                ASSERT_IE(0, mesh_equal(meshes + i, f.meshes + i));
+                ASSERT_IE(1, f.meshes[i].mapped);
+                ASSERT_IE(1, f.meshes[i].bvh != NULL);
+                ASSERT_IE(1, f.meshes[i].adjacency != NULL);
+                // Used in place, and aligned
+                ASSERT_IE(0, ((uintptr_t)f.meshes[i].vertices) %
+                          MESH_BIN_ALIGN);
+                ASSERT_IE(1, (char*)f.meshes[i].indices > (char*)f.base);
+        }
+
+        // The meshes can be queried, and modified without touching
+        // the file
+        p.p = (struct vec3){ .a = { 0.3f, 5.0f, 0.2f } };
+        p.v = (struct vec3){ .a = { 0.0f, -10.0f, 0.0f } };
+        ASSERT_IE(1, compute_toi(&toi, &p, f.meshes, 1));
+        mesh_translate(f.meshes, (struct vec3){ .a = { 0.0f, 1.0f, 0.0f } });
+        ASSERT_FE(meshes[0].vertices[0].pos.y + 1.0f,
+                  f.meshes[0].vertices[0].pos.y);
+
+        mesh_file_close(&f);
+        ASSERT_IE(1, f.base == NULL);
+        for (int i = 0; i < 2; i++)
+        {
+                mesh_free(meshes + i);
+        }
+        free(meshes);
+
+        return 0;
+}
+
+static int test_bin_load_meshes(void)
+{
+        struct mesh* meshes = make_meshes();
+        char tmp[] = "/tmp/kfg_bin_XXXXXX";
+        char path[64];
+        struct mesh* r;
+        int count = 0;
+        int fd = mkstemp(tmp);
+
+        ASSERT_IE(1, fd >= 0);
+        close(fd);
+        unlink(tmp);
+        snprintf(path, sizeof(path), "%s%s", tmp, MESH_BIN_EXT);
+
+        // Picked by the extension, and detected when reading
+        ASSERT_IE(0, write_meshes(path, meshes, 2));
+        ASSERT_IE(1, mesh_bin_probe(path));
+        r = load_meshes(path, &count);
+        unlink(path);
+
+        ASSERT_IE(2, count);
+        ASSERT_IE(1, r != NULL);
+        for (int i = 0; i < 2; i++)
+        {
+                ASSERT_IE(0, mesh_equal(meshes + i, r + i));
+                ASSERT_IE(0, r[i].mapped);
+                mesh_free(r + i);
+                mesh_free(meshes + i);
+        }
+        free(r);
+        free(meshes);
+
+        return 0;
+}
+
+static int test_bin_invalid(void)
+{
+        struct mesh* meshes = make_meshes();
+        char path[] = "/tmp/kfg_bin_XXXXXX";
+        struct mesh_bin_header h;
+        struct mesh_bin_entry e;
+        struct mesh_file f;
+        FILE* fp;
+        int fd = mkstemp(path);
+
+        ASSERT_IE(1, fd >= 0);
+        close(fd);
+
+        // Not a binary file
+        ASSERT_IE(0, mesh_bin_probe(path));
+        ASSERT_IE(-1, mesh_file_open(&f, path));
+
+        ASSERT_IE(0, write_meshes_bin(path, meshes, 1));
+
+        // Wrong version
+        fp = fopen(path, "r+b");
+        ASSERT_IE(1, fread(&h, sizeof(h), 1, fp));
+        h.version = MESH_BIN_VERSION + 1;
+        rewind(fp);
+        fwrite(&h, sizeof(h), 1, fp);
+        fclose(fp);
+        ASSERT_IE(-1, mesh_file_open(&f, path));
+
+        // Block past the end of the file
+        h.version = MESH_BIN_VERSION;
+        fp = fopen(path, "r+b");
+        fwrite(&h, sizeof(h), 1, fp);
+        ASSERT_IE(1, fread(&e, sizeof(e), 1, fp));
+        e.normal_off += MESH_BIN_ALIGN * 1000;
+        fseek(fp, (long)sizeof(h), SEEK_SET);
+        fwrite(&e, sizeof(e), 1, fp);
+        fclose(fp);
+        ASSERT_IE(-1, mesh_file_open(&f, path));
+        ASSERT_IE(1, f.base == NULL);
+
+        unlink(path);
+        for (int i = 0; i < 2; i++)
+        {
+                mesh_free(meshes + i);
+        }
+        free(meshes);
+
+        return 0;
+}
+
+static int test_json_chunks(void)
+{
+        static const size_t chunks[] = { 1, 7, 4096, 0 };
+        struct mesh* meshes = make_meshes();
+        char path[] = "/tmp/kfg_json_XXXXXX";
+        int fd = mkstemp(path);
+        int ret = 0;
+
+        ASSERT_IE(1, fd >= 0);
+        close(fd);
+        ASSERT_IE(0, write_meshes(path, meshes, 2));
+
+        // Values split over any chunk boundary are read the same
+        for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++)
+        {
+                struct mesh_json_error err;
+                FILE* f = fopen(path, "rb");
+                struct mesh* r;
+                int count = 0;
+
+                r = read_meshes_json(f, chunks[c], &count, &err);
+                fclose(f);
+                ASSERT_IE(1, r != NULL);
+                ASSERT_IE(2, count);
+                ASSERT_IE(0, err.msg[0]);
+                for (int i = 0; i < count; i++)
+                {
+                        ret |= mesh_equal(meshes + i, r + i);
+                        ASSERT_IE(1, r[i].bvh != NULL);
+                        mesh_free(r + i);
+                }
+                free(r);
+        }
+
+        unlink(path);
+        for (int i = 0; i < 2; i++)
+        {
+                mesh_free(meshes + i);
+        }
+        free(meshes);
+
+        return ret;
+}
+
+static int test_json_schema(void)
+{
+        // Keys in any order and case, the first of any duplicates
+        // is used, unknown keys and non numbers are skipped
+        static char doc[] =
+                "{ \"version\": [1, {\"a\": null}], \"MESHES\": [\n"
+                "  { \"Restitution\": 0.5, \"static_mu\": \"x\",\n"
+                "    \"restitution\": 0.9,\n"
+                "    \"extra\": {\"k\": [true, false, \"s\\\"\\u00e5\"]},\n"
+                "    \"indices\": [0, 1, 2, 2, 1, 3],\n"
+                "    \"vertices\": [\n"
+                "      {\"position\": [0, 0, 0, 7], \"color\": [1, 0, 0]},\n"
+                "      {\"color\": [0.1, 0.2, 0.3, 0.4, 9],\n"
+                "       \"position\": [1e0, -0.0, 0.5e-1], \"uv\": [1]},\n"
+                "      {\"position\": [0.1, 1.25E+1, 1],\n"
+                "       \"color\": [1, \"r\", 1, 1]},\n"
+                "      {\"position\": [1, 2, 3]} ],\n"
+                "    \"grid_x\": 2.7, \"grid_z\": 2 }\n"
+                " ], \"meshes\": [] }";
+        FILE* f = fmemopen(doc, sizeof(doc) - 1, "r");
+        struct mesh* r;
+        int count = 0;
+
+        r = read_meshes_json(f, 16, &count, NULL);
+        fclose(f);
+
+        ASSERT_IE(1, r != NULL);
+        ASSERT_IE(1, count);
+        ASSERT_FE(0.5f, r->restitution);
+        ASSERT_FE(0.5f, r->static_mu);
+        ASSERT_FE(0.5f, r->dynamic_mu);
+        ASSERT_IE(2, r->grid_x);
+        ASSERT_IE(2, r->grid_z);
+        ASSERT_IE(4, r->vertex_count);
+        ASSERT_IE(6, r->index_count);
+        ASSERT_IE(3, r->indices[5]);
+        ASSERT_FE(0.6f, r->vertices[0].color.y);
+        ASSERT_FE(0.4f, r->vertices[1].color.w);
+        ASSERT_FE(0.05f, r->vertices[1].pos.z);
+        ASSERT_FE(12.5f, r->vertices[2].pos.y);
+        ASSERT_FE(0.3f, r->vertices[2].color.x);
+
+        mesh_free(r);
+        free(r);
+
+        return 0;
+}
+
+static int json_error_at(const char* doc, uint64_t offset)
+{
+        struct mesh_json_error err;
+        FILE* f = fmemopen((void*)(uintptr_t)doc, strlen(doc), "r");
+        struct mesh* r;
+        int count = 0;
+
+        r = read_meshes_json(f, 5, &count, &err);
+        fclose(f);
+
+        ASSERT_IE(1, r == NULL);
+        ASSERT_IE(0, count);
+        ASSERT_IE(1, err.msg[0] != '\0');
+        ASSERT_IE(offset, err.offset);
+
+        return 0;
+}
+
+static int test_json_errors(void)
+{
+        ASSERT_IE(0, json_error_at("{\"meshes\": [1]}", 12));
+        ASSERT_IE(0, json_error_at("{\"meshes\":[{\"vertices\":[],"
+                                   "\"indices\":[0,x]}]}", 39));
+        // Reported at the start of the array
+        ASSERT_IE(0, json_error_at("{\"meshes\":[{\"vertices\":"
+                                   "[{\"position\":[0,1]}],"
+                                   "\"indices\":[]}]}", 36));
+        // Index past the last vertex, found at the end of the mesh
+        ASSERT_IE(0, json_error_at("{\"meshes\":[{\"vertices\":"
+                                   "[{\"position\":[0,1,2]}],"
+                                   "\"indices\":[0,0,1]}]}", 64));
+        // Truncated file
+        ASSERT_IE(0, json_error_at("{\"meshes\":[{\"vertices\":[", 24));
+        ASSERT_IE(0, json_error_at("{\"other\": 1}", 12));
+        ASSERT_IE(0, json_error_at("", 0));
+
+        return 0;
+}
+
+static int test_json_write(void)
+{
+        struct mesh* meshes = make_meshes();
+        char path[] = "/tmp/kfg_json_XXXXXX";
+        long size[2];
+        int ret = 0;
+
+        for (int compact = 0; compact < 2; compact++)
+        {
+                FILE* f = tmpfile();
+                struct mesh* r;
+                int count = 0;
+
+                ASSERT_IE(0, write_meshes_json(f, meshes, 2, compact));
+                size[compact] = ftell(f);
+                rewind(f);
+                r = read_meshes_json(f, 0, &count, NULL);
+                fclose(f);
+
+                ASSERT_IE(2, count);
+                for (int i = 0; i < count; i++)
+                {
+                        ret |= mesh_equal(meshes + i, r + i);
+                        mesh_free(r + i);
+                }
+                free(r);
+        }
+        ASSERT_IE(1, size[1] < size[0]);
+
+        // Through a file descriptor
+        {
+                int fd = mkstemp(path);
+                struct mesh* r;
+                int count = 0;
+
+                ASSERT_IE(1, fd >= 0);
+                ASSERT_IE(0, write_meshes_json_fd(fd, meshes, 2, 1));
+                close(fd);
+                r = load_meshes_json(path, &count, NULL);
+                unlink(path);
+
+                ASSERT_IE(2, count);
+                for (int i = 0; i < count; i++)
+                {
+                        ret |= mesh_equal(meshes + i, r + i);
+                        mesh_free(r + i);
+                }
+                free(r);
+        }
+
+        for (int i = 0; i < 2; i++)
+        {
+                mesh_free(meshes + i);
+        }
+        free(meshes);
+
+        return ret;
+}
+
+static int test_json_write_floats(void)
+{
+        struct mesh* m = gen_mesh(1.0f, 1.0f, 1.0f);
+        char* buf = NULL;
+        size_t len = 0;
+        FILE* f = open_memstream(&buf, &len);
+
+        m->restitution = 0.3f;
+        m->static_mu = 1.0f / 3.0f;
+        m->dynamic_mu = -0.0f;
+        m->vertices[0].pos.y = 1e-7f;
+        m->vertices[1].pos.y = 12345678.0f;
+
+        ASSERT_IE(0, write_meshes_json(f, m, 1, 1));
+        fclose(f);
+
+        ASSERT_IE(1, strstr(buf, "{\"meshes\":[{\"restitution\":0.3,"
+                            "\"static_mu\":0.33333334,"
+                            "\"dynamic_mu\":-0,") == buf);
+        ASSERT_IE(1, strstr(buf, "\"position\":[0,1e-07,0]") != NULL);
+        ASSERT_IE(1, strstr(buf, "\"position\":[1,12345678,0]") != NULL);
+        ASSERT_IE(1, strstr(buf, "\"indices\":[0,2,1,1,2,3]}]}") != NULL);
+
+        free(buf);
+        mesh_free(m);
+        free(m);
+
+        return 0;
+}
+
+static int test_large_mesh(void)
+{
+        // 301 x 301 vertices, past what 16 bit indices can address
+        struct mesh* m = gen_mesh(300.0f, 300.0f, 1.0f);
+        char path[] = "/tmp/kfg_bin_XXXXXX";
+        struct mesh_file mf;
+        struct particle p = {0};
+        struct collision toi;
+        uint32_t last = 0;
+        int ret = 0;
+        int fd;
+
+        ASSERT_IE(301 * 301, m->vertex_count);
+        ASSERT_IE(1, m->indices == NULL);
+        ASSERT_IE(1, m->indices32 != NULL);
+        ASSERT_IE(4, mesh_index_size(m));
+        for (uint32_t i = 0; i < m->index_count; i++)
+        {
+                last = mesh_index(m, i) > last ? mesh_index(m, i) : last;
+        }
+        ASSERT_IE(m->vertex_count - 1, last);
+
+        // Hit a triangle in the far corner, which uses vertices past
+        // index 65535
+        mesh_translate(m, (struct vec3){ .a = { -150.0f, 0.0f, -150.0f } });
+        p.p = (struct vec3){ .a = { 149.7f, 5.0f, 149.2f } };
+        p.v = (struct vec3){ .a = { 0.0f, -10.0f, 0.0f } };
+        ASSERT_IE(1, compute_toi(&toi, &p, m, 1));
+        ASSERT_FE(0.5f, toi.t);
+
+        // Binary file keeps the index width
+        fd = mkstemp(path);
+        ASSERT_IE(1, fd >= 0);
+        close(fd);
+        ASSERT_IE(0, write_meshes_bin(path, m, 1));
+        ASSERT_IE(0, mesh_file_open(&mf, path));
+        unlink(path);
+        ASSERT_IE(1, mf.count);
+        ret |= mesh_equal(m, mf.meshes);
+        ASSERT_IE(1, compute_toi(&toi, &p, mf.meshes, 1));
+        mesh_file_close(&mf);
+
+        // JSON, with the indices allocated up front from the grid
+        // size, and widened while reading when there is no grid
+        for (int grid = 1; grid >= 0; grid--)
+        {
+                FILE* f = tmpfile();
+                struct mesh* r;
+                int count = 0;
+
+                if (!grid)
+                {
+                        m->grid_x = 0;
+                        m->grid_z = 0;
+                }
+                ASSERT_IE(0, write_meshes_json(f, m, 1, 1));
+                rewind(f);
+                r = read_meshes_json(f, 0, &count, NULL);
+                fclose(f);
+
+                ASSERT_IE(1, count);
+                ASSERT_IE(1, r->indices32 != NULL);
+                ret |= mesh_equal(m, r);
+                mesh_free(r);
+                free(r);
+        }
+
+        mesh_free(m);
+        free(m);
+
+        return ret;
+}
+
+static int test_bin_version1(void)
+{
+        struct mesh* meshes = make_meshes();
+        char path[] = "/tmp/kfg_bin_XXXXXX";
+        size_t v1_size = offsetof(struct mesh_bin_entry, index_size);
+        struct mesh_bin_header h;
+        struct mesh_bin_entry e[2];
+        struct mesh* r;
+        int count = 0;
+        FILE* fp;
+        int fd = mkstemp(path);
+
+        ASSERT_IE(1, fd >= 0);
+        close(fd);
+        ASSERT_IE(0, write_meshes_bin(path, meshes, 2));
+
+        // Rewrite as version 1, with the shorter mesh table entries.
+        // The blocks stay where they are.
+        fp = fopen(path, "r+b");
+        ASSERT_IE(1, fread(&h, sizeof(h), 1, fp));
+        ASSERT_IE(2, fread(e, sizeof(e[0]), 2, fp));
+        h.version = 1;
+        rewind(fp);
+        fwrite(&h, sizeof(h), 1, fp);
+        fwrite(e + 0, v1_size, 1, fp);
+        fwrite(e + 1, v1_size, 1, fp);
+        fclose(fp);
+
+        r = load_meshes_bin(path, &count);
+        unlink(path);
+
+        ASSERT_IE(2, count);
+        ASSERT_IE(1, r != NULL);
+        for (int i = 0; i < 2; i++)
+        {
+                ASSERT_IE(0, mesh_equal(meshes + i, r + i));
+                mesh_free(r + i);
+                mesh_free(meshes + i);
+        }
+        free(r);
+        free(meshes);
+
+        return 0;
+}
+
+static struct test_entry tests[] = {
+        {"binary mesh: mapped roundtrip", test_bin_roundtrip},
+        {"binary mesh: load_meshes",      test_bin_load_meshes},
+        {"binary mesh: invalid files",    test_bin_invalid},
+        {"json stream: chunk sizes",      test_json_chunks},
+        {"json stream: schema",           test_json_schema},
+        {"json stream: error offsets",    test_json_errors},
+        {"json writer: roundtrip",        test_json_write},
+        {"json writer: shortest floats",  test_json_write_floats},
+        {"32 bit indices: large mesh",    test_large_mesh},
+        {"binary mesh: version 1 file",   test_bin_version1},
+};
+RUN_TESTS(tests)
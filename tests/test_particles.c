@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include "km_particles.h"
+#include "km_phys.h"
+#define TEST_LCG_SEED 2026u
+#include "test.h"
+
+#define NUM_OBJS 1000
+
+static int test_gather_scatter(void);
+static int test_update_vs_objects(void);
+
+static void random_objects(struct object* objs, int n)
+{
+        memset(objs, 0, (size_t)n * sizeof(struct object));
+        for (int i = 0; i < n; i++)
+        {
+                struct object* o = objs + i;
+
+                o->p.p.x = (lcg_u01() - 0.5f) * 20.0f;
+                o->p.p.y = lcg_u01() * 50.0f;
+                o->p.p.z = (lcg_u01() - 0.5f) * 20.0f;
+                o->p.v.x = (lcg_u01() - 0.5f) * 30.0f;
+                o->p.v.y = lcg_u01() * 30.0f;
+                o->p.v.z = (lcg_u01() - 0.5f) * 30.0f;
+                o->area = 0.01f + lcg_u01() * 0.1f;
+                o->drag_c = 0.47f;
+                object_set_m(o, 0.1f + lcg_u01() * 2.0f);
+        }
+}
+
+static int test_gather_scatter(void)
+{
+        struct particles ps;
+        struct object objs[10];
+        struct object back[10];
+
+        random_objects(objs, 10);
+        ASSERT_IE(0, particles_init(&ps, 10));
+        ASSERT_IE(1, ((uintptr_t)ps.vz % 64) == 0);
+        ASSERT_IE(-1, particles_gather(&ps, objs, 11));
+        ASSERT_IE(0, particles_gather(&ps, objs, 10));
+        ASSERT_IE(10, ps.count);
+
+        memset(back, 0, sizeof(back));
+        particles_scatter(&ps, back);
+        for (int i = 0; i < 10; i++)
+        {
+                ASSERT_FE(objs[i].p.p.y, back[i].p.p.y);
+                ASSERT_FE(objs[i].p.v.z, back[i].p.v.z);
+                ASSERT_FE(objs[i].m, ps.m[i]);
+                ASSERT_FE(objs[i].area * objs[i].drag_c, ps.cd[i]);
+                // cold state is not touched
+                ASSERT_FE(0.0f, back[i].m);
+        }
+
+        particles_free(&ps);
+        ASSERT_IE(0, ps.cap);
+
+        return 0;
+}
+
+static int test_update_vs_objects(void)
+{
+        struct object* objs = malloc(NUM_OBJS * sizeof(struct object));
+        struct object* res = malloc(NUM_OBJS * sizeof(struct object));
+        struct particles ps;
+        struct world w = {0};
+        int ret = 0;
+
+        default_world(&w, 60);
+        random_objects(objs, NUM_OBJS);
+        ASSERT_IE(0, particles_init(&ps, NUM_OBJS));
+        ASSERT_IE(0, particles_gather(&ps, objs, NUM_OBJS));
+
+        for (int step = 0; step < 300; step++)
+        {
+                update_objects(step, &w, objs, NUM_OBJS, 0);
+                update_particles(&w, &ps);
+        }
+
+        memcpy(res, objs, NUM_OBJS * sizeof(struct object));
+        particles_scatter(&ps, res);
+
+        // Without any surfaces, the result must be bit identical
+        for (int i = 0; i < NUM_OBJS && !ret; i++)
+        {
+                if (memcmp(&objs[i].p, &res[i].p, sizeof(struct particle)))
+                {
+                        printf("particle %d differs\n", i);
+                        ret = 1;
+                }
+        }
+
+        particles_free(&ps);
+        free(objs);
+        free(res);
+
+        return ret;
+}
+
+static struct test_entry tests[] = {
+        {"gather/scatter",         test_gather_scatter},
+        {"update vs update_objects", test_update_vs_objects},
+};
+RUN_TESTS(tests)
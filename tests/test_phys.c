@@ -1,5 +1,8 @@
+#include <stdlib.h>
+#include <string.h>
 #include "km_phys.h"
 #include "km_geom.h"
+#include "km_spatial.h"
 #include "test.h"
 
 #define THR 1e-4f
@@ -9,6 +12,8 @@ static int test_friction_force_dyn(void);
 static int test_friction_force_stat(void);
 static int test_friction_force_coulomb(void);
 static int test_apex_no_steady_state(void);
+static int test_sleep_timer(void);
+static int test_active_set(void);
 
 static int test_drag_force(void)
 {
@@ -471,11 +476,185 @@ static int test_apex_no_steady_state(void)
         return ret;
 }
 
+static int steps_to_sleep(float sleep_time, int* at_rest)
+{
+        struct mesh* m = gen_mesh(10.0f, 10.0f, 1.0f);
+        struct world wo;
+        struct object o = {0};
+        int step;
+
+        mesh_translate(m, (struct vec3){ .a = {-5.0f, 0, -5.0f} });
+        m->restitution = 0.5f;
+        m->static_mu = 0.5f;
+        m->dynamic_mu = 0.4f;
+        default_world(&wo, 60);
+        wo.surface_count = 1;
+        wo.surfaces = m;
+        wo.sleep_time = sleep_time;
+
+        o.p.p.y = 1.0f;
+        object_set_m(&o, 1.0f);
+        o.restitution = 0.5f;
+        o.static_mu = 0.5f;
+        o.dynamic_mu = 0.4f;
+
+        *at_rest = -1;
+        for (step = 0; step < 60 * 60 && !o.steady_state; step++)
+        {
+                update_object(step, &wo, &o);
+                if (*at_rest < 0 && o.sleep_timer > 0.0f)
+                {
+                        *at_rest = step;
+                }
+        }
+
+        mesh_free(m);
+        free(m);
+
+        return step;
+}
+
+static int test_sleep_timer(void)
+{
+        int rest0;
+        int rest1;
+        int s0 = steps_to_sleep(0.0f, &rest0);
+        int s1 = steps_to_sleep(0.5f, &rest1);
+
+        // Without hysteresis the object sleeps the first step it is
+        // at rest
+        ASSERT_IE(rest0 + 1, s0);
+        // With it, it must stay at rest for 30 steps
+        ASSERT_IE(rest0, rest1);
+        ASSERT_IE(1, s1 - rest1 >= 30);
+        ASSERT_IE(1, s1 - rest1 <= 31);
+
+        return 0;
+}
+
+#define SET_OBJS 200
+
+static int test_active_set(void)
+{
+        struct mesh* m = gen_mesh(10.0f, 10.0f, 0.5f);
+        struct object* all = calloc(SET_OBJS, sizeof(struct object));
+        struct object* act = calloc(SET_OBJS, sizeof(struct object));
+        struct active_set s;
+        struct spatial_hash h;
+        struct world wo;
+        int ret = 0;
+
+        mesh_translate(m, (struct vec3){ .a = {-5.0f, 0, -5.0f} });
+        m->restitution = 0.3f;
+        m->static_mu = 0.6f;
+        m->dynamic_mu = 0.5f;
+        default_world(&wo, 60);
+        wo.surface_count = 1;
+        wo.surfaces = m;
+        wo.sleep_time = 0.25f;
+
+        for (int i = 0; i < SET_OBJS; i++)
+        {
+                struct object* o = all + i;
+
+                o->p.p.x = (float)(i % 20) * 0.4f - 4.0f;
+                o->p.p.y = 0.5f + (float)(i % 7) * 0.3f;
+                o->p.p.z = (float)(i / 20) * 0.8f - 4.0f;
+                o->restitution = 0.3f;
+                o->static_mu = 0.6f;
+                o->dynamic_mu = 0.5f;
+                object_set_m(o, 1.0f);
+        }
+        memcpy(act, all, SET_OBJS * sizeof(struct object));
+
+        ASSERT_IE(0, active_set_init(&s, act, SET_OBJS));
+        ASSERT_IE(SET_OBJS, s.count);
+
+        for (int step = 0; step < 600; step++)
+        {
+                update_objects(step, &wo, all, SET_OBJS, 0);
+                update_active_objects(step, &wo, act, &s);
+        }
+
+        // Same result as updating all objects, and all asleep
+        for (int i = 0; i < SET_OBJS && !ret; i++)
+        {
+                if (memcmp(all + i, act + i, sizeof(struct object)))
+                {
+                        printf("object %d differs\n", i);
+                        ret = 1;
+                }
+        }
+        ASSERT_IE(0, s.count);
+
+        // Impulse
+        active_set_impulse(&s, act, 3, (struct vec3){ .a = {0, 2.0f, 0} });
+        ASSERT_IE(1, s.count);
+        ASSERT_IE(0, act[3].steady_state);
+        ASSERT_FE(2.0f, act[3].p.v.y);
+        // Waking an awake object does not add it twice
+        active_set_wake(&s, act, 3);
+        ASSERT_IE(1, s.count);
+
+        // Neighbour contact, only objects 2 and 4 are in reach
+        spatial_hash_init(&h);
+        ASSERT_IE(0, spatial_hash_build(&h, act, SET_OBJS, NULL));
+        ASSERT_IE(2, active_set_wake_near(&s, act, &h, act[3].p.p, 0.5f));
+        // Already awake, nothing left to wake
+        ASSERT_IE(0, active_set_wake_near(&s, act, &h, act[3].p.p, 0.5f));
+        spatial_hash_free(&h);
+        ASSERT_IE(3, s.count);
+        ASSERT_IE(0, act[2].steady_state);
+        ASSERT_IE(1, act[5].steady_state);
+
+        // Woken outside the set, the set still picks it up
+        object_apply_impulse(act + 10, (struct vec3){ .a = {0, 1.0f, 0} });
+        ASSERT_IE(3, s.count);
+        active_set_wake(&s, act, 10);
+        ASSERT_IE(4, s.count);
+        object_wake(act + 11);
+        ASSERT_IE(1, active_set_sync(&s, act));
+        ASSERT_IE(5, s.count);
+        ASSERT_IE(0, active_set_sync(&s, act));
+
+        // Hard enough contact, through the world's set
+        wo.active_set = &s;
+        act[20].p.p = act[21].p.p;
+        act[20].p.p.x -= 0.15f;
+        act[20].p.rad = 0.1f;
+        act[21].p.rad = 0.1f;
+        active_set_impulse(&s, act, 20, (struct vec3){ .a = {3.0f, 0, 0} });
+        ASSERT_IE(6, s.count);
+        ASSERT_IE(1, collide_objects(&wo, act + 20, act + 21));
+        ASSERT_IE(0, act[21].steady_state);
+        ASSERT_IE(7, s.count);
+        wo.active_set = NULL;
+
+        // Surface modification wakes everything else resting on it
+        mesh_heightmap(m, 1, 0.5f, 2.0f);
+        ASSERT_IE(SET_OBJS - 7, active_set_wake_mesh(&s, act, m));
+        ASSERT_IE(SET_OBJS, s.count);
+        for (int i = 0; i < SET_OBJS; i++)
+        {
+                ASSERT_IE(1, act[i].contact_mesh == NULL);
+        }
+
+        active_set_free(&s);
+        mesh_free(m);
+        free(m);
+        free(all);
+        free(act);
+
+        return ret;
+}
+
 static struct test_entry tests[] = {
         {"drag_force",            test_drag_force},
         {"friction_force_dyn",    test_friction_force_dyn},
         {"friction_force_stat",   test_friction_force_stat},
         {"friction_force_coulomb", test_friction_force_coulomb},
         {"apex_no_steady_state", test_apex_no_steady_state},
+        {"sleep_timer",          test_sleep_timer},
+        {"active_set",           test_active_set},
 };
 RUN_TESTS(tests)
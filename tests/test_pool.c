@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "km_pool.h"
+#include "km_geom.h"
+#include "km_phys.h"
+#define TEST_LCG_SEED 99u
+#include "test.h"
+
+#define NUM_ITEMS 10007
+#define NUM_OBJS 2000
+
+static int test_pool_cover(void);
+static int test_pool_serial(void);
+static int test_update_parallel(void);
+
+struct cover_ctx
+{
+        _Atomic int calls;
+        int* seen;
+};
+
+static void cover_fn(void* ctx, uint32_t begin, uint32_t end)
+{
+        struct cover_ctx* c = ctx;
+        volatile float sink = 0.0f;
+
+        atomic_fetch_add(&c->calls, 1);
+        for (uint32_t i = begin; i < end; i++)
+        {
+                c->seen[i]++;
+                // Uneven work, to make the threads steal
+                for (uint32_t k = 0; k < (i % 97) * 10; k++)
+                {
+                        sink += 1.0f;
+                }
+        }
+}
+
+static int test_pool_cover(void)
+{
+        struct km_pool* p = km_pool_create(4);
+        struct cover_ctx c;
+
+        ASSERT_IE(1, p != NULL);
+        ASSERT_IE(4, km_pool_threads(p));
+
+        c.seen = calloc(NUM_ITEMS, sizeof(int));
+        for (int run = 0; run < 20; run++)
+        {
+                atomic_store(&c.calls, 0);
+                memset(c.seen, 0, NUM_ITEMS * sizeof(int));
+                km_pool_run(p, NUM_ITEMS, 7, cover_fn, &c);
+
+                // Each thread's range is chunked on its own
+                ASSERT_IE(1, atomic_load(&c.calls) <=
+                          (NUM_ITEMS + 6) / 7 + 4);
+                for (int i = 0; i < NUM_ITEMS; i++)
+                {
+                        ASSERT_IE(1, c.seen[i]);
+                }
+        }
+
+        // Fewer items than threads
+        memset(c.seen, 0, NUM_ITEMS * sizeof(int));
+        km_pool_run(p, 3, 1, cover_fn, &c);
+        ASSERT_IE(1, c.seen[0]);
+        ASSERT_IE(1, c.seen[2]);
+        ASSERT_IE(0, c.seen[3]);
+
+        free(c.seen);
+        km_pool_free(p);
+
+        return 0;
+}
+
+static int test_pool_serial(void)
+{
+        struct km_pool* p = km_pool_create(1);
+        struct cover_ctx c;
+
+        ASSERT_IE(1, p != NULL);
+
+        c.seen = calloc(100, sizeof(int));
+        atomic_store(&c.calls, 0);
+        km_pool_run(p, 100, 8, cover_fn, &c);
+        ASSERT_IE(13, atomic_load(&c.calls));
+        for (int i = 0; i < 100; i++)
+        {
+                ASSERT_IE(1, c.seen[i]);
+        }
+
+        free(c.seen);
+        km_pool_free(p);
+
+        return 0;
+}
+
+static int test_update_parallel(void)
+{
+        struct object* serial = calloc(NUM_OBJS, sizeof(struct object));
+        struct object* parallel = calloc(NUM_OBJS, sizeof(struct object));
+        struct mesh* m = gen_mesh(20.0f, 20.0f, 0.5f);
+        struct world w = {0};
+        int ret = 0;
+
+        default_world(&w, 60);
+        mesh_translate(m, (struct vec3){ .a = { -10.0f, 0.0f, -10.0f } });
+        mesh_heightmap(m, 10, 3.0f, 4.0f);
+        m->restitution = 0.5f;
+        m->static_mu = 0.5f;
+        m->dynamic_mu = 0.4f;
+        w.surfaces = m;
+        w.surface_count = 1;
+
+        for (int i = 0; i < NUM_OBJS; i++)
+        {
+                struct object* o = serial + i;
+
+                o->p.p.x = (lcg_u01() - 0.5f) * 18.0f;
+                o->p.p.y = 4.0f + lcg_u01() * 10.0f;
+                o->p.p.z = (lcg_u01() - 0.5f) * 18.0f;
+                o->p.v.x = (lcg_u01() - 0.5f) * 4.0f;
+                o->p.v.z = (lcg_u01() - 0.5f) * 4.0f;
+                o->area = 0.01f;
+                o->drag_c = 0.47f;
+                o->restitution = 0.6f;
+                o->static_mu = 0.5f;
+                o->dynamic_mu = 0.4f;
+                object_set_m(o, 0.5f + lcg_u01());
+        }
+        memcpy(parallel, serial, NUM_OBJS * sizeof(struct object));
+
+        ASSERT_IE(0, world_start_pool(&w, 4));
+
+        for (int step = 0; step < 240; step++)
+        {
+                update_objects(step, &w, serial, NUM_OBJS, 0);
+                update_objects_parallel(step, &w, parallel, NUM_OBJS);
+        }
+
+        for (int i = 0; i < NUM_OBJS && !ret; i++)
+        {
+                if (memcmp(serial + i, parallel + i, sizeof(struct object)))
+                {
+                        printf("object %d differs\n", i);
+                        ret = 1;
+                }
+        }
+
+        world_stop_pool(&w);
+        ASSERT_IE(1, w.pool == NULL);
+
+        mesh_free(m);
+        free(m);
+        free(serial);
+        free(parallel);
+
+        return ret;
+}
+
+static struct test_entry tests[] = {
+        {"pool: cover all items", test_pool_cover},
+        {"pool: single thread",   test_pool_serial},
+        {"update_objects_parallel", test_update_parallel},
+};
+RUN_TESTS(tests)
@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <string.h>
+#include "km_plat.h"
+#include "km_geom.h"
+#include "test.h"
+
+#define N 10000
+
+static int test_rand_reference(void);
+static int test_rand_seed(void);
+static int test_rand_heightmap(void);
+
+static int test_rand_reference(void)
+{
+        struct rand_state r = { .s = { 1, 2, 3, 4 } };
+
+        // Reference output of xoshiro256** and splitmix64
+        ASSERT_IE(1, rand_state_next(&r) == 11520ull);
+        ASSERT_IE(1, rand_state_next(&r) == 0ull);
+        ASSERT_IE(1, rand_state_next(&r) == 1509978240ull);
+        ASSERT_IE(1, rand_state_next(&r) == 1215971899390074240ull);
+
+        rand_state_seed(&r, 0);
+        ASSERT_IE(1, r.s[0] == 0xE220A8397B1DCDAFull);
+
+        return 0;
+}
+
+static int test_rand_seed(void)
+{
+        float* a = malloc(N * sizeof(float));
+        float* b = malloc(N * sizeof(float));
+        double sum = 0.0;
+
+        rand_seed(4711);
+        rand_u01_fill(a, N);
+        rand_seed(4711);
+        for (int i = 0; i < N; i++)
+        {
+                b[i] = rand_u01();
+                sum += b[i];
+                ASSERT_IE(1, b[i] >= 0.0f && b[i] < 1.0f);
+        }
+        ASSERT_IE(0, memcmp(a, b, N * sizeof(float)));
+        ASSERT_IE(1, sum / N > 0.49 && sum / N < 0.51);
+
+        rand_seed(4712);
+        rand_u01_fill(b, N);
+        ASSERT_IE(1, memcmp(a, b, N * sizeof(float)) != 0);
+
+        free(a);
+        free(b);
+
+        return 0;
+}
+
+static int test_rand_heightmap(void)
+{
+        struct mesh* a = gen_mesh(20.0f, 20.0f, 0.5f);
+        struct mesh* b = gen_mesh(20.0f, 20.0f, 0.5f);
+
+        // The same seed gives the same terrain
+        rand_seed(17);
+        mesh_heightmap(a, 20, 4.0f, 5.0f);
+        rand_seed(17);
+        mesh_heightmap(b, 20, 4.0f, 5.0f);
+        ASSERT_IE(0, memcmp(a->vertices, b->vertices,
+                            a->vertex_count * sizeof(struct vertex)));
+
+        mesh_free(a);
+        free(a);
+        mesh_free(b);
+        free(b);
+
+        return 0;
+}
+
+static struct test_entry tests[] = {
+        {"rand: reference sequence", test_rand_reference},
+        {"rand: seed and fill",      test_rand_seed},
+        {"rand: seeded heightmap",   test_rand_heightmap},
+};
+RUN_TESTS(tests)
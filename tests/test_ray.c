@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "km_geom.h"
+#include "km_phys.h"
+#include "km_plat.h"
+#include "test.h"
+
+#define NUM_RAYS 3000
+
+static int test_ray_single(void);
+static int test_ray_batch(void);
+
+// Three bumpy meshes side by side
+static void make_world(struct world* w)
+{
+        default_world(w, 60);
+        w->surface_count = 3;
+        w->surfaces = calloc(3, sizeof(struct mesh));
+
+        for (int i = 0; i < w->surface_count; i++)
+        {
+                struct mesh* m = gen_mesh(8.0f, 8.0f, 0.5f);
+
+                mesh_translate(m, (struct vec3){
+                                .a = { -12.0f + 8.0f * (float)i,
+                                       (float)i, -4.0f } });
+                mesh_heightmap(m, 4, 2.0f, 3.0f);
+                w->surfaces[i] = *m;
+                free(m);
+        }
+}
+
+static void free_world(struct world* w)
+{
+        world_stop_pool(w);
+        world_free_bvh(w);
+        for (int i = 0; i < w->surface_count; i++)
+        {
+                mesh_free(w->surfaces + i);
+        }
+        free(w->surfaces);
+}
+
+// Rays from above, pointing mostly down, some of them too short
+static void random_rays(struct vec3* o, struct vec3* d, float* t_max,
+                        struct rand_state* rs)
+{
+        for (int i = 0; i < NUM_RAYS; i++)
+        {
+                o[i] = (struct vec3){ .a = {
+                                (rand_state_u01(rs) * 2.0f - 1.0f) * 14.0f,
+                                4.0f + rand_state_u01(rs) * 4.0f,
+                                (rand_state_u01(rs) * 2.0f - 1.0f) * 6.0f } };
+                d[i] = vec3_norm((struct vec3){ .a = {
+                                        rand_state_u01(rs) * 2.0f - 1.0f,
+                                        -1.0f - rand_state_u01(rs),
+                                        rand_state_u01(rs) * 2.0f - 1.0f } });
+                t_max[i] = i % 8 ? 20.0f : 1.0f;
+        }
+}
+
+// Bit identical, without the padding
+static int same_hit(const struct ray_hit* a, const struct ray_hit* b)
+{
+        return memcmp(&a->t, &b->t, sizeof(float)) ||
+                memcmp(&a->n, &b->n, sizeof(struct vec3)) ||
+                a->m != b->m ||
+                a->ti != b->ti ||
+                memcmp(&a->u, &b->u, sizeof(float)) ||
+                memcmp(&a->v, &b->v, sizeof(float));
+}
+
+static int test_ray_single(void)
+{
+        struct rand_state rs;
+        struct world w;
+        struct ray_hit hit;
+        struct vec3 o = { .a = { -8.0f, 10.0f, 0.0f } };
+        struct vec3 down = { .a = { 0.0f, -2.0f, 0.0f } };
+        int hits = 0;
+
+        rand_state_seed(&rs, 4711);
+        make_world(&w);
+
+        // Same segment as a moving particle
+        for (int i = 0; i < 1000; i++)
+        {
+                struct particle p = {0};
+                struct collision toi;
+                struct vertex* v0;
+                struct vertex* v1;
+                struct vertex* v2;
+                struct vec3 d = vec3_norm((struct vec3){ .a = {
+                                        rand_state_u01(&rs) * 2.0f - 1.0f,
+                                        -1.0f,
+                                        rand_state_u01(&rs) * 2.0f - 1.0f } });
+                float t_max = 15.0f;
+                int coll;
+
+                p.p = (struct vec3){ .a = {
+                                (rand_state_u01(&rs) * 2.0f - 1.0f) * 12.0f,
+                                6.0f,
+                                (rand_state_u01(&rs) * 2.0f - 1.0f) * 4.0f } };
+                p.v = vec3_scalarm(d, t_max);
+                coll = compute_toi(&toi, &p, w.surfaces, w.surface_count) &&
+                        toi.t <= 1.0f;
+
+                ASSERT_IE(coll, world_raycast(&w, p.p, d, t_max, &hit));
+                if (!coll)
+                {
+                        ASSERT_IE(1, hit.m == NULL);
+                        ASSERT_IE(1, isinf(hit.t));
+                        continue;
+                }
+                hits++;
+                ASSERT_FE(toi.t * t_max, hit.t);
+                ASSERT_IE(1, hit.m == toi.m);
+                ASSERT_IE(toi.ti, hit.ti);
+
+                // The barycentrics give back the hit point
+                mesh_get_tri(&v0, &v1, &v2, hit.m, hit.ti);
+                {
+                        struct vec3 a = vec3_add(p.p, vec3_scalarm(d, hit.t));
+                        struct vec3 e1 = vec3_sub(v1->pos, v0->pos);
+                        struct vec3 e2 = vec3_sub(v2->pos, v0->pos);
+                        struct vec3 b = vec3_add(v0->pos, vec3_add(
+                                                         vec3_scalarm(e1, hit.u),
+                                                         vec3_scalarm(e2, hit.v)));
+
+                        ASSERT_IE(1, hit.u > -1e-3f && hit.v > -1e-3f);
+                        ASSERT_IE(1, hit.u + hit.v < 1.0f + 1e-3f);
+                        ASSERT_IE(1, fabsf(a.x - b.x) < 1e-3f);
+                        ASSERT_IE(1, fabsf(a.y - b.y) < 1e-3f);
+                        ASSERT_IE(1, fabsf(a.z - b.z) < 1e-3f);
+                }
+        }
+        ASSERT_IE(1, hits > 500);
+
+        // Direction need not be normalized, t is in units of it
+        ASSERT_IE(1, world_raycast(&w, o, down, 10.0f, &hit));
+        ASSERT_IE(1, hit.m == w.surfaces + 0);
+        ASSERT_IE(1, fabsf(10.0f - 2.0f * hit.t - hit.m->vertices[0].pos.y) < 3.0f);
+
+        // Too short, pointing away, or no length
+        ASSERT_IE(0, world_raycast(&w, o, down, 0.5f, &hit));
+        ASSERT_IE(0, world_raycast(&w, o, vec3_scalarm(down, -1.0f),
+                                   10.0f, &hit));
+        ASSERT_IE(0, world_raycast(&w, o, down, 0.0f, &hit));
+        ASSERT_IE(1, hit.m == NULL);
+
+        free_world(&w);
+
+        return 0;
+}
+
+static int test_ray_batch(void)
+{
+        struct rand_state rs;
+        struct vec3* o = malloc(NUM_RAYS * sizeof(struct vec3));
+        struct vec3* d = malloc(NUM_RAYS * sizeof(struct vec3));
+        float* t_max = malloc(NUM_RAYS * sizeof(float));
+        struct ray_hit* ref = calloc(NUM_RAYS, sizeof(struct ray_hit));
+        struct ray_hit* hits = calloc(NUM_RAYS, sizeof(struct ray_hit));
+        struct world w;
+        int n = 0;
+
+        rand_state_seed(&rs, 4711);
+        make_world(&w);
+        random_rays(o, d, t_max, &rs);
+        for (int i = 0; i < NUM_RAYS; i++)
+        {
+                n += world_raycast(&w, o[i], d[i], t_max[i], ref + i);
+        }
+        ASSERT_IE(1, n > NUM_RAYS / 4);
+        ASSERT_IE(1, n < NUM_RAYS);
+
+        // Serial, over the bvh, and on threads, all the same as one
+        // ray at a time
+        for (int k = 0; k < 3; k++)
+        {
+                if (k == 1)
+                {
+                        ASSERT_IE(0, world_build_bvh(&w));
+                }
+                if (k == 2)
+                {
+                        ASSERT_IE(0, world_start_pool(&w, 4));
+                }
+                memset(hits, 0xFF, NUM_RAYS * sizeof(struct ray_hit));
+                ASSERT_IE(n, world_raycast_batch(&w, o, d, t_max, hits,
+                                                 NUM_RAYS));
+                for (int i = 0; i < NUM_RAYS; i++)
+                {
+                        ASSERT_IE(0, same_hit(ref + i, hits + i));
+                }
+        }
+
+        ASSERT_IE(0, world_raycast_batch(&w, o, d, t_max, hits, 0));
+        // All from the same origin
+        for (int i = 0; i < NUM_RAYS; i++)
+        {
+                o[i] = o[0];
+        }
+        ASSERT_IE(1, world_raycast_batch(&w, o, d, t_max, hits,
+                                         NUM_RAYS) > 0);
+
+        free_world(&w);
+        free(o);
+        free(d);
+        free(t_max);
+        free(ref);
+        free(hits);
+
+        return 0;
+}
+
+static struct test_entry tests[] = {
+        {"raycast: same as toi",        test_ray_single},
+        {"raycast: batch",              test_ray_batch},
+};
+RUN_TESTS(tests)
@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "km_sap.h"
+#include "km_phys.h"
+#include "km_geom.h"
+#include "km_plat.h"
+#include "test.h"
+
+#define NUM_OBJS 400
+#define BOX 10.0f
+
+static int test_sap_pairs(void);
+static int test_sap_head_on(void);
+static int test_sap_sleeping(void);
+static int test_sap_floor(void);
+static int test_sap_momentum(void);
+
+static void make_ball(struct object* o, float x, float y, float z,
+                      struct rand_state* rs)
+{
+        memset(o, 0, sizeof(*o));
+        o->p.p = (struct vec3){ .a = { x, y, z } };
+        o->p.rad = 0.1f + rand_state_u01(rs) * 0.2f;
+        o->restitution = 1.0f;
+        object_set_m(o, 0.5f + rand_state_u01(rs));
+}
+
+static int cmp_pair(const void* a, const void* b)
+{
+        const struct sap_pair* p = a;
+        const struct sap_pair* q = b;
+
+        if (p->a != q->a)
+        {
+                return p->a < q->a ? -1 : 1;
+        }
+        return p->b < q->b ? -1 : (p->b > q->b);
+}
+
+// All pairs of boxes overlapping, by testing every pair
+static uint32_t brute_pairs(const struct object* objs,
+                            int n,
+                            struct sap_pair* out)
+{
+        uint32_t count = 0;
+
+        for (int i = 0; i < n; i++)
+        {
+                for (int j = i + 1; j < n; j++)
+                {
+                        const struct particle* a = &objs[i].p;
+                        const struct particle* b = &objs[j].p;
+                        float r = a->rad + b->rad;
+
+                        if (a->rad > 0.0f && b->rad > 0.0f &&
+                            fabsf(a->p.x - b->p.x) <= r &&
+                            fabsf(a->p.y - b->p.y) <= r &&
+                            fabsf(a->p.z - b->p.z) <= r)
+                        {
+                                out[count++] = (struct sap_pair){
+                                        (uint32_t)i, (uint32_t)j };
+                        }
+                }
+        }
+
+        return count;
+}
+
+static int test_sap_pairs(void)
+{
+        struct rand_state rs;
+        struct object* objs = malloc(NUM_OBJS * sizeof(struct object));
+        struct sap_pair* exp = malloc(NUM_OBJS * NUM_OBJS *
+                                      sizeof(struct sap_pair));
+        struct sap s;
+        int ret = 0;
+
+        rand_state_seed(&rs, 1234);
+        for (int i = 0; i < NUM_OBJS; i++)
+        {
+                make_ball(objs + i,
+                          rand_state_u01(&rs) * BOX,
+                          rand_state_u01(&rs) * BOX,
+                          rand_state_u01(&rs) * BOX,
+                          &rs);
+        }
+        // Points are never paired
+        objs[7].p.rad = 0.0f;
+        ASSERT_IE(0, sap_init(&s, objs, NUM_OBJS));
+
+        for (int step = 0; step < 20 && !ret; step++)
+        {
+                int n = sap_update(&s, objs);
+                uint32_t e = brute_pairs(objs, NUM_OBJS, exp);
+
+                ASSERT_IE(e, n);
+                ASSERT_IE(1, n > 10);
+                qsort(s.pairs, s.pair_count, sizeof(*s.pairs), cmp_pair);
+                ret = memcmp(exp, s.pairs, e * sizeof(*exp)) != 0;
+                // Small moves only need a few swaps, far from the
+                // (2n)^2 / 4 of an unsorted array
+                if (step > 0)
+                {
+                        ASSERT_IE(1, s.swaps < 2 * NUM_OBJS);
+                }
+
+                for (int i = 0; i < NUM_OBJS; i++)
+                {
+                        objs[i].p.p.x += (rand_state_u01(&rs) - 0.5f) * 0.05f;
+                        objs[i].p.p.y += (rand_state_u01(&rs) - 0.5f) * 0.05f;
+                }
+        }
+
+        sap_free(&s);
+        free(exp);
+        free(objs);
+
+        return ret;
+}
+
+static int test_sap_head_on(void)
+{
+        struct rand_state rs;
+        struct world w = {0};
+        struct object o[2];
+
+        rand_state_seed(&rs, 1234);
+        default_world(&w, 60);
+        make_ball(o + 0, 0.0f, 0.0f, 0.0f, &rs);
+        make_ball(o + 1, 0.0f, 0.0f, 0.0f, &rs);
+        object_set_m(o + 0, 1.0f);
+        object_set_m(o + 1, 1.0f);
+        o[0].p.rad = 0.5f;
+        o[1].p.rad = 0.5f;
+        o[1].p.p.x = 0.9f;
+        o[0].p.v.x = 2.0f;
+        o[1].p.v.x = -1.0f;
+
+        // Elastic with equal masses, the velocities are swapped
+        ASSERT_IE(1, collide_objects(&w, o + 0, o + 1));
+        ASSERT_FE(-1.0f, o[0].p.v.x);
+        ASSERT_FE(2.0f, o[1].p.v.x);
+        ASSERT_FE(1.0f, o[1].p.p.x - o[0].p.p.x);
+        ASSERT_FE(0.9f, o[0].p.p.x + o[1].p.p.x);
+
+        // Touching and moving apart, nothing happens
+        ASSERT_IE(0, collide_objects(&w, o + 0, o + 1));
+        ASSERT_FE(-1.0f, o[0].p.v.x);
+
+        return 0;
+}
+
+static int test_sap_sleeping(void)
+{
+        struct rand_state rs;
+        struct world w = {0};
+        struct object o[2];
+
+        rand_state_seed(&rs, 1234);
+        default_world(&w, 60);
+        make_ball(o + 0, 0.0f, 0.0f, 0.0f, &rs);
+        make_ball(o + 1, 0.0f, 0.35f, 0.0f, &rs);
+        o[0].p.rad = 0.2f;
+        o[1].p.rad = 0.2f;
+        o[0].steady_state = 1;
+
+        // A slow touch leaves the sleeping object where it is
+        o[1].p.v.y = -0.001f;
+        ASSERT_IE(1, collide_objects(&w, o + 0, o + 1));
+        ASSERT_IE(1, o[0].steady_state);
+        ASSERT_FE(0.0f, o[0].p.p.y);
+        ASSERT_FE(0.0f, o[0].p.v.y);
+        ASSERT_FE(0.4f, o[1].p.p.y);
+        ASSERT_IE(1, o[1].p.v.y > 0.0f);
+
+        // A hard one wakes it
+        o[1].p.p.y = 0.35f;
+        o[1].p.v.y = -3.0f;
+        ASSERT_IE(1, collide_objects(&w, o + 0, o + 1));
+        ASSERT_IE(0, o[0].steady_state);
+        ASSERT_IE(1, o[0].p.v.y < -1.0f);
+
+        // Both asleep, nothing to do
+        o[0].steady_state = 1;
+        o[1].steady_state = 1;
+        o[1].p.p.y = 0.35f;
+        ASSERT_IE(0, collide_objects(&w, o + 0, o + 1));
+
+        return 0;
+}
+
+static int test_sap_floor(void)
+{
+        struct rand_state rs;
+        struct mesh* m = gen_mesh(4.0f, 4.0f, 0.5f);
+        struct world w = {0};
+        struct object o[2];
+
+        rand_state_seed(&rs, 1234);
+        default_world(&w, 60);
+        mesh_translate(m, (struct vec3){ .a = {-2.0f, 0.0f, -2.0f} });
+        w.surfaces = m;
+        w.surface_count = 1;
+
+        // Resting on the floor, and pressed into it from above
+        make_ball(o + 0, 0.0f, 0.201f, 0.0f, &rs);
+        make_ball(o + 1, 0.0f, 0.5f, 0.0f, &rs);
+        o[0].p.rad = 0.2f;
+        o[1].p.rad = 0.2f;
+        o[0].contact_mesh = m;
+        o[0].contact_normal = (struct vec3){ .a = {0.0f, 1.0f, 0.0f} };
+        o[1].p.v.y = -1.0f;
+
+        // The floor stops the lower ball, the contact is to be found
+        // again
+        ASSERT_IE(1, collide_objects(&w, o + 0, o + 1));
+        ASSERT_IE(1, o[0].p.p.y >= o[0].p.rad);
+        ASSERT_IE(1, o[0].p.p.y < 0.21f);
+        ASSERT_IE(1, o[0].contact_mesh == NULL);
+        ASSERT_FE(0.6f, o[1].p.p.y);
+
+        mesh_free(m);
+        free(m);
+
+        return 0;
+}
+
+/*
+ * Balls in empty space, no gravity or drag. Momentum is kept, and
+ * after a while the balls are no longer overlapping.
+ */
+static int test_sap_momentum(void)
+{
+        struct rand_state rs;
+        struct object* objs = malloc(NUM_OBJS * sizeof(struct object));
+        struct world w = {0};
+        struct sap s;
+        struct vec3 p0 = {0};
+        struct vec3 p1 = {0};
+        int contacts = 0;
+        float overlap = 0.0f;
+
+        rand_state_seed(&rs, 1234);
+        default_world(&w, 60);
+        w.g = (struct vec3){0};
+        for (int i = 0; i < NUM_OBJS; i++)
+        {
+                make_ball(objs + i,
+                          rand_state_u01(&rs) * BOX,
+                          rand_state_u01(&rs) * BOX,
+                          rand_state_u01(&rs) * BOX,
+                          &rs);
+                objs[i].p.v = (struct vec3){ .a = {
+                                rand_state_u01(&rs) - 0.5f,
+                                rand_state_u01(&rs) - 0.5f,
+                                rand_state_u01(&rs) - 0.5f } };
+                p0 = vec3_add(p0, vec3_scalarm(objs[i].p.v, objs[i].m));
+        }
+        ASSERT_IE(0, sap_init(&s, objs, NUM_OBJS));
+
+        for (int step = 0; step < 120; step++)
+        {
+                int c = update_objects_sap(step, &w, objs, NUM_OBJS, &s);
+
+                ASSERT_IE(1, c >= 0);
+                contacts += c;
+        }
+        ASSERT_IE(1, contacts > 50);
+
+        for (int i = 0; i < NUM_OBJS; i++)
+        {
+                p1 = vec3_add(p1, vec3_scalarm(objs[i].p.v, objs[i].m));
+        }
+        ASSERT_IE(1, fabsf(p1.x - p0.x) < 1e-3f);
+        ASSERT_IE(1, fabsf(p1.y - p0.y) < 1e-3f);
+        ASSERT_IE(1, fabsf(p1.z - p0.z) < 1e-3f);
+
+        ASSERT_IE(1, sap_update(&s, objs) >= 0);
+        for (uint32_t i = 0; i < s.pair_count; i++)
+        {
+                struct particle* a = &objs[s.pairs[i].a].p;
+                struct particle* b = &objs[s.pairs[i].b].p;
+                struct vec3 d = vec3_sub(a->p, b->p);
+                float o = a->rad + b->rad - sqrtf(vec3_dot(d, d));
+
+                overlap = MAX(overlap, o);
+        }
+        ASSERT_IE(1, overlap < 0.05f);
+
+        sap_free(&s);
+        free(objs);
+
+        return 0;
+}
+
+static struct test_entry tests[] = {
+        {"sap: pairs vs brute force", test_sap_pairs},
+        {"sap: head on collision",    test_sap_head_on},
+        {"sap: sleeping objects",     test_sap_sleeping},
+        {"sap: pushed onto a floor",  test_sap_floor},
+        {"sap: momentum",             test_sap_momentum},
+};
+RUN_TESTS(tests)
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "km_spatial.h"
+#include "km_sap.h"
+#include "km_phys.h"
+#include "km_pool.h"
+#include "km_plat.h"
+#include "test.h"
+
+#define NUM_OBJS 20000
+#define BOX 40.0f
+
+static int test_spatial_build(void);
+static int test_spatial_query(void);
+static int test_spatial_pairs(void);
+
+// Random spheres in a box, some of them points
+static struct object* make_objs(int n, struct rand_state* rs)
+{
+        struct object* objs = calloc((size_t)n, sizeof(struct object));
+
+        for (int i = 0; i < n; i++)
+        {
+                objs[i].p.p = (struct vec3){ .a = {
+                                (rand_state_u01(rs) - 0.5f) * BOX,
+                                rand_state_u01(rs) * BOX * 0.25f,
+                                (rand_state_u01(rs) - 0.5f) * BOX } };
+                objs[i].p.rad = i % 10 ?
+                        0.05f + rand_state_u01(rs) * 0.15f : 0.0f;
+                objs[i].restitution = 0.5f;
+                object_set_m(objs + i, 1.0f);
+        }
+
+        return objs;
+}
+
+struct found
+{
+        uint32_t* idx;
+        uint32_t count;
+};
+
+static void collect(void* ctx, uint32_t i)
+{
+        struct found* f = ctx;
+
+        f->idx[f->count++] = i;
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+        uint32_t x = *(const uint32_t*)a;
+        uint32_t y = *(const uint32_t*)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static int test_spatial_build(void)
+{
+        struct rand_state rs;
+        struct object* objs;
+        struct km_pool* pool[2] = { km_pool_create(4), km_pool_create(3) };
+        struct spatial_hash h[3];
+
+        rand_state_seed(&rs, 2024);
+        objs = make_objs(NUM_OBJS, &rs);
+        for (int k = 0; k < 3; k++)
+        {
+                spatial_hash_init(h + k);
+                // Grows from empty
+                ASSERT_IE(0, spatial_hash_build(h + k, objs, 100, NULL));
+                ASSERT_IE(0, spatial_hash_build(h + k, objs, NUM_OBJS,
+                                                k ? pool[k - 1] : NULL));
+        }
+        ASSERT_IE(NUM_OBJS, h[0].n);
+        ASSERT_FE(0.4f, h[0].cell);
+        ASSERT_IE(NUM_OBJS, h[0].start[h[0].buckets]);
+
+        // Same on any number of threads, buckets sorted by index
+        for (int k = 1; k < 3; k++)
+        {
+                ASSERT_IE(h[0].buckets, h[k].buckets);
+                ASSERT_IE(0, memcmp(h[0].start, h[k].start,
+                                    (h[0].buckets + 1) * sizeof(uint32_t)));
+                ASSERT_IE(0, memcmp(h[0].idx, h[k].idx,
+                                    NUM_OBJS * sizeof(uint32_t)));
+        }
+        for (uint32_t b = 0; b < h[0].buckets; b++)
+        {
+                for (uint32_t k = h[0].start[b] + 1; k < h[0].start[b + 1]; k++)
+                {
+                        ASSERT_IE(1, h[0].idx[k - 1] < h[0].idx[k]);
+                        ASSERT_IE(b, h[0].bucket[h[0].idx[k]]);
+                }
+        }
+
+        for (int k = 0; k < 3; k++)
+        {
+                spatial_hash_free(h + k);
+        }
+        km_pool_free(pool[0]);
+        km_pool_free(pool[1]);
+        free(objs);
+
+        return 0;
+}
+
+static int test_spatial_query(void)
+{
+        struct rand_state rs;
+        struct object* objs;
+        uint32_t* exp = malloc(NUM_OBJS * sizeof(uint32_t));
+        struct found f = { .idx = malloc(NUM_OBJS * sizeof(uint32_t)) };
+        struct spatial_hash h;
+        int ret = 0;
+
+        rand_state_seed(&rs, 2024);
+        objs = make_objs(NUM_OBJS, &rs);
+        spatial_hash_init(&h);
+        ASSERT_IE(0, spatial_hash_build(&h, objs, NUM_OBJS, NULL));
+
+        for (int q = 0; q < 200 && !ret; q++)
+        {
+                struct vec3 p = { .a = {
+                                (rand_state_u01(&rs) - 0.5f) * BOX,
+                                rand_state_u01(&rs) * BOX * 0.25f,
+                                (rand_state_u01(&rs) - 0.5f) * BOX } };
+                // Mostly small, some larger than the scene
+                float r = q % 50 ? rand_state_u01(&rs) * 2.0f : BOX;
+                uint32_t e = 0;
+
+                for (uint32_t i = 0; i < NUM_OBJS; i++)
+                {
+                        struct vec3 d = vec3_sub(objs[i].p.p, p);
+                        float lim = r + objs[i].p.rad;
+
+                        if (vec3_dot(d, d) <= lim * lim)
+                        {
+                                exp[e++] = i;
+                        }
+                }
+
+                f.count = 0;
+                spatial_hash_query(&h, objs, p, r, collect, &f);
+                qsort(f.idx, f.count, sizeof(uint32_t), cmp_u32);
+                ASSERT_IE(e, f.count);
+                ret = memcmp(exp, f.idx, e * sizeof(uint32_t)) != 0;
+        }
+
+        spatial_hash_free(&h);
+        free(exp);
+        free(f.idx);
+        free(objs);
+
+        return ret;
+}
+
+static int test_spatial_pairs(void)
+{
+        struct rand_state rs;
+        struct object* objs;
+        struct spatial_hash h;
+        struct world w = {0};
+        uint32_t e = 0;
+        int n;
+        int c;
+
+        rand_state_seed(&rs, 2024);
+        objs = make_objs(NUM_OBJS, &rs);
+        spatial_hash_init(&h);
+        ASSERT_IE(0, spatial_hash_build(&h, objs, NUM_OBJS, NULL));
+        n = spatial_hash_pairs(&h, objs);
+        ASSERT_IE(1, n > 100);
+
+        for (uint32_t i = 0; i < NUM_OBJS; i++)
+        {
+                for (uint32_t j = i + 1; j < NUM_OBJS; j++)
+                {
+                        struct vec3 d = vec3_sub(objs[i].p.p, objs[j].p.p);
+                        float r = objs[i].p.rad + objs[j].p.rad;
+
+                        if (objs[i].p.rad > 0.0f && objs[j].p.rad > 0.0f &&
+                            vec3_dot(d, d) <= r * r)
+                        {
+                                e++;
+                        }
+                }
+        }
+        ASSERT_IE(e, n);
+        for (int k = 0; k < n; k++)
+        {
+                ASSERT_IE(1, h.pairs[k].a < h.pairs[k].b);
+                ASSERT_IE(1, k == 0 || h.pairs[k - 1].a <= h.pairs[k].a);
+        }
+
+        // Usable by the narrowphase. Separating a pair can separate
+        // later ones too, they are no longer in contact.
+        default_world(&w, 60);
+        c = collide_pairs(&w, objs, h.pairs, (uint32_t)n);
+        ASSERT_IE(1, c > n / 4 && c <= n);
+
+        spatial_hash_free(&h);
+        free(objs);
+
+        return 0;
+}
+
+static struct test_entry tests[] = {
+        {"spatial: build on threads",  test_spatial_build},
+        {"spatial: query vs all",      test_spatial_query},
+        {"spatial: pairs",             test_spatial_pairs},
+};
+RUN_TESTS(tests)
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include "km_step.h"
+#include "km_phys.h"
+#include "test.h"
+
+#define MS 1000000LL
+
+static int test_step_accumulate(void);
+static int test_step_capped(void);
+static int test_step_interpolate(void);
+static int test_step_frame_rate(void);
+
+static int test_step_accumulate(void)
+{
+        struct stepper s;
+
+        ASSERT_IE(-1, stepper_init(&s, 0.0f, 5));
+        ASSERT_IE(-1, stepper_init(&s, 0.01f, 0));
+        ASSERT_IE(0, stepper_init(&s, 0.01f, 5));
+        ASSERT_IE(1, s.dt_ns == 10 * MS);
+
+        // Short frames add up to a step
+        ASSERT_IE(0, stepper_advance(&s, 4 * MS));
+        ASSERT_FE(0.4f, stepper_alpha(&s));
+        ASSERT_IE(0, stepper_advance(&s, 4 * MS));
+        ASSERT_IE(1, stepper_advance(&s, 4 * MS));
+        ASSERT_FE(0.2f, stepper_alpha(&s));
+        // A long one runs several
+        ASSERT_IE(3, stepper_advance(&s, 29 * MS));
+        ASSERT_FE(0.1f, stepper_alpha(&s));
+        // Time never runs backwards
+        ASSERT_IE(0, stepper_advance(&s, -5 * MS));
+        ASSERT_FE(0.1f, stepper_alpha(&s));
+
+        ASSERT_IE(5, s.frames);
+        ASSERT_IE(4, s.steps);
+        ASSERT_IE(3, s.peak_steps);
+        ASSERT_IE(0, s.capped_frames);
+
+        return 0;
+}
+
+static int test_step_capped(void)
+{
+        struct stepper s;
+
+        ASSERT_IE(0, stepper_init(&s, 0.01f, 4));
+
+        // A stall, only max_steps are run and the rest is dropped
+        ASSERT_IE(4, stepper_advance(&s, 1000 * MS + 5 * MS));
+        ASSERT_FE(0.5f, stepper_alpha(&s));
+        ASSERT_IE(1, s.capped_frames);
+        ASSERT_IE(1, s.dropped_ns == 96 * 10 * MS);
+        // and the next frame is back to normal
+        ASSERT_IE(1, stepper_advance(&s, 10 * MS));
+        ASSERT_IE(1, s.capped_frames);
+        ASSERT_IE(4, s.peak_steps);
+
+        return 0;
+}
+
+static int test_step_interpolate(void)
+{
+        struct particle a = {0};
+        struct particle b = {0};
+        struct particle o;
+
+        b.p = (struct vec3){ .a = { 2.0f, -4.0f, 1.0f } };
+        b.r = (struct vec3){ .a = { 1.0f, 0.0f, -1.0f } };
+        b.v.x = 3.0f;
+        b.rad = 0.5f;
+
+        particle_interpolate(&o, &a, &b, 0.25f);
+        ASSERT_FE(0.5f, o.p.x);
+        ASSERT_FE(-1.0f, o.p.y);
+        ASSERT_FE(0.25f, o.p.z);
+        ASSERT_FE(0.25f, o.r.x);
+        ASSERT_FE(-0.25f, o.r.z);
+        // Not interpolated
+        ASSERT_FE(3.0f, o.v.x);
+        ASSERT_FE(0.5f, o.rad);
+
+        particle_interpolate(&o, &a, &b, 0.0f);
+        ASSERT_IE(0, memcmp(&o.p, &a.p, sizeof(o.p)));
+        particle_interpolate(&o, &a, &b, 1.0f);
+        ASSERT_IE(0, memcmp(&o.p, &b.p, sizeof(o.p)));
+
+        return 0;
+}
+
+/*
+ * The same simulated time at two frame rates runs the same steps, and
+ * gives the same state.
+ */
+static int test_step_frame_rate(void)
+{
+        struct world w = {0};
+        struct object o[2] = {0};
+        struct stepper s[2];
+        int64_t frame[2] = { 7 * MS, 23 * MS };
+        int64_t total = 161 * MS;
+
+        default_world(&w, 60);
+        for (int k = 0; k < 2; k++)
+        {
+                o[k].p.p.y = 10.0f;
+                o[k].p.v.x = 1.0f;
+                o[k].area = 0.01f;
+                o[k].drag_c = 0.47f;
+                object_set_m(o + k, 1.0f);
+                ASSERT_IE(0, stepper_init(s + k, w.dt, 5));
+
+                for (int64_t t = 0; t < total; t += frame[k])
+                {
+                        int64_t dt = t + frame[k] > total ?
+                                total - t : frame[k];
+                        int n = stepper_advance(s + k, dt);
+
+                        for (int i = 0; i < n; i++)
+                        {
+                                update_object(1, &w, o + k);
+                        }
+                }
+        }
+
+        ASSERT_IE(1, s[0].steps == s[1].steps);
+        ASSERT_IE(1, s[0].steps == 9);
+        ASSERT_IE(1, s[0].acc_ns == s[1].acc_ns);
+        ASSERT_IE(0, memcmp(o + 0, o + 1, sizeof(o[0])));
+        ASSERT_IE(1, o[0].p.p.y < 10.0f);
+
+        return 0;
+}
+
+static struct test_entry tests[] = {
+        {"step: accumulate",       test_step_accumulate},
+        {"step: capped catch up",  test_step_capped},
+        {"step: interpolate",      test_step_interpolate},
+        {"step: frame rate",       test_step_frame_rate},
+};
+RUN_TESTS(tests)
@@ -0,0 +1,367 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "km_geom.h"
+#include "km_bvh.h"
+#include "km_phys.h"
+#include "km_plat.h"
+#include "km_plat.h"
+#include "test.h"
+
+#define NUM_OBJS 200
+
+static int test_sweep_features(void);
+static int test_sweep_touching(void);
+static int test_sweep_heightmap(void);
+static int test_sweep_world(void);
+
+/*
+ * The same mesh three times, walked as a grid, through a bvh, and
+ * triangle by triangle. With peaks, a heightmap is applied first.
+ */
+static void make_meshes(struct mesh* out, float size, float d, int peaks)
+{
+        for (int k = 0; k < 3; k++)
+        {
+                struct mesh* m = gen_mesh(size, size, d);
+
+                if (k == 0 && peaks > 0)
+                {
+                        mesh_heightmap(m, peaks, 1.5f, 2.5f);
+                }
+                if (k > 0)
+                {
+                        memcpy(m->vertices, out[0].vertices,
+                               m->vertex_count * sizeof(struct vertex));
+                        mesh_build_tris(m);
+                        m->grid_x = 0;
+                }
+                if (k == 1)
+                {
+                        mesh_build_bvh(m);
+                }
+                if (k == 2)
+                {
+                        bvh_free(m->bvh);
+                        free(m->bvh);
+                        m->bvh = NULL;
+                }
+                out[k] = *m;
+                free(m);
+        }
+}
+
+static void free_meshes(struct mesh* m)
+{
+        for (int k = 0; k < 3; k++)
+        {
+                mesh_free(m + k);
+        }
+}
+
+/*
+ * Sweep a sphere against all three meshes, they must agree. Returns
+ * the hit against the grid.
+ */
+static int sweep(struct mesh* m,
+                 struct vec3 p,
+                 struct vec3 v,
+                 float r,
+                 struct collision* toi)
+{
+        struct particle pt = { .p = p, .v = v, .rad = r };
+        int hit = compute_toi(toi, &pt, m, 1);
+
+        for (int k = 1; k < 3; k++)
+        {
+                struct collision o;
+
+                if (compute_toi(&o, &pt, m + k, 1) != hit)
+                {
+                        return -1;
+                }
+                if (hit && (memcmp(&o.t, &toi->t, sizeof(float)) ||
+                            memcmp(&o.n, &toi->n, sizeof(struct vec3)) ||
+                            o.ti != toi->ti))
+                {
+                        return -1;
+                }
+        }
+
+        return hit;
+}
+
+static struct vec3 closest_on_tri(struct vec3 p,
+                                  struct vec3 a,
+                                  struct vec3 b,
+                                  struct vec3 c)
+{
+        struct vec3 ab = vec3_sub(b, a);
+        struct vec3 ac = vec3_sub(c, a);
+        struct vec3 ap = vec3_sub(p, a);
+        struct vec3 bp = vec3_sub(p, b);
+        struct vec3 cp = vec3_sub(p, c);
+        float d1 = vec3_dot(ab, ap);
+        float d2 = vec3_dot(ac, ap);
+        float d3 = vec3_dot(ab, bp);
+        float d4 = vec3_dot(ac, bp);
+        float d5 = vec3_dot(ab, cp);
+        float d6 = vec3_dot(ac, cp);
+        float va = d3 * d6 - d5 * d4;
+        float vb = d5 * d2 - d1 * d6;
+        float vc = d1 * d4 - d3 * d2;
+        float w;
+
+        if (d1 <= 0.0f && d2 <= 0.0f)
+        {
+                return a;
+        }
+        if (d3 >= 0.0f && d4 <= d3)
+        {
+                return b;
+        }
+        if (d6 >= 0.0f && d5 <= d6)
+        {
+                return c;
+        }
+        if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+        {
+                return vec3_add(a, vec3_scalarm(ab, d1 / (d1 - d3)));
+        }
+        if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+        {
+                return vec3_add(a, vec3_scalarm(ac, d2 / (d2 - d6)));
+        }
+        if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+        {
+                w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+                return vec3_add(b, vec3_scalarm(vec3_sub(c, b), w));
+        }
+
+        w = 1.0f / (va + vb + vc);
+
+        return vec3_add(a, vec3_add(vec3_scalarm(ab, vb * w),
+                                    vec3_scalarm(ac, vc * w)));
+}
+
+static float tri_dist(const struct mesh* m, uint32_t ti, struct vec3 p)
+{
+        struct vertex* a;
+        struct vertex* b;
+        struct vertex* c;
+        struct vec3 d;
+
+        mesh_get_tri(&a, &b, &c, m, ti);
+        d = vec3_sub(p, closest_on_tri(p, a->pos, b->pos, c->pos));
+
+        return sqrtf(vec3_dot(d, d));
+}
+
+static int test_sweep_features(void)
+{
+        // A 2 x 2 square at y = 0, triangles (0,0)(0,2)(2,0) and
+        // (2,0)(0,2)(2,2)
+        struct mesh m[3];
+        struct collision toi;
+        struct particle p = {0};
+        float s = sqrtf(0.5f);
+
+        make_meshes(m, 2.0f, 2.0f, 0);
+
+        // Face, from above and from below
+        ASSERT_IE(1, sweep(m, (struct vec3){ .a = { 1.0f, 2.0f, 1.0f } },
+                           (struct vec3){ .a = { 0.0f, -4.0f, 0.0f } },
+                           0.5f, &toi));
+        ASSERT_FE(0.375f, toi.t);
+        ASSERT_FE(1.0f, toi.n.y);
+        ASSERT_IE(1, sweep(m, (struct vec3){ .a = { 1.0f, -2.0f, 1.0f } },
+                           (struct vec3){ .a = { 0.0f, 4.0f, 0.0f } },
+                           0.5f, &toi));
+        ASSERT_FE(0.375f, toi.t);
+        ASSERT_FE(-1.0f, toi.n.y);
+
+        // Edge x = 0, moving in the mesh's plane. A point passes it.
+        ASSERT_IE(1, sweep(m, (struct vec3){ .a = { -2.0f, 0.0f, 1.0f } },
+                           (struct vec3){ .a = { 4.0f, 0.0f, 0.0f } },
+                           0.5f, &toi));
+        ASSERT_FE(0.375f, toi.t);
+        ASSERT_FE(-1.0f, toi.n.x);
+        ASSERT_FE(0.0f, toi.n.y);
+        ASSERT_IE(0, toi.ti);
+        p.p = (struct vec3){ .a = { -2.0f, 0.0f, 1.0f } };
+        p.v = (struct vec3){ .a = { 4.0f, 0.0f, 0.0f } };
+        ASSERT_IE(0, compute_toi(&toi, &p, m, 1));
+
+        // Edge x = 0 from above at an angle, the face is not reached
+        ASSERT_IE(1, sweep(m, (struct vec3){ .a = { -1.0f, 1.0f, 1.0f } },
+                           (struct vec3){ .a = { 1.0f, -1.0f, 0.0f } },
+                           0.5f, &toi));
+        ASSERT_IE(1, fabsf(toi.t - (1.0f - 0.5f * s)) < 1e-5f);
+        ASSERT_IE(1, fabsf(toi.n.x + s) < 1e-5f);
+        ASSERT_IE(1, fabsf(toi.n.y - s) < 1e-5f);
+
+        // Corner (2, 0, 2), along the diagonal
+        ASSERT_IE(1, sweep(m, (struct vec3){ .a = { 4.0f, 0.0f, 4.0f } },
+                           (struct vec3){ .a = { -2.0f, 0.0f, -2.0f } },
+                           0.5f, &toi));
+        ASSERT_IE(1, fabsf(toi.t - (1.0f - 0.25f * s)) < 1e-5f);
+        ASSERT_IE(1, fabsf(toi.n.x - s) < 1e-5f);
+        ASSERT_IE(1, fabsf(toi.n.z - s) < 1e-5f);
+        ASSERT_IE(1, toi.ti);
+
+        // Too short, or passing by
+        ASSERT_IE(0, sweep(m, (struct vec3){ .a = { 1.0f, 2.0f, 1.0f } },
+                           (struct vec3){ .a = { 0.0f, -1.0f, 0.0f } },
+                           0.5f, &toi));
+        ASSERT_IE(0, sweep(m, (struct vec3){ .a = { -2.0f, 0.0f, 2.6f } },
+                           (struct vec3){ .a = { 6.0f, 0.0f, 0.0f } },
+                           0.5f, &toi));
+
+        free_meshes(m);
+
+        return 0;
+}
+
+static int test_sweep_touching(void)
+{
+        struct mesh m[3];
+        struct collision toi;
+        struct vec3 c = { .a = { 1.0f, 0.4f, 1.0f } };
+        struct vec3 down = { .a = { 0.0f, -1.0f, 0.0f } };
+        struct vec3 up = { .a = { 0.0f, 1.0f, 0.0f } };
+
+        make_meshes(m, 2.0f, 2.0f, 0);
+
+        // Sinking in hits at once, leaving or sliding does not
+        ASSERT_IE(1, sweep(m, c, down, 0.5f, &toi));
+        ASSERT_FE(0.0f, toi.t);
+        ASSERT_FE(1.0f, toi.n.y);
+        ASSERT_IE(0, sweep(m, c, up, 0.5f, &toi));
+        c.y = 0.501f;
+        ASSERT_IE(0, sweep(m, c, (struct vec3){ .a = { 0.5f, 0.0f, 0.3f } },
+                           0.5f, &toi));
+
+        // Overlapping the edge x = 0 from outside
+        c = (struct vec3){ .a = { -0.4f, 0.0f, 1.0f } };
+        ASSERT_IE(1, sweep(m, c, (struct vec3){ .a = { 1.0f, 0.0f, 0.0f } },
+                           0.5f, &toi));
+        ASSERT_FE(0.0f, toi.t);
+        ASSERT_FE(-1.0f, toi.n.x);
+        ASSERT_IE(0, sweep(m, c, (struct vec3){ .a = { -1.0f, 0.0f, 0.0f } },
+                           0.5f, &toi));
+
+        free_meshes(m);
+
+        return 0;
+}
+
+static int test_sweep_heightmap(void)
+{
+        struct rand_state rs;
+        struct mesh m[3];
+        int hits = 0;
+
+        rand_state_seed(&rs, 4711);
+        rand_seed(17);
+        make_meshes(m, 8.0f, 0.5f, 6);
+
+        for (int i = 0; i < 1000; i++)
+        {
+                struct collision toi;
+                float r = 0.05f + rand_state_u01(&rs) * 0.45f;
+                struct vec3 p = { .a = {
+                                rand_state_u01(&rs) * 10.0f - 1.0f,
+                                2.0f + r + rand_state_u01(&rs) * 2.0f,
+                                rand_state_u01(&rs) * 10.0f - 1.0f } };
+                struct vec3 v = { .a = {
+                                (rand_state_u01(&rs) * 2.0f - 1.0f) * 3.0f,
+                                -rand_state_u01(&rs) * 5.0f,
+                                (rand_state_u01(&rs) * 2.0f - 1.0f) * 3.0f } };
+                int hit = sweep(m, p, v, r, &toi);
+                float t = hit ? toi.t : 1.0f;
+                struct vec3 c = vec3_add(p, vec3_scalarm(v, t));
+
+                ASSERT_IE(1, hit >= 0);
+
+                // Touching the hit triangle, not inside any triangle
+                if (hit)
+                {
+                        ASSERT_IE(1, fabsf(tri_dist(m, toi.ti, c) - r) < 1e-3f);
+                        ASSERT_IE(1, fabsf(vec3_dot(toi.n, toi.n) - 1.0f) < 1e-4f);
+                        hits++;
+                }
+                for (uint32_t ti = 0; ti < m->index_count / 3; ti++)
+                {
+                        ASSERT_IE(1, tri_dist(m, ti, c) > r - 1e-3f);
+                }
+        }
+        ASSERT_IE(1, hits > 200);
+
+        free_meshes(m);
+
+        return 0;
+}
+
+static int test_sweep_world(void)
+{
+        struct rand_state rs;
+        struct object* objs = calloc(NUM_OBJS, sizeof(struct object));
+        struct mesh* ground = gen_mesh(8.0f, 8.0f, 0.5f);
+        struct world w;
+        int resting = 0;
+
+        rand_state_seed(&rs, 4711);
+        default_world(&w, 60);
+        w.surfaces = ground;
+        w.surface_count = 1;
+
+        for (int i = 0; i < NUM_OBJS; i++)
+        {
+                struct object* o = objs + i;
+
+                o->p.p.x = 1.0f + rand_state_u01(&rs) * 6.0f;
+                o->p.p.y = 0.5f + rand_state_u01(&rs) * 3.0f;
+                o->p.p.z = 1.0f + rand_state_u01(&rs) * 6.0f;
+                o->p.rad = 0.1f + rand_state_u01(&rs) * 0.3f;
+                o->area = 0.01f;
+                o->drag_c = 0.47f;
+                o->restitution = 0.5f;
+                o->static_mu = 0.5f;
+                o->dynamic_mu = 0.4f;
+                object_set_m(o, 1.0f);
+        }
+
+        for (int step = 0; step < 300; step++)
+        {
+                update_objects(step, &w, objs, NUM_OBJS, 0);
+                for (int i = 0; i < NUM_OBJS; i++)
+                {
+                        ASSERT_IE(1, objs[i].p.p.y > objs[i].p.rad - 1e-3f);
+                }
+        }
+
+        // Resting on the surface, not on the center
+        for (int i = 0; i < NUM_OBJS; i++)
+        {
+                if (objs[i].contact_mesh &&
+                    fabsf(objs[i].p.p.y - objs[i].p.rad) < 0.01f)
+                {
+                        resting++;
+                }
+        }
+        ASSERT_IE(NUM_OBJS, resting);
+
+        mesh_free(ground);
+        free(ground);
+        free(objs);
+
+        return 0;
+}
+
+static struct test_entry tests[] = {
+        {"sweep: face, edge and vertex", test_sweep_features},
+        {"sweep: touching",              test_sweep_touching},
+        {"sweep: heightmap",             test_sweep_heightmap},
+        {"sweep: world",                 test_sweep_world},
+};
+RUN_TESTS(tests)
@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <string.h>
+#include "km_terrain.h"
+#include "km_geom.h"
+#include "km_phys.h"
+#include "test.h"
+
+#define CHUNK 8.0f
+// Chunks per side
+#define SIDE 4
+#define NUM_OBJS 500
+
+static int test_terrain_table(void);
+static int test_terrain_toi(void);
+static int test_terrain_world(void);
+static int test_terrain_walk(void);
+
+/*
+ * SIDE x SIDE chunks centered at the origin, on a plane rising 0.1 per
+ * chunk in x and z, so neighbouring chunks meet without a step. Ordered
+ * by z, then x, as the cells are visited.
+ */
+static struct mesh* make_chunks(struct terrain* t)
+{
+        struct mesh* chunks = calloc(SIDE * SIDE, sizeof(struct mesh));
+
+        if (t && terrain_init(t, CHUNK))
+        {
+                free(chunks);
+                return NULL;
+        }
+
+        for (int cz = 0; cz < SIDE; cz++)
+        {
+                for (int cx = 0; cx < SIDE; cx++)
+                {
+                        struct mesh* m = gen_mesh(CHUNK, CHUNK, 0.5f);
+                        int32_t x = cx - SIDE / 2;
+                        int32_t z = cz - SIDE / 2;
+                        struct vec3 d = { .a = {
+                                        (float)x * CHUNK,
+                                        0.0f,
+                                        (float)z * CHUNK } };
+
+                        mesh_translate(m, d);
+                        for (uint32_t i = 0; i < m->vertex_count; i++)
+                        {
+                                struct vec3* p = &m->vertices[i].pos;
+
+                                p->y = 0.1f / CHUNK * (p->x + p->z) + 0.4f;
+                        }
+                        mesh_normalize(m);
+                        mesh_inward_normalize(m);
+                        mesh_build_tris(m);
+                        mesh_refit_bvh(m);
+                        m->restitution = 0.5f;
+                        chunks[cz * SIDE + cx] = *m;
+                        free(m);
+                        if (t)
+                        {
+                                terrain_add(t, x, z, chunks + cz * SIDE + cx);
+                        }
+                }
+        }
+
+        return chunks;
+}
+
+static void free_chunks(struct mesh* chunks)
+{
+        for (int i = 0; i < SIDE * SIDE; i++)
+        {
+                mesh_free(chunks + i);
+        }
+        free(chunks);
+}
+
+static int test_terrain_table(void)
+{
+        struct terrain t;
+        struct mesh m[2];
+        int32_t cx;
+        int32_t cz;
+
+        ASSERT_IE(-1, terrain_init(&t, 0.0f));
+        ASSERT_IE(0, terrain_init(&t, 2.0f));
+
+        // Enough to grow the table a few times, negative cells too
+        for (int32_t z = -20; z < 20; z++)
+        {
+                for (int32_t x = -20; x < 20; x++)
+                {
+                        ASSERT_IE(0, terrain_add(&t, x, z, m + ((x + z) & 1)));
+                }
+        }
+        ASSERT_IE(1600, t.count);
+        ASSERT_IE(0, terrain_add(&t, 3, -4, m + 1));
+        ASSERT_IE(1600, t.count);
+        ASSERT_IE(1, terrain_get(&t, 3, -4) == m + 1);
+        ASSERT_IE(1, terrain_get(&t, 20, 0) == NULL);
+
+        // Remove every third, the rest must still be found
+        for (int32_t z = -20; z < 20; z++)
+        {
+                for (int32_t x = -20; x < 20; x++)
+                {
+                        if ((x * 40 + z) % 3 == 0)
+                        {
+                                ASSERT_IE(1, terrain_remove(&t, x, z) != NULL);
+                        }
+                }
+        }
+        ASSERT_IE(1, terrain_remove(&t, 0, 0) == NULL);
+        ASSERT_IE(1067, t.count);
+        for (int32_t z = -20; z < 20; z++)
+        {
+                for (int32_t x = -20; x < 20; x++)
+                {
+                        int gone = (x * 40 + z) % 3 == 0;
+
+                        ASSERT_IE(gone, terrain_get(&t, x, z) == NULL);
+                }
+        }
+
+        terrain_cell(&t, (struct vec3){ .a = { -0.5f, 9.0f, 4.0f } },
+                     &cx, &cz);
+        ASSERT_IE(-1, cx);
+        ASSERT_IE(2, cz);
+        terrain_cell(&t, (struct vec3){ .a = { 1e30f, 0.0f, -1e30f } },
+                     &cx, &cz);
+        ASSERT_IE(1, cx > 0);
+        ASSERT_IE(1, cz < 0);
+
+        terrain_free(&t);
+
+        return 0;
+}
+
+static int test_terrain_toi(void)
+{
+        struct terrain t;
+        struct mesh* chunks = make_chunks(&t);
+        float ext = CHUNK * SIDE * 0.5f;
+        int hits = 0;
+
+        ASSERT_IE(1, chunks != NULL);
+        ASSERT_IE(SIDE * SIDE, t.count);
+
+        // Same result as testing every chunk
+        for (int i = 0; i < 2000; i++)
+        {
+                struct particle p = {0};
+                struct collision a;
+                struct collision b;
+                int ha;
+                int hb;
+
+                p.p = (struct vec3){ .a = {
+                                (lcg_u01() * 2.0f - 1.0f) * ext,
+                                0.5f + lcg_u01() * 2.0f,
+                                (lcg_u01() * 2.0f - 1.0f) * ext } };
+                // Mostly short steps, some long ones across chunks
+                float len = i % 10 ? 0.5f : 3.0f * CHUNK;
+                p.v = (struct vec3){ .a = {
+                                (lcg_u01() * 2.0f - 1.0f) * len,
+                                -lcg_u01() * 3.0f,
+                                (lcg_u01() * 2.0f - 1.0f) * len } };
+
+                ha = compute_toi(&a, &p, chunks, SIDE * SIDE);
+                hb = compute_toi_terrain(&b, &p, &t);
+                ASSERT_IE(ha, hb);
+                if (ha)
+                {
+                        ASSERT_FE(a.t, b.t);
+                        ASSERT_IE(1, a.m == b.m);
+                        ASSERT_IE(a.ti, b.ti);
+                        hits++;
+                }
+        }
+        ASSERT_IE(1, hits > 100);
+
+        terrain_free(&t);
+        free_chunks(chunks);
+
+        return 0;
+}
+
+static int test_terrain_world(void)
+{
+        struct object* flat = calloc(NUM_OBJS, sizeof(struct object));
+        struct object* chunked = calloc(NUM_OBJS, sizeof(struct object));
+        struct terrain t;
+        struct mesh* a = make_chunks(NULL);
+        struct mesh* b = make_chunks(&t);
+        struct world wf = {0};
+        struct world wc = {0};
+        struct active_set s;
+        int32_t cx;
+        int32_t cz;
+        int ret = 0;
+        int r = 0;
+
+        default_world(&wf, 60);
+        default_world(&wc, 60);
+        wf.surfaces = a;
+        wf.surface_count = SIDE * SIDE;
+        wc.terrain = &t;
+
+        for (int i = 0; i < NUM_OBJS; i++)
+        {
+                struct object* o = flat + i;
+
+                o->p.p.x = (lcg_u01() - 0.5f) * CHUNK * SIDE * 0.9f;
+                o->p.p.y = 1.0f + lcg_u01() * 5.0f;
+                o->p.p.z = (lcg_u01() - 0.5f) * CHUNK * SIDE * 0.9f;
+                o->p.v.x = (lcg_u01() - 0.5f) * 2.0f;
+                o->p.v.z = (lcg_u01() - 0.5f) * 2.0f;
+                o->area = 0.01f;
+                o->drag_c = 0.47f;
+                o->restitution = 0.6f;
+                o->static_mu = 0.5f;
+                o->dynamic_mu = 0.4f;
+                object_set_m(o, 0.5f + lcg_u01());
+        }
+        memcpy(chunked, flat, NUM_OBJS * sizeof(struct object));
+
+        // Same path through the world, meshes compared by index
+        for (int step = 0; step < 180; step++)
+        {
+                update_objects(step, &wf, flat, NUM_OBJS, 0);
+                update_objects(step, &wc, chunked, NUM_OBJS, 0);
+        }
+        for (int i = 0; i < NUM_OBJS && !ret; i++)
+        {
+                struct object o;
+
+                memcpy(&o, chunked + i, sizeof(o));
+                if (o.contact_mesh)
+                {
+                        o.contact_mesh = a + (o.contact_mesh - b);
+                }
+                if (memcmp(flat + i, &o, sizeof(o)))
+                {
+                        printf("object %d differs\n", i);
+                        ret = 1;
+                }
+        }
+
+        // Remove the chunk under an object in contact, it must fall
+        while (r < NUM_OBJS && !chunked[r].contact_mesh)
+        {
+                r++;
+        }
+        ASSERT_IE(1, r < NUM_OBJS);
+        terrain_cell(&t, chunked[r].p.p, &cx, &cz);
+        ASSERT_IE(0, active_set_init(&s, chunked, NUM_OBJS));
+        {
+                struct mesh* m = terrain_remove(&t, cx, cz);
+                float y = chunked[r].p.p.y;
+
+                ASSERT_IE(1, m != NULL);
+                ASSERT_IE(1, terrain_get(&t, cx, cz) == NULL);
+                active_set_wake_mesh(&s, chunked, m);
+                ASSERT_IE(1, chunked[r].contact_mesh == NULL);
+                for (int step = 0; step < 30; step++)
+                {
+                        update_active_objects(step, &wc, chunked, &s);
+                }
+                ASSERT_IE(1, chunked[r].p.p.y < y - 1.0f);
+        }
+
+        active_set_free(&s);
+        terrain_free(&t);
+        free_chunks(a);
+        free_chunks(b);
+        free(flat);
+        free(chunked);
+
+        return ret;
+}
+
+struct walk
+{
+        const struct mesh* chunks;
+        int order[SIDE * SIDE];
+        int count;
+        // Shorten the query to this at the first chunk, if > 0
+        float t_hit;
+};
+
+static void walk_chunk(void* ctx, struct mesh* m, float* t_max)
+{
+        struct walk* w = ctx;
+
+        w->order[w->count++] = (int)(m - w->chunks);
+        if (w->t_hit > 0.0f)
+        {
+                *t_max = MIN(*t_max, w->t_hit);
+        }
+}
+
+static int test_terrain_walk(void)
+{
+        struct terrain t;
+        struct mesh* chunks = make_chunks(&t);
+        struct walk w = { .chunks = chunks };
+        // Along the second row, from the first chunk to the last
+        struct vec3 o = { .a = {-15.0f, 2.0f, -4.0f} };
+        struct vec3 d = { .a = {30.0f, 0.0f, 0.0f} };
+
+        // In order along the segment, each chunk once
+        terrain_query_seg(&t, o, d, walk_chunk, &w);
+        ASSERT_IE(SIDE, w.count);
+        for (int i = 0; i < SIDE; i++)
+        {
+                ASSERT_IE(SIDE + i, w.order[i]);
+        }
+        w.count = 0;
+        terrain_query_seg(&t, vec3_add(o, d), vec3_scalarm(d, -1.0f),
+                          walk_chunk, &w);
+        ASSERT_IE(SIDE, w.count);
+        ASSERT_IE(2 * SIDE - 1, w.order[0]);
+        ASSERT_IE(SIDE, w.order[SIDE - 1]);
+
+        // A hit in the first chunk ends the walk, only the neighbour
+        // sharing the edge the segment reaches is visited
+        w.count = 0;
+        w.t_hit = 0.1f;
+        terrain_query_seg(&t, o, d, walk_chunk, &w);
+        ASSERT_IE(2, w.count);
+        ASSERT_IE(SIDE, w.order[0]);
+        ASSERT_IE(SIDE + 1, w.order[1]);
+
+        terrain_free(&t);
+        free_chunks(chunks);
+
+        return 0;
+}
+
+static struct test_entry tests[] = {
+        {"terrain: hash table",        test_terrain_table},
+        {"terrain: toi vs all chunks", test_terrain_toi},
+        {"terrain: world update",      test_terrain_world},
+        {"terrain: walk along a sweep", test_terrain_walk},
+};
+RUN_TESTS(tests)
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "km_water.h"
+#include "km_geom.h"
+#include "km_phys.h"
+#include "km_pool.h"
+#include "test.h"
+
+#define STEPS 200
+#define DT (1.0f / 240.0f)
+
+static int test_water_damping(void);
+static int test_water_vs_mesh(void);
+static int test_water_unstable(void);
+static int test_water_damping_rect(void);
+static int test_water_normals(void);
+
+// 81 x 81 water mesh with a bump in it, over a sloping ground
+static struct mesh* make_water(struct mesh** ground)
+{
+        struct mesh* v = gen_mesh(20.0f, 20.0f, 0.25f);
+
+        *ground = gen_mesh(20.0f, 20.0f, 0.25f);
+        for (uint32_t i = 0; i < v->vertex_count; i++)
+        {
+                float x = v->vertices[i].pos.x - 8.0f;
+                float z = v->vertices[i].pos.z - 10.0f;
+
+                v->vertices[i].pos.y = 0.5f / (1.0f + x * x + z * z);
+                (*ground)->vertices[i].pos.y =
+                        (*ground)->vertices[i].pos.x * 0.05f - 0.6f;
+        }
+
+        return v;
+}
+
+static int test_water_damping(void)
+{
+        ASSERT_FE(0.0f, water_damping(1.0f));
+        ASSERT_FE(1.0f, water_damping(-1.0f));
+        ASSERT_FE(0.5f, water_damping(0.0f));
+
+        return 0;
+}
+
+static int test_water_vs_mesh(void)
+{
+        struct mesh* ground;
+        struct mesh* ref = make_water(&ground);
+        struct mesh* v = gen_mesh(20.0f, 20.0f, 0.25f);
+        struct km_pool* pool = km_pool_create(4);
+        struct water w;
+        struct water_grid g[2];
+
+        memcpy(v->vertices, ref->vertices,
+               v->vertex_count * sizeof(struct vertex));
+
+        ASSERT_IE(0, init_water(&w, ref, ground));
+        ASSERT_IE(0, water_grid_init(g + 0, v, ground));
+        ASSERT_IE(0, water_grid_init(g + 1, v, ground));
+        ASSERT_IE(81, g[0].nx);
+        ASSERT_IE(0, ((uintptr_t)g[0].damp) % 64);
+
+        for (int step = 0; step < STEPS; step++)
+        {
+                update_water(&w, ref, DT);
+                ASSERT_IE(0, water_grid_step(g + 0, DT, NULL));
+                ASSERT_IE(0, water_grid_step(g + 1, DT, pool));
+        }
+
+        // Bit identical, serial and on threads
+        for (int k = 0; k < 2; k++)
+        {
+                water_grid_store(g + k, v);
+                for (uint32_t i = 0; i < v->vertex_count; i++)
+                {
+                        ASSERT_IE(0, memcmp(&ref->vertices[i].pos.y,
+                                            &v->vertices[i].pos.y,
+                                            sizeof(float)));
+                }
+        }
+        // The wave has moved, and is damped in the shallows
+        ASSERT_IE(1, v->vertices[41 * 81 + 32].pos.y != 0.5f);
+        ASSERT_FE(0.0f, g[0].cur[41 * 81 + 75]);
+
+        water_grid_free(g + 0);
+        water_grid_free(g + 1);
+        ASSERT_IE(1, g[0].cur == NULL);
+        km_pool_free(pool);
+        free_water(&w);
+        mesh_free(ref);
+        free(ref);
+        mesh_free(v);
+        free(v);
+        mesh_free(ground);
+        free(ground);
+
+        return 0;
+}
+
+static int test_water_unstable(void)
+{
+        struct mesh* ground;
+        struct mesh* v = make_water(&ground);
+        struct water_grid g;
+        float y;
+
+        ASSERT_IE(0, water_grid_init(&g, v, NULL));
+        y = g.cur[41 * 81 + 32];
+        ASSERT_IE(-1, water_grid_step(&g, 1.0f, NULL));
+        ASSERT_FE(y, g.cur[41 * 81 + 32]);
+        water_grid_free(&g);
+
+        // Not a grid, or not the same grid
+        v->grid_x = 0;
+        ASSERT_IE(-1, water_grid_init(&g, v, NULL));
+        v->grid_x = 81;
+        ground->grid_z = 80;
+        ASSERT_IE(-1, water_grid_init(&g, v, ground));
+
+        mesh_free(v);
+        free(v);
+        mesh_free(ground);
+        free(ground);
+
+        return 0;
+}
+
+static int test_water_damping_rect(void)
+{
+        struct mesh* ground;
+        struct mesh* ref = make_water(&ground);
+        struct mesh* v = gen_mesh(20.0f, 20.0f, 0.25f);
+        struct water w;
+        struct water_grid g;
+        float before[81 * 81];
+
+        memcpy(v->vertices, ref->vertices,
+               v->vertex_count * sizeof(struct vertex));
+        ASSERT_IE(0, init_water(&w, ref, ground));
+        ASSERT_IE(0, water_grid_init(&g, v, ground));
+        ASSERT_IE(0, memcmp(w.damp, g.damp, sizeof(before)));
+        memcpy(before, g.damp, sizeof(before));
+
+        // Raise the ground in a rectangle sticking out of the grid,
+        // only the cells in it change
+        for (uint32_t z = 10; z < 81; z++)
+        {
+                for (uint32_t x = 20; x < 30; x++)
+                {
+                        ground->vertices[z * 81 + x].pos.y = 1.0f;
+                }
+        }
+        update_water_damping(&w, ref, 20, 10, 30, 100);
+        water_grid_update_damping(&g, ground, 20, 10, 30, 100);
+        ASSERT_IE(0, memcmp(w.damp, g.damp, sizeof(before)));
+        for (uint32_t z = 0; z < 81; z++)
+        {
+                for (uint32_t x = 0; x < 81; x++)
+                {
+                        uint32_t i = z * 81 + x;
+                        int in = z >= 10 && x >= 20 && x < 30;
+
+                        ASSERT_FE(in ? 0.0f : before[i], g.damp[i]);
+                }
+        }
+
+        for (int step = 0; step < STEPS; step++)
+        {
+                update_water(&w, ref, DT);
+                ASSERT_IE(0, water_grid_step(&g, DT, NULL));
+        }
+        water_grid_store(&g, v);
+        for (uint32_t i = 0; i < v->vertex_count; i++)
+        {
+                ASSERT_IE(0, memcmp(&ref->vertices[i].pos.y,
+                                    &v->vertices[i].pos.y, sizeof(float)));
+        }
+        free_water(&w);
+        water_grid_free(&g);
+
+        // Without ground nothing is damped
+        ASSERT_IE(0, init_water(&w, ref, NULL));
+        ASSERT_FE(1.0f, w.damp[0]);
+        ASSERT_FE(1.0f, w.damp[81 * 81 - 1]);
+        free_water(&w);
+        ASSERT_IE(1, w.damp == NULL);
+
+        mesh_free(ref);
+        free(ref);
+        mesh_free(v);
+        free(v);
+        mesh_free(ground);
+        free(ground);
+
+        return 0;
+}
+
+static int test_water_normals(void)
+{
+        struct mesh* ground;
+        struct mesh* v = make_water(&ground);
+        struct mesh* ref = gen_mesh(20.0f, 20.0f, 0.25f);
+        struct water_grid g;
+        float eps = 1e-4f;
+        int moved;
+
+        ASSERT_IE(0, water_grid_init(&g, v, ground));
+        ASSERT_IE(0, mesh_grid_normalize(v));
+
+        // Nothing has moved yet
+        ASSERT_IE(0, water_grid_store_normals(&g, v, eps));
+
+        for (int step = 0; step < 20; step++)
+        {
+                ASSERT_IE(0, water_grid_step(&g, DT, NULL));
+        }
+        moved = water_grid_store_normals(&g, v, eps);
+        ASSERT_IE(1, moved > 0);
+        ASSERT_IE(1, moved < (int)v->vertex_count);
+
+        // The mesh is within eps of the solver, and the normals are
+        // the same as recreating all of them
+        memcpy(ref->vertices, v->vertices,
+               v->vertex_count * sizeof(struct vertex));
+        ASSERT_IE(0, mesh_grid_normalize(ref));
+        for (uint32_t i = 0; i < v->vertex_count; i++)
+        {
+                ASSERT_IE(1, fabsf(v->vertices[i].pos.y - g.cur[i]) <= eps);
+                ASSERT_IE(0, memcmp(&ref->vertices[i].normal,
+                                    &v->vertices[i].normal,
+                                    sizeof(struct vec3)));
+        }
+
+        water_grid_free(&g);
+        ASSERT_IE(1, g.dirty == NULL);
+        mesh_free(v);
+        free(v);
+        mesh_free(ref);
+        free(ref);
+        mesh_free(ground);
+        free(ground);
+
+        return 0;
+}
+
+static struct test_entry tests[] = {
+        {"water: damping",              test_water_damping},
+        {"water grid: same as mesh",    test_water_vs_mesh},
+        {"water grid: invalid input",   test_water_unstable},
+        {"water: damping rectangle",    test_water_damping_rect},
+        {"water grid: dirty normals",   test_water_normals},
+};
+RUN_TESTS(tests)
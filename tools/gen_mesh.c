@@ -10,6 +10,8 @@
 #include "km_input.h"
 #include "metal/metal_renderer.h"
 #include "km_geom.h"
+#include "km_pool.h"
+#include "km_plat.h"
 
 int main(int argc, char* argv[])
 {
@@ -24,12 +26,13 @@ int main(int argc, char* argv[])
         float d = 0.5f;
         const char* output = "mesh.json";
         const char* input_file = NULL;
+        int convert = 0;
         int num_peaks = 5;
         float height = 5.0f;
         float radius = 10.0f;
         int opt;
 
-        while ((opt = getopt(argc, argv, "w:h:d:o:f:")) != -1)
+        while ((opt = getopt(argc, argv, "w:h:d:o:f:cs:")) != -1)
         {
                 switch (opt)
                 {
@@ -48,13 +51,59 @@ int main(int argc, char* argv[])
                 case 'f':
                         input_file = optarg;
                         break;
+                case 'c':
+                        convert = 1;
+                        break;
+                case 's':
+                        // The same seed generates the same terrain
+                        rand_seed(strtoull(optarg, NULL, 0));
+                        break;
                 default:
-                        fprintf(stderr, "usage: %s [-w width] [-h height] [-d delta] [-o output] [-f file]\n",
+                        fprintf(stderr, "usage: %s [-w width] [-h height] [-d delta] [-o output] [-f file] [-c] [-s seed]\n",
                                 argv[0]);
                         return 1;
                 }
         }
 
+        // Convert the input file to the output's format (JSON, or
+        // binary if it ends with MESH_BIN_EXT) without opening a window
+        if (convert)
+        {
+                int count = 0;
+                int ret = 0;
+                struct mesh* meshes;
+
+                if (!input_file)
+                {
+                        fprintf(stderr, "-c requires an input file (-f)\n");
+                        return 1;
+                }
+                meshes = load_meshes(input_file, &count);
+                if (!meshes)
+                {
+                        fprintf(stderr, "failed to load mesh from %s\n",
+                                input_file);
+                        return 1;
+                }
+                if (write_meshes(output, meshes, count) != 0)
+                {
+                        fprintf(stderr, "failed to write mesh to %s\n",
+                                output);
+                        ret = 1;
+                }
+                else
+                {
+                        printf("wrote %d meshes to %s\n", count, output);
+                }
+                for (int i = 0; i < count; i++)
+                {
+                        mesh_free(meshes + i);
+                }
+                free(meshes);
+
+                return ret;
+        }
+
         input.width = KM_DEFAULT_WIDTH;
         input.height = KM_DEFAULT_HEIGHT;
         struct vec3 sv = (struct vec3){ .a = { -w/2.0f, 0.0f, -h/2.0f} };
@@ -96,6 +145,8 @@ int main(int argc, char* argv[])
 
         struct mesh* m;
         int loaded_from_file = 0;
+        // Heightmaps are generated on all cores, NULL runs serially
+        struct km_pool* pool = km_pool_create(0);
 
         if (input_file)
         {
@@ -121,15 +172,15 @@ int main(int argc, char* argv[])
                 m->static_mu = 0.5f;
                 m->dynamic_mu = 0.5f;
                 mesh_translate(m, sv);
-                mesh_heightmap(m, num_peaks, height, radius);
+                mesh_heightmap_pool(m, num_peaks, height, radius, pool);
                 mesh_colorize(m);
         }
 
-        printf("vertices: (%d x %d) %d\n",
+        printf("vertices: (%d x %d) %u\n",
                m->grid_x,
                m->grid_z,
                m->vertex_count);
-        printf("indices:  %d\n", m->index_count);
+        printf("indices:  %u\n", m->index_count);
 
         if (renderer->update(renderer,
                              m, 1, 1) != 0)
@@ -170,7 +221,7 @@ int main(int argc, char* argv[])
                         }
 
                         mesh_translate(m, sv);
-                        mesh_heightmap(m, num_peaks, height, radius);
+                        mesh_heightmap_pool(m, num_peaks, height, radius, pool);
                         mesh_colorize(m);
 
                         if (renderer->update(renderer,
@@ -213,6 +264,7 @@ int main(int argc, char* argv[])
 
         mesh_free(m);
         free(m);
+        km_pool_free(pool);
 
         km_window_destroy(&window);
         SDL_Quit();